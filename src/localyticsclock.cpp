@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsclock.h"
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
+#include <QtCore/QThreadStorage>
+#if defined(Q_OS_LINUX)
+#include <time.h>
+#endif
+
+#if defined(Q_OS_LINUX) && defined(CLOCK_BOOTTIME)
+#define LOCALYTICS_CLOCK_BOOTTIME
+#endif
+
+/*
+  A thread's copy of the base of the clock, so that reading it takes no
+  lock.
+*/
+struct LocalyticsClockSnapshot
+{
+  LocalyticsClockSnapshot() : base(0), synchronizedAt(0), generation(-1) {}
+
+  qint64 base;
+  qint64 synchronizedAt;
+  int generation;
+};
+
+/*
+  The base of the clock, and the boot time it was read at.
+*/
+class LocalyticsClockBase
+{
+  public:
+  LocalyticsClockBase()
+  {
+    monotonic.start();
+    base = 0;
+    synchronizedAt = 0;
+    realtime = 0;
+    realtimeWall = QDateTime::currentMSecsSinceEpoch();
+    realtimeMonotonic = 0;
+  }
+
+  void synchronize(qint64 now)
+  {
+    synchronizedAt = now;
+    base = QDateTime::currentMSecsSinceEpoch() - now;
+    generation.ref();
+  }
+
+  QMutex lock;
+  QElapsedTimer monotonic;
+  qint64 base;
+  qint64 synchronizedAt;
+  QAtomicInt generation;
+  QThreadStorage<LocalyticsClockSnapshot *> snapshots;
+
+  // Without a boot time clock, elapsedRealtimeMSecs() as of the wall and
+  // monotonic times it was last read at.
+  qint64 realtime;
+  qint64 realtimeWall;
+  qint64 realtimeMonotonic;
+};
+
+Q_GLOBAL_STATIC(LocalyticsClockBase, clockBase)
+
+#ifdef LOCALYTICS_CLOCK_BOOTTIME
+static bool bootTimeMSecs(qint64 *msecs)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_BOOTTIME, &now) != 0)
+    return false;
+  *msecs = (qint64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  return true;
+}
+#endif
+
+qint64 LocalyticsClock::currentMSecsSinceEpoch()
+{
+#ifdef LOCALYTICS_CLOCK_BOOTTIME
+  // The offset is taken on the boot time clock, which goes on while the
+  // device is suspended, so timestamps are right as soon as it wakes.
+  qint64 now;
+  if (bootTimeMSecs(&now))
+    {
+      LocalyticsClockBase *clock = clockBase();
+      if (!clock->snapshots.hasLocalData())
+        clock->snapshots.setLocalData(new LocalyticsClockSnapshot);
+      LocalyticsClockSnapshot *snapshot = clock->snapshots.localData();
+      if (snapshot->generation != (int) clock->generation
+          || now - snapshot->synchronizedAt > CLOCK_SYNC_INTERVAL_MS)
+        {
+          QMutexLocker locker(&clock->lock);
+          if (clock->generation == 0 || now - clock->synchronizedAt > CLOCK_SYNC_INTERVAL_MS)
+            clock->synchronize(now);
+          snapshot->base = clock->base;
+          snapshot->synchronizedAt = clock->synchronizedAt;
+          snapshot->generation = clock->generation;
+        }
+      return snapshot->base + now;
+    }
+#endif
+  // No clock which includes suspended time but the wall clock itself.
+  return QDateTime::currentMSecsSinceEpoch();
+}
+
+qint64 LocalyticsClock::monotonicMSecs()
+{
+  return clockBase()->monotonic.elapsed();
+}
+
+qint64 LocalyticsClock::elapsedRealtimeMSecs()
+{
+#ifdef LOCALYTICS_CLOCK_BOOTTIME
+  qint64 now;
+  if (bootTimeMSecs(&now))
+    return now;
+#endif
+  LocalyticsClockBase *clock = clockBase();
+  qint64 wall = QDateTime::currentMSecsSinceEpoch();
+  qint64 monotonic = clock->monotonic.elapsed();
+  QMutexLocker locker(&clock->lock);
+  // The wall clock goes on while suspended.  Where it went back, or
+  // less far than the monotonic clock, the monotonic clock is used.
+  clock->realtime += qMax(wall - clock->realtimeWall, monotonic - clock->realtimeMonotonic);
+  clock->realtimeWall = wall;
+  clock->realtimeMonotonic = monotonic;
+  return clock->realtime;
+}
+
+QString LocalyticsClock::clientTime(bool milliseconds)
+{
+  return formatTime(currentMSecsSinceEpoch(), milliseconds);
+}
+
+QString LocalyticsClock::formatTime(qint64 msecsSinceEpoch, bool milliseconds)
+{
+  if (milliseconds)
+    {
+      return QString::number(msecsSinceEpoch / 1000.0, 'f', 3);
+    }
+  return QString::number(msecsSinceEpoch / 1000);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSCLOCK_H
+#define LOCALYTICSCLOCK_H
+
+#include <QtCore/QString>
+
+#define CLOCK_SYNC_INTERVAL_MS 60000 // How often the wall clock is read again
+
+/*!
+  Cheap timestamps and monotonic durations for the session.
+
+  The wall clock is read once, in UTC, and later times are that base
+  plus the time elapsed on the boot time clock, which goes on while the
+  device is suspended, so a timestamp costs a read of that clock
+  instead of a local time conversion.  Each thread keeps a copy of the
+  base, so reading it takes no lock.  The base is read again every
+  CLOCK_SYNC_INTERVAL_MS, so changes of the wall clock show up in
+  timestamps within that time.  Where there is no boot time clock,
+  timestamps read the wall clock directly.
+
+  Durations only use the monotonic clock and never see changes of the
+  wall clock.  The monotonic clock stops while the device is
+  suspended, so waits which must include that time use
+  elapsedRealtimeMSecs().
+
+  All methods are thread-safe.
+*/
+class LocalyticsClock
+{
+  public:
+  /*!
+    \return The current time, in milliseconds since the epoch.
+  */
+  static qint64 currentMSecsSinceEpoch();
+
+  /*!
+    \return Milliseconds since the clock was first used, which never
+    go backwards.
+  */
+  static qint64 monotonicMSecs();
+
+  /*!
+    Milliseconds from an arbitrary origin, which never go backwards and,
+    unlike monotonicMSecs(), include the time the device was
+    suspended.  On Linux this is CLOCK_BOOTTIME.  Elsewhere it follows
+    the wall clock, but advances at least as much as the monotonic
+    clock, so setting the wall clock back doesn't stop it.
+  */
+  static qint64 elapsedRealtimeMSecs();
+
+  /*!
+    Formats the current time for the client time ("ct") field of a
+    blob.
+    \param milliseconds Whether to keep milliseconds, as a fraction of
+    a second.
+    \return Seconds since the epoch.
+  */
+  static QString clientTime(bool milliseconds = false);
+
+  /*!
+    Formats a time in milliseconds since the epoch as clientTime() does.
+  */
+  static QString formatTime(qint64 msecsSinceEpoch, bool milliseconds = false);
+};
+
+#endif // LOCALYTICSCLOCK_H
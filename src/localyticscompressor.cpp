@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticscompressor.h"
+#include <time.h>
+#ifdef QLOCALYTICS_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+int LocalyticsCompressor::_defaultLevel = Z_DEFAULT_COMPRESSION;
+int LocalyticsCompressor::_defaultStrategy = Z_DEFAULT_STRATEGY;
+int LocalyticsCompressor::_defaultMemLevel = 8;
+
+// Starting estimates of the compression speed of each level, refined
+// by measurement whenever a member is compressed in adaptive mode.
+double LocalyticsCompressor::_bytesPerMillisecond[10] = {
+  200000, 60000, 55000, 45000, 30000, 25000, 20000, 12000, 8000, 6000
+};
+
+static int levelIndex(int level)
+{
+  return (level < 0 || level > 9) ? 6 : level;
+}
+
+LocalyticsCompressor::LocalyticsCompressor() :
+  _level(_defaultLevel),
+  _strategy(_defaultStrategy),
+  _memLevel(_defaultMemLevel),
+  _effectiveLevel(_defaultLevel),
+  _inputBytes(0),
+  _startClock(0),
+  _active(false)
+{
+}
+
+LocalyticsCompressor::~LocalyticsCompressor()
+{
+  end();
+}
+
+void LocalyticsCompressor::setLevel(int level)
+{
+  _level = level;
+}
+
+int LocalyticsCompressor::level() const
+{
+  return _level;
+}
+
+void LocalyticsCompressor::setStrategy(int strategy)
+{
+  _strategy = strategy;
+}
+
+int LocalyticsCompressor::strategy() const
+{
+  return _strategy;
+}
+
+void LocalyticsCompressor::setMemLevel(int memLevel)
+{
+  _memLevel = memLevel;
+}
+
+int LocalyticsCompressor::memLevel() const
+{
+  return _memLevel;
+}
+
+void LocalyticsCompressor::setDefaultLevel(int level)
+{
+  _defaultLevel = level;
+}
+
+void LocalyticsCompressor::setDefaultStrategy(int strategy)
+{
+  _defaultStrategy = strategy;
+}
+
+void LocalyticsCompressor::setDefaultMemLevel(int memLevel)
+{
+  _defaultMemLevel = memLevel;
+}
+
+int LocalyticsCompressor::effectiveLevel() const
+{
+  return _effectiveLevel;
+}
+
+/*!
+  @method adaptiveLevel
+  @abstract Picks the best level expected to compress the given amount of input within the CPU time budget.
+*/
+int LocalyticsCompressor::adaptiveLevel(qint64 sizeHint) const
+{
+  if (sizeHint <= 0)
+    return Z_DEFAULT_COMPRESSION;
+
+  static const int candidates[] = { 9, 6, 1 };
+  for (int i = 0; i < 3; i++)
+    {
+      if (sizeHint / _bytesPerMillisecond[candidates[i]] <= COMPRESSION_ADAPTIVE_BUDGET_MS)
+        return candidates[i];
+    }
+  return 1;
+}
+
+void LocalyticsCompressor::recordThroughput(qint64 bytes, double milliseconds)
+{
+  // Small members finish within the resolution of the clock.
+  if (bytes < COMPRESSOR_CHUNK_SIZE || milliseconds <= 0)
+    return;
+
+  double &estimate = _bytesPerMillisecond[levelIndex(_effectiveLevel)];
+  estimate = 0.8 * estimate + 0.2 * (bytes / milliseconds);
+}
+
+bool LocalyticsCompressor::begin(qint64 sizeHint)
+{
+  end();
+
+  _effectiveLevel = (_level == COMPRESSION_LEVEL_ADAPTIVE) ? adaptiveLevel(sizeHint) : _level;
+  _inputBytes = 0;
+  _startClock = clock();
+
+#ifdef QLOCALYTICS_USE_LIBDEFLATE
+  _input.clear();
+  if (sizeHint > 0)
+    _input.reserve(sizeHint);
+  _active = true;
+#else
+  _stream.zalloc = Z_NULL;
+  _stream.zfree = Z_NULL;
+  _stream.opaque = Z_NULL;
+  _stream.next_in = Z_NULL;
+  _stream.avail_in = 0;
+
+  // Window bits 15+16 selects the gzip wrapper.
+  _active = (deflateInit2(&_stream, _effectiveLevel, Z_DEFLATED, (15+16), _memLevel, _strategy) == Z_OK);
+#endif
+  return _active;
+}
+
+bool LocalyticsCompressor::append(const QByteArray &data, QByteArray *out)
+{
+  if (!_active)
+    return false;
+  if (data.isEmpty())
+    return true;
+
+  _inputBytes += data.length();
+#ifdef QLOCALYTICS_USE_LIBDEFLATE
+  Q_UNUSED(out);
+  _input.append(data);
+  return true;
+#else
+  _stream.next_in = (Bytef *)data.constData();
+  _stream.avail_in = data.length();
+  return drain(Z_NO_FLUSH, out);
+#endif
+}
+
+bool LocalyticsCompressor::finish(QByteArray *out)
+{
+  if (!_active)
+    return false;
+
+  bool success;
+#ifdef QLOCALYTICS_USE_LIBDEFLATE
+  // libdeflate has no streaming interface; the member is compressed in one pass.
+  int level = (_effectiveLevel == Z_DEFAULT_COMPRESSION) ? 6 : _effectiveLevel;
+  struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+  success = (compressor != NULL);
+  if (success)
+    {
+      int start = out->length();
+      size_t bound = libdeflate_gzip_compress_bound(compressor, _input.length());
+      out->resize(start + (int) bound);
+      size_t written = libdeflate_gzip_compress(compressor, _input.constData(), _input.length(),
+                                                out->data() + start, bound);
+      libdeflate_free_compressor(compressor);
+      out->resize(start + (int) written);
+      success = (written > 0);
+    }
+#else
+  _stream.next_in = Z_NULL;
+  _stream.avail_in = 0;
+  success = drain(Z_FINISH, out);
+#endif
+
+  if (success && _level == COMPRESSION_LEVEL_ADAPTIVE)
+    {
+      recordThroughput(_inputBytes, (clock() - _startClock) * 1000.0 / CLOCKS_PER_SEC);
+    }
+  end();
+  return success;
+}
+
+#ifndef QLOCALYTICS_USE_LIBDEFLATE
+bool LocalyticsCompressor::drain(int flush, QByteArray *out)
+{
+  // Deflate into the fixed window and copy out whatever it produced,
+  // until deflate stops filling the window.
+  int code;
+  do {
+    _stream.next_out = (Bytef *)_window;
+    _stream.avail_out = COMPRESSOR_CHUNK_SIZE;
+
+    code = deflate(&_stream, flush);
+    if (code == Z_STREAM_ERROR)
+      return false;
+
+    out->append(_window, COMPRESSOR_CHUNK_SIZE - _stream.avail_out);
+  } while (_stream.avail_out == 0);
+
+  return (flush != Z_FINISH || code == Z_STREAM_END);
+}
+#endif
+
+void LocalyticsCompressor::end()
+{
+  if (_active)
+    {
+#ifdef QLOCALYTICS_USE_LIBDEFLATE
+      _input.clear();
+#else
+      deflateEnd(&_stream);
+#endif
+      _active = false;
+    }
+}
+
+QByteArray LocalyticsCompressor::gzipDeflate(const QByteArray &data)
+{
+  if (data.length() == 0)
+    return data;
+
+  LocalyticsCompressor compressor;
+  QByteArray compressed;
+  if (!compressor.begin(data.length()) ||
+      !compressor.append(data, &compressed) ||
+      !compressor.finish(&compressed))
+    return QByteArray();
+
+  return compressed;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSCOMPRESSOR_H
+#define LOCALYTICSCOMPRESSOR_H
+
+#include <QtCore/QByteArray>
+#include <zlib.h>
+
+#define COMPRESSOR_CHUNK_SIZE          16384   // Size of the fixed output window deflate writes into, in bytes
+#define COMPRESSION_LEVEL_ADAPTIVE     -2      // Pick the level for each member from its size and measured compression speed
+#define COMPRESSION_ADAPTIVE_BUDGET_MS 20      // CPU time the adaptive mode aims to spend on one member, in milliseconds
+
+/*!
+  Produces gzip members incrementally.
+
+  Input is fed with append() as it becomes available and compressed
+  output is appended to the caller's buffer one fixed-size window at a
+  time, so the whole input never has to be held at once.
+
+  Members are produced by zlib unless the library is built with
+  QLOCALYTICS_USE_LIBDEFLATE, in which case libdeflate compresses each
+  member in one pass once finish() is called.  Both produce standard
+  gzip members.
+*/
+class LocalyticsCompressor
+{
+  public:
+  /*!
+    Creates a compressor using the default level, strategy and memory
+    level.
+  */
+  LocalyticsCompressor();
+  ~LocalyticsCompressor();
+
+  /*!
+    \param level 0 to 9, `Z_DEFAULT_COMPRESSION` or
+    COMPRESSION_LEVEL_ADAPTIVE.
+  */
+  void setLevel(int level);
+  int level() const;
+
+  /*!
+    \param strategy A zlib strategy such as `Z_DEFAULT_STRATEGY` or
+    `Z_FILTERED`.  Ignored by the libdeflate backend.
+  */
+  void setStrategy(int strategy);
+  int strategy() const;
+
+  /*!
+    \param memLevel 1 to 9: memory used for the compression state.
+    Ignored by the libdeflate backend.
+  */
+  void setMemLevel(int memLevel);
+  int memLevel() const;
+
+  /*!
+    Defaults applied to compressors created afterwards, including the
+    ones which compress upload headers when they are staged.  The
+    library default is `Z_DEFAULT_COMPRESSION`, `Z_DEFAULT_STRATEGY`
+    and memory level 8.
+  */
+  static void setDefaultLevel(int level);
+  static void setDefaultStrategy(int strategy);
+  static void setDefaultMemLevel(int memLevel);
+
+  /*!
+    Starts a new gzip member, discarding any member in progress.
+    \param sizeHint Expected amount of input, in bytes, used by the
+    adaptive level.  Pass 0 if unknown.
+    \return `true` on success, `false` if deflate could not be initialized.
+  */
+  bool begin(qint64 sizeHint = 0);
+
+  /*!
+    Compresses more input.
+    \param data The next piece of uncompressed input.
+    \param out Compressed output is appended to this buffer.
+    \return `true` on success, `false` otherwise.
+  */
+  bool append(const QByteArray &data, QByteArray *out);
+
+  /*!
+    Flushes the remaining output and the gzip trailer.
+    \param out Compressed output is appended to this buffer.
+    \return `true` on success, `false` otherwise.
+  */
+  bool finish(QByteArray *out);
+
+  /*!
+    The level used for the current or most recent member; differs from
+    level() in adaptive mode.
+  */
+  int effectiveLevel() const;
+
+  /*!
+    Compresses the given data into a single gzip member using the
+    default settings.
+
+    Gzip members may be concatenated and the result is still a valid
+    gzip stream, which is what allows upload headers to be compressed
+    independently when they are staged.
+
+    \param data The uncompressed data.
+    \return The gzip member, or an empty array on failure.
+  */
+  static QByteArray gzipDeflate(const QByteArray &data);
+
+  private:
+  int adaptiveLevel(qint64 sizeHint) const;
+  void recordThroughput(qint64 bytes, double milliseconds);
+  void end();
+
+  int _level;
+  int _strategy;
+  int _memLevel;
+  int _effectiveLevel;
+  qint64 _inputBytes;
+  double _startClock;
+  bool _active;
+#ifdef QLOCALYTICS_USE_LIBDEFLATE
+  QByteArray _input;
+#else
+  bool drain(int flush, QByteArray *out);
+  z_stream _stream;
+  char _window[COMPRESSOR_CHUNK_SIZE];
+#endif
+
+  static int _defaultLevel;
+  static int _defaultStrategy;
+  static int _defaultMemLevel;
+  static double _bytesPerMillisecond[10];
+};
+
+#endif // LOCALYTICSCOMPRESSOR_H
@@ -27,10 +27,15 @@
  * DAMAGE.
  */
 
+#define LOCALYTICS_LOG_COMPONENT "localytics database"
+
 #include "localyticsdatabase.h"
+#include "localyticscompressor.h"
+#include "localyticslog.h"
+#include <QCryptographicHash>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QtSql/QtSql>
-#include <QDebug>
 #include <QDateTime>
 #include <QUuid>
 #include <QChar>
@@ -38,25 +43,77 @@
 
 #define LOCALYTICS_DIR              QLatin1String(".localytics")	// Name for the directory in which Localytics database is stored
 #define LOCALYTICS_DB               QLatin1String("localytics")	// File name for the database (without extension)
+#define LOCALYTICS_SPOOL_DIR        QLatin1String("spool")	// Name for the directory of spooled upload bodies, inside LOCALYTICS_DIR
+#define CLOSE_WRITE_BUDGET_MS       20              // Time within which queueing a close event is expected to complete
 #define BUSY_TIMEOUT                30              // Maximum time SQlite will busy-wait for the database to unlock before returning SQLITE_BUSY
 
 LocalyticsDatabase* LocalyticsDatabase::_sharedLocalyticsDatabase = 0;
+QHash<QString, LocalyticsDatabase *> LocalyticsDatabase::_shards;
+QMutex LocalyticsDatabase::_sharedLock;
+
+
+LocalyticsDatabase::LocalyticsDatabase(QObject *parent) : QObject(parent),
+    _connectionName(QLatin1String(QSqlDatabase::defaultConnection)),
+    _uploadSequence(QLatin1String("last_upload_number"), SEQUENCE_BLOCK_SIZE),
+    _sessionSequence(QLatin1String("last_session_number"), 1)
+{
+    open();
+}
+
+LocalyticsDatabase::LocalyticsDatabase(const QString &shard, QObject *parent) : QObject(parent),
+    _shard(shard),
+    _connectionName(QString(QLatin1String("%1-%2")).arg(LOCALYTICS_DB).arg(shard)),
+    _uploadSequence(QLatin1String("last_upload_number"), SEQUENCE_BLOCK_SIZE),
+    _sessionSequence(QLatin1String("last_session_number"), 1)
+{
+    open();
+}
+
+LocalyticsDatabase* LocalyticsDatabase::databaseForAppKey(const QString &appKey)
+{
+    QMutexLocker locker(&_sharedLock);
+    QString shard = shardName(appKey);
+    LocalyticsDatabase *database = _shards.value(shard);
+    if (!database) {
+        database = new LocalyticsDatabase(shard);
+        _shards.insert(shard, database);
+    }
+    return database;
+}
+
+/*!
+ @method shardName
+ @abstract The shard of an application key: a digest of the key, so that any key makes a valid file name.
+ */
+QString LocalyticsDatabase::shardName(const QString &appKey)
+{
+    QByteArray digest = QCryptographicHash::hash(appKey.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return QLatin1String(digest.left(16));
+}
 
+QString LocalyticsDatabase::shard() const
+{
+    return _shard;
+}
 
-LocalyticsDatabase::LocalyticsDatabase(QObject *parent) : QObject(parent)
+/*!
+ @method open
+ @abstract Opens the database file, and creates or upgrades its schema.
+ */
+void LocalyticsDatabase::open()
 {
     // Attempt to open database. It will be created if it does not exist, already.
 
-  _databaseConnection = QSqlDatabase::addDatabase( QLatin1String("QSQLITE") );
+  _databaseConnection = QSqlDatabase::addDatabase( QLatin1String("QSQLITE"), _connectionName );
   _databaseConnection.setDatabaseName(pathToDatabaseFile());
   bool success = _databaseConnection.open();
   if (!success)
     {
-      qDebug() << _databaseConnection.lastError();
+      LOCALYTICS_ERROR(_databaseConnection.lastError().text());
       qFatal( "Failed to connect." );
     }
 
-    qDebug( "Connected!" );
+    LOCALYTICS_DEBUG(QLatin1String("Connected!"));
 
 //    // If we were unable to open the database, it is likely corrupted. Clobber it and move on.
 //    if (code != SQLITE_OK) {
@@ -73,13 +130,32 @@ LocalyticsDatabase::LocalyticsDatabase(QObject *parent) : QObject(parent)
     if (schemaVersion() < 7) {
         createSchema();
     }
+    if (schemaVersion() < 8) {
+        upgradeToSchemaV8();
+    }
+    if (schemaVersion() < 9) {
+        upgradeToSchemaV9();
+    }
+    if (schemaVersion() < 10) {
+        upgradeToSchemaV10();
+    }
+    if (schemaVersion() < 11) {
+        upgradeToSchemaV11();
+    }
+
+    _queueProvisionalEvents = QSqlQuery(_databaseConnection);
+    _queueProvisionalEvents.prepare(QLatin1String("UPDATE localytics_info SET queued_close_event_blob = :close, queued_flow_event_blob = :flow"));
 }
 
 LocalyticsDatabase::~LocalyticsDatabase()
 {
   if (_databaseConnection.isOpen()) 
     {
-      QSqlDatabase::removeDatabase(QLatin1String("QSQLITE"));
+      // The connection can only be removed once no handle refers to it.
+      _queueProvisionalEvents = QSqlQuery();
+      _databaseConnection.close();
+      _databaseConnection = QSqlDatabase();
+      QSqlDatabase::removeDatabase(_connectionName);
     }
 }
 
@@ -91,8 +167,9 @@ QString LocalyticsDatabase::pathToDatabaseFile()
   if (!directoryPath.exists()) {
     QDir::home().mkpath(LOCALYTICS_DIR);
   }
-  QString p = QDir::homePath() +  QLatin1Char('/') + LOCALYTICS_DIR + QLatin1Char('/') + LOCALYTICS_DB + QLatin1String(".db") ;
-  qDebug() << "Path do DB: " << p;
+  QString name = _shard.isEmpty() ? QString(LOCALYTICS_DB) : _connectionName;
+  QString p = QDir::homePath() +  QLatin1Char('/') + LOCALYTICS_DIR + QLatin1Char('/') + name + QLatin1String(".db") ;
+  LOCALYTICS_DEBUG(QLatin1String("Path to DB: ") + p);
   return p;
 }
 
@@ -108,6 +185,10 @@ bool LocalyticsDatabase::releaseTransaction(QString name) {
 }
 
 bool LocalyticsDatabase::rollbackTransaction(QString name) {
+    // A rolled back reservation leaves the in-memory blocks ahead of the database.
+    _uploadSequence.invalidate();
+    _sessionSequence.invalidate();
+
     QSqlQuery q(_databaseConnection);
     return q.exec(QString(QLatin1String("ROLLBACK TO SAVEPOINT %1")).arg(name));
 }
@@ -162,9 +243,20 @@ void LocalyticsDatabase::createSchema()
                                     "custom_d0 CHAR(64), "
                                     "custom_d1 CHAR(64), "
                                     "custom_d2 CHAR(64), "
-                                    "custom_d3 CHAR(64) "
+                                    "custom_d3 CHAR(64), "
+                                    "queued_close_event_blob TEXT "
                                     ")"));
 
+    success &= q.exec(QLatin1String("CREATE TABLE localytics_amp_rule ("
+                                    "rule_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                    "rule_name TEXT UNIQUE, "
+                                    "expiration INTEGER, "
+                                    "version INTEGER)"));
+
+    success &= q.exec(QLatin1String("CREATE TABLE localytics_amp_ruleevent ("
+                                    "rule_id INTEGER REFERENCES localytics_amp_rule(rule_id) ON DELETE CASCADE, "
+                                    "event_name TEXT)"));
+
     success &= q.exec(QLatin1String("INSERT INTO localytics_info (schema_version, last_upload_number, last_session_number, opt_out) VALUES (7, 0, 0, 0)"));
 
     if (success)
@@ -174,12 +266,136 @@ void LocalyticsDatabase::createSchema()
 
 }
 
+void LocalyticsDatabase::upgradeToSchemaV8()
+{
+    // Version 8 stores the compressed upload body of each header.
+    _databaseConnection.transaction();
+
+    bool success = true;
+    QSqlQuery q(_databaseConnection);
+
+    success &= q.exec(QLatin1String("ALTER TABLE upload_headers ADD COLUMN gzip_blob BLOB"));
+    success &= q.exec(QLatin1String("UPDATE localytics_info SET schema_version = 8"));
+
+    if (success)
+        _databaseConnection.commit();
+    else
+        _databaseConnection.rollback();
+}
+
+void LocalyticsDatabase::upgradeToSchemaV9()
+{
+    // Version 9 journals upload requests, so that a crash between
+    // posting a batch and deleting it doesn't resend the backlog.
+    _databaseConnection.transaction();
+
+    bool success = true;
+    QSqlQuery q(_databaseConnection);
+
+    success &= q.exec(QLatin1String("CREATE TABLE upload_journal ("
+                                    " request_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                                    " first_sequence INTEGER NOT NULL,"
+                                    " last_sequence INTEGER NOT NULL,"
+                                    " sequence_numbers TEXT NOT NULL,"
+                                    " body_hash BLOB,"
+                                    " state INTEGER NOT NULL,"
+                                    " updated_at INTEGER)"));
+    success &= q.exec(QLatin1String("UPDATE localytics_info SET schema_version = 9"));
+
+    if (success)
+        _databaseConnection.commit();
+    else
+        _databaseConnection.rollback();
+}
+
+void LocalyticsDatabase::upgradeToSchemaV10()
+{
+    // Version 10 adds what schemas created by earlier versions of this
+    // library lacked, although the library uses it: the queued close
+    // event, and the tables cleared by resetAnalyticsData().
+    _databaseConnection.transaction();
+
+    bool success = true;
+    QSqlQuery q(_databaseConnection);
+
+    bool hasQueuedCloseEvent = false;
+    success &= q.exec(QLatin1String("PRAGMA table_info(localytics_info)"));
+    while (q.next()) {
+        if (q.value(1).toString() == QLatin1String("queued_close_event_blob")) {
+            hasQueuedCloseEvent = true;
+        }
+    }
+    if (!hasQueuedCloseEvent) {
+        success &= q.exec(QLatin1String("ALTER TABLE localytics_info ADD COLUMN queued_close_event_blob TEXT"));
+    }
+    success &= q.exec(QLatin1String("CREATE TABLE IF NOT EXISTS localytics_amp_rule ("
+                                    "rule_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                    "rule_name TEXT UNIQUE, "
+                                    "expiration INTEGER, "
+                                    "version INTEGER)"));
+    success &= q.exec(QLatin1String("CREATE TABLE IF NOT EXISTS localytics_amp_ruleevent ("
+                                    "rule_id INTEGER REFERENCES localytics_amp_rule(rule_id) ON DELETE CASCADE, "
+                                    "event_name TEXT)"));
+    success &= q.exec(QLatin1String("UPDATE localytics_info SET schema_version = 10"));
+
+    if (success)
+        _databaseConnection.commit();
+    else
+        _databaseConnection.rollback();
+}
+
+void LocalyticsDatabase::upgradeToSchemaV11()
+{
+    // Version 11 keeps the flow event of a backgrounded session in the
+    // provisional slot along with its close event.
+    _databaseConnection.transaction();
+
+    bool success = true;
+    QSqlQuery q(_databaseConnection);
+
+    success &= q.exec(QLatin1String("ALTER TABLE localytics_info ADD COLUMN queued_flow_event_blob TEXT"));
+    success &= q.exec(QLatin1String("UPDATE localytics_info SET schema_version = 11"));
+
+    if (success)
+        _databaseConnection.commit();
+    else
+        _databaseConnection.rollback();
+}
+
 qint64 LocalyticsDatabase::databaseSize()
 {
     QFile db(pathToDatabaseFile());
     return db.size();
 }
 
+QString LocalyticsDatabase::spoolDirectory()
+{
+    QString path = QDir::homePath() + QLatin1Char('/') + LOCALYTICS_DIR + QLatin1Char('/') + LOCALYTICS_SPOOL_DIR;
+    if (!_shard.isEmpty()) {
+        path += QLatin1Char('-') + _shard;
+    }
+    QDir directory(path);
+    if (!directory.exists()) {
+        directory.mkpath(path);
+    }
+    return path;
+}
+
+qint64 LocalyticsDatabase::spoolSize()
+{
+    qint64 size = 0;
+    QFileInfoList files = QDir(spoolDirectory()).entryInfoList(QDir::Files);
+    for (int i = 0; i < files.size(); i++) {
+        size += files.at(i).size();
+    }
+    return size;
+}
+
+qint64 LocalyticsDatabase::storageSize()
+{
+    return databaseSize() + spoolSize();
+}
+
 int LocalyticsDatabase::eventCount() {
     int count = 0;
 
@@ -267,79 +483,21 @@ bool LocalyticsDatabase::setCustomDimension(int dimension, QString value)
   q.prepare(QString(QLatin1String("UPDATE localytics_info SET custom_d%1 = :value")).arg(dimension));
 
   q.bindValue(QLatin1String(":value"), value);
-  return q.exec();
+  bool success = q.exec();
+  if (success) {
+    emit customDimensionsChanged();
+  }
+  return success;
 }
 
 bool LocalyticsDatabase::incrementLastUploadNumber(int *uploadNumber)
 {
-    QString t(QLatin1String("increment_upload_number"));
-    bool success = true;
-
-    success = beginTransaction(t);
-    QSqlQuery q(_databaseConnection);
-
-    if (success)
-      {
-        // Increment value
-        success = q.exec(QLatin1String("UPDATE localytics_info "
-                                       "SET last_upload_number = (last_upload_number + 1)"));
-      }
-
-    if (success)
-      {
-        // Retrieve new value
-        success = q.exec(QLatin1String("SELECT last_upload_number FROM localytics_info"));
-        if (q.next()) 
-          {
-            *uploadNumber = q.value(0).toInt();
-          }
-      }
-
-    if (success) 
-      {
-        releaseTransaction(t);
-      }
-    else
-      {
-        rollbackTransaction(t);
-      }
-    return success;
+    return _uploadSequence.next(_databaseConnection, uploadNumber);
 }
 
 bool LocalyticsDatabase::incrementLastSessionNumber(int *sessionNumber)
 {
-    QString t(QLatin1String("increment_session_number"));
-    bool success = true;
-
-    success = beginTransaction(t);
-    QSqlQuery q(_databaseConnection);
-
-    if (success)
-      {
-        // Increment value
-        success = q.exec(QLatin1String("UPDATE localytics_info "
-                                       "SET last_session_number = (last_session_number + 1)"));
-      }
-
-    if (success) 
-      {
-        // Retrieve new value
-        success = q.exec(QLatin1String("SELECT last_session_number FROM localytics_info"));
-        if (q.next()) 
-          {
-            *sessionNumber = q.value(0).toInt();
-          }
-      }
-
-    if (success) 
-      {
-        releaseTransaction(t);
-      } 
-    else
-      {
-        rollbackTransaction(t);
-      }
-    return success;
+    return _sessionSequence.next(_databaseConnection, sessionNumber);
 }
 
 bool LocalyticsDatabase::addEventWithBlobString(QString blob, int *rowid)
@@ -360,104 +518,65 @@ bool LocalyticsDatabase::addEventWithBlobString(QString blob)
   return addEventWithBlobString(blob, 0);
 }
 
-bool LocalyticsDatabase::addCloseEventWithBlobString(QString blob)
+bool LocalyticsDatabase::queueProvisionalEvents(QString closeBlob, QString flowBlob)
 {
-    QString t(QLatin1String("add_close_event"));
-    bool success = beginTransaction(t);
-
-    int event_id;
-    // Add close event.
-    if (success) 
-      {
-        success = addEventWithBlobString(blob, &event_id);
-      }
-
-    // Record row id to localytics_info so that it can be removed if the session resumes.
-    if (success) {
-        QSqlQuery q(_databaseConnection);
-        q.prepare(QLatin1String("UPDATE localytics_info SET last_close_event = (SELECT event_id FROM events WHERE rowid = :rowid)"));
-        q.bindValue(QLatin1String(":rowid"), event_id);
-        success = q.exec();
-    }
-
-    if (success) {
-        releaseTransaction(t);
-    } else {
-        rollbackTransaction(t);
+    // One statement is atomic by itself, so no savepoint is needed.
+    QElapsedTimer timer;
+    timer.start();
+    _queueProvisionalEvents.bindValue(QLatin1String(":close"), closeBlob);
+    _queueProvisionalEvents.bindValue(QLatin1String(":flow"), flowBlob);
+    bool success = _queueProvisionalEvents.exec();
+    qint64 elapsed = timer.elapsed();
+    if (elapsed > CLOSE_WRITE_BUDGET_MS) {
+        LOCALYTICS_WARNING(QString(QLatin1String("Queueing the close event took %1 ms.")).arg(elapsed));
     }
     return success;
 }
 
-bool LocalyticsDatabase::queueCloseEventWithBlobString(QString blob)
+bool LocalyticsDatabase::queueFlowEventWithBlobString(QString blob)
 {
-    QString t(QLatin1String("queue_close_event"));
-    bool success = this->beginTransaction(t);
-
-    // Queue close event.
-    if (success) {
-        QSqlQuery queueCloseEvent(_databaseConnection);
-        queueCloseEvent.prepare(QLatin1String("UPDATE localytics_info SET queued_close_event_blob = :blob"));
-        queueCloseEvent.bindValue(QLatin1String(":blob"), blob);
-        success = queueCloseEvent.exec();
-    }
-    if (success) {
-        this->releaseTransaction(t);
-    } else {
-        this->rollbackTransaction(t);
-    }
-    return success;
+    QSqlQuery q(_databaseConnection);
+    q.prepare(QLatin1String("UPDATE localytics_info SET queued_flow_event_blob = :blob"));
+    q.bindValue(QLatin1String(":blob"), blob);
+    return q.exec();
 }
 
-QString LocalyticsDatabase::dequeueCloseEventBlobString()
+bool LocalyticsDatabase::promoteProvisionalEvents()
 {
-    QString val;
+    QString closeBlob;
+    QString flowBlob;
     QSqlQuery q(_databaseConnection);
-    q.exec(QLatin1String("SELECT queued_close_event_blob FROM localytics_info"));
+    q.exec(QLatin1String("SELECT queued_close_event_blob, queued_flow_event_blob FROM localytics_info"));
     if (q.next()) {
-        val = q.value(0).toString();
+        closeBlob = q.value(0).toString();
+        flowBlob = q.value(1).toString();
     }
-
-    // Clear the queued close event blob.
-    queueCloseEventWithBlobString(QString());
-
-    return val;
-}
-
-bool LocalyticsDatabase::addFlowEventWithBlobString(QString blob)
-{
-    QString t(QLatin1String("add_flow_event"));
-    bool success = this->beginTransaction(t);
-    int event_id;
-    // Add flow event.
-    if (success) {
-      success = addEventWithBlobString(blob, &event_id);
+    q.finish();
+    if (closeBlob.isEmpty() && flowBlob.isEmpty()) {
+        return true;
     }
 
-    // Record row id to localytics_info so that it can be removed if the session resumes.
+    QString t(QLatin1String("promote_provisional_events"));
+    bool success = beginTransaction(t);
+    // The flow event goes first, as it did when it was written on upload.
+    if (success && !flowBlob.isEmpty()) {
+        success = addEventWithBlobString(flowBlob);
+    }
+    if (success && !closeBlob.isEmpty()) {
+        success = addEventWithBlobString(closeBlob);
+    }
     if (success) {
-        QSqlQuery q(_databaseConnection);
-        q.prepare(QLatin1String("UPDATE localytics_info SET last_flow_event = (SELECT event_id FROM events WHERE rowid = :rowid)"));
-        q.bindValue(QLatin1String(":rowid"), event_id);
-        success = q.exec();
+        success = q.exec(QLatin1String("UPDATE localytics_info SET queued_close_event_blob = null, queued_flow_event_blob = null"));
     }
 
     if (success) {
-        this->releaseTransaction(t);
+        releaseTransaction(t);
     } else {
-        this->rollbackTransaction(t);
+        rollbackTransaction(t);
     }
     return success;
 }
 
-bool LocalyticsDatabase::removeLastCloseAndFlowEvents()
-{
-    // Attempt to remove the last recorded close event.
-    // Fail quietly if none was saved or it was previously removed.
-    QSqlQuery q(_databaseConnection);
-
-    return q.exec(QLatin1String("DELETE FROM events WHERE event_id = (SELECT last_close_event FROM localytics_info) OR event_id = (SELECT last_flow_event FROM localytics_info)"));
-}
-
 bool LocalyticsDatabase::addHeaderWithSequenceNumber(int number, QString blob, int *insertedRowId)
 {
     QSqlQuery q(_databaseConnection);
@@ -490,7 +609,63 @@ bool LocalyticsDatabase::stageEventsForUpload(int headerId)
     q.prepare(QLatin1String("UPDATE events SET upload_header = :upload_header WHERE upload_header IS NULL"));
     q.bindValue(QLatin1String(":upload_header"), headerId);
 
-    return q.exec();
+    bool success = q.exec();
+
+    // A missing member is not fatal: uploadGzipData() retries the compression.
+    if (success) {
+        compressUploadHeader(headerId);
+    }
+    return success;
+}
+
+bool LocalyticsDatabase::compressUploadHeader(int headerId)
+{
+    // The header blob followed by its events, in the order they were
+    // recorded.  Rows are deflated one at a time as they are read.
+    LocalyticsCompressor compressor;
+    QByteArray member;
+    qint64 sizeHint = 0;
+    if (compressor.level() == COMPRESSION_LEVEL_ADAPTIVE) {
+        QSqlQuery size(_databaseConnection);
+        size.prepare(QLatin1String("SELECT SUM(LENGTH(blob_string)) FROM events WHERE upload_header = :header"));
+        size.bindValue(QLatin1String(":header"), headerId);
+        if (size.exec() && size.next()) {
+            sizeHint = size.value(0).toLongLong();
+        }
+    }
+    if (!compressor.begin(sizeHint)) {
+        return false;
+    }
+
+    QSqlQuery header(_databaseConnection);
+    header.prepare(QLatin1String("SELECT blob_string FROM upload_headers WHERE sequence_number = :header"));
+    header.bindValue(QLatin1String(":header"), headerId);
+    if (!header.exec() || !header.next()) {
+        return false;
+    }
+    compressor.append(header.value(0).toString().toUtf8(), &member);
+
+    QSqlQuery events(_databaseConnection);
+    events.setForwardOnly(true);
+    events.prepare(QLatin1String("SELECT blob_string FROM events WHERE upload_header = :header ORDER BY event_id"));
+    events.bindValue(QLatin1String(":header"), headerId);
+    if (!events.exec()) {
+        return false;
+    }
+    while (events.next()) {
+        if (!compressor.append(events.value(0).toString().toUtf8(), &member)) {
+            return false;
+        }
+    }
+    if (!compressor.finish(&member)) {
+        return false;
+    }
+
+    QSqlQuery update(_databaseConnection);
+    update.prepare(QLatin1String("UPDATE upload_headers SET gzip_blob = :gzip_blob WHERE sequence_number = :header"));
+    update.bindValue(QLatin1String(":gzip_blob"), member);
+    update.bindValue(QLatin1String(":header"), headerId);
+    return update.exec();
 }
 
 bool LocalyticsDatabase::updateAppKey(QString appKey)
@@ -520,6 +695,50 @@ QString LocalyticsDatabase::uploadBlobString()
     return uploadBlobString;
 }
 
+QByteArray LocalyticsDatabase::uploadGzipData()
+{
+    // Concatenated gzip members form a valid multi-member gzip stream.
+    QByteArray uploadData;
+    QList<LocalyticsUploadSegment> segments = uploadSegments();
+    for (int i = 0; i < segments.size(); i++) {
+        uploadData.append(uploadSegmentData(segments.at(i).sequenceNumber));
+    }
+
+    return uploadData;
+}
+
+QList<LocalyticsUploadSegment> LocalyticsDatabase::uploadSegments()
+{
+    QSqlQuery missing(_databaseConnection);
+    missing.exec(QLatin1String("SELECT sequence_number FROM upload_headers WHERE gzip_blob IS NULL"));
+    while (missing.next()) {
+        compressUploadHeader(missing.value(0).toInt());
+    }
+
+    QList<LocalyticsUploadSegment> segments;
+    QSqlQuery q(_databaseConnection);
+    q.exec(QLatin1String("SELECT sequence_number, LENGTH(gzip_blob) FROM upload_headers "
+                         "WHERE gzip_blob IS NOT NULL ORDER BY sequence_number"));
+    while (q.next()) {
+        LocalyticsUploadSegment segment;
+        segment.sequenceNumber = q.value(0).toInt();
+        segment.size = q.value(1).toLongLong();
+        segments.append(segment);
+    }
+    return segments;
+}
+
+QByteArray LocalyticsDatabase::uploadSegmentData(int sequenceNumber)
+{
+    QSqlQuery q(_databaseConnection);
+    q.prepare(QLatin1String("SELECT gzip_blob FROM upload_headers WHERE sequence_number = :sequence"));
+    q.bindValue(QLatin1String(":sequence"), sequenceNumber);
+    if (q.exec() && q.next()) {
+        return q.value(0).toByteArray();
+    }
+    return QByteArray();
+}
+
 bool LocalyticsDatabase::deleteUploadedData()
 {
     // Delete all headers and staged events.
@@ -538,6 +757,97 @@ bool LocalyticsDatabase::deleteUploadedData()
     return success;
 }
 
+bool LocalyticsDatabase::deleteUploadedData(const QList<int> &sequenceNumbers)
+{
+    if (sequenceNumbers.isEmpty()) {
+        return true;
+    }
+
+    QStringList numbers;
+    for (int i = 0; i < sequenceNumbers.size(); i++) {
+        numbers.append(QString::number(sequenceNumbers.at(i)));
+    }
+    QString list = numbers.join(QLatin1String(","));
+
+    QString t(QLatin1String("delete_upload_batch"));
+    bool success = beginTransaction(t);
+
+    QSqlQuery q(_databaseConnection);
+    success &= q.exec(QString(QLatin1String("DELETE FROM events WHERE upload_header IN (%1)")).arg(list));
+    success &= q.exec(QString(QLatin1String("DELETE FROM upload_headers WHERE sequence_number IN (%1)")).arg(list));
+
+    if (success) {
+        releaseTransaction(t);
+    } else {
+        rollbackTransaction(t);
+    }
+    return success;
+}
+
+bool LocalyticsDatabase::addJournalEntry(const QList<int> &sequenceNumbers, const QByteArray &bodyHash, int *requestId)
+{
+    if (sequenceNumbers.isEmpty()) {
+        return false;
+    }
+
+    QStringList numbers;
+    for (int i = 0; i < sequenceNumbers.size(); i++) {
+        numbers.append(QString::number(sequenceNumbers.at(i)));
+    }
+
+    QSqlQuery q(_databaseConnection);
+    q.prepare(QLatin1String("INSERT INTO upload_journal (first_sequence, last_sequence, sequence_numbers, body_hash, state, updated_at) "
+                            "VALUES (:first, :last, :numbers, :hash, :state, :updated)"));
+    q.bindValue(QLatin1String(":first"), sequenceNumbers.first());
+    q.bindValue(QLatin1String(":last"), sequenceNumbers.last());
+    q.bindValue(QLatin1String(":numbers"), numbers.join(QLatin1String(",")));
+    q.bindValue(QLatin1String(":hash"), bodyHash);
+    q.bindValue(QLatin1String(":state"), JOURNAL_IN_FLIGHT);
+    q.bindValue(QLatin1String(":updated"), QDateTime::currentDateTime().toTime_t());
+    bool success = q.exec();
+    if (success) {
+        *requestId = q.lastInsertId().toInt();
+    }
+    return success;
+}
+
+bool LocalyticsDatabase::setJournalState(int requestId, int state)
+{
+    QSqlQuery q(_databaseConnection);
+    q.prepare(QLatin1String("UPDATE upload_journal SET state = :state, updated_at = :updated WHERE request_id = :request"));
+    q.bindValue(QLatin1String(":state"), state);
+    q.bindValue(QLatin1String(":updated"), QDateTime::currentDateTime().toTime_t());
+    q.bindValue(QLatin1String(":request"), requestId);
+    return q.exec();
+}
+
+bool LocalyticsDatabase::removeJournalEntry(int requestId)
+{
+    QSqlQuery q(_databaseConnection);
+    q.prepare(QLatin1String("DELETE FROM upload_journal WHERE request_id = :request"));
+    q.bindValue(QLatin1String(":request"), requestId);
+    return q.exec();
+}
+
+QList<LocalyticsJournalEntry> LocalyticsDatabase::journalEntries()
+{
+    QList<LocalyticsJournalEntry> entries;
+    QSqlQuery q(_databaseConnection);
+    q.exec(QLatin1String("SELECT request_id, sequence_numbers, body_hash, state FROM upload_journal ORDER BY request_id"));
+    while (q.next()) {
+        LocalyticsJournalEntry entry;
+        entry.requestId = q.value(0).toInt();
+        QStringList numbers = q.value(1).toString().split(QLatin1Char(','), QString::SkipEmptyParts);
+        for (int i = 0; i < numbers.size(); i++) {
+            entry.sequenceNumbers.append(numbers.at(i).toInt());
+        }
+        entry.bodyHash = q.value(2).toByteArray();
+        entry.state = q.value(3).toInt();
+        entries.append(entry);
+    }
+    return entries;
+}
+
 bool LocalyticsDatabase::resetAnalyticsData() {
     // Delete or zero all analytics data.
     // Reset: headers, events, session number, upload number, last session start, last close event, and last flow event.
@@ -549,15 +859,19 @@ bool LocalyticsDatabase::resetAnalyticsData() {
 
     success &= q.exec(QLatin1String("DELETE FROM events"));
     success &= q.exec(QLatin1String("DELETE FROM upload_headers"));
+    success &= q.exec(QLatin1String("DELETE FROM upload_journal"));
     success &= q.exec(QLatin1String("DELETE FROM localytics_amp_rule"));
     success &= q.exec(QLatin1String("DELETE FROM localytics_amp_ruleevent"));
     success &= q.exec(QLatin1String("UPDATE localytics_info SET "
                                     " last_session_number = 0, last_upload_number = 0,"
                                     " last_close_event = null, last_flow_event = null, last_session_start = null, "
                                     " custom_d0 = null, custom_d1 = null, custom_d2 = null, custom_d3 = null, "
-                                    " customer_id = null, queued_close_event_blob = null "));
+                                    " customer_id = null, queued_close_event_blob = null, queued_flow_event_blob = null "));
+    _uploadSequence.invalidate();
+    _sessionSequence.invalidate();
     if (success) {
         releaseTransaction(t);
+        emit customDimensionsChanged();
     } else {
         rollbackTransaction(t);
     }
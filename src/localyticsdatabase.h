@@ -31,14 +31,44 @@
 #define LOCALYTICSDATABASE_H
 
 #include <QObject>
+#include <QHash>
+#include <QList>
+#include <QMutex>
 #include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlQuery>
+#include "localyticssequence.h"
 
 
 class QDateTime;
 
 #define MAX_DATABASE_SIZE   500000  // The maximum allowed disk size of the primary database file at open, in bytes
 #define VACUUM_THRESHOLD    0.8     // The database is vacuumed after its size exceeds this proportion of the maximum.
+#define SEQUENCE_BLOCK_SIZE 8       // How many upload numbers are reserved with each database write.
 
+#define JOURNAL_IN_FLIGHT   0       // The request was posted and no response has been handled yet.
+#define JOURNAL_ACKED       1       // The server accepted the request; its headers are being deleted.
+#define JOURNAL_FAILED      2       // The request failed; its headers are sent again by a later upload.
+
+
+/*!
+  A staged upload header and the size of its stored gzip member.
+*/
+struct LocalyticsUploadSegment
+{
+    int sequenceNumber;
+    qint64 size;
+};
+
+/*!
+  A request recorded in the upload journal.
+*/
+struct LocalyticsJournalEntry
+{
+    int requestId;
+    QList<int> sequenceNumbers;
+    QByteArray bodyHash;
+    int state;
+};
 
 class LocalyticsDatabase : public QObject
 {
@@ -47,12 +77,37 @@ class LocalyticsDatabase : public QObject
       friend class DatabaseTest;
 public:
     
+    /*!
+      The database may be looked up from any thread, but QtSql
+      connections can only be used on the thread which opened them, so
+      it must only be used on the thread which first called this,
+      which is the session's thread.
+    */
     static LocalyticsDatabase* sharedLocalyticsDatabase() {
+        QMutexLocker locker(&_sharedLock);
         if (!_sharedLocalyticsDatabase) {
             _sharedLocalyticsDatabase = new LocalyticsDatabase;
         }
         return _sharedLocalyticsDatabase;
     }
+
+    /*!
+      The database of the sessions of one application key, kept apart
+      from the shared database and those of other keys.  Like the
+      shared database, it is created on first use and must only be used
+      on that thread.
+
+      \param appKey The application key.
+      \return The database of that key, in a file of its own.
+    */
+    static LocalyticsDatabase* databaseForAppKey(const QString &appKey);
+
+    /*!
+      \return The name of the shard of this database, or an empty
+      string for the shared database.
+    */
+    QString shard() const;
+
     /*!
       The size of the sqlite3-backing database.
       
@@ -60,6 +115,26 @@ public:
      */
     qint64 databaseSize();
 
+    /*!
+      The directory in which upload bodies are spooled, see
+      LocalyticsUploader::setSpooling().  It is created if needed.
+    */
+    QString spoolDirectory();
+
+    /*!
+      \return Total size of the spooled upload bodies, in bytes.
+    */
+    qint64 spoolSize();
+
+    /*!
+      The disk space used for analytics data, which is checked against
+      MAX_DATABASE_SIZE.  Spooled bodies are copies of staged data, but
+      still take up the space.
+
+      \return databaseSize() plus spoolSize(), in bytes.
+    */
+    qint64 storageSize();
+
     /*!
       Number of events in the database.
       They are added by calling "add*Event*" functions
@@ -78,29 +153,125 @@ public:
     */
     QDateTime createdTimestamp();
 
-    
+    /*!
+      Retrieves the next upload number.
+
+      Numbers are reserved SEQUENCE_BLOCK_SIZE at a time, so most calls
+      do not touch the database.  The stored value is a high-water
+      mark: numbers never repeat, but those left unused in a block when
+      the process exits are skipped.
+      \return `true` on success, `false` otherwise.
+    */
     bool incrementLastUploadNumber(int *uploadNumber);
+
+    /*!
+      Retrieves the next session number.  Session numbers count the
+      sessions of the device, so each is written as it is handed out
+      and none are skipped.
+      \return `true` on success, `false` otherwise.
+    */
     bool incrementLastSessionNumber(int *sessionNumber);
 
     bool addEventWithBlobString(QString blob);
     bool addEventWithBlobString(QString blob, int *rowid);
 
-    bool addCloseEventWithBlobString(QString blob);
-    bool queueCloseEventWithBlobString(QString blob);
-    QString  dequeueCloseEventBlobString();
-    bool addFlowEventWithBlobString(QString blob);
-    bool removeLastCloseAndFlowEvents();
+    /*!
+      Keeps the close and flow events of a session which went to the
+      background in the provisional slot, replacing what it held, in
+      one prepared statement, so that they can be written in the little
+      time the OS leaves on suspend.  A write taking longer than
+      CLOSE_WRITE_BUDGET_MS is logged.  Nothing is inserted into the
+      events table, so resuming the session deletes nothing.
+      \param closeBlob The close event.
+      \param flowBlob The flow event, or a null string if there is none.
+      \return `true` on success, `false` otherwise.
+    */
+    bool queueProvisionalEvents(QString closeBlob, QString flowBlob);
+
+    /*!
+      Keeps a flow event in the provisional slot, next to the close
+      event held there.
+      \param blob The flow event, or a null string to clear it.
+    */
+    bool queueFlowEventWithBlobString(QString blob);
+
+    /*!
+      Moves the events of the provisional slot into the events table, for
+      a session which won't be resumed.
+      \return `true` on success, including when the slot is empty.
+    */
+    bool promoteProvisionalEvents();
 
     bool addHeaderWithSequenceNumber(int number, QString blob, int *insertedRowId);
+
+    /*!
+      Associates all outstanding events with the given upload header
+      and stores the gzip member for the header and its events, so the
+      data is never compressed again at upload time.
+      \return `true` if the events were staged, `false` otherwise.
+    */
     bool stageEventsForUpload(int headerId);
     bool updateAppKey(QString appKey);
     QString  uploadBlobString();
 
+    /*!
+      The request body for an upload: the stored gzip member of every
+      upload header, in sequence order.  Headers which have no member
+      yet (staged by an older version, or whose compression failed) are
+      compressed and persisted first.
+      \return Multi-member gzip data, or an empty array if nothing is staged.
+    */
+    QByteArray uploadGzipData();
+
+    /*!
+      Lists the staged upload headers and the sizes of their gzip
+      members, in sequence order, compressing any header which has no
+      member yet.  The body of an upload is the concatenation of these
+      members, each read with uploadSegmentData().
+    */
+    QList<LocalyticsUploadSegment> uploadSegments();
+
+    /*!
+      Reads the stored gzip member of an upload header, in one query.
+      \param sequenceNumber The upload header.
+      \return The member; empty if the header is gone.
+    */
+    QByteArray uploadSegmentData(int sequenceNumber);
+
     /*!
       Upon successful upload, purges local data that was just uploaded.
       \return `true` on success, `false` otherwise.
     */
     bool deleteUploadedData();
+
+    /*!
+      Purges the given upload headers and their events, once the
+      request which carried them has succeeded.
+      \param sequenceNumbers The upload headers to delete.
+      \return `true` on success, `false` otherwise.
+    */
+    bool deleteUploadedData(const QList<int> &sequenceNumbers);
+
+    /*!
+      Records a request about to be posted in the upload journal, in
+      the JOURNAL_IN_FLIGHT state.  The journal survives the process,
+      so that an upload interrupted by a crash can be resumed with the
+      same requests.
+      \param sequenceNumbers The upload headers the request carries.
+      \param bodyHash SHA-1 hash identifying the request body, see
+      LocalyticsUploader::bodyHash().
+      \param requestId Set to the identifier of the new entry.
+      \return `true` on success, `false` otherwise.
+    */
+    bool addJournalEntry(const QList<int> &sequenceNumbers, const QByteArray &bodyHash, int *requestId);
+    bool setJournalState(int requestId, int state);
+    bool removeJournalEntry(int requestId);
+
+    /*!
+      \return Every journal entry, oldest first.
+    */
+    QList<LocalyticsJournalEntry> journalEntries();
+
     bool resetAnalyticsData();
     bool vacuumIfRequired();
 
@@ -127,7 +298,11 @@ public:
 
 
 signals:
-    
+    /*!
+      Emitted when custom dimensions are set or reset.
+    */
+    void customDimensionsChanged();
+
 public slots:
     
 private:
@@ -136,16 +311,31 @@ private:
       \param parent Parent object to retain ownership.
     */
     explicit LocalyticsDatabase(QObject *parent = 0);
+    LocalyticsDatabase(const QString &shard, QObject *parent = 0);
     ~LocalyticsDatabase();
 
+    void open();
+    static QString shardName(const QString &appKey);
     QString pathToDatabaseFile();
     int schemaVersion();
     void createSchema();
+    void upgradeToSchemaV8();
+    void upgradeToSchemaV9();
+    void upgradeToSchemaV10();
+    void upgradeToSchemaV11();
+    bool compressUploadHeader(int headerId);
     void moveDbToCaches();
     QString randomUUID();
+    QString _shard;
+    QString _connectionName;
     QSqlDatabase _databaseConnection;
+    QSqlQuery _queueProvisionalEvents;
+    LocalyticsSequence _uploadSequence;
+    LocalyticsSequence _sessionSequence;
 
     static LocalyticsDatabase *_sharedLocalyticsDatabase;
+    static QHash<QString, LocalyticsDatabase *> _shards;
+    static QMutex _sharedLock;
 };
 
 #endif // LOCALYTICSDATABASE_H
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticseventbuffer.h"
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QtAlgorithms>
+
+// Shared by every session, so that events keep one order process wide.
+static QAtomicInt eventSequence;
+
+static bool sequencePrecedes(int a, int b)
+{
+  // Compared by difference, so the order survives the sequence
+  // wrapping.  The difference is taken unsigned, where wrapping is
+  // defined.
+  return (int) ((unsigned int) a - (unsigned int) b) < 0;
+}
+
+static bool precedes(const LocalyticsBufferedEvent &a, const LocalyticsBufferedEvent &b)
+{
+  return sequencePrecedes(a.sequence, b.sequence);
+}
+
+static void addStats(LocalyticsEventStats *sum, const LocalyticsEventStats &stats)
+{
+  sum->events += stats.events;
+  sum->truncatedEvents += stats.truncatedEvents;
+  sum->truncatedNames += stats.truncatedNames;
+  sum->truncatedKeys += stats.truncatedKeys;
+  sum->truncatedValues += stats.truncatedValues;
+  sum->droppedAttributes += stats.droppedAttributes;
+}
+
+LocalyticsEventBuffer::LocalyticsEventBuffer() :
+  orphaned(false), limitsGeneration(-1)
+{
+}
+
+LocalyticsEventBufferHandle::LocalyticsEventBufferHandle(const QSharedPointer<LocalyticsEventBuffer> &buffer) :
+  buffer(buffer)
+{
+}
+
+LocalyticsEventBufferHandle::~LocalyticsEventBufferHandle()
+{
+  // Events left behind are still taken by the next takeAll().
+  QMutexLocker locker(&buffer->lock);
+  buffer->orphaned = true;
+}
+
+LocalyticsEventBuffers::LocalyticsEventBuffers()
+{
+}
+
+void LocalyticsEventBuffers::append(LocalyticsBufferedEvent event, const LocalyticsEventStats &truncations)
+{
+  LocalyticsEventBuffer *buffer = localBuffer();
+  QMutexLocker locker(&buffer->lock);
+  event.sequence = eventSequence.fetchAndAddOrdered(1);
+  buffer->events.append(event);
+  buffer->stats.events++;
+  if (truncations.truncatedNames || truncations.truncatedKeys || truncations.truncatedValues || truncations.droppedAttributes)
+    {
+      LocalyticsEventStats counted = truncations;
+      counted.events = 0;
+      counted.truncatedEvents = 1;
+      addStats(&buffer->stats, counted);
+    }
+}
+
+QList<LocalyticsBufferedEvent> LocalyticsEventBuffers::takeAll()
+{
+  QList<LocalyticsBufferedEvent> events;
+  QMutexLocker locker(&_lock);
+  // Events are numbered while their buffer is locked, so every event
+  // numbered below the limit is in its buffer once that is locked.
+  // Later events may be in buffers drained before them, and are left
+  // for the next call, which keeps the order across calls.
+  int limit = eventSequence.fetchAndAddOrdered(0);
+  for (int i = 0; i < _buffers.size(); )
+    {
+      LocalyticsEventBuffer *buffer = _buffers.at(i).data();
+      bool drained;
+      {
+        QMutexLocker bufferLocker(&buffer->lock);
+        // A buffer's events are numbered in the order they were appended.
+        while (!buffer->events.isEmpty() && sequencePrecedes(buffer->events.first().sequence, limit))
+          events.append(buffer->events.takeFirst());
+        drained = buffer->orphaned && buffer->events.isEmpty();
+        if (drained)
+          addStats(&_retiredStats, buffer->stats);
+      }
+      if (drained)
+        _buffers.removeAt(i);
+      else
+        i++;
+    }
+  qStableSort(events.begin(), events.end(), precedes);
+  return events;
+}
+
+void LocalyticsEventBuffers::setLimits(const LocalyticsEventLimits &limits)
+{
+  QMutexLocker locker(&_lock);
+  _limits = limits;
+  // Threads copy the limits again on their next event.
+  _limitsGeneration.ref();
+}
+
+LocalyticsEventLimits LocalyticsEventBuffers::limits()
+{
+  QMutexLocker locker(&_lock);
+  return _limits;
+}
+
+const LocalyticsEventLimits &LocalyticsEventBuffers::localLimits()
+{
+  LocalyticsEventBuffer *buffer = localBuffer();
+  if (buffer->limitsGeneration != (int) _limitsGeneration)
+    {
+      QMutexLocker locker(&_lock);
+      buffer->limits = _limits;
+      buffer->limitsGeneration = _limitsGeneration;
+    }
+  return buffer->limits;
+}
+
+LocalyticsEventStats LocalyticsEventBuffers::stats()
+{
+  QMutexLocker locker(&_lock);
+  LocalyticsEventStats stats = _retiredStats;
+  for (int i = 0; i < _buffers.size(); i++)
+    {
+      LocalyticsEventBuffer *buffer = _buffers.at(i).data();
+      QMutexLocker bufferLocker(&buffer->lock);
+      addStats(&stats, buffer->stats);
+    }
+  return stats;
+}
+
+void LocalyticsEventBuffers::resetStats()
+{
+  QMutexLocker locker(&_lock);
+  _retiredStats = LocalyticsEventStats();
+  for (int i = 0; i < _buffers.size(); i++)
+    {
+      LocalyticsEventBuffer *buffer = _buffers.at(i).data();
+      QMutexLocker bufferLocker(&buffer->lock);
+      buffer->stats = LocalyticsEventStats();
+    }
+}
+
+LocalyticsEventBuffer *LocalyticsEventBuffers::localBuffer()
+{
+  if (!_localBuffers.hasLocalData())
+    {
+      QSharedPointer<LocalyticsEventBuffer> buffer(new LocalyticsEventBuffer);
+      _localBuffers.setLocalData(new LocalyticsEventBufferHandle(buffer));
+      QMutexLocker locker(&_lock);
+      _buffers.append(buffer);
+    }
+  return _localBuffers.localData()->buffer.data();
+}
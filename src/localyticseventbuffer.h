@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSEVENTBUFFER_H
+#define LOCALYTICSEVENTBUFFER_H
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QString>
+#include <QtCore/QThreadStorage>
+#include "localyticssession.h"
+
+/*!
+  A tagged event waiting to be stored.  The session's keys and custom
+  dimensions belong to the thread which owns the database, so they are
+  inserted between the head and the tail of the blob when it is
+  stored.
+*/
+struct LocalyticsBufferedEvent
+{
+  int sequence;
+  QString name;
+  QString head;
+  QString tail;
+};
+
+/*
+  The events buffered by one thread, and what the limits cut from the
+  events it tagged.
+*/
+class LocalyticsEventBuffer
+{
+  public:
+  LocalyticsEventBuffer();
+
+  QMutex lock;
+  QList<LocalyticsBufferedEvent> events;
+  LocalyticsEventStats stats;
+  bool orphaned;
+
+  // The thread's copy of the limits, only used by that thread.
+  LocalyticsEventLimits limits;
+  int limitsGeneration;
+};
+
+/*
+  Thread local reference to a buffer, which marks it orphaned when its
+  thread finishes.
+*/
+class LocalyticsEventBufferHandle
+{
+  public:
+  explicit LocalyticsEventBufferHandle(const QSharedPointer<LocalyticsEventBuffer> &buffer);
+  ~LocalyticsEventBufferHandle();
+
+  QSharedPointer<LocalyticsEventBuffer> buffer;
+};
+
+/*!
+  Per-thread staging buffers of tagged events.
+
+  Each thread appends to a buffer of its own, so producers contend
+  neither with each other nor, except while their buffer is drained,
+  with the owner of the database.  Every event is numbered from one
+  process wide sequence as it is appended, and takeAll() merges the
+  buffers back into that order.
+
+  The event limits and stats are kept per thread as well, so tagging
+  takes no lock but that of the thread's buffer.
+*/
+class LocalyticsEventBuffers
+{
+  public:
+  LocalyticsEventBuffers();
+
+  /*!
+    Numbers an event and appends it to the calling thread's buffer.
+    \param truncations What the limits cut from the event.
+  */
+  void append(LocalyticsBufferedEvent event, const LocalyticsEventStats &truncations);
+
+  /*!
+    Removes the events of every buffer which were numbered before the
+    call.  Events appended while the buffers are drained are left for
+    the next call.
+    \return The events, in the order they were appended.
+  */
+  QList<LocalyticsBufferedEvent> takeAll();
+
+  void setLimits(const LocalyticsEventLimits &limits);
+  LocalyticsEventLimits limits();
+
+  /*!
+    \return The limits, as the calling thread last copied them.  The
+    copy is only refreshed after setLimits().
+  */
+  const LocalyticsEventLimits &localLimits();
+
+  /*!
+    \return The stats of every thread, summed.
+  */
+  LocalyticsEventStats stats();
+  void resetStats();
+
+  private:
+  LocalyticsEventBuffer *localBuffer();
+
+  QMutex _lock;
+  QList<QSharedPointer<LocalyticsEventBuffer> > _buffers;
+  QThreadStorage<LocalyticsEventBufferHandle *> _localBuffers;
+  LocalyticsEventLimits _limits;
+  QAtomicInt _limitsGeneration;
+  LocalyticsEventStats _retiredStats; // Stats of the buffers removed
+};
+
+#endif // LOCALYTICSEVENTBUFFER_H
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsflowring.h"
+
+LocalyticsFlowRing::LocalyticsFlowRing() :
+  _entries(FLOW_CAPACITY), _start(0), _staged(0), _end(0),
+  _screens(FLOW_CAPACITY), _screenStart(0), _screenEnd(0),
+  _droppedEntries(0), _droppedNames(0)
+{
+  _names.reserve(2 * FLOW_MAX_NAMES);
+  _types.reserve(2 * FLOW_MAX_NAMES);
+  _eventIds.reserve(FLOW_MAX_NAMES);
+  _screenIds.reserve(FLOW_MAX_NAMES);
+}
+
+int LocalyticsFlowRing::lookup(LocalyticsFlowType type, const QString &name) const
+{
+  const QHash<QString, int> &ids = type == LocalyticsFlowScreen ? _screenIds : _eventIds;
+  return ids.value(name, -1);
+}
+
+int LocalyticsFlowRing::intern(LocalyticsFlowType type, const QString &name, const QString &escapedName)
+{
+  QHash<QString, int> &ids = type == LocalyticsFlowScreen ? _screenIds : _eventIds;
+  int id = ids.value(name, -1);
+  if (id >= 0)
+    return id;
+  if (ids.size() >= FLOW_MAX_NAMES)
+    return -1;
+
+  id = _names.size();
+  _names.append(escapedName);
+  _types.append(type);
+  ids.insert(name, id);
+  return id;
+}
+
+void LocalyticsFlowRing::append(int id)
+{
+  if (id < 0 || id >= _names.size())
+    return;
+
+  if (_end - first() == FLOW_CAPACITY)
+    _droppedEntries++;
+  _entries[_end % FLOW_CAPACITY] = id;
+  _end++;
+
+  if (_types.at(id) == LocalyticsFlowScreen)
+    {
+      _screens[_screenEnd % FLOW_CAPACITY] = id;
+      _screenEnd++;
+    }
+}
+
+void LocalyticsFlowRing::dropName()
+{
+  _droppedNames++;
+}
+
+void LocalyticsFlowRing::markStaged()
+{
+  _staged = _end;
+}
+
+void LocalyticsFlowRing::clear()
+{
+  _start = _staged = _end;
+  _screenStart = _screenEnd;
+  _droppedEntries = 0;
+  _droppedNames = 0;
+}
+
+bool LocalyticsFlowRing::hasUnstaged() const
+{
+  return _end > qMax(first(), _staged);
+}
+
+int LocalyticsFlowRing::size() const
+{
+  return (int) (_end - first());
+}
+
+qint64 LocalyticsFlowRing::droppedEntries() const
+{
+  return _droppedEntries;
+}
+
+qint64 LocalyticsFlowRing::droppedNames() const
+{
+  return _droppedNames;
+}
+
+QString LocalyticsFlowRing::unstagedEntries() const
+{
+  return render(qMax(first(), _staged), _end);
+}
+
+QString LocalyticsFlowRing::stagedEntries() const
+{
+  return render(first(), qMax(first(), _staged));
+}
+
+QString LocalyticsFlowRing::screens() const
+{
+  QString result;
+  qint64 from = qMax(_screenStart, _screenEnd - FLOW_CAPACITY);
+  for (qint64 i = from; i < _screenEnd; i++)
+    {
+      if (i > from)
+        result.append(QLatin1Char(','));
+      result.append(QLatin1Char('"')).append(_names.at(_screens.at(i % FLOW_CAPACITY))).append(QLatin1Char('"'));
+    }
+  return result;
+}
+
+/*
+  The oldest entry still in the ring.
+*/
+qint64 LocalyticsFlowRing::first() const
+{
+  return qMax(_start, _end - FLOW_CAPACITY);
+}
+
+QString LocalyticsFlowRing::render(qint64 from, qint64 to) const
+{
+  QString result;
+  for (qint64 i = from; i < to; i++)
+    {
+      int id = _entries.at(i % FLOW_CAPACITY);
+      if (i > from)
+        result.append(QLatin1Char(','));
+      result.append(_types.at(id) == LocalyticsFlowScreen ? QLatin1String("{\"s\":\"") : QLatin1String("{\"e\":\""));
+      result.append(_names.at(id));
+      result.append(QLatin1String("\"}"));
+    }
+  return result;
+}
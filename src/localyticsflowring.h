@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSFLOWRING_H
+#define LOCALYTICSFLOWRING_H
+
+#include <QtCore/QHash>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+#include "localyticssession.h"
+
+#define FLOW_CAPACITY          100   // Flow entries, and screens, kept per session
+#define FLOW_MAX_NAMES         512   // Distinct names of each type which are interned
+#define FLOW_MAX_NAME_LENGTH   128   // Characters of a name which are kept
+
+/*!
+  The screens and events of a session, in the order they happened.
+
+  Names are interned once, escaped for JSON, and the ring only keeps
+  their indices, so recording an entry costs a hash lookup and an
+  index store, and allocates nothing once a name has been seen.
+
+  Truncation policy:
+  <ul>
+  <li>At most FLOW_CAPACITY entries, and as many screens, are kept.
+  Beyond that the oldest are overwritten, uploaded ("old") entries
+  first, and counted by droppedEntries().</li>
+  <li>Names are cut to FLOW_MAX_NAME_LENGTH characters.</li>
+  <li>Interned names are kept for the life of the ring, at most
+  FLOW_MAX_NAMES of each type. Entries naming anything else are not
+  recorded and are counted by droppedNames().</li>
+  </ul>
+*/
+class LocalyticsFlowRing
+{
+  public:
+  LocalyticsFlowRing();
+
+  /*!
+    Looks a name up without interning it.
+    \return The index of the name, or -1 if it is unknown.
+  */
+  int lookup(LocalyticsFlowType type, const QString &name) const;
+
+  /*!
+    Interns a name.
+    \param escapedName The name, truncated and escaped for JSON.
+    \return The index of the name, or -1 if the table is full.
+  */
+  int intern(LocalyticsFlowType type, const QString &name, const QString &escapedName);
+
+  /*!
+    Records an entry for an interned name.
+  */
+  void append(int id);
+
+  /*!
+    Counts an entry which could not be recorded because its name
+    could not be interned.
+  */
+  void dropName();
+
+  /*!
+    Marks every recorded entry as uploaded.
+  */
+  void markStaged();
+
+  /*!
+    Forgets the entries, but not the names, for a new session.
+  */
+  void clear();
+
+  bool hasUnstaged() const;
+  int size() const;
+  qint64 droppedEntries() const;
+  qint64 droppedNames() const;
+
+  /*!
+    \return The entries not uploaded yet, as JSON objects joined by
+    commas, for example {"s":"Home"},{"e":"Click"}.
+  */
+  QString unstagedEntries() const;
+
+  /*!
+    \return The uploaded entries, in the same format.
+  */
+  QString stagedEntries() const;
+
+  /*!
+    \return The screens, as JSON strings joined by commas.
+  */
+  QString screens() const;
+
+  private:
+  qint64 first() const;
+  QString render(qint64 from, qint64 to) const;
+
+  QHash<QString, int> _eventIds;
+  QHash<QString, int> _screenIds;
+  QVector<QString> _names;
+  QVector<LocalyticsFlowType> _types;
+
+  // Positions count every entry ever appended; entry n is at n % FLOW_CAPACITY.
+  QVector<int> _entries;
+  qint64 _start;
+  qint64 _staged;
+  qint64 _end;
+
+  QVector<int> _screens;
+  qint64 _screenStart;
+  qint64 _screenEnd;
+
+  qint64 _droppedEntries;
+  qint64 _droppedNames;
+};
+
+#endif // LOCALYTICSFLOWRING_H
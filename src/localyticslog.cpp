@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticslog.h"
+#include <QtCore/QDebug>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+
+// Initialized statically, so messages logged by other static
+// initializers see the default level.
+#ifdef QLOCALYTICS_VERBOSE_DEBUG_OUTPUT
+QBasicAtomicInt LocalyticsLog::_level = Q_BASIC_ATOMIC_INITIALIZER(LocalyticsLog::Debug);
+#else
+QBasicAtomicInt LocalyticsLog::_level = Q_BASIC_ATOMIC_INITIALIZER(LocalyticsLog::Warning);
+#endif
+LocalyticsLog::Sink LocalyticsLog::_sink = &LocalyticsLog::defaultSink;
+
+// Guards _sink.  Only taken for enabled messages.
+Q_GLOBAL_STATIC(QMutex, sinkLock)
+
+void LocalyticsLog::setLevel(Level level)
+{
+  _level.fetchAndStoreRelaxed(level);
+}
+
+LocalyticsLog::Level LocalyticsLog::level()
+{
+  return (Level) (int) _level;
+}
+
+void LocalyticsLog::setSink(Sink sink)
+{
+  QMutexLocker locker(sinkLock());
+  _sink = sink ? sink : &LocalyticsLog::defaultSink;
+}
+
+void LocalyticsLog::write(Level level, const char *component, const QString &message)
+{
+  Sink sink;
+  {
+    // Called outside the lock, so a sink may log or replace itself.
+    QMutexLocker locker(sinkLock());
+    sink = _sink;
+  }
+  sink(level, component, message);
+}
+
+void LocalyticsLog::defaultSink(Level level, const char *component, const QString &message)
+{
+  if (level >= Warning)
+    {
+      qWarning("(%s) %s", component, qPrintable(message));
+    }
+  else
+    {
+      qDebug("(%s) %s", component, qPrintable(message));
+    }
+}
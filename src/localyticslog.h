@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSLOG_H
+#define LOCALYTICSLOG_H
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QString>
+
+/*
+  Lowest level compiled in: 0 debug, 1 info, 2 warning, 3 error, 4
+  none.  Messages below it cost nothing at all.  Debug messages are
+  only compiled in with QLOCALYTICS_VERBOSE_DEBUG_OUTPUT.
+*/
+#ifndef QLOCALYTICS_LOG_MIN_LEVEL
+#ifdef QLOCALYTICS_VERBOSE_DEBUG_OUTPUT
+#define QLOCALYTICS_LOG_MIN_LEVEL 0
+#else
+#define QLOCALYTICS_LOG_MIN_LEVEL 1
+#endif
+#endif
+
+/*!
+  Diagnostic output of the library.
+
+  Messages are written through the LOCALYTICS_DEBUG(),
+  LOCALYTICS_INFO(), LOCALYTICS_WARNING() and LOCALYTICS_ERROR()
+  macros, which only evaluate their message argument when its level
+  is enabled, so a disabled message is never formatted.  A message is
+  enabled when its level is at least both QLOCALYTICS_LOG_MIN_LEVEL,
+  fixed at compile time, and level(), which can be changed at run
+  time and defaults to Warning (Debug with
+  QLOCALYTICS_VERBOSE_DEBUG_OUTPUT).
+
+  Enabled messages go to the sink, which writes them with qDebug() and
+  qWarning() unless replaced with setSink().  The level and the sink
+  can be changed while other threads are logging.
+*/
+class LocalyticsLog
+{
+  public:
+  enum Level
+    {
+      Debug = 0,
+      Info = 1,
+      Warning = 2,
+      Error = 3,
+      Off = 4
+    };
+
+  /*!
+    Receives every enabled message.
+    \param level The level of the message.
+    \param component The part of the library it comes from, e.g.
+    "localytics uploader".
+    \param message The message.
+  */
+  typedef void (*Sink)(Level level, const char *component, const QString &message);
+
+  static void setLevel(Level level);
+  static Level level();
+
+  /*!
+    \param sink Function receiving the messages, or 0 for the default
+    sink.
+  */
+  static void setSink(Sink sink);
+
+  static bool isEnabled(Level level)
+  {
+    // A plain read of the level: no locked instruction on the path of
+    // every disabled message.
+    return level >= QLOCALYTICS_LOG_MIN_LEVEL && level >= (int) _level;
+  }
+
+  static void write(Level level, const char *component, const QString &message);
+
+  private:
+  static void defaultSink(Level level, const char *component, const QString &message);
+
+  static QBasicAtomicInt _level;
+  static Sink _sink;
+};
+
+/*
+  Each file using these defines LOCALYTICS_LOG_COMPONENT, the name its
+  messages are tagged with, before including this header.
+*/
+#define LOCALYTICS_LOG(level, message)                                     \
+  do {                                                                     \
+    if (LocalyticsLog::isEnabled(level))                                   \
+      LocalyticsLog::write(level, LOCALYTICS_LOG_COMPONENT, (message));    \
+  } while (0)
+
+#define LOCALYTICS_DEBUG(message)   LOCALYTICS_LOG(LocalyticsLog::Debug, message)
+#define LOCALYTICS_INFO(message)    LOCALYTICS_LOG(LocalyticsLog::Info, message)
+#define LOCALYTICS_WARNING(message) LOCALYTICS_LOG(LocalyticsLog::Warning, message)
+#define LOCALYTICS_ERROR(message)   LOCALYTICS_LOG(LocalyticsLog::Error, message)
+
+#endif // LOCALYTICSLOG_H
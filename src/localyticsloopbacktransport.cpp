@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsloopbacktransport.h"
+#include <QtCore/QIODevice>
+#include <QtCore/QTimer>
+
+LocalyticsLoopbackTransport::LocalyticsLoopbackTransport(QObject *parent) :
+  LocalyticsTransport(parent),
+  _statusCode(202),
+  _keepBodies(false),
+  _requestsReceived(0),
+  _bytesReceived(0)
+{
+}
+
+int LocalyticsLoopbackTransport::send(const QUrl &url, const LocalyticsTransportHeaders &headers, QIODevice *body)
+{
+  Q_UNUSED(url);
+  Q_UNUSED(headers);
+
+  int requestNumber = nextRequest();
+  LocalyticsLoopbackRequest &request = _reading[body];
+  request.request = requestNumber;
+  request.size = 0;
+  body->setParent(this);
+  connect(body, SIGNAL(readyRead()), this, SLOT(bodyReadyRead()));
+  readBody(body);
+  return requestNumber;
+}
+
+void LocalyticsLoopbackTransport::abort(int request)
+{
+  QHash<QIODevice *, LocalyticsLoopbackRequest>::iterator i;
+  for (i = _reading.begin(); i != _reading.end(); ++i)
+    {
+      if (i.value().request == request)
+        {
+          i.key()->deleteLater();
+          _reading.erase(i);
+          return;
+        }
+    }
+  for (int j = 0; j < _pending.size(); j++)
+    {
+      if (_pending.at(j).first == request)
+        {
+          // The queued response is answered for no request.
+          _pending[j].first = 0;
+          return;
+        }
+    }
+}
+
+void LocalyticsLoopbackTransport::bodyReadyRead()
+{
+  QIODevice *body = qobject_cast<QIODevice *>(sender());
+  if (body && _reading.contains(body))
+    {
+      readBody(body);
+    }
+}
+
+/*!
+ @method readBody
+ @abstract Reads as much of a body as it has to offer, and once it is all read queues the response.  A shaped
+ body is read further when it signals readyRead().
+ */
+void LocalyticsLoopbackTransport::readBody(QIODevice *body)
+{
+  LocalyticsLoopbackRequest &request = _reading[body];
+  char chunk[16384];
+  qint64 read;
+  while ((read = body->read(chunk, sizeof(chunk))) > 0)
+    {
+      request.size += read;
+      if (_keepBodies)
+        {
+          request.received.append(chunk, (int) read);
+        }
+    }
+  if (read == 0 && !body->atEnd())
+    return;
+
+  LocalyticsLoopbackRequest finished = _reading.take(body);
+  body->deleteLater();
+  if (_keepBodies)
+    {
+      _bodies.append(finished.received);
+    }
+  _requestsReceived++;
+  _bytesReceived += finished.size;
+
+  // Nothing is reported before send() has returned.
+  _pending.enqueue(qMakePair(finished.request, finished.size));
+  QTimer::singleShot(0, this, SLOT(respond()));
+}
+
+void LocalyticsLoopbackTransport::respond()
+{
+  QPair<int, qint64> request = _pending.dequeue();
+  if (request.first == 0)
+    return;
+  LocalyticsTransportResponse response;
+  response.statusCode = _statusCode;
+  emit uploadProgress(request.first, request.second);
+  emit finished(request.first, response);
+}
+
+void LocalyticsLoopbackTransport::setStatusCode(int statusCode)
+{
+  _statusCode = statusCode;
+}
+
+int LocalyticsLoopbackTransport::statusCode() const
+{
+  return _statusCode;
+}
+
+void LocalyticsLoopbackTransport::setKeepBodies(bool keep)
+{
+  _keepBodies = keep;
+}
+
+QList<QByteArray> LocalyticsLoopbackTransport::bodies() const
+{
+  return _bodies;
+}
+
+int LocalyticsLoopbackTransport::requestsReceived() const
+{
+  return _requestsReceived;
+}
+
+qint64 LocalyticsLoopbackTransport::bytesReceived() const
+{
+  return _bytesReceived;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSLOOPBACKTRANSPORT_H
+#define LOCALYTICSLOOPBACKTRANSPORT_H
+
+#include <QtCore/QHash>
+#include <QtCore/QQueue>
+#include "localyticstransport.h"
+
+/*
+  A request whose body is still being read.
+*/
+struct LocalyticsLoopbackRequest
+{
+  int request;
+  qint64 size;
+  QByteArray received;
+};
+
+/*!
+  Completes requests in process without any network, for benchmarks
+  of the upload path.  Each body is read to its end, so the cost of
+  reading it from the database is included, and the request is
+  answered with statusCode() on the next pass of the event loop.
+*/
+class LocalyticsLoopbackTransport : public LocalyticsTransport
+{
+  Q_OBJECT
+  public:
+  explicit LocalyticsLoopbackTransport(QObject *parent = 0);
+
+  int send(const QUrl &url, const LocalyticsTransportHeaders &headers, QIODevice *body);
+  void abort(int request);
+
+  /*!
+    \param statusCode The status every request is answered with.
+    Defaults to 202.
+  */
+  void setStatusCode(int statusCode);
+  int statusCode() const;
+
+  /*!
+    Whether the bodies received are kept, for bodies().  Off by
+    default.
+  */
+  void setKeepBodies(bool keep);
+  QList<QByteArray> bodies() const;
+
+  /*!
+    \return The number of requests and body bytes received.
+  */
+  int requestsReceived() const;
+  qint64 bytesReceived() const;
+
+  private slots:
+  void bodyReadyRead();
+  void respond();
+
+  private:
+  void readBody(QIODevice *body);
+
+  int _statusCode;
+  bool _keepBodies;
+  QList<QByteArray> _bodies;
+  int _requestsReceived;
+  qint64 _bytesReceived;
+  QHash<QIODevice *, LocalyticsLoopbackRequest> _reading;
+  QQueue<QPair<int, qint64> > _pending;
+};
+
+#endif // LOCALYTICSLOOPBACKTRANSPORT_H
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsnetworktransport.h"
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkReply>
+#include <QtNetwork/QNetworkRequest>
+
+LocalyticsNetworkTransport::LocalyticsNetworkTransport(QObject *parent) :
+  LocalyticsTransport(parent)
+{
+  _networkManager = new QNetworkAccessManager(this);
+  connect(_networkManager, SIGNAL(finished(QNetworkReply*)),
+          this, SLOT(replyFinished(QNetworkReply*)));
+}
+
+int LocalyticsNetworkTransport::send(const QUrl &url, const LocalyticsTransportHeaders &headers, QIODevice *body)
+{
+  QNetworkRequest request(url);
+  for (int i = 0; i < headers.size(); i++)
+    {
+      request.setRawHeader(headers.at(i).first, headers.at(i).second);
+    }
+  // The body has a known size, so it is sent as it is read.
+  request.setAttribute(QNetworkRequest::DoNotBufferUploadDataAttribute, true);
+
+  QNetworkReply *reply = _networkManager->post(request, body);
+  body->setParent(reply);
+  connect(reply, SIGNAL(uploadProgress(qint64, qint64)),
+          this, SLOT(replyUploadProgress(qint64, qint64)));
+
+  int requestNumber = nextRequest();
+  _requests.insert(reply, requestNumber);
+  return requestNumber;
+}
+
+void LocalyticsNetworkTransport::prewarm(const QUrl &url)
+{
+  QUrl root = url;
+  root.setPath(QLatin1String("/"));
+  QNetworkRequest request(root);
+  request.setRawHeader("Connection", "keep-alive");
+  _networkManager->head(request);
+}
+
+void LocalyticsNetworkTransport::abort(int request)
+{
+  QNetworkReply *reply = _requests.key(request);
+  if (!reply)
+    return;
+
+  // Aborting finishes the reply straight away.
+  _requests.remove(reply);
+  _aborted.insert(reply);
+  reply->abort();
+}
+
+void LocalyticsNetworkTransport::replyUploadProgress(qint64 bytesSent, qint64 bytesTotal)
+{
+  Q_UNUSED(bytesTotal);
+  QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+  if (_requests.contains(reply))
+    {
+      emit uploadProgress(_requests.value(reply), bytesSent);
+    }
+}
+
+void LocalyticsNetworkTransport::replyFinished(QNetworkReply *reply)
+{
+  reply->deleteLater();
+  if (_aborted.remove(reply))
+    return;
+  if (!_requests.contains(reply))
+    {
+      // Whatever the response, the connection is now open.
+      emit prewarmed();
+      return;
+    }
+
+  int requestNumber = _requests.take(reply);
+  LocalyticsTransportResponse response;
+  response.statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  if (response.statusCode == 0)
+    {
+      response.errorString = reply->errorString();
+    }
+  response.retryAfter = reply->rawHeader("Retry-After");
+  response.body = reply->readAll();
+  emit finished(requestNumber, response);
+}
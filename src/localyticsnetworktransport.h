@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSNETWORKTRANSPORT_H
+#define LOCALYTICSNETWORKTRANSPORT_H
+
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include "localyticstransport.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
+
+/*!
+  Sends requests through a QNetworkAccessManager, which keeps
+  connections alive between requests and handles HTTPS and proxies.
+  This is the transport the uploader uses by default.
+*/
+class LocalyticsNetworkTransport : public LocalyticsTransport
+{
+  Q_OBJECT
+  public:
+  explicit LocalyticsNetworkTransport(QObject *parent = 0);
+
+  int send(const QUrl &url, const LocalyticsTransportHeaders &headers, QIODevice *body);
+
+  /*!
+    Sends a HEAD request to the root of the host, which leaves an open
+    connection for the requests which follow.
+  */
+  void prewarm(const QUrl &url);
+  void abort(int request);
+
+  private slots:
+  void replyFinished(QNetworkReply *reply);
+  void replyUploadProgress(qint64 bytesSent, qint64 bytesTotal);
+
+  private:
+  QNetworkAccessManager *_networkManager;
+  QHash<QNetworkReply *, int> _requests;
+  QSet<QNetworkReply *> _aborted;
+};
+
+#endif // LOCALYTICSNETWORKTRANSPORT_H
@@ -0,0 +1,683 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#define LOCALYTICS_LOG_COMPONENT "relay"
+
+#include "localyticsrelay.h"
+#include "localyticscompressor.h"
+#include "localyticslog.h"
+#include "localyticsnetworktransport.h"
+#include "webserviceconstants.h"
+#include <QtCore/QBuffer>
+#include <QtCore/QDateTime>
+#include <QtCore/QTimer>
+#include <QtCore/QUuid>
+#include <QtCore/QtEndian>
+#include <QtNetwork/QTcpSocket>
+
+#ifndef LOCALYTICS_URL_SECURED
+#define LOCALYTICS_URL_SECURED QLatin1String("https://analytics.localytics.com/api/v2/applications/%1/uploads")
+#endif
+
+LocalyticsRelayConnection::LocalyticsRelayConnection(int socketDescriptor, LocalyticsRelay *relay) :
+  QObject(),
+  _socketDescriptor(socketDescriptor),
+  _relay(relay),
+  _socket(0)
+{
+}
+
+/*!
+ @method start
+ @abstract Opens the socket, on the worker thread which the connection was moved to.
+ */
+void LocalyticsRelayConnection::start()
+{
+  _socket = new QTcpSocket(this);
+  if (!_socket->setSocketDescriptor(_socketDescriptor))
+    {
+      LOCALYTICS_WARNING(QLatin1String("Unable to open relay connection: ") + _socket->errorString());
+      deleteLater();
+      return;
+    }
+  connect(_socket, SIGNAL(readyRead()), this, SLOT(readRecords()));
+  connect(_socket, SIGNAL(disconnected()), this, SLOT(deleteLater()));
+}
+
+void LocalyticsRelayConnection::readRecords()
+{
+  _buffer.append(_socket->readAll());
+
+  int offset = 0;
+  while (_buffer.size() - offset >= (int) sizeof(quint32))
+    {
+      quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(_buffer.constData() + offset));
+      if (length == 0 || length > RELAY_MAX_RECORD_BYTES)
+        {
+          // The stream can't be resynchronized.
+          LOCALYTICS_WARNING(QString(QLatin1String("Closing relay connection after a record of %1 bytes")).arg(length));
+          _relay->recordMalformed();
+          _buffer.clear();
+          _socket->abort();
+          deleteLater();
+          return;
+        }
+      if (_buffer.size() - offset - (int) sizeof(quint32) < (int) length)
+        break;
+
+      offset += sizeof(quint32);
+      _relay->ingest(QByteArray::fromRawData(_buffer.constData() + offset, length));
+      offset += length;
+    }
+  _buffer.remove(0, offset);
+}
+
+LocalyticsRelayWorker::LocalyticsRelayWorker(LocalyticsRelay *relay) :
+  QThread(),
+  _relay(relay)
+{
+}
+
+void LocalyticsRelayWorker::adopt(int socketDescriptor)
+{
+  LocalyticsRelayConnection *connection = new LocalyticsRelayConnection(socketDescriptor, _relay);
+  connection->moveToThread(this);
+  {
+    QMutexLocker locker(&_lock);
+    _connections.removeAll(QPointer<LocalyticsRelayConnection>());
+    _connections.append(connection);
+  }
+  QMetaObject::invokeMethod(connection, "start", Qt::QueuedConnection);
+}
+
+void LocalyticsRelayWorker::run()
+{
+  exec();
+
+  // Connections still open are closed on the thread they belong to.
+  QList<QPointer<LocalyticsRelayConnection> > connections;
+  {
+    QMutexLocker locker(&_lock);
+    connections = _connections;
+    _connections.clear();
+  }
+  for (int i = 0; i < connections.size(); i++)
+    {
+      delete connections.at(i);
+    }
+}
+
+LocalyticsRelayServer::LocalyticsRelayServer(LocalyticsRelay *relay) :
+  QTcpServer(relay),
+  _relay(relay),
+  _nextWorker(0)
+{
+}
+
+void LocalyticsRelayServer::incomingConnection(int socketDescriptor)
+{
+  // Connections are spread over the workers in turn.
+  LocalyticsRelayWorker *worker = _relay->_workers.at(_nextWorker % _relay->_workers.size());
+  _nextWorker++;
+  worker->adopt(socketDescriptor);
+}
+
+LocalyticsRelay::LocalyticsRelay(QObject *parent) :
+  QObject(parent),
+  _workerThreads(QThread::idealThreadCount()),
+  _batchEvents(RELAY_BATCH_EVENTS),
+  _batchBytes(RELAY_BATCH_BYTES),
+  _batchAge(RELAY_BATCH_AGE_MS),
+  _maxDevicesPerShard(RELAY_MAX_DEVICES_PER_SHARD),
+  _deviceIdle(RELAY_DEVICE_IDLE_MS),
+  _transport(0),
+  _maxConcurrentUploads(RELAY_MAX_CONCURRENT_UPLOADS)
+{
+  _clock.start();
+  _server = new LocalyticsRelayServer(this);
+  setTransport(new LocalyticsNetworkTransport);
+
+  _sweepTimer = new QTimer(this);
+  connect(_sweepTimer, SIGNAL(timeout()), this, SLOT(sweep()));
+  _sweepTimer->start(qBound(100, _batchAge / 4, 1000));
+
+  _retryTimer = new QTimer(this);
+  _retryTimer->setSingleShot(true);
+  connect(_retryTimer, SIGNAL(timeout()), this, SLOT(retryBatches()));
+}
+
+LocalyticsRelay::~LocalyticsRelay()
+{
+  close();
+}
+
+bool LocalyticsRelay::listen(const QHostAddress &address, quint16 port)
+{
+  if (_workers.isEmpty())
+    {
+      for (int i = 0; i < qMax(1, _workerThreads); i++)
+        {
+          LocalyticsRelayWorker *worker = new LocalyticsRelayWorker(this);
+          worker->start();
+          _workers.append(worker);
+        }
+    }
+  if (!_server->listen(address, port))
+    {
+      LOCALYTICS_WARNING(QLatin1String("Relay unable to listen: ") + _server->errorString());
+      return false;
+    }
+  LOCALYTICS_INFO(QString(QLatin1String("Relay listening on port %1")).arg(_server->serverPort()));
+  return true;
+}
+
+quint16 LocalyticsRelay::serverPort() const
+{
+  return _server->serverPort();
+}
+
+void LocalyticsRelay::close()
+{
+  _server->close();
+  for (int i = 0; i < _workers.size(); i++)
+    {
+      _workers.at(i)->quit();
+      _workers.at(i)->wait();
+      delete _workers.at(i);
+    }
+  _workers.clear();
+}
+
+void LocalyticsRelay::setWorkerThreads(int threads)
+{
+  _workerThreads = threads;
+}
+
+int LocalyticsRelay::workerThreads() const
+{
+  return _workerThreads;
+}
+
+void LocalyticsRelay::setBatchLimits(int events, qint64 bytes, int ageMilliseconds)
+{
+  _batchEvents = events;
+  _batchBytes = bytes;
+  _batchAge = ageMilliseconds;
+  _sweepTimer->start(qBound(100, _batchAge / 4, 1000));
+}
+
+void LocalyticsRelay::setDeviceLimits(int maxDevicesPerShard, int idleMilliseconds)
+{
+  _maxDevicesPerShard = qMax(1, maxDevicesPerShard);
+  _deviceIdle = idleMilliseconds;
+}
+
+void LocalyticsRelay::setEndpoint(const QString &urlFormat)
+{
+  _urlFormat = urlFormat;
+}
+
+void LocalyticsRelay::setTransport(LocalyticsTransport *transport)
+{
+  Q_ASSERT(_inFlight.isEmpty());
+  if (_transport)
+    {
+      _transport->deleteLater();
+    }
+  _transport = transport;
+  _transport->setParent(this);
+  connect(_transport, SIGNAL(finished(int, const LocalyticsTransportResponse &)),
+          this, SLOT(requestFinished(int, const LocalyticsTransportResponse &)));
+}
+
+LocalyticsTransport *LocalyticsRelay::transport() const
+{
+  return _transport;
+}
+
+void LocalyticsRelay::setMaxConcurrentUploads(int requests)
+{
+  _maxConcurrentUploads = qMax(1, requests);
+}
+
+LocalyticsRelayShard &LocalyticsRelay::shardOf(const QByteArray &installId)
+{
+  return _shards[qHash(installId) % RELAY_SHARDS];
+}
+
+/*!
+ @method deviceOf
+ @abstract The device of an install id, added if it is new, and marked as seen.  The shard must be locked.
+ */
+LocalyticsRelayDevice &LocalyticsRelay::deviceOf(LocalyticsRelayShard &shard, const QByteArray &installId)
+{
+  QHash<QByteArray, LocalyticsRelayDevice>::iterator device = shard.devices.find(installId);
+  if (device == shard.devices.end())
+    {
+      if (shard.devices.size() >= _maxDevicesPerShard)
+        evictLeastRecent(shard);
+      device = shard.devices.insert(installId, LocalyticsRelayDevice());
+    }
+  device.value().lastSeen = _clock.elapsed();
+  return device.value();
+}
+
+/*!
+ @method evictLeastRecent
+ @abstract Forgets the device of a full shard which sent a record the longest ago, dropping its events.  The shard
+ must be locked.
+ */
+void LocalyticsRelay::evictLeastRecent(LocalyticsRelayShard &shard)
+{
+  QHash<QByteArray, LocalyticsRelayDevice>::iterator oldest = shard.devices.begin();
+  QHash<QByteArray, LocalyticsRelayDevice>::iterator device;
+  for (device = shard.devices.begin(); device != shard.devices.end(); ++device)
+    {
+      if (device.value().lastSeen < oldest.value().lastSeen)
+        oldest = device;
+    }
+  if (oldest == shard.devices.end())
+    return;
+  shard.droppedEvents += oldest.value().eventCount;
+  shard.evictedDevices++;
+  shard.devices.erase(oldest);
+}
+
+bool LocalyticsRelay::ingest(const QByteArray &record)
+{
+  // The type, then the install id up to the first newline.
+  int idEnd = record.indexOf('\n', 1);
+  if (idEnd < 2)
+    {
+      recordMalformed();
+      return false;
+    }
+  QByteArray installId = record.mid(1, idEnd - 1);
+  if (installId.contains('"') || installId.contains('\\'))
+    {
+      recordMalformed();
+      return false;
+    }
+
+  QList<LocalyticsRelayBatch> batches;
+  {
+    LocalyticsRelayShard &shard = shardOf(installId);
+    QMutexLocker locker(&shard.lock);
+    char type = record.at(0);
+    if (type == RELAY_RECORD_DEVICE)
+      {
+        int keyEnd = record.indexOf('\n', idEnd + 1);
+        int countersEnd = keyEnd < 0 ? -1 : record.indexOf('\n', keyEnd + 1);
+        QByteArray appKey = record.mid(idEnd + 1, keyEnd - idEnd - 1);
+        QList<QByteArray> counters = record.mid(keyEnd + 1, countersEnd - keyEnd - 1).split(' ');
+        bool persistedAtValid = false;
+        bool sequenceValid = false;
+        qint64 persistedAt = counters.value(0).toLongLong(&persistedAtValid);
+        int sequence = counters.value(1).toInt(&sequenceValid);
+        if (countersEnd < 0 || appKey.isEmpty() || appKey.contains('"') || appKey.contains('\\')
+            || counters.size() != 2 || !persistedAtValid || !sequenceValid || persistedAt < 0 || sequence < 0)
+          {
+            locker.unlock();
+            recordMalformed();
+            return false;
+          }
+        shard.records++;
+        LocalyticsRelayDevice &device = deviceOf(shard, installId);
+        // The client's counters outlive the relay's memory of the device,
+        // so a device evicted or lost with a restart doesn't repeat the
+        // sequence numbers of its earlier batches.
+        if (persistedAt > 0)
+          device.persistedAt = persistedAt;
+        if (device.persistedAt == 0)
+          device.persistedAt = QDateTime::currentDateTime().toTime_t();
+        device.nextSequence = qMax(device.nextSequence, sequence);
+        device.appKey = appKey;
+        device.attributes = record.mid(countersEnd + 1);
+      }
+    else if (type == RELAY_RECORD_EVENT && record.size() > idEnd + 1)
+      {
+        shard.records++;
+        shard.events++;
+        LocalyticsRelayDevice &device = deviceOf(shard, installId);
+        if (device.persistedAt == 0)
+          device.persistedAt = QDateTime::currentDateTime().toTime_t();
+
+        int size = record.size() - idEnd - 1;
+        if (record.endsWith('\n'))
+          size--;
+        if (device.appKey.isEmpty() && device.events.size() + size >= RELAY_MAX_PENDING_BYTES)
+          {
+            // Nowhere to send them until the device's header arrives.
+            shard.droppedEvents++;
+            return true;
+          }
+        if (device.eventCount == 0)
+          device.oldestEvent = _clock.elapsed();
+        device.events.append(record.constData() + idEnd + 1, size);
+        device.events.append('\n');
+        device.eventCount++;
+      }
+    else
+      {
+        locker.unlock();
+        recordMalformed();
+        return false;
+      }
+
+    LocalyticsRelayDevice &device = shard.devices[installId];
+    if (!device.appKey.isEmpty() && (device.eventCount >= _batchEvents || device.events.size() >= _batchBytes))
+      {
+        takeBatch(installId, device, &batches);
+      }
+  }
+
+  // Compressed on the ingesting thread, outside of the shard's lock.
+  if (!batches.isEmpty())
+    enqueue(batches);
+  return true;
+}
+
+void LocalyticsRelay::recordMalformed()
+{
+  QMutexLocker locker(&_outboxLock);
+  _uploadStats.malformedRecords++;
+}
+
+/*!
+ @method takeBatch
+ @abstract Moves the events of a device to a new batch, behind its next sequence number.  The shard of the device
+ must be locked.
+ */
+void LocalyticsRelay::takeBatch(const QByteArray &installId, LocalyticsRelayDevice &device, QList<LocalyticsRelayBatch> *batches)
+{
+  LocalyticsRelayBatch batch;
+  batch.appKey = device.appKey;
+  batch.installId = installId;
+  batch.attributes = device.attributes;
+  batch.persistedAt = device.persistedAt;
+  batch.sequenceNumber = device.nextSequence++;
+  batch.body = device.events;
+  batch.eventCount = device.eventCount;
+  batch.attempts = 0;
+  batches->append(batch);
+
+  device.events.clear();
+  device.eventCount = 0;
+}
+
+/*!
+ @method collectBatches
+ @abstract Takes the events of the devices whose oldest event has waited long enough, or of all devices, and
+ evicts the devices which have been idle for too long.
+ */
+void LocalyticsRelay::collectBatches(bool all)
+{
+  qint64 now = _clock.elapsed();
+  QList<LocalyticsRelayBatch> batches;
+  for (int i = 0; i < RELAY_SHARDS; i++)
+    {
+      LocalyticsRelayShard &shard = _shards[i];
+      QMutexLocker locker(&shard.lock);
+      QHash<QByteArray, LocalyticsRelayDevice>::iterator device = shard.devices.begin();
+      while (device != shard.devices.end())
+        {
+          if (device.value().eventCount > 0 && !device.value().appKey.isEmpty()
+              && (all || now - device.value().oldestEvent >= _batchAge))
+            {
+              takeBatch(device.key(), device.value(), &batches);
+            }
+
+          // Events of a device whose header never arrived are dropped
+          // with it.
+          if (now - device.value().lastSeen >= _deviceIdle
+              && (device.value().eventCount == 0 || device.value().appKey.isEmpty()))
+            {
+              shard.droppedEvents += device.value().eventCount;
+              shard.evictedDevices++;
+              device = shard.devices.erase(device);
+            }
+          else
+            {
+              ++device;
+            }
+        }
+    }
+  if (!batches.isEmpty())
+    enqueue(batches);
+}
+
+void LocalyticsRelay::sweep()
+{
+  collectBatches(false);
+}
+
+void LocalyticsRelay::flush()
+{
+  collectBatches(true);
+}
+
+/*!
+ @method assemble
+ @abstract Replaces the events of a batch by the gzip member of its header and events, in the format of the blobs
+ which LocalyticsSession stages.
+ */
+bool LocalyticsRelay::assemble(LocalyticsRelayBatch &batch)
+{
+  QByteArray uuid = QUuid::createUuid().toString().toAscii();
+  uuid = uuid.mid(1, uuid.size() - 2);
+
+  QByteArray blob;
+  blob.reserve(batch.body.size() + batch.attributes.size() + 256);
+  blob += "{\"";
+  blob += PARAM_SEQUENCE_NUMBER.latin1();
+  blob += "\":" + QByteArray::number(batch.sequenceNumber);
+  blob += ",\"";
+  blob += PARAM_PERSISTED_AT.latin1();
+  blob += "\":" + QByteArray::number(batch.persistedAt);
+  blob += ",\"";
+  blob += PARAM_DATA_TYPE.latin1();
+  blob += "\":\"h\",\"";
+  blob += PARAM_UUID.latin1();
+  blob += "\":\"" + uuid + "\",\"";
+  blob += PARAM_ATTRIBUTES.latin1();
+  blob += "\":{\"";
+  blob += PARAM_DATA_TYPE.latin1();
+  blob += "\":\"a\",\"";
+  blob += PARAM_INSTALL_ID.latin1();
+  blob += "\":\"" + batch.installId + "\",\"";
+  blob += PARAM_APP_KEY.latin1();
+  blob += "\":\"" + batch.appKey + '"';
+  if (!batch.attributes.isEmpty())
+    {
+      blob += ',' + batch.attributes;
+    }
+  blob += "}}\n";
+  blob += batch.body;
+
+  batch.body = LocalyticsCompressor::gzipDeflate(blob);
+  return !batch.body.isEmpty();
+}
+
+/*!
+ @method enqueue
+ @abstract Assembles batches and queues them to be sent.  May be called from any thread.
+ */
+void LocalyticsRelay::enqueue(QList<LocalyticsRelayBatch> batches)
+{
+  int failed = 0;
+  for (int i = 0; i < batches.size(); )
+    {
+      if (assemble(batches[i]))
+        {
+          i++;
+        }
+      else
+        {
+          failed += batches.at(i).eventCount;
+          batches.removeAt(i);
+        }
+    }
+
+  {
+    QMutexLocker locker(&_outboxLock);
+    _uploadStats.batches += batches.size();
+    _uploadStats.droppedEvents += failed;
+    _outbox += batches;
+    while (_outbox.size() > RELAY_MAX_QUEUED_BATCHES)
+      {
+        // Keep the most recent data when the server can't keep up.
+        _uploadStats.droppedEvents += _outbox.takeFirst().eventCount;
+      }
+  }
+  if (_postScheduled.testAndSetOrdered(0, 1))
+    {
+      QMetaObject::invokeMethod(this, "postBatches", Qt::QueuedConnection);
+    }
+}
+
+QUrl LocalyticsRelay::uploadUrl(const QByteArray &appKey) const
+{
+  QString urlFormat = _urlFormat.isEmpty() ? QString(LOCALYTICS_URL_SECURED) : _urlFormat;
+  return QUrl(urlFormat.arg(QString(QLatin1String(QUrl::toPercentEncoding(QLatin1String(appKey.constData()))))));
+}
+
+void LocalyticsRelay::postBatches()
+{
+  _postScheduled.fetchAndStoreOrdered(0);
+
+  QList<LocalyticsRelayBatch> batches;
+  {
+    QMutexLocker locker(&_outboxLock);
+    while (_inFlight.size() + batches.size() < _maxConcurrentUploads && !_outbox.isEmpty())
+      {
+        batches.append(_outbox.takeFirst());
+      }
+  }
+
+  QByteArray uploadTime = QByteArray::number((double) QDateTime::currentDateTime().toTime_t(), 'f', 0);
+  for (int i = 0; i < batches.size(); i++)
+    {
+      const LocalyticsRelayBatch &batch = batches.at(i);
+      LocalyticsTransportHeaders headers;
+      headers << qMakePair(QString(HEADER_CLIENT_TIME).toAscii(), uploadTime);
+      headers << qMakePair(QString(HEADER_INSTALL_ID).toAscii(), batch.installId);
+      headers << qMakePair(QByteArray("Content-Type"), QByteArray("application/x-gzip"));
+      headers << qMakePair(QByteArray("Content-Length"), QByteArray::number(batch.body.size()));
+      headers << qMakePair(QByteArray("Connection"), QByteArray("keep-alive"));
+
+      QBuffer *body = new QBuffer;
+      body->setData(batch.body);
+      body->open(QIODevice::ReadOnly);
+      int request = _transport->send(uploadUrl(batch.appKey), headers, body);
+      _inFlight.insert(request, batch);
+    }
+}
+
+void LocalyticsRelay::requestFinished(int request, const LocalyticsTransportResponse &response)
+{
+  if (!_inFlight.contains(request))
+    return;
+
+  LocalyticsRelayBatch batch = _inFlight.take(request);
+  int statusCode = response.statusCode;
+  {
+    QMutexLocker locker(&_outboxLock);
+    if (statusCode >= 200 && statusCode < 400)
+      {
+        _uploadStats.uploadedBatches++;
+        _uploadStats.bytesUploaded += batch.body.size();
+      }
+    else if ((statusCode == 0 || statusCode == 429 || statusCode >= 500) && ++batch.attempts < RELAY_MAX_ATTEMPTS)
+      {
+        LOCALYTICS_DEBUG(QString(QLatin1String("Relay upload failed (%1), retrying")).arg(statusCode ? QString::number(statusCode) : response.errorString));
+        _retrying.append(batch);
+      }
+    else
+      {
+        LOCALYTICS_WARNING(QString(QLatin1String("Relay upload of %1 events dropped (%2)")).arg(batch.eventCount).arg(statusCode ? QString::number(statusCode) : response.errorString));
+        _uploadStats.failedBatches++;
+        _uploadStats.droppedEvents += batch.eventCount;
+      }
+  }
+  if (!_retrying.isEmpty() && !_retryTimer->isActive())
+    {
+      _retryTimer->start(RELAY_RETRY_DELAY_MS);
+    }
+
+  postBatches();
+  if (pendingBatches() == 0)
+    {
+      emit idle();
+    }
+}
+
+void LocalyticsRelay::retryBatches()
+{
+  {
+    QMutexLocker locker(&_outboxLock);
+    _outbox = _retrying + _outbox;
+    _retrying.clear();
+  }
+  postBatches();
+}
+
+int LocalyticsRelay::deviceCount() const
+{
+  int devices = 0;
+  for (int i = 0; i < RELAY_SHARDS; i++)
+    {
+      QMutexLocker locker(&_shards[i].lock);
+      devices += _shards[i].devices.size();
+    }
+  return devices;
+}
+
+int LocalyticsRelay::pendingBatches() const
+{
+  QMutexLocker locker(&_outboxLock);
+  return _outbox.size() + _retrying.size() + _inFlight.size();
+}
+
+LocalyticsRelayStats LocalyticsRelay::stats() const
+{
+  LocalyticsRelayStats stats;
+  {
+    QMutexLocker locker(&_outboxLock);
+    stats = _uploadStats;
+  }
+  for (int i = 0; i < RELAY_SHARDS; i++)
+    {
+      QMutexLocker locker(&_shards[i].lock);
+      stats.records += _shards[i].records;
+      stats.events += _shards[i].events;
+      stats.droppedEvents += _shards[i].droppedEvents;
+      stats.evictedDevices += _shards[i].evictedDevices;
+    }
+  return stats;
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSRELAY_H
+#define LOCALYTICSRELAY_H
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QThread>
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QTcpServer>
+#include "localyticstransport.h"
+
+#define RELAY_SHARDS                64       // Number of independently locked partitions of the device table
+#define RELAY_MAX_RECORD_BYTES      65536    // Largest record accepted; a connection sending a larger one is closed
+#define RELAY_BATCH_EVENTS          100      // Default number of events of a device which completes a batch
+#define RELAY_BATCH_BYTES           65536    // Default size of the events of a device which completes a batch, in bytes
+#define RELAY_BATCH_AGE_MS          10000    // Default age of the oldest event of a device at which its batch is sent anyway
+#define RELAY_MAX_PENDING_BYTES     262144   // Events kept for a device whose header is not known yet, in bytes
+#define RELAY_MAX_QUEUED_BATCHES    10000    // Batches waiting to be sent before the oldest are dropped
+#define RELAY_MAX_ATTEMPTS          5        // Times a batch is sent before it is dropped
+#define RELAY_RETRY_DELAY_MS        5000     // Wait before failed batches are sent again
+#define RELAY_MAX_CONCURRENT_UPLOADS 8       // Default number of requests in flight at once
+#define RELAY_MAX_DEVICES_PER_SHARD 4096     // Default devices kept per shard before the least recently seen is evicted
+#define RELAY_DEVICE_IDLE_MS        600000   // Default time without records after which a device with nothing to send is evicted
+
+#define RELAY_RECORD_DEVICE         'd'      // Record type setting the header of a device
+#define RELAY_RECORD_EVENT          'e'      // Record type of an event of a device
+
+class QTcpSocket;
+class QTimer;
+class LocalyticsRelay;
+
+/*!
+  Counters of a relay since it was created.
+*/
+struct LocalyticsRelayStats
+{
+  LocalyticsRelayStats() :
+    records(0), events(0), malformedRecords(0), droppedEvents(0), evictedDevices(0),
+    batches(0), uploadedBatches(0), failedBatches(0), bytesUploaded(0) {}
+
+  qint64 records;          // Records ingested
+  qint64 events;           // Events ingested
+  qint64 malformedRecords; // Records which could not be parsed
+  qint64 droppedEvents;    // Events given up on: over a limit, evicted, rejected or failed too often
+  qint64 evictedDevices;   // Devices forgotten for being idle or over the per shard limit
+  qint64 batches;          // Upload bodies assembled
+  qint64 uploadedBatches;  // Upload bodies accepted by the server
+  qint64 failedBatches;    // Upload bodies rejected or failed too often
+  qint64 bytesUploaded;    // Compressed bytes accepted by the server
+};
+
+/*
+  Header state and pending events of one device.
+*/
+struct LocalyticsRelayDevice
+{
+  LocalyticsRelayDevice() : persistedAt(0), nextSequence(1), eventCount(0), oldestEvent(0), lastSeen(0) {}
+
+  QByteArray appKey;
+  QByteArray attributes;
+  qint64 persistedAt;
+  int nextSequence;
+  QByteArray events;
+  int eventCount;
+  qint64 oldestEvent;
+  qint64 lastSeen;
+};
+
+/*
+  An assembled upload body of one device.
+*/
+struct LocalyticsRelayBatch
+{
+  QByteArray appKey;
+  QByteArray installId;
+  QByteArray attributes;
+  qint64 persistedAt;
+  int sequenceNumber;
+  QByteArray body;       // The events until assembled, then the gzip member
+  int eventCount;
+  int attempts;
+};
+
+/*
+  A partition of the device table, selected by a hash of the install
+  id, with its own lock so that threads ingesting for different
+  devices rarely wait for each other.
+*/
+struct LocalyticsRelayShard
+{
+  LocalyticsRelayShard() : records(0), events(0), droppedEvents(0), evictedDevices(0) {}
+
+  mutable QMutex lock;
+  QHash<QByteArray, LocalyticsRelayDevice> devices;
+  qint64 records;
+  qint64 events;
+  qint64 droppedEvents;
+  qint64 evictedDevices;
+};
+
+/*
+  Reads the records of one client connection, on a worker thread.
+*/
+class LocalyticsRelayConnection : public QObject
+{
+  Q_OBJECT
+  public:
+  LocalyticsRelayConnection(int socketDescriptor, LocalyticsRelay *relay);
+
+  private slots:
+  void start();
+  void readRecords();
+
+  private:
+  int _socketDescriptor;
+  LocalyticsRelay *_relay;
+  QTcpSocket *_socket;
+  QByteArray _buffer;
+};
+
+/*
+  A thread running the connections handed to it, which it deletes
+  when it finishes.
+*/
+class LocalyticsRelayWorker : public QThread
+{
+  public:
+  explicit LocalyticsRelayWorker(LocalyticsRelay *relay);
+
+  void adopt(int socketDescriptor);
+
+  protected:
+  void run();
+
+  private:
+  LocalyticsRelay *_relay;
+  QMutex _lock;
+  QList<QPointer<LocalyticsRelayConnection> > _connections;
+};
+
+/*
+  Hands the connections accepted by a relay to its workers.
+*/
+class LocalyticsRelayServer : public QTcpServer
+{
+  public:
+  explicit LocalyticsRelayServer(LocalyticsRelay *relay);
+
+  protected:
+  void incomingConnection(int socketDescriptor);
+
+  private:
+  LocalyticsRelay *_relay;
+  int _nextWorker;
+};
+
+/*!
+  Batches, headers and uploads the events of many devices, for running
+  the library as a relay in front of the Localytics service.
+
+  Clients connect to a local socket and send records, each made of a
+  32-bit big-endian length followed by that many bytes:
+
+  <ul>
+  <li>RELAY_RECORD_DEVICE, the install id, a newline, the app key, a
+  newline, the time the device's data was first persisted, in seconds
+  since the epoch, a space and the sequence number of its next batch,
+  either 0 if the client doesn't keep it, a newline, and the members of
+  the header's attributes object as JSON, e.g.
+  `"dp":"BlackBerry10","dmo":"Z10"`.  Sets the header of the device's
+  next batches.</li>
+  <li>RELAY_RECORD_EVENT, the install id, a newline, and the event
+  blob as LocalyticsSession::tagEvent() stores it.</li>
+  </ul>
+
+  Events are kept per device.  When a device has RELAY_BATCH_EVENTS
+  events or RELAY_BATCH_BYTES of them, or its oldest has waited
+  RELAY_BATCH_AGE_MS, they are assembled, behind a header with the
+  device's next sequence number, into one gzip member and uploaded
+  for its app key and install id.  Connections are read and batches
+  assembled on a pool of worker threads, and the device table is
+  partitioned so that they rarely contend.
+
+  A device is forgotten once it has sent nothing for
+  RELAY_DEVICE_IDLE_MS and has no events waiting to be batched, or
+  when its shard holds RELAY_MAX_DEVICES_PER_SHARD devices and it is
+  the least recently seen.  Its client sends its RELAY_RECORD_DEVICE
+  record again when it comes back.  The relay then continues from the
+  persisted-at time and sequence number of that record, as it does
+  after a restart.  Where they are 0, the device starts again from
+  sequence number 1 with a new persisted-at time, and the server sees
+  sequence numbers it already received for that install id, so clients
+  should keep both and send a sequence number past their last batch.
+
+  The relay keeps its state in memory only: batches which have not
+  been accepted are lost if the process ends.
+*/
+class LocalyticsRelay : public QObject
+{
+  Q_OBJECT
+  friend class LocalyticsRelayConnection;
+  friend class LocalyticsRelayServer;
+  public:
+  explicit LocalyticsRelay(QObject *parent = 0);
+  ~LocalyticsRelay();
+
+  /*!
+    Starts accepting clients.
+    \param address The address to listen on, by default the loopback
+    interface only.
+    \param port The port, or 0 to pick a free one.
+    \return `true` on success.
+  */
+  bool listen(const QHostAddress &address = QHostAddress::LocalHost, quint16 port = 0);
+  quint16 serverPort() const;
+
+  /*!
+    Stops accepting clients and closes the connections of the current
+    ones.  Events already received are still uploaded.
+  */
+  void close();
+
+  /*!
+    \param threads Number of threads reading connections, by default
+    QThread::idealThreadCount().  Takes effect at the next listen().
+  */
+  void setWorkerThreads(int threads);
+  int workerThreads() const;
+
+  /*!
+    Sets when the events of a device are sent.  Must be set before the
+    relay starts listening.
+    \param events Number of events.
+    \param bytes Size of the events, in bytes.
+    \param ageMilliseconds Age of the oldest event.
+  */
+  void setBatchLimits(int events, qint64 bytes, int ageMilliseconds);
+
+  /*!
+    Sets how long devices are kept.  Must be set before the relay
+    starts listening.
+    \param maxDevicesPerShard Devices kept in each of the RELAY_SHARDS
+    partitions, at least 1.
+    \param idleMilliseconds Time without records after which a device
+    with nothing to send is evicted.
+  */
+  void setDeviceLimits(int maxDevicesPerShard, int idleMilliseconds);
+
+  /*!
+    \param urlFormat The upload URL, as for
+    LocalyticsUploader::setEndpoint().  Defaults to the Localytics
+    service over HTTPS.
+  */
+  void setEndpoint(const QString &urlFormat);
+
+  /*!
+    Sets how batches are sent.  The relay takes ownership of the
+    transport and deletes the previous one, which must not have
+    requests in flight.  Defaults to a LocalyticsNetworkTransport.
+  */
+  void setTransport(LocalyticsTransport *transport);
+  LocalyticsTransport *transport() const;
+
+  /*!
+    \param requests Number of requests in flight at once, at least 1.
+    Defaults to RELAY_MAX_CONCURRENT_UPLOADS.
+  */
+  void setMaxConcurrentUploads(int requests);
+
+  /*!
+    Ingests one record, without its length prefix.  May be called from
+    any thread, for clients which do not go through the socket.
+    \return `false` if the record is malformed.
+  */
+  bool ingest(const QByteArray &record);
+
+  /*!
+    Assembles the events of every device, whatever their number and
+    age, and starts sending them.  Must be called on the relay's
+    thread.
+  */
+  void flush();
+
+  /*!
+    \return The number of devices seen.
+  */
+  int deviceCount() const;
+
+  /*!
+    \return The number of batches waiting or in flight.  Must be
+    called on the relay's thread.
+  */
+  int pendingBatches() const;
+
+  LocalyticsRelayStats stats() const;
+
+signals:
+  /*!
+    Emitted when the last pending batch has been sent or given up on.
+  */
+  void idle();
+
+  private slots:
+  void sweep();
+  void postBatches();
+  void retryBatches();
+  void requestFinished(int request, const LocalyticsTransportResponse &response);
+
+  private:
+  LocalyticsRelayShard &shardOf(const QByteArray &installId);
+  LocalyticsRelayDevice &deviceOf(LocalyticsRelayShard &shard, const QByteArray &installId);
+  static void evictLeastRecent(LocalyticsRelayShard &shard);
+  static void takeBatch(const QByteArray &installId, LocalyticsRelayDevice &device, QList<LocalyticsRelayBatch> *batches);
+  void collectBatches(bool all);
+  void enqueue(QList<LocalyticsRelayBatch> batches);
+  void recordMalformed();
+  static bool assemble(LocalyticsRelayBatch &batch);
+  QUrl uploadUrl(const QByteArray &appKey) const;
+
+  LocalyticsRelayServer *_server;
+  QList<LocalyticsRelayWorker *> _workers;
+  int _workerThreads;
+  int _batchEvents;
+  qint64 _batchBytes;
+  int _batchAge;
+  int _maxDevicesPerShard;
+  int _deviceIdle;
+  QString _urlFormat;
+  LocalyticsTransport *_transport;
+  int _maxConcurrentUploads;
+  LocalyticsRelayShard _shards[RELAY_SHARDS];
+  QElapsedTimer _clock;
+  QTimer *_sweepTimer;
+  QTimer *_retryTimer;
+
+  mutable QMutex _outboxLock;
+  QList<LocalyticsRelayBatch> _outbox;
+  QList<LocalyticsRelayBatch> _retrying;
+  QHash<int, LocalyticsRelayBatch> _inFlight;
+  QAtomicInt _postScheduled;
+  LocalyticsRelayStats _uploadStats;
+};
+
+#endif // LOCALYTICSRELAY_H
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsretrypolicy.h"
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QStringList>
+
+LocalyticsRetryPolicy::LocalyticsRetryPolicy() :
+  _baseDelay(RETRY_BASE_DELAY_MS),
+  _maxDelay(RETRY_MAX_DELAY_MS),
+  _failureThreshold(CIRCUIT_FAILURE_THRESHOLD),
+  _cooldown(CIRCUIT_COOLDOWN_MS),
+  _consecutiveFailures(0),
+  _circuitOpen(false)
+{
+  // Seeded per process so that devices don't share a jitter sequence.
+  _randomState = (quint32) QDateTime::currentMSecsSinceEpoch() ^ ((quint32) QCoreApplication::applicationPid() << 16);
+  if (_randomState == 0)
+    _randomState = 0x9e3779b9;
+}
+
+void LocalyticsRetryPolicy::setBaseDelay(int milliseconds)
+{
+  _baseDelay = milliseconds;
+}
+
+void LocalyticsRetryPolicy::setMaxDelay(int milliseconds)
+{
+  _maxDelay = milliseconds;
+}
+
+void LocalyticsRetryPolicy::setFailureThreshold(int failures)
+{
+  _failureThreshold = failures;
+}
+
+void LocalyticsRetryPolicy::setCooldown(int milliseconds)
+{
+  _cooldown = milliseconds;
+}
+
+int LocalyticsRetryPolicy::recordFailure(int retryAfter)
+{
+  _consecutiveFailures++;
+  if (_consecutiveFailures >= _failureThreshold)
+    {
+      _circuitOpen = true;
+      _circuitOpenedAt.start();
+      return -1;
+    }
+
+  return qMax(backoffDelay(), retryAfter);
+}
+
+void LocalyticsRetryPolicy::recordSuccess()
+{
+  _consecutiveFailures = 0;
+  _circuitOpen = false;
+}
+
+bool LocalyticsRetryPolicy::isCircuitOpen() const
+{
+  return _circuitOpen && _circuitOpenedAt.elapsed() < _cooldown;
+}
+
+int LocalyticsRetryPolicy::consecutiveFailures() const
+{
+  return _consecutiveFailures;
+}
+
+/*!
+ @method backoffDelay
+ @abstract Exponential backoff with "equal jitter": half of the delay is fixed, the other half random.
+ */
+int LocalyticsRetryPolicy::backoffDelay()
+{
+  qint64 delay = _baseDelay;
+  for (int i = 1; i < _consecutiveFailures && delay < _maxDelay; i++)
+    {
+      delay *= 2;
+    }
+  delay = qMin(delay, (qint64) _maxDelay);
+
+  qint64 half = delay / 2;
+  return (int) (half + (half > 0 ? random() % (half + 1) : 0));
+}
+
+quint32 LocalyticsRetryPolicy::random()
+{
+  // xorshift32
+  _randomState ^= _randomState << 13;
+  _randomState ^= _randomState >> 17;
+  _randomState ^= _randomState << 5;
+  return _randomState;
+}
+
+int LocalyticsRetryPolicy::parseRetryAfter(const QByteArray &value)
+{
+  QString text = QString::fromLatin1(value.constData(), value.length()).trimmed();
+  if (text.isEmpty())
+    return -1;
+
+  bool isNumber = false;
+  int seconds = text.toInt(&isNumber);
+  if (isNumber)
+    return seconds >= 0 ? qMin(seconds, RETRY_MAX_DELAY_MS / 1000) * 1000 : -1;
+
+  // HTTP date, e.g. "Wed, 21 Oct 2015 07:28:00 GMT".  Month names are
+  // matched by hand because QDateTime parses them in the system locale.
+  static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  QStringList parts = text.split(QLatin1Char(' '), QString::SkipEmptyParts);
+  if (parts.size() != 6)
+    return -1;
+
+  int month = 0;
+  while (month < 12 && parts.at(2) != QLatin1String(months[month]))
+    month++;
+  QTime time = QTime::fromString(parts.at(4), QLatin1String("hh:mm:ss"));
+  QDate date(parts.at(3).toInt(), month + 1, parts.at(1).toInt());
+  if (month == 12 || !date.isValid() || !time.isValid())
+    return -1;
+
+  qint64 delay = QDateTime::currentDateTime().msecsTo(QDateTime(date, time, Qt::UTC));
+  return (int) qBound((qint64) 0, delay, (qint64) RETRY_MAX_DELAY_MS);
+}
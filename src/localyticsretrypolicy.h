@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSRETRYPOLICY_H
+#define LOCALYTICSRETRYPOLICY_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QElapsedTimer>
+
+#define RETRY_BASE_DELAY_MS        5000     // Delay before the first retry, doubled for each further failure
+#define RETRY_MAX_DELAY_MS         600000   // Upper bound of the backoff delay
+#define CIRCUIT_FAILURE_THRESHOLD  5        // Consecutive failures which open the circuit breaker
+#define CIRCUIT_COOLDOWN_MS        1800000  // How long the circuit stays open before another attempt is allowed
+
+/*!
+  Decides when a failed upload is tried again.
+
+  Each consecutive failure doubles the delay before the next attempt,
+  with random jitter so that devices which failed together don't
+  retry together, and a server supplied `Retry-After` is never
+  undercut.  After CIRCUIT_FAILURE_THRESHOLD consecutive failures the
+  circuit breaker opens: no upload is attempted, and no payload built,
+  until the cooldown has passed.  The next attempt after that is a
+  probe; if it fails too the circuit opens again straight away.
+*/
+class LocalyticsRetryPolicy
+{
+  public:
+  LocalyticsRetryPolicy();
+
+  void setBaseDelay(int milliseconds);
+  void setMaxDelay(int milliseconds);
+  void setFailureThreshold(int failures);
+  void setCooldown(int milliseconds);
+
+  /*!
+    Records a failed attempt.
+    \param retryAfter Delay requested by the server in milliseconds,
+    or -1 if none was given.
+    \return Delay before the next attempt in milliseconds, or -1 if
+    the circuit breaker is now open.
+  */
+  int recordFailure(int retryAfter = -1);
+
+  /*!
+    Records a successful attempt, closing the circuit breaker.
+  */
+  void recordSuccess();
+
+  /*!
+    \return `true` while uploads must not be attempted.
+  */
+  bool isCircuitOpen() const;
+
+  int consecutiveFailures() const;
+
+  /*!
+    Parses the value of a `Retry-After` header, given either in
+    seconds or as an HTTP date.
+    \return The delay in milliseconds, or -1 if it could not be parsed.
+  */
+  static int parseRetryAfter(const QByteArray &value);
+
+  private:
+  int backoffDelay();
+  quint32 random();
+
+  int _baseDelay;
+  int _maxDelay;
+  int _failureThreshold;
+  int _cooldown;
+  int _consecutiveFailures;
+  bool _circuitOpen;
+  QElapsedTimer _circuitOpenedAt;
+  quint32 _randomState;
+};
+
+#endif // LOCALYTICSRETRYPOLICY_H
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticssequence.h"
+#include <QtSql/QSqlQuery>
+#include <QtCore/QVariant>
+
+LocalyticsSequence::LocalyticsSequence(const QString &column, int blockSize) :
+  _column(column),
+  _blockSize(blockSize > 0 ? blockSize : 1),
+  _next(0),
+  _limit(0),
+  _loaded(false)
+{
+}
+
+bool LocalyticsSequence::next(QSqlDatabase database, int *number)
+{
+  if (!_loaded)
+    {
+      QSqlQuery q(database);
+      if (!q.exec(QString(QLatin1String("SELECT %1 FROM localytics_info")).arg(_column)) || !q.next())
+        {
+          return false;
+        }
+      _limit = q.value(0).toInt();
+      _next = _limit + 1;
+      _loaded = true;
+    }
+
+  if (_next > _limit)
+    {
+      // Persist the new high-water mark before handing out any of the block.
+      int limit = _limit + _blockSize;
+      QSqlQuery q(database);
+      q.prepare(QString(QLatin1String("UPDATE localytics_info SET %1 = :limit")).arg(_column));
+      q.bindValue(QLatin1String(":limit"), limit);
+      if (!q.exec())
+        {
+          return false;
+        }
+      _limit = limit;
+    }
+
+  *number = _next++;
+  return true;
+}
+
+void LocalyticsSequence::invalidate()
+{
+  _loaded = false;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSSEQUENCE_H
+#define LOCALYTICSSEQUENCE_H
+
+#include <QtCore/QString>
+#include <QtSql/QSqlDatabase>
+
+/*!
+  Hands out increasing numbers backed by a column of `localytics_info`.
+
+  Numbers are reserved from the database in blocks: the column holds
+  the high-water mark of every number reserved so far and is written
+  once per block, and numbers within the block are handed out from
+  memory.  Numbers left over in a block when the process dies are
+  skipped, so values stay monotonic across crashes but may have gaps.
+*/
+class LocalyticsSequence
+{
+  public:
+  /*!
+    \param column The `localytics_info` column holding the high-water mark.
+    \param blockSize How many numbers to reserve with each write.
+  */
+  LocalyticsSequence(const QString &column, int blockSize);
+
+  /*!
+    Retrieves the next number, reserving a new block if required.
+    \param database Open connection to the Localytics database.
+    \param number Receives the next number.
+    \return `true` on success, `false` if a block could not be reserved.
+  */
+  bool next(QSqlDatabase database, int *number);
+
+  /*!
+    Forgets the in-memory block so the high-water mark is read again.
+    Must be called whenever the column may have changed underneath,
+    i.e. after it is reset or a savepoint containing a reservation is
+    rolled back.
+  */
+  void invalidate();
+
+  private:
+  QString _column;
+  int _blockSize;
+  int _next;
+  int _limit;
+  bool _loaded;
+};
+
+#endif // LOCALYTICSSEQUENCE_H
@@ -27,15 +27,24 @@
  * DAMAGE.
  */
 
+#define LOCALYTICS_LOG_COMPONENT "localytics"
+
 #include "localyticssession.h"
+#include "localyticsclock.h"
 #include "localyticsdatabase.h"
+#include "localyticseventbuffer.h"
+#include "localyticsflowring.h"
+#include "localyticslog.h"
 #include "localyticsuploader.h"
+#include "localyticsuploaderpool.h"
+#include "localyticsuploadscheduler.h"
 #include "webserviceconstants.h"
 #include <QCoreApplication>
 #include <QCryptographicHash>
-#include <QDebug>
 #include <QRegExp>
 #include <QSettings>
+#include <QThread>
+#include <QTimer>
 #include <QUuid>
 #include <QVariantMap>
 
@@ -70,30 +79,133 @@
 #define DEFAULT_BACKGROUND_SESSION_TIMEOUT 15   
 
 
+/*
+  The number of characters at the start of a string which fit in a
+  number of UTF-8 bytes, without splitting a surrogate pair.  Only
+  looks at the characters which fit.
+*/
+static int utf8Prefix(const QString &string, int maxBytes, int *bytes)
+{
+  int used = 0;
+  int i = 0;
+  int length = string.length();
+  while (i < length)
+    {
+      QChar c = string.at(i);
+      int chars = 1;
+      int size;
+      if (c.unicode() < 0x80)
+        size = 1;
+      else if (c.unicode() < 0x800)
+        size = 2;
+      else if (c.isHighSurrogate() && i + 1 < length && string.at(i + 1).isLowSurrogate())
+        {
+          size = 4;
+          chars = 2;
+        }
+      else
+        size = 3;
+      if (used + size > maxBytes)
+        break;
+      used += size;
+      i += chars;
+    }
+  *bytes = used;
+  return i;
+}
+
 LocalyticsSession* LocalyticsSession::_sharedLocalyticsSession = 0;
+QHash<QString, LocalyticsSession *> LocalyticsSession::_sessions;
+QMutex LocalyticsSession::_sharedLock;
 
 LocalyticsSession::LocalyticsSession(QObject *parent) : QObject(parent)
+{
+        setUp(LocalyticsDatabase::sharedLocalyticsDatabase(), LocalyticsUploader::sharedLocalyticsUploader());
+}
+
+LocalyticsSession::LocalyticsSession(LocalyticsDatabase *database, LocalyticsUploader *uploader, QObject *parent) :
+  QObject(parent)
+{
+  setUp(database, uploader);
+}
+
+/*!
+ @method setUp
+ @abstract Initializes the members of a new session, which stores its data in the given database and uploads it
+ with the given uploader.
+ */
+void LocalyticsSession::setUp(LocalyticsDatabase *database, LocalyticsUploader *uploader)
 {
         _isSessionOpen  = false;
         _hasInitialized = false;
         _backgroundSessionTimeout = DEFAULT_BACKGROUND_SESSION_TIMEOUT;
         _sessionHasBeenOpen = false;
         _enableHTTPS = true;
+        _prewarmConnection = false;
+        _millisecondClientTime = 0;
+        _sessionStartTime = 0;
+        _sessionResumeTime = 0;
+        _sessionCloseTime = -1;
+        _sessionActiveDuration = 0;
+        _eventBuffers = new LocalyticsEventBuffers;
+        _flow = new LocalyticsFlowRing;
+
+        _database = database;
+        _uploader = uploader;
+
+        _uploadScheduler = new LocalyticsUploadScheduler(_uploader, this);
+        connect(_uploadScheduler, SIGNAL(uploadDue()), this, SLOT(scheduledUpload()));
+
+        refreshDimensions();
+        connect(_database, SIGNAL(customDimensionsChanged()), this, SLOT(refreshDimensions()));
+
+        // The close and flow events of a backgrounded session stay
+        // provisional until it can no longer be resumed.
+        _backgroundTimer = new QTimer(this);
+        _backgroundTimer->setSingleShot(true);
+        connect(_backgroundTimer, SIGNAL(timeout()), this, SLOT(promoteProvisionalEvents()));
+}
+
+LocalyticsSession* LocalyticsSession::sessionForAppKey(const QString &appKey)
+{
+  LocalyticsSession *session;
+  {
+    QMutexLocker locker(&_sharedLock);
+    session = _sessions.value(appKey);
+    if (session)
+      return session;
+
+    LocalyticsDatabase *database = LocalyticsDatabase::databaseForAppKey(appKey);
+    session = new LocalyticsSession(database, LocalyticsUploaderPool::sharedUploaderPool()->uploaderForDatabase(database));
+    _sessions.insert(appKey, session);
+  }
+  session->init(appKey);
+  return session;
+}
 
-        LocalyticsDatabase::sharedLocalyticsDatabase();
+LocalyticsSession::~LocalyticsSession()
+{
+  delete _eventBuffers;
+  delete _flow;
 }
 
 void LocalyticsSession::init(QString appKey)
 {
+  if (QThread::currentThread() != thread())
+    {
+      QMetaObject::invokeMethod(this, "init", Qt::QueuedConnection, Q_ARG(QString, appKey));
+      return;
+    }
+
   // If the session has already initialized, don't bother doing it again.
   if (hasInitialized())
     {
-      logMessage(QLatin1String("Object has already been initialized."));
+      LOCALYTICS_DEBUG(QLatin1String("Object has already been initialized."));
       return;
     }
   if (appKey.isNull() || appKey.length() == 0)
     {
-      logMessage(QLatin1String("App key is null or empty."));
+      LOCALYTICS_DEBUG(QLatin1String("App key is null or empty."));
       _hasInitialized = false;
       return;
     }
@@ -105,7 +217,7 @@ void LocalyticsSession::init(QString appKey)
   //  self.hasInitialized = NO;
   //  return;
   //}
-  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  LocalyticsDatabase *db = _database;
   if (db) {
     // Check if the app key has changed.
     QString lastAppKey = db->appKey();
@@ -124,8 +236,10 @@ void LocalyticsSession::init(QString appKey)
     }
 
     _applicationKey = appKey;
+    _headerAttributes = QString();
+    _headerInstallId = QString();
     _hasInitialized = true;
-    logMessage(QLatin1String("Object Initialized. Application's key is: ") + _applicationKey);
+    LOCALYTICS_INFO(QLatin1String("Object Initialized. Application's key is: ") + _applicationKey);
   }
 }
 
@@ -146,22 +260,38 @@ void LocalyticsSession::startSession(QString appKey)
 // Public interface to ll_open.
 void LocalyticsSession::open()
 {
-  //dispatch_async(_queue, ^{
+  // Calls from other threads are queued on the session's thread, as
+  // the iOS library dispatches them to its queue.
+  if (QThread::currentThread() != thread())
+    {
+      QMetaObject::invokeMethod(this, "open", Qt::QueuedConnection);
+      return;
+    }
   ll_open();
-  //  });
 }
 
 bool LocalyticsSession::resume()
 {
+  if (QThread::currentThread() != thread())
+    {
+      bool resumed = false;
+      QMetaObject::invokeMethod(this, "resume", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, resumed));
+      return resumed;
+    }
+
   // Do nothing if session is already open
   if (_isSessionOpen == true)
     return true;
 
   bool ret = false;
   // conditions for resuming previous session
-  QDateTime now = QDateTime::currentDateTime();
-  if (_sessionHasBeenOpen &&
-      (!_sessionCloseTime.isValid() || _sessionCloseTime.secsTo(now) <= _backgroundSessionTimeout)
+  // A session whose provisional close was promoted can't be resumed.
+  // The timer doesn't run while the device is suspended, so the time
+  // in the background is measured on a clock which includes that.
+  bool provisional = _sessionCloseTime < 0 || _backgroundTimer->isActive();
+  _backgroundTimer->stop();
+  if (_sessionHasBeenOpen && provisional &&
+      (_sessionCloseTime < 0 || LocalyticsClock::elapsedRealtimeMSecs() - _sessionCloseTime <= _backgroundSessionTimeout * 1000)
       ) 
     {
       // Note that we allow the session to be resumed even if the
@@ -174,11 +304,11 @@ bool LocalyticsSession::resume()
       ret = true;
       if(ll_isOptedIn() == false) 
         {
-          logMessage(QLatin1String("Can't resume session because user is opted out."));
+          LOCALYTICS_DEBUG(QLatin1String("Can't resume session because user is opted out."));
         } 
       else
         {
-          logMessage(QLatin1String("Resume called - Resuming previous session."));
+          LOCALYTICS_DEBUG(QLatin1String("Resume called - Resuming previous session."));
           reopenPreviousSession();
         }
     } 
@@ -187,86 +317,107 @@ bool LocalyticsSession::resume()
       ret = false;
     if (ll_isOptedIn() == false) 
       {
-        logMessage(QLatin1String("Can't resume session because user is opted out."));
+        LOCALYTICS_DEBUG(QLatin1String("Can't resume session because user is opted out."));
       } 
     else
       {
         // otherwise open new session and upload
-        logMessage(QLatin1String("Resume called - Opening a new session."));
+        LOCALYTICS_DEBUG(QLatin1String("Resume called - Opening a new session."));
         ll_open();
       }
     }
-  _sessionCloseTime = QDateTime();
+  _sessionCloseTime = -1;
   return ret;
 }
 
 void LocalyticsSession::close()
 {
+  if (QThread::currentThread() != thread())
+    {
+      QMetaObject::invokeMethod(this, "close", Qt::QueuedConnection);
+      return;
+    }
+
+  // Store events tagged on other threads while the session is open.
+  flushEventBuffers();
+
   // Do nothing if the session is not open
   if (_isSessionOpen == false) 
     {
-      logMessage(QLatin1String("Unable to close session - session is not open!"));
+      LOCALYTICS_DEBUG(QLatin1String("Unable to close session - session is not open!"));
       return;
     }
 
   // Save time of close
-  _sessionCloseTime = QDateTime::currentDateTime();
+  _sessionCloseTime = LocalyticsClock::elapsedRealtimeMSecs();
 
   // Update active session duration.
-  _sessionActiveDuration += _sessionResumeTime.secsTo(_sessionCloseTime);
+  _sessionActiveDuration += LocalyticsClock::monotonicMSecs() - _sessionResumeTime;
 
-  int sessionLength = (int)(QDateTime::currentDateTime().toTime_t() - _lastSessionStartTimestamp.toTime_t());
+  // Neither duration sees changes of the wall clock.  The session's
+  // length includes the time the device was suspended, its active
+  // duration doesn't.
+  qint64 sessionLength = (_sessionCloseTime - _sessionStartTime) / 1000;
 
   //try {
-  // Create the JSON representing the close blob
+  // Create the JSON representing the close blob.  Only the times and
+  // the screens are added here; the rest was prepared while the
+  // session was open, as the OS leaves little time on suspend.
+  QString screens = _flow->screens();
   QString closeEventString;
-  closeEventString.append(QLatin1Char('{'));
-  closeEventString.append(formatAttribute(PARAM_DATA_TYPE, QLatin1String("c"), true));
-  closeEventString.append(formatAttribute(PARAM_SESSION_UUID, _sessionUUID));
-  closeEventString.append(formatAttribute(PARAM_UUID, randomUUID()));
-  closeEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_START).arg((double) _lastSessionStartTimestamp.toTime_t(), 0, 'f', 0));
-  closeEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_ACTIVE).arg(_sessionActiveDuration));
-  closeEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg((double) QDateTime::currentDateTime().toTime_t(), 0, 'f', 0));
-
-  // Avoid recording session lengths of users with unreasonable client
-  // times (usually caused by developers testing clock change attacks)
-  if (sessionLength > 0 && sessionLength < 400000)
+  closeEventString.reserve(_closeBlobHead.length() + screens.length() + _dimensions.length() + 96);
+  closeEventString.append(_closeBlobHead);
+  closeEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_ACTIVE).arg(_sessionActiveDuration / 1000));
+  closeEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg(LocalyticsClock::clientTime(_millisecondClientTime != 0)));
+
+  if (sessionLength > 0)
     {
       closeEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_TOTAL).arg(sessionLength));
     }
 
   // Open second level - screen flow
   closeEventString.append(QString(QLatin1String(",\"%1\":[")).arg(PARAM_SESSION_SCREENFLOW));
-  closeEventString.append(_screens);
+  closeEventString.append(screens);
   // Close second level - screen flow
   closeEventString.append(QLatin1Char(']'));
 
-  // Append the custom dimensions
-  closeEventString.append(customDimensions());
-
-  // Append the location
-  closeEventString.append(locationDimensions());
+  // Append the custom dimensions and the location
+  closeEventString.append(_dimensions);
 
   // Close first level - close blob
   closeEventString.append(QLatin1String("}\n"));
 
-  bool success = LocalyticsDatabase::sharedLocalyticsDatabase()->queueCloseEventWithBlobString(closeEventString);
+  // The close and flow events stay in the provisional slot, which
+  // the next close replaces, until the session can't be resumed.
+  bool success = _database->queueProvisionalEvents(closeEventString, flowEventBlobString());
+  _backgroundTimer->start((int) (_backgroundSessionTimeout * 1000));
 
   _isSessionOpen = false;  // Session is no longer open.
 
   if (success)
     {
-      logMessage(QLatin1String("Session successfully closed."));
+      LOCALYTICS_INFO(QLatin1String("Session successfully closed."));
     }
   else
     {
-      logMessage(QLatin1String("Failed to record session close."));
+      LOCALYTICS_WARNING(QLatin1String("Failed to record session close."));
     }
+
+  _uploadScheduler->lifecycleTransition();
 }
 
 void LocalyticsSession::setOptIn(bool optedIn)
 {
-  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  if (QThread::currentThread() != thread())
+    {
+      QMetaObject::invokeMethod(this, "setOptIn", Qt::QueuedConnection, Q_ARG(bool, optedIn));
+      return;
+    }
+
+  // Events tagged before opting out are still recorded.
+  flushEventBuffers();
+
+  LocalyticsDatabase *db = _database;
   QString t(QLatin1String("set_opt"));
   bool success = db->beginTransaction(t);
 
@@ -293,18 +444,39 @@ void LocalyticsSession::setOptIn(bool optedIn)
   if (success)
     {
       db->releaseTransaction(t);
-      logMessage(QString(QLatin1String("Application opted %1")).arg(optedIn ? QLatin1String("in") : QLatin1String("out")));
+      LOCALYTICS_INFO(QString(QLatin1String("Application opted %1")).arg(optedIn ? QLatin1String("in") : QLatin1String("out")));
     }
   else
     {
       db->rollbackTransaction(t);
-      logMessage(QLatin1String("Failed to update opt state."));
+      LOCALYTICS_WARNING(QLatin1String("Failed to update opt state."));
+    }
+
+}
+
+void LocalyticsSession::setConnectionPrewarming(bool prewarm)
+{
+  if (QThread::currentThread() != thread())
+    {
+      QMetaObject::invokeMethod(this, "setConnectionPrewarming", Qt::QueuedConnection, Q_ARG(bool, prewarm));
+      return;
     }
+  _prewarmConnection = prewarm;
+}
 
+void LocalyticsSession::setMillisecondClientTime(bool milliseconds)
+{
+  _millisecondClientTime.fetchAndStoreRelease(milliseconds ? 1 : 0);
 }
 
 bool LocalyticsSession::isOptedIn()
 {
+  if (QThread::currentThread() != thread())
+    {
+      bool optedIn = false;
+      QMetaObject::invokeMethod(this, "isOptedIn", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, optedIn));
+      return optedIn;
+    }
   return this->ll_isOptedIn();
 }
 
@@ -320,98 +492,240 @@ void LocalyticsSession::tagEvent(const QString &event, const QVariantMap &attrib
 
 void LocalyticsSession::tagEvent(const QString &event, const QVariantMap &attributes, const QVariantMap &reportAttributes)
 {
-	// Do nothing if the session is not open.
-	if (_isSessionOpen == false)
+	bool ownThread = QThread::currentThread() == thread();
+
+	// Do nothing if the session is not open. On other threads this is
+	// only known once the event is stored.
+	if (ownThread && _isSessionOpen == false)
 	{
-          logMessage(QLatin1String("Cannot tag an event because the session is not open."));
+          LOCALYTICS_DEBUG(QLatin1String("Cannot tag an event because the session is not open."));
 		return;
 	}
 
 	if(event.isEmpty())
 	{
-          logMessage(QLatin1String("Event tagged without a name. Skipping."));
+          LOCALYTICS_DEBUG(QLatin1String("Event tagged without a name. Skipping."));
 		return;
 	}
 
-	// Create the JSON for the event
-	QString eventString;
-	eventString.append(QLatin1Char('{'));
-	eventString.append(formatAttribute(PARAM_DATA_TYPE,  QLatin1String("e"), true));
-	eventString.append(formatAttribute(PARAM_UUID, randomUUID()));
-	eventString.append(formatAttribute(PARAM_APP_KEY, _applicationKey));
-	eventString.append(formatAttribute(PARAM_SESSION_UUID, _sessionUUID));
-	eventString.append(formatAttribute(PARAM_EVENT_NAME, escapeString(event)));
-	eventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg((double) QDateTime::currentDateTime().toTime_t(), 0, 'f', 0));
-
-	// Append the custom dimensions
-	eventString.append(customDimensions());
-
-	// Append the location
-	eventString.append(locationDimensions());
-
-	// If there are any attributes for this event, add them as a hash
-	int attrIndex = 0;
-	if(!attributes.isEmpty())
+	const LocalyticsEventLimits &limits = _eventBuffers->localLimits();
+	LocalyticsEventStats truncations;
+	int nameBytes;
+	int nameLength = utf8Prefix(event, limits.maxNameBytes, &nameBytes);
+	if (nameLength < event.length())
 	{
-		// Open second level - attributes
-                eventString.append(QString(QLatin1String(",\"%1\":{")).arg(PARAM_ATTRIBUTES));
-
-		 QMapIterator<QString, QVariant> i(attributes);
-		 while (i.hasNext())
-		 {
-			 i.next();
-			 // Have to escape paramName and paramValue because they user-defined.
-
-			 eventString.append(formatAttribute(escapeString(i.key()), escapeString(i.value().toString()), attrIndex == 0));
-			 attrIndex++;
-		 }
-
-		// Close second level - attributes
-		eventString.append(QLatin1Char('}'));
+		truncations.truncatedNames++;
 	}
 
-	// If there are any report attributes for this event, add them as above
-	attrIndex = 0;
-	if (!reportAttributes.isEmpty())
-          {
-                eventString.append(QString(QLatin1String(",\"%1\":{")).arg(PARAM_REPORT_ATTRIBUTES));
-		QMapIterator<QString, QVariant> i(reportAttributes);
-		while (i.hasNext())
-                  {
-			i.next();
-			eventString.append(formatAttribute(escapeString(i.key()), escapeString(i.value().toString()), attrIndex == 0));
-			attrIndex++;
-		}
-		eventString.append(QLatin1Char('}'));
-	}
+	// Create the JSON for the event, leaving out the session's keys
+	// and dimensions which are added when it is stored.
+	LocalyticsBufferedEvent buffered;
+	buffered.name = event.left(nameLength);
+	buffered.head.append(QLatin1Char('{'));
+	buffered.head.append(formatAttribute(PARAM_DATA_TYPE,  QLatin1String("e"), true));
+	buffered.head.append(formatAttribute(PARAM_UUID, randomUUID()));
+	buffered.head.append(formatAttribute(PARAM_EVENT_NAME, escapeString(buffered.name)));
+	buffered.head.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg(LocalyticsClock::clientTime(_millisecondClientTime != 0)));
+
+	// If there are any attributes for this event, add them as a hash,
+	// then the report attributes as another.
+	int attributeCount = 0;
+	int eventBytes = nameBytes;
+	appendAttributes(&buffered.tail, PARAM_ATTRIBUTES, attributes, limits, &attributeCount, &eventBytes, &truncations);
+	appendAttributes(&buffered.tail, PARAM_REPORT_ATTRIBUTES, reportAttributes, limits, &attributeCount, &eventBytes, &truncations);
 
 	// Close first level - Event information
-	eventString.append(QLatin1String("}\n"));
+	buffered.tail.append(QLatin1String("}\n"));
 
-	bool success = LocalyticsDatabase::sharedLocalyticsDatabase()->addEventWithBlobString(eventString);
-	if (success) 
+	_eventBuffers->append(buffered, truncations);
+
+	if (ownThread)
           {
-            // User-originated events should be tracked as application flow.
-            addFlowEvent(event, QLatin1String("e")); // "e" for Event.
-            logMessage(QLatin1String("Tagged event: ") + event);
-          } 
-        else
+            flushEventBuffers();
+          }
+	else if (_flushScheduled.testAndSetOrdered(0, 1))
           {
-            logMessage(QLatin1String("Failed to tag event."));
+            // One flush picks up everything buffered until it runs.
+            QMetaObject::invokeMethod(this, "flushEventBuffers", Qt::QueuedConnection);
           }
+}
+
+/*!
+ @method appendAttributes
+ @abstract Appends a hash of attributes to an event blob, within the limits.  Names and values are cut before
+ they are escaped, so no string longer than a limit is built.
+ @param attributeCount The attributes of the event appended so far, updated.
+ @param eventBytes The bytes of the event's name, keys and values so far, updated.
+ @param truncations Counts what was cut or dropped.
+ */
+void LocalyticsSession::appendAttributes(QString *blob, const QString &param, const QVariantMap &attributes,
+                                         const LocalyticsEventLimits &limits, int *attributeCount, int *eventBytes,
+                                         LocalyticsEventStats *truncations)
+{
+  bool opened = false;
+  QMapIterator<QString, QVariant> i(attributes);
+  while (i.hasNext())
+    {
+      i.next();
+      if (*attributeCount >= limits.maxAttributes)
+        {
+          truncations->droppedAttributes++;
+          continue;
+        }
+
+      QString value = i.value().toString();
+      int keyBytes;
+      int valueBytes;
+      int keyLength = utf8Prefix(i.key(), limits.maxKeyBytes, &keyBytes);
+      int valueLength = utf8Prefix(value, limits.maxValueBytes, &valueBytes);
+      if (*eventBytes + keyBytes + valueBytes > limits.maxEventBytes)
+        {
+          truncations->droppedAttributes++;
+          continue;
+        }
+      if (keyLength < i.key().length())
+        truncations->truncatedKeys++;
+      if (valueLength < value.length())
+        truncations->truncatedValues++;
+
+      // Open second level - attributes
+      if (!opened)
+        {
+          blob->append(QString(QLatin1String(",\"%1\":{")).arg(param));
+        }
+      // Have to escape paramName and paramValue because they user-defined.
+      blob->append(formatAttribute(escapeString(i.key().left(keyLength)), escapeString(value.left(valueLength)), !opened));
+      opened = true;
+      (*attributeCount)++;
+      *eventBytes += keyBytes + valueBytes;
+    }
+
+  // Close second level - attributes
+  if (opened)
+    {
+      blob->append(QLatin1Char('}'));
+    }
+}
+
+void LocalyticsSession::setEventLimits(const LocalyticsEventLimits &limits)
+{
+  _eventBuffers->setLimits(limits);
+}
+
+LocalyticsEventLimits LocalyticsSession::eventLimits() const
+{
+  return _eventBuffers->limits();
+}
+
+LocalyticsEventStats LocalyticsSession::eventStats() const
+{
+  // Each thread counts its own events, next to its buffer.
+  return _eventBuffers->stats();
+}
+
+void LocalyticsSession::resetEventStats()
+{
+  _eventBuffers->resetStats();
+}
+
+void LocalyticsSession::tagScreen(const QString &screen)
+{
+  if (QThread::currentThread() != thread())
+    {
+      QMetaObject::invokeMethod(this, "tagScreen", Qt::QueuedConnection, Q_ARG(QString, screen));
+      return;
+    }
+
+  if (_isSessionOpen == false)
+    {
+      LOCALYTICS_DEBUG(QLatin1String("Cannot tag a screen because the session is not open."));
+      return;
+    }
+
+  addFlowEvent(screen, LocalyticsFlowScreen);
+}
+
+/*!
+ @method flushEventBuffers
+ @abstract Stores the events buffered by every thread, in the order
+ they were tagged, in one transaction.
+ */
+void LocalyticsSession::flushEventBuffers()
+{
+  _flushScheduled.fetchAndStoreOrdered(0);
+  QList<LocalyticsBufferedEvent> events = _eventBuffers->takeAll();
+  if (events.isEmpty())
+    return;
+
+  if (_isSessionOpen == false)
+    {
+      LOCALYTICS_DEBUG(QString(QLatin1String("Dropped %1 events tagged while the session was not open.")).arg(events.size()));
+      return;
+    }
 
+  // The same for every event of the session.
+  QString sessionAttributes;
+  sessionAttributes.append(formatAttribute(PARAM_APP_KEY, _applicationKey));
+  sessionAttributes.append(formatAttribute(PARAM_SESSION_UUID, _sessionUUID));
+  sessionAttributes.append(_dimensions);
+
+  LocalyticsDatabase *db = _database;
+  QString t(QLatin1String("tag_events"));
+  bool success = db->beginTransaction(t);
+  QList<int> lengths;
+  for (int i = 0; success && i < events.size(); i++)
+    {
+      const LocalyticsBufferedEvent &event = events.at(i);
+      QString eventString = event.head + sessionAttributes + event.tail;
+      success = db->addEventWithBlobString(eventString);
+      if (success)
+        {
+          // User-originated events should be tracked as application flow.
+          addFlowEvent(event.name, LocalyticsFlowEvent);
+          LOCALYTICS_DEBUG(QLatin1String("Tagged event: ") + event.name);
+          lengths.append(eventString.length());
+        }
+    }
+
+  if (success)
+    {
+      db->releaseTransaction(t);
+      for (int i = 0; i < lengths.size(); i++)
+        _uploadScheduler->eventAdded(lengths.at(i));
+    }
+  else
+    {
+      db->rollbackTransaction(t);
+      LOCALYTICS_WARNING(QString(QLatin1String("Failed to tag %1 events.")).arg(events.size()));
+    }
 }
 
 void LocalyticsSession::upload()
 {
-  if (LocalyticsUploader::sharedLocalyticsUploader()->isUploading())
+  if (QThread::currentThread() != thread())
+    {
+      QMetaObject::invokeMethod(this, "upload", Qt::QueuedConnection);
+      return;
+    }
+
+  // Stage events tagged on other threads with this upload.
+  flushEventBuffers();
+
+  if (_uploader->isUploading())
+    {
+      LOCALYTICS_DEBUG(QLatin1String("An upload is already in progress. Uploading again once it completes."));
+      _uploadScheduler->requestUpload();
+      return;
+    }
+  if (_uploader->isCircuitOpen())
     {
-      logMessage(QLatin1String("An upload is already in progress. Aborting."));
+      // Don't build and compress a payload the server can't take yet.
+      LOCALYTICS_DEBUG(QLatin1String("Uploads are suspended after repeated failures. Aborting."));
       return;
     }
 
   QString t(QLatin1String("stage_upload"));
-  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  LocalyticsDatabase *db = _database;
   bool success = db->beginTransaction(t);
 
   // - The event list for the current session is not modified
@@ -453,46 +767,56 @@ void LocalyticsSession::upload()
       db->releaseTransaction(t);
       
       // Move new flow events to the old flow event array.
-      if (_unstagedFlowEvents.length() > 0) 
+      _flow->markStaged();
+      
+      // Begin upload, in larger requests on Wi-Fi than on cellular
+      // networks, and at the rate configured for the network.
+      LocalyticsUploader *uploader = _uploader;
+      QString networkType = getNetworkType();
+      uploader->setMaxUploadBytes(_uploadScheduler->maxUploadBytes(networkType));
+      uploader->setMaxUploadRate(_uploadScheduler->maxUploadRate(networkType));
+      if (_headerInstallId.isEmpty())
         {
-          if (_stagedFlowEvents.length() > 0) 
-            {
-              _stagedFlowEvents.append(QLatin1Char(',')).append(_unstagedFlowEvents);
-            } 
-          else
-            {
-              _stagedFlowEvents = _unstagedFlowEvents;
-            }
-          _unstagedFlowEvents = QString(QLatin1String(""));
+          cacheHeaderFragments();
         }
-      
-      // Begin upload.
-      LocalyticsUploader::sharedLocalyticsUploader()->upload(_applicationKey, _enableHTTPS,  installationId());
+      uploader->upload(_applicationKey, _enableHTTPS, _headerInstallId);
     }
   else
     {
       db->rollbackTransaction(t);
-      logMessage(QLatin1String("Failed to start upload."));
+      LOCALYTICS_WARNING(QLatin1String("Failed to start upload."));
     }
 }
 
+/*!
+ @method scheduledUpload
+ @abstract Starts an upload requested by the upload scheduler.
+ */
+void LocalyticsSession::scheduledUpload()
+{
+  if (_hasInitialized == false)
+    return;
+
+  LOCALYTICS_DEBUG(QLatin1String("Starting scheduled upload."));
+  upload();
+}
+
 QString LocalyticsSession::libraryVersion()
 {
   return CLIENT_VERSION;
 }
 
-void LocalyticsSession::dequeueCloseEventBlobString()
+/*!
+ @method promoteProvisionalEvents
+ @abstract Stores the close and flow events of the previous session as events, once the background timeout
+ expired or a new session starts.  They stay provisional if this fails.
+ */
+void LocalyticsSession::promoteProvisionalEvents()
 {
-  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
-  QString closeEventString = db->dequeueCloseEventBlobString();
-  if (!closeEventString.isNull() && !closeEventString.isEmpty())
+  _backgroundTimer->stop();
+  if (!_database->promoteProvisionalEvents())
     {
-      bool success = db->addCloseEventWithBlobString(closeEventString);
-      if (!success)
-        {
-          // Re-queue the close event.
-          db->queueCloseEventWithBlobString(closeEventString);
-        }
+      LOCALYTICS_WARNING(QLatin1String("Failed to store the close event of the previous session."));
     }
 }
 
@@ -502,32 +826,32 @@ void LocalyticsSession::ll_open()
   if (_hasInitialized == false || // the session object has not yet initialized
       _isSessionOpen == true)  // session has already been opened
     {
-      logMessage(QLatin1String("Unable to open session."));
+      LOCALYTICS_DEBUG(QLatin1String("Unable to open session."));
       return;
     }
 
   if (ll_isOptedIn() == false)
     {
-      logMessage(QLatin1String("Can't open session because user is opted out."));
+      LOCALYTICS_DEBUG(QLatin1String("Can't open session because user is opted out."));
       return;
     }
   //TRY
   // If there is too much data on the disk, don't bother collecting any more.
-  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
-  if (db->databaseSize() > MAX_DATABASE_SIZE) 
+  LocalyticsDatabase *db = _database;
+  if (db->storageSize() > MAX_DATABASE_SIZE) 
     {
-      logMessage(QLatin1String("Database has exceeded the maximum size. Session not opened."));
+      LOCALYTICS_WARNING(QLatin1String("Database has exceeded the maximum size. Session not opened."));
       _isSessionOpen = false;
       return;
     }
 
-  this->dequeueCloseEventBlobString();
+  this->promoteProvisionalEvents();
+  refreshDimensions();
 
   _sessionActiveDuration = 0;
-  _sessionResumeTime = QDateTime::currentDateTime();
-  _unstagedFlowEvents = QString();
-  _stagedFlowEvents = QString();
-  _screens = QString();
+  _sessionResumeTime = LocalyticsClock::monotonicMSecs();
+  _sessionStartTime = LocalyticsClock::elapsedRealtimeMSecs();
+  _flow->clear();
 
   // Begin transaction for session open.
   QString t(QLatin1String("open_session"));
@@ -540,7 +864,7 @@ void LocalyticsSession::ll_open()
   QDateTime previousSessionStartTime = db->lastSessionStartTimestamp();
 
   // Save session start time.
-  _lastSessionStartTimestamp = _sessionResumeTime;
+  _lastSessionStartTimestamp = QDateTime::fromMSecsSinceEpoch(LocalyticsClock::currentMSecsSinceEpoch());
   if (success) 
     {
       success = db->setLastsessionStartTimestamp(_lastSessionStartTimestamp);
@@ -565,7 +889,7 @@ void LocalyticsSession::ll_open()
       openEventString.append(QLatin1Char('{'));
       openEventString.append(this->formatAttribute(PARAM_DATA_TYPE, QLatin1String("s"), true));
       openEventString.append(this->formatAttribute(PARAM_NEW_SESSION_UUID, _sessionUUID));
-      openEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg((double) _lastSessionStartTimestamp.toTime_t(), 0, 'f', 0)); // measured in seconds.
+      openEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg(LocalyticsClock::formatTime(_lastSessionStartTimestamp.toMSecsSinceEpoch(), _millisecondClientTime != 0))); // measured in seconds.
       openEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_NUMBER).arg(sessionNumber));
 
       double elapsedTime = 0.0;
@@ -577,8 +901,7 @@ void LocalyticsSession::ll_open()
       QString elapsedTimeString = QString(QLatin1String("%1")).arg(elapsedTime, 0, 'f', 0);
       openEventString.append(this->formatAttribute(PARAM_SESSION_ELAPSE_TIME, elapsedTimeString));
       
-      openEventString.append(this->customDimensions());
-      openEventString.append(this->locationDimensions());
+      openEventString.append(_dimensions);
       
       openEventString.append(QLatin1String("}\n"));
       success = db->addEventWithBlobString(openEventString);
@@ -589,13 +912,19 @@ void LocalyticsSession::ll_open()
       db->releaseTransaction(t);
       _isSessionOpen = true;
       _sessionHasBeenOpen = true;
-      logMessage(QLatin1String("Successfully opened session. UUID is: ") + _sessionUUID);
+      prepareCloseBlob();
+      LOCALYTICS_INFO(QLatin1String("Successfully opened session. UUID is: ") + _sessionUUID);
+      if (_prewarmConnection)
+        {
+          _uploader->prewarm(_enableHTTPS);
+        }
+      _uploadScheduler->lifecycleTransition();
     }
   else
     {
       db->rollbackTransaction(t);
       _isSessionOpen = false;
-      logMessage(QLatin1String("Failed to open session."));
+      LOCALYTICS_WARNING(QLatin1String("Failed to open session."));
     }
 
 }
@@ -608,84 +937,97 @@ void LocalyticsSession::reopenPreviousSession()
 {
   if (_sessionHasBeenOpen == false)
     {
-      logMessage(QLatin1String("Unable to reopen previous session, because a previous session was never opened."));
+      LOCALYTICS_DEBUG(QLatin1String("Unable to reopen previous session, because a previous session was never opened."));
       return;
     }
 
   // Record session resume time.
-  _sessionResumeTime = QDateTime::currentDateTime();
+  _sessionResumeTime = LocalyticsClock::monotonicMSecs();
 
-  //Remove close and flow events if they exist.
-  LocalyticsDatabase::sharedLocalyticsDatabase()->removeLastCloseAndFlowEvents();
+  // The close and flow events are still provisional, and the next
+  // close replaces them, so nothing needs to be removed.
+  prepareCloseBlob();
   _isSessionOpen = true;
 }
 
+/*!
+ @method prepareCloseBlob
+ @abstract Builds the part of the close blob which doesn't change until the session closes: its type, the
+ session's UUID, a fresh UUID for the blob and the session's start time.
+ */
+void LocalyticsSession::prepareCloseBlob()
+{
+  _closeBlobHead = QString(QLatin1Char('{'));
+  _closeBlobHead.append(formatAttribute(PARAM_DATA_TYPE, QLatin1String("c"), true));
+  _closeBlobHead.append(formatAttribute(PARAM_SESSION_UUID, _sessionUUID));
+  _closeBlobHead.append(formatAttribute(PARAM_UUID, randomUUID()));
+  _closeBlobHead.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_START).arg((double) _lastSessionStartTimestamp.toTime_t(), 0, 'f', 0));
+}
+
+/*!
+ @method refreshDimensions
+ @abstract Reads the custom dimensions and the location again, when the session starts and when the
+ database reports they changed, so that events and the close blob don't query them each time.
+ */
+void LocalyticsSession::refreshDimensions()
+{
+  _dimensions = customDimensions() + locationDimensions();
+}
+
 /*!
  @method addFlowEvent
  @abstract Adds a simple key-value pair to the list of events tagged during this session.
  @param name The name of the tagged event.
- @param eventType A key representing the type of the tagged event. Either "s" for Screen or "e" for Event.
+ @param type Whether the entry is a screen or an event.
  */
-void LocalyticsSession::addFlowEvent(const QString &name, const QString& eventType)
+void LocalyticsSession::addFlowEvent(const QString &name, LocalyticsFlowType type)
 {
-    if (name.isEmpty() || eventType.isEmpty())
-        return;
-//
-//    // Format new event as simple key-value dictionary.
-//    QString eventString = formatAttribute(eventType, escapeString(name), true);
-//
-//    // Flow events are uploaded as a sequence of key-value pairs. Wrap the above in braces and append to the list.
-//    BOOL previousFlowEvents = self.unstagedFlowEvents.length > 0;
-//    if (previousFlowEvents) {
-//        [self.unstagedFlowEvents appendString:@","];
-//    }
-//    [self.unstagedFlowEvents appendFormat:@"{%@}", eventString];
+  if (name.isEmpty())
+    return;
+
+  // Names are escaped once, the first time they are seen.
+  int id = _flow->lookup(type, name);
+  if (id < 0)
+    {
+      id = _flow->intern(type, name, escapeString(name.left(FLOW_MAX_NAME_LENGTH)));
+    }
+  if (id < 0)
+    {
+      _flow->dropName();
+      return;
+    }
+  _flow->append(id);
 }
 
 
 /*!
  @method blobHeaderStringWithSequenceNumber:
  @abstract Creates the JSON string for the upload blob header, substituting in the given upload sequence number.
+ Only the sequence number, the UUID, the network type and the available memory change between uploads; the
+ rest of the header is built once by cacheHeaderFragments.
  @param  nextSequenceNumber The sequence number for the current upload attempt.
  @return The upload header JSON blob.
  */
 QString LocalyticsSession::blobHeaderStringWithSequenceNumber(int nextSequenceNumber)
 {
-  QString headerString;
+  if (_headerAttributes.isEmpty())
+    {
+      cacheHeaderFragments();
+    }
 
-  QString uuid = this->randomUUID();
-  QString device_uuid = this->uniqueDeviceIdentifier();
-  QLocale locale = QLocale::system();
-  QString device_language = QLocale::languageToString(locale.language());
-  QString locale_country = QLocale::countryToString(locale.country());
+  QString headerString;
+  headerString.reserve(_headerPersistedAt.length() + _headerAttributes.length() + _headerLocale.length() + 160);
 
   // Open first level - blob information
   headerString.append(QLatin1Char('{'));
   headerString.append(QString(QLatin1String("\"%1\":%2")).arg(PARAM_SEQUENCE_NUMBER).arg(nextSequenceNumber));
-  headerString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_PERSISTED_AT).arg((double) LocalyticsDatabase::sharedLocalyticsDatabase()->createdTimestamp().toTime_t(),0,'f', 0));
+  headerString.append(_headerPersistedAt);
   headerString.append(formatAttribute(PARAM_DATA_TYPE, QLatin1String("h")));
-  headerString.append(formatAttribute(PARAM_UUID, uuid));
+  headerString.append(formatAttribute(PARAM_UUID, this->randomUUID()));
 
   // Open second level - blob header attributes
   headerString.append(QString(QLatin1String(",\"%1\":{")).arg(PARAM_ATTRIBUTES));
-  headerString.append(formatAttribute(PARAM_DATA_TYPE, QLatin1String("a"), true));
-
-  // >>  Application and session information
-  headerString.append(formatAttribute(PARAM_INSTALL_ID, installationId()));
-  headerString.append(formatAttribute(PARAM_APP_KEY, _applicationKey));
-  headerString.append(formatAttribute(PARAM_APP_VERSION, appVersion()));
-  headerString.append(formatAttribute(PARAM_LIBRARY_VERSION, libraryVersion()));
-
-  // >>  Device Information
-  if (!device_uuid.isEmpty())
-  {
-    headerString.append(formatAttribute(PARAM_DEVICE_UUID_HASHED, hashString(device_uuid)));
-  }
-
-  headerString.append(formatAttribute(PARAM_DEVICE_MANUFACTURER, QLatin1String("RIM")));
-  headerString.append(formatAttribute(PARAM_DEVICE_PLATFORM, QLatin1String("BlackBerry10")));
-  headerString.append(formatAttribute(PARAM_DEVICE_OS_VERSION, systemVersion()));
-  headerString.append(formatAttribute(PARAM_DEVICE_MODEL, deviceModel()));
+  headerString.append(_headerAttributes);
   headerString.append(formatAttribute(PARAM_DATA_CONNECTION_TYPE, getNetworkType()));
 
   qint64 availableMemoryBytes = availableMemory();
@@ -693,10 +1035,7 @@ QString LocalyticsSession::blobHeaderStringWithSequenceNumber(int nextSequenceNu
     {
       headerString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_DEVICE_MEMORY).arg(availableMemoryBytes));
     }
-  headerString.append(formatAttribute(PARAM_LOCALE_LANGUAGE, device_language));
-  headerString.append(formatAttribute(PARAM_LOCALE_COUNTRY, locale_country));
-  //headerString.append(formatAttribute(PARAM_DEVICE_COUNTRY, [locale objectForKey:NSLocaleCountryCode]));
-  headerString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_JAILBROKEN).arg(isDeviceJailbroken() ? QLatin1String("true") : QLatin1String("false")));
+  headerString.append(_headerLocale);
 
   //  Close second level - attributes
   headerString.append(QLatin1Char('}'));
@@ -705,9 +1044,50 @@ QString LocalyticsSession::blobHeaderStringWithSequenceNumber(int nextSequenceNu
   return headerString;
 }
 
+/*!
+ @method cacheHeaderFragments
+ @abstract Builds the parts of the upload header which stay the same for the life of the session: the
+ database's creation time, the application and device information before the network type, and the
+ locale after the available memory.  They are rebuilt when the session is initialized with an app key.
+ */
+void LocalyticsSession::cacheHeaderFragments()
+{
+  QString device_uuid = this->uniqueDeviceIdentifier();
+  QLocale locale = QLocale::system();
+  QString device_language = QLocale::languageToString(locale.language());
+  QString locale_country = QLocale::countryToString(locale.country());
+
+  _headerPersistedAt = QString(QLatin1String(",\"%1\":%2")).arg(PARAM_PERSISTED_AT).arg((double) _database->createdTimestamp().toTime_t(),0,'f', 0);
+
+  _headerAttributes = formatAttribute(PARAM_DATA_TYPE, QLatin1String("a"), true);
+
+  // >>  Application and session information
+  _headerInstallId = installationId();
+  _headerAttributes.append(formatAttribute(PARAM_INSTALL_ID, _headerInstallId));
+  _headerAttributes.append(formatAttribute(PARAM_APP_KEY, _applicationKey));
+  _headerAttributes.append(formatAttribute(PARAM_APP_VERSION, appVersion()));
+  _headerAttributes.append(formatAttribute(PARAM_LIBRARY_VERSION, libraryVersion()));
+
+  // >>  Device Information
+  if (!device_uuid.isEmpty())
+  {
+    _headerAttributes.append(formatAttribute(PARAM_DEVICE_UUID_HASHED, hashString(device_uuid)));
+  }
+
+  _headerAttributes.append(formatAttribute(PARAM_DEVICE_MANUFACTURER, QLatin1String("RIM")));
+  _headerAttributes.append(formatAttribute(PARAM_DEVICE_PLATFORM, QLatin1String("BlackBerry10")));
+  _headerAttributes.append(formatAttribute(PARAM_DEVICE_OS_VERSION, systemVersion()));
+  _headerAttributes.append(formatAttribute(PARAM_DEVICE_MODEL, deviceModel()));
+
+  _headerLocale = formatAttribute(PARAM_LOCALE_LANGUAGE, device_language);
+  _headerLocale.append(formatAttribute(PARAM_LOCALE_COUNTRY, locale_country));
+  //_headerLocale.append(formatAttribute(PARAM_DEVICE_COUNTRY, [locale objectForKey:NSLocaleCountryCode]));
+  _headerLocale.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_JAILBROKEN).arg(isDeviceJailbroken() ? QLatin1String("true") : QLatin1String("false")));
+}
+
 bool LocalyticsSession::ll_isOptedIn()
 {
-  return LocalyticsDatabase::sharedLocalyticsDatabase()->isOptedOut() == false;
+  return _database->isOptedOut() == false;
 }
 
 /*!
@@ -725,56 +1105,73 @@ bool LocalyticsSession::createOptEvent(bool optState)
   //this actually transmits the opposite of the opt state. The JSON contains whether the user is opted out, not whether the user is opted in.
   optEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_OPT_VALUE).arg(optState ? QLatin1String("false") : QLatin1String("true")));
 
-  optEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg((double) QDateTime::currentDateTime().toTime_t(), 0, 'f', 0));
+  optEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_CLIENT_TIME).arg(LocalyticsClock::clientTime(_millisecondClientTime != 0)));
   optEventString.append(QLatin1String("}\n"));
 
-  bool success = LocalyticsDatabase::sharedLocalyticsDatabase()->addEventWithBlobString(optEventString);
+  bool success = _database->addEventWithBlobString(optEventString);
   return success;
 }
 
 /*
   @method saveApplicationFlowAndRemoveOnResume:
-  @abstract Constructs an application flow blob string and writes it to the database, optionally flagging it for deletion
-  if the session is resumed.
-  @param removeOnResume YES if the application flow blob should be deleted if the session is resumed.
+  @abstract Constructs an application flow blob string and writes it to the database, optionally keeping it
+  provisional until the session can no longer be resumed.
+  @param removeOnResume YES if the application flow blob should be replaced if the session is resumed.
   @return YES if the application flow event was written to the database successfully.
 */
 bool LocalyticsSession::saveApplicationFlowAndRemoveOnResume(bool removeOnResume)
 {
-  bool success = true;
-  
+  QString flowEventString = flowEventBlobString();
+
   // If there are no new events, then there is nothing additional to save.
-  if (_unstagedFlowEvents.length())
-    {
-      // Flows are uploaded as a distinct blob type containing
-      // arrays of new and previously-uploaded event and screen
-      // names. Write a flow event to the database.
-      QString flowEventString;
-      
-      // Open first level - flow blob event
-      flowEventString.append(QLatin1Char('{'));
-      flowEventString.append(formatAttribute(PARAM_DATA_TYPE, QLatin1String("f"), true));
-      flowEventString.append(formatAttribute(PARAM_UUID, randomUUID()));
-      flowEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_START).arg((double) _lastSessionStartTimestamp.toTime_t(), 0, 'f', 0));
-      
-      // Open second level - new flow events
-      flowEventString.append(QString(QLatin1String(",\"%1\":[")).arg(PARAM_NEW_FLOW_EVENTS));
-      flowEventString.append(_unstagedFlowEvents); // Flow events are escaped in |-addFlowEventWithName:|
-      // Close second level - new flow events
-      flowEventString.append(QLatin1Char(']'));
-      
-      // Open second level - old flow events
-      flowEventString.append(QString(QLatin1String(",\"%1\":[")).arg(PARAM_OLD_FLOW_EVENTS));
-      flowEventString.append(_stagedFlowEvents);
-      // Close second level - old flow events
-      flowEventString.append(QLatin1Char(']'));
-      
-      // Close first level - flow blob event
-      flowEventString.append(QString(QLatin1String("}\n")));
-      
-      success = LocalyticsDatabase::sharedLocalyticsDatabase()->addFlowEventWithBlobString(flowEventString);
-    }
-  return success;
+  if (flowEventString.isEmpty())
+    return true;
+
+  if (removeOnResume)
+    return _database->queueFlowEventWithBlobString(flowEventString);
+
+  // The new entries of a provisional flow event are still new here, so
+  // it is cleared along with this write rather than stored later.
+  return _database->addEventWithBlobString(flowEventString)
+    && _database->queueFlowEventWithBlobString(QString());
+}
+
+/*
+  @method flowEventBlobString
+  @abstract Constructs the application flow blob string.
+  @return The flow blob, or a null string if there are no new flow events.
+*/
+QString LocalyticsSession::flowEventBlobString()
+{
+  QString flowEventString;
+  if (!_flow->hasUnstaged())
+    return flowEventString;
+
+  // Flows are uploaded as a distinct blob type containing
+  // arrays of new and previously-uploaded event and screen
+  // names.
+
+  // Open first level - flow blob event
+  flowEventString.append(QLatin1Char('{'));
+  flowEventString.append(formatAttribute(PARAM_DATA_TYPE, QLatin1String("f"), true));
+  flowEventString.append(formatAttribute(PARAM_UUID, randomUUID()));
+  flowEventString.append(QString(QLatin1String(",\"%1\":%2")).arg(PARAM_SESSION_START).arg((double) _lastSessionStartTimestamp.toTime_t(), 0, 'f', 0));
+
+  // Open second level - new flow events
+  flowEventString.append(QString(QLatin1String(",\"%1\":[")).arg(PARAM_NEW_FLOW_EVENTS));
+  flowEventString.append(_flow->unstagedEntries()); // Flow events are escaped in |addFlowEvent|
+  // Close second level - new flow events
+  flowEventString.append(QLatin1Char(']'));
+
+  // Open second level - old flow events
+  flowEventString.append(QString(QLatin1String(",\"%1\":[")).arg(PARAM_OLD_FLOW_EVENTS));
+  flowEventString.append(_flow->stagedEntries());
+  // Close second level - old flow events
+  flowEventString.append(QLatin1Char(']'));
+
+  // Close first level - flow blob event
+  flowEventString.append(QString(QLatin1String("}\n")));
+  return flowEventString;
 }
 
 
@@ -816,15 +1213,6 @@ QString LocalyticsSession::escapeString(const QString input)
 }
 
 
-void LocalyticsSession::logMessage(QString msg)
-{
-  if (DO_LOCALYTICS_LOGGING)
-    {
-      qDebug() << "(localytics) " <<  msg;
-    }
-}
-
-
 /*!
   @method customDimensions
   @abstract Returns the json blob containing the custom dimensions. Assumes this will be appended
@@ -836,7 +1224,7 @@ QString LocalyticsSession::customDimensions()
   
   for(int i=0; i <4; i++)
     {
-      QString dimension = LocalyticsDatabase::sharedLocalyticsDatabase()->customDimension(i);
+      QString dimension = _database->customDimension(i);
       if (!dimension.isEmpty())
         {
           dimensions.append(QString(QLatin1String(",\"c%1\":\"%2\"")).arg(i).arg(dimension));
@@ -899,7 +1287,7 @@ QString LocalyticsSession::installationId()
   // If it hasn't been found yet, generate a new one.
   if (installId.isEmpty())
     {
-      logMessage(QLatin1String("Install ID not find one in database, generating a new one."));
+      LOCALYTICS_DEBUG(QLatin1String("Install ID not find one in database, generating a new one."));
       installId = randomUUID();
       // Store the newly generated installId
       settings.setValue(PREFERENCES_KEY, installId);
@@ -980,9 +1368,9 @@ QString LocalyticsSession::deviceModel()
 {
 #ifdef __QNXNTO__
   bb::device::HardwareInfo info;
-  qDebug() << info.modelName(); //"BlackBerry 10 Dev Alpha"
-  qDebug() << info.modelNumber(); //"STL100-1"
-  qDebug() << info.hardwareId(); //"0x04002607"
+  LOCALYTICS_DEBUG(info.modelName()); //"BlackBerry 10 Dev Alpha"
+  LOCALYTICS_DEBUG(info.modelNumber()); //"STL100-1"
+  LOCALYTICS_DEBUG(info.hardwareId()); //"0x04002607"
   return info.modelName();
 #else
   return QLatin1String("unknown");
@@ -33,25 +33,120 @@
 
 
 #include <QObject>
+#include <QAtomicInt>
 #include <QDateTime>
+#include <QHash>
+#include <QMutex>
 #include <QVariantMap>
 
-// Set this to true to enable localytics traces (useful for debugging)
-#define DO_LOCALYTICS_LOGGING true
+class LocalyticsDatabase;
+class LocalyticsEventBuffers;
+class LocalyticsFlowRing;
+class LocalyticsUploader;
+class LocalyticsUploadScheduler;
+class QTimer;
 
+#define EVENT_MAX_ATTRIBUTES     50    // Attributes and report attributes kept per event
+#define EVENT_MAX_NAME_BYTES     128   // UTF-8 bytes kept of an event name
+#define EVENT_MAX_KEY_BYTES      128   // UTF-8 bytes kept of an attribute key
+#define EVENT_MAX_VALUE_BYTES    255   // UTF-8 bytes kept of an attribute value
+#define EVENT_MAX_BYTES          4096  // UTF-8 bytes of an event's name, keys and values together
+
+/*
+  Kind of an entry of the session's flow: "e" for a tagged event, "s"
+  for a screen.
+*/
+enum LocalyticsFlowType
+{
+  LocalyticsFlowEvent,
+  LocalyticsFlowScreen
+};
+
+/*!
+  Limits on what tagEvent() stores of an event.  Lengths are counted
+  in UTF-8 bytes before escaping, and never split a character.
+
+  A name, key or value over its limit is cut.  Attributes past
+  maxAttributes, and attributes which would take the event over
+  maxEventBytes, are dropped; attributes are taken in the order of
+  their keys, attributes before report attributes.
+*/
+struct LocalyticsEventLimits
+{
+  LocalyticsEventLimits() :
+    maxAttributes(EVENT_MAX_ATTRIBUTES), maxNameBytes(EVENT_MAX_NAME_BYTES), maxKeyBytes(EVENT_MAX_KEY_BYTES),
+    maxValueBytes(EVENT_MAX_VALUE_BYTES), maxEventBytes(EVENT_MAX_BYTES) {}
+
+  int maxAttributes;
+  int maxNameBytes;
+  int maxKeyBytes;
+  int maxValueBytes;
+  int maxEventBytes;
+};
+
+/*!
+  What the limits cut from tagged events.
+*/
+struct LocalyticsEventStats
+{
+  LocalyticsEventStats() :
+    events(0), truncatedEvents(0), truncatedNames(0), truncatedKeys(0),
+    truncatedValues(0), droppedAttributes(0) {}
+
+  qint64 events;            // Events tagged
+  qint64 truncatedEvents;   // Events of which anything was cut or dropped
+  qint64 truncatedNames;    // Event names cut
+  qint64 truncatedKeys;     // Attribute keys cut
+  qint64 truncatedValues;   // Attribute values cut
+  qint64 droppedAttributes; // Attributes dropped
+};
+
+/*!
+  The public API may be called from any thread.  The session, the
+  database and the uploader belong to the thread which first calls
+  sharedLocalyticsSession(), which must run an event loop for as long
+  as they are used, normally the main thread.  Calls from other
+  threads are carried out on that thread: tagEvent() buffers the event
+  and returns straight away, resume() and isOptedIn() wait for the
+  result, and the others are queued.
+*/
 class LocalyticsSession : public QObject
 {
     Q_OBJECT
 public:
     explicit LocalyticsSession(QObject *parent = 0);
+    ~LocalyticsSession();
     friend class SessionTest;
+    friend class BenchmarkTest;
     
     static LocalyticsSession* sharedLocalyticsSession() {
+        QMutexLocker locker(&_sharedLock);
         if (!_sharedLocalyticsSession) {
             _sharedLocalyticsSession = new LocalyticsSession;
         }
         return _sharedLocalyticsSession;
     }
+
+  /*!
+    A session of its own for one application key, for processes in
+    which several modules are instrumented with different keys.
+
+    The shared session keeps a single database and wipes it whenever
+    it is initialized with another key.  Each session returned here
+    instead stores its data in a database file of its own, see
+    LocalyticsDatabase::databaseForAppKey(), and uploads it with its
+    own scheduler.  Their uploaders belong to the
+    LocalyticsUploaderPool, so they share its connections and upload
+    rate.
+
+    The session is created, and initialized with `appKey`, on the
+    first call for the key.  Later calls return the same session.
+
+    \param appKey The key unique for each application
+    generated at http://www.localytics.com
+    \return The session of `appKey`.
+  */
+  static LocalyticsSession* sessionForAppKey(const QString &appKey);
   /*!
     Initializes the Localytics Object. Not necessary if you choose to
     use startSession().
@@ -59,7 +154,7 @@ public:
     \param appKey The key unique for each application
     generated at http://www.localytics.com
   */
-  void init(QString appKey);
+  Q_INVOKABLE void init(QString appKey);
 
   /*!  
     An optional convenience initialize method that also calls the
@@ -88,7 +183,7 @@ public:
     
     \param optedIn `true` if the user is opted in, `false` otherwise.
   */
-  void setOptIn(bool optedIn);
+  Q_INVOKABLE void setOptIn(bool optedIn);
   
   /*!
     (OPTIONAL) Whether or not this user has is opted in or out.
@@ -102,7 +197,7 @@ public:
 
     \result `true` if the user is opted in, `false` otherwise.
   */
-  bool isOptedIn();
+  Q_INVOKABLE bool isOptedIn();
   
   /*!
     Opens the Localytics session. Not necessary if you choose to
@@ -117,10 +212,12 @@ public:
 
     If for any reason this is called more than once every subsequent
     open call will be ignored.
+
+    Data recorded so far is uploaded if automatic uploads are enabled.
     
     \sa close()
   */
-  void open();
+  Q_INVOKABLE void open();
   
   /*!
     Resumes the Localytics session. 
@@ -136,7 +233,7 @@ public:
     was started (`false`). If the user has opted out of analytics then the
     return from this method is undefined.
   */
-  bool resume();
+  Q_INVOKABLE bool resume();
 
   /*!
     Closes the Localytics session.
@@ -147,8 +244,10 @@ public:
     events will be processed and the session time will not appear. This is
     because the session is not yet closed so it should not be used in
     comparison with sessions which are closed.
+
+    Data recorded so far is uploaded if automatic uploads are enabled.
   */
-  void close();
+  Q_INVOKABLE void close();
 
   /*!
     Creates a low priority thread which uploads any Localytics data already stored 
@@ -159,8 +258,42 @@ public:
     complete.  It is also reasonable to upload again when the
     application is exiting because if the upload is cancelled the data
     will just get uploaded the next time the app comes up.
+
+    If an upload is already running, another one starts as soon as it
+    completes.
   */
-  void upload();
+  Q_INVOKABLE void upload();
+
+  /*!
+    (OPTIONAL) The scheduler which uploads data automatically, based
+    on how much has been recorded and how long it has waited.  Call
+    `uploadScheduler()->setEnabled(true)` to have uploads happen
+    without calling upload().
+
+    It also picks the largest request size, which is larger on Wi-Fi
+    than on cellular networks.
+  */
+  LocalyticsUploadScheduler *uploadScheduler() {
+    return _uploadScheduler;
+  }
+
+  /*!
+    (OPTIONAL) Whether to connect to the upload server as soon as the
+    session opens, so that the first upload doesn't wait for the DNS
+    lookup, TCP connect and TLS handshake.  Off by default.
+
+    \param prewarm `true` to connect when the session opens.
+  */
+  Q_INVOKABLE void setConnectionPrewarming(bool prewarm);
+
+  /*!
+    (OPTIONAL) Whether the client time of events keeps milliseconds,
+    as a fraction of a second.  Off by default.  Set it before tagging
+    events on other threads.
+
+    \param milliseconds `true` to keep milliseconds.
+  */
+  void setMillisecondClientTime(bool milliseconds);
 
   /*!
    Allows a session to tag a particular event as having occurred.
@@ -183,26 +316,70 @@ public:
    </ul>
    <br>
    See the tagging guide at: http://wiki.localytics.com/
+
+   Events tagged on other threads than the session's are kept in a
+   buffer per thread, and stored in the order they were tagged once
+   the session's thread gets to them.  They are dropped if the session
+   is not open by then.
+
+   Names, attributes and their lengths are limited, see
+   setEventLimits().
    \param event The name of the event which occurred.
    */
   void tagEvent(const QString &event);
   void tagEvent(const QString &event, const QVariantMap &attributes);
   void tagEvent(const QString &event, const QVariantMap &attributes, const QVariantMap &reportAttributes);
 
+  /*!
+    (OPTIONAL) Limits what is stored of each tagged event, so that one
+    oversized event can't take a large share of the database.
+
+    \param limits The limits, see LocalyticsEventLimits for the defaults.
+  */
+  void setEventLimits(const LocalyticsEventLimits &limits);
+  LocalyticsEventLimits eventLimits() const;
+
+  /*!
+    \return What the limits cut from the events tagged since the
+    session was created or the stats were last reset.
+  */
+  LocalyticsEventStats eventStats() const;
+  void resetEventStats();
+
+  /*!
+   Records that the user went to a screen of the application, for the
+   session's screen flow.
+
+   Only the latest screens and events of a session are kept, see
+   LocalyticsFlowRing for the limits.  Screens tagged while the
+   session is not open are ignored.
+   \param screen The name of the screen.
+   */
+  Q_INVOKABLE void tagScreen(const QString &screen);
+
   bool hasInitialized() {
     return _hasInitialized;
   }
   bool saveApplicationFlowAndRemoveOnResume(bool removeOnResume);
 
+private slots:
+  void scheduledUpload();
+  void flushEventBuffers();
+  void refreshDimensions();
+  void promoteProvisionalEvents();
+
 private:
-  void logMessage(QString msg);
+
+  LocalyticsSession(LocalyticsDatabase *database, LocalyticsUploader *uploader, QObject *parent = 0);
 
   /* Private methods. */
+  void setUp(LocalyticsDatabase *database, LocalyticsUploader *uploader);
   void ll_open();
   void reopenPreviousSession();
-  void addFlowEvent(const QString &name, const QString& eventType);
-  //void addScreenWithName(QString);
+  void prepareCloseBlob();
+  void addFlowEvent(const QString &name, LocalyticsFlowType type);
   QString blobHeaderStringWithSequenceNumber(int nextSequenceNumber);
+  void cacheHeaderFragments();
   bool ll_isOptedIn();
 
 // Datapoint methods.
@@ -213,7 +390,10 @@ private:
   QString escapeString(QString input);
   QString installationId();
   QString libraryVersion(); /*! Localytics lib version */
-  void dequeueCloseEventBlobString();
+  QString flowEventBlobString();
+  void appendAttributes(QString *blob, const QString &param, const QVariantMap &attributes,
+                        const LocalyticsEventLimits &limits, int *attributeCount, int *eventBytes,
+                        LocalyticsEventStats *truncations);
   QString formatAttribute(QString name, QString value, bool firstAttribute);
   QString formatAttribute(QString name, QString value);
   bool createOptEvent(bool optState);
@@ -235,15 +415,30 @@ private:
   QString _sessionUUID;
   QString _applicationKey;
   QDateTime _lastSessionStartTimestamp;
-  QDateTime _sessionResumeTime;
-  QDateTime _sessionCloseTime;
-  QString _unstagedFlowEvents;
-  QString _stagedFlowEvents;
-  QString _screens;
-  qint64 _sessionActiveDuration; // seconds
+  qint64 _sessionStartTime; // elapsed realtime milliseconds
+  qint64 _sessionResumeTime; // monotonic milliseconds
+  qint64 _sessionCloseTime; // elapsed realtime milliseconds, -1 while open
+  QAtomicInt _millisecondClientTime; // bool, read by every thread tagging events
+  LocalyticsFlowRing *_flow;
+  QString _closeBlobHead;
+  QString _dimensions;
+  QString _headerPersistedAt;
+  QString _headerAttributes;
+  QString _headerLocale;
+  QString _headerInstallId;
+  qint64 _sessionActiveDuration; // milliseconds
   bool _sessionHasBeenOpen;
   quint32 _sessionNumber;
+  LocalyticsDatabase *_database;
+  LocalyticsUploader *_uploader;
+  LocalyticsUploadScheduler *_uploadScheduler;
+  QTimer *_backgroundTimer;
+  bool _prewarmConnection;
+  LocalyticsEventBuffers *_eventBuffers;
+  QAtomicInt _flushScheduled;
   static LocalyticsSession *_sharedLocalyticsSession;
+  static QHash<QString, LocalyticsSession *> _sessions;
+  static QMutex _sharedLock;
 
 };
 
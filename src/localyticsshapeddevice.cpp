@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsshapeddevice.h"
+#include <QtCore/QTimer>
+
+LocalyticsTokenBucket::LocalyticsTokenBucket() :
+  _rate(0),
+  _capacity(0),
+  _tokens(0)
+{
+}
+
+void LocalyticsTokenBucket::setRate(qint64 bytesPerSecond)
+{
+  if (bytesPerSecond == _rate)
+    return;
+
+  _rate = qMax((qint64) 0, bytesPerSecond);
+  _capacity = qMax((qint64) 1, qMin(_rate, (qint64) SHAPING_MAX_BURST_BYTES));
+  _tokens = _capacity;
+  _refilled.start();
+}
+
+qint64 LocalyticsTokenBucket::rate() const
+{
+  return _rate;
+}
+
+qint64 LocalyticsTokenBucket::available()
+{
+  if (_rate == 0)
+    return Q_INT64_C(0x7fffffffffffffff);
+
+  refill();
+  return (qint64) _tokens;
+}
+
+void LocalyticsTokenBucket::consume(qint64 bytes)
+{
+  if (_rate == 0)
+    return;
+
+  refill();
+  _tokens = qMax(0.0, _tokens - bytes);
+}
+
+int LocalyticsTokenBucket::refillTime()
+{
+  if (_rate == 0)
+    return 0;
+
+  refill();
+  return (int) ((_capacity - _tokens) * 1000 / _rate) + 1;
+}
+
+void LocalyticsTokenBucket::refill()
+{
+  qint64 elapsed = _refilled.restart();
+  _tokens = qMin((double) _capacity, _tokens + (double) elapsed * _rate / 1000);
+}
+
+
+LocalyticsShapedDevice::LocalyticsShapedDevice(QIODevice *body, LocalyticsTokenBucket *bucket, QObject *parent) :
+  QIODevice(parent),
+  _body(body),
+  _bucket(bucket)
+{
+  _body->setParent(this);
+  _refillTimer = new QTimer(this);
+  _refillTimer->setSingleShot(true);
+  connect(_refillTimer, SIGNAL(timeout()), this, SIGNAL(readyRead()));
+}
+
+bool LocalyticsShapedDevice::open(OpenMode mode)
+{
+  if ((mode & QIODevice::WriteOnly) || !_body->isOpen())
+    {
+      return false;
+    }
+  return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+bool LocalyticsShapedDevice::isSequential() const
+{
+  return false;
+}
+
+qint64 LocalyticsShapedDevice::size() const
+{
+  return _body->size();
+}
+
+bool LocalyticsShapedDevice::seek(qint64 pos)
+{
+  return _body->seek(pos) && QIODevice::seek(pos);
+}
+
+qint64 LocalyticsShapedDevice::readData(char *data, qint64 maxSize)
+{
+  qint64 allowed = qMin(maxSize, _bucket->available());
+  if (allowed <= 0)
+    {
+      // Nothing may be sent until the bucket has filled up again.
+      if (!_refillTimer->isActive())
+        {
+          _refillTimer->start(_bucket->refillTime());
+        }
+      return 0;
+    }
+
+  qint64 read = _body->read(data, allowed);
+  if (read > 0)
+    {
+      _bucket->consume(read);
+    }
+  else if (read < 0)
+    {
+      setErrorString(_body->errorString());
+    }
+  return read;
+}
+
+qint64 LocalyticsShapedDevice::writeData(const char *, qint64)
+{
+  return -1;
+}
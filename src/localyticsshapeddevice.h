@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSSHAPEDDEVICE_H
+#define LOCALYTICSSHAPEDDEVICE_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QIODevice>
+
+#define SHAPING_MAX_BURST_BYTES 16384   // Most bytes a shaped upload sends at once after being idle
+
+class QTimer;
+
+/*!
+  Token bucket limiting how fast upload bytes are sent.
+
+  Tokens accrue at rate() bytes per second, up to one second's worth
+  or SHAPING_MAX_BURST_BYTES, whichever is smaller, and each byte sent
+  takes one.
+*/
+class LocalyticsTokenBucket
+{
+  public:
+  LocalyticsTokenBucket();
+
+  /*!
+    \param bytesPerSecond Upload rate, or 0 for no limit.  The bucket
+    starts out full.
+  */
+  void setRate(qint64 bytesPerSecond);
+  qint64 rate() const;
+
+  /*!
+    \return The number of bytes which may be sent now.
+  */
+  qint64 available();
+
+  /*!
+    Takes the tokens of `bytes` bytes which were sent.
+  */
+  void consume(qint64 bytes);
+
+  /*!
+    \return Milliseconds until the bucket is full again.
+  */
+  int refillTime();
+
+  private:
+  void refill();
+
+  qint64 _rate;
+  qint64 _capacity;
+  double _tokens;
+  QElapsedTimer _refilled;
+};
+
+/*!
+  Request body which is read no faster than a LocalyticsTokenBucket
+  allows.
+
+  The device wraps the body built by the uploader.  When the bucket is
+  empty, reads return no data and readyRead() is emitted once it has
+  filled up again, so the network layer sends the body at the shaped
+  rate instead of as fast as the link allows.
+*/
+class LocalyticsShapedDevice : public QIODevice
+{
+  Q_OBJECT
+  public:
+  /*!
+    \param body The body to send, open for reading.  The device takes
+    ownership of it.
+    \param bucket The bucket limiting the rate, shared by every request
+    in flight.  It must outlive the device.
+    \param parent Parent object to retain ownership.
+  */
+  LocalyticsShapedDevice(QIODevice *body, LocalyticsTokenBucket *bucket, QObject *parent = 0);
+
+  bool open(OpenMode mode);
+  bool isSequential() const;
+  qint64 size() const;
+  bool seek(qint64 pos);
+
+  protected:
+  qint64 readData(char *data, qint64 maxSize);
+  qint64 writeData(const char *data, qint64 maxSize);
+
+  private:
+  QIODevice *_body;
+  LocalyticsTokenBucket *_bucket;
+  QTimer *_refillTimer;
+};
+
+#endif // LOCALYTICSSHAPEDDEVICE_H
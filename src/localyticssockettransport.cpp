@@ -0,0 +1,625 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticssockettransport.h"
+#include "localyticsspooldevice.h"
+#include "localyticsuploaddevice.h"
+#include <QtCore/QIODevice>
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QTimer>
+#include <QtNetwork/QTcpSocket>
+#ifndef QT_NO_OPENSSL
+#include <QtNetwork/QSslSocket>
+#endif
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#endif
+
+LocalyticsSocketConnection::LocalyticsSocketConnection(const QUrl &url, QObject *parent) :
+  QObject(parent),
+  _scheme(url.scheme().toLower()),
+  _host(url.host()),
+  _port(url.port(_scheme == QLatin1String("https") ? 443 : 80)),
+  _writeNotifier(0),
+  _ready(false),
+  _request(0),
+  _completing(false),
+  _body(0),
+  _streaming(false),
+  _segmentOffset(0),
+  _buffered(0),
+  _bytesSent(0)
+{
+#ifndef QT_NO_OPENSSL
+  if (_scheme == QLatin1String("https"))
+    {
+      _socket = new QSslSocket(this);
+      connect(_socket, SIGNAL(encrypted()), this, SLOT(socketReady()));
+    }
+  else
+#endif
+    {
+      _socket = new QTcpSocket(this);
+      connect(_socket, SIGNAL(connected()), this, SLOT(socketReady()));
+    }
+  // Only emitted for data written through the socket's own buffer.
+  connect(_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(socketBytesWritten(qint64)));
+  connect(_socket, SIGNAL(readyRead()), this, SLOT(readResponse()));
+  connect(_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError()));
+  connect(_socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
+}
+
+bool LocalyticsSocketConnection::matches(const QUrl &url) const
+{
+  QString scheme = url.scheme().toLower();
+  return scheme == _scheme
+    && url.host() == _host
+    && url.port(scheme == QLatin1String("https") ? 443 : 80) == _port;
+}
+
+bool LocalyticsSocketConnection::isBusy() const
+{
+  return _request != 0;
+}
+
+int LocalyticsSocketConnection::request() const
+{
+  return _request;
+}
+
+bool LocalyticsSocketConnection::isOpen() const
+{
+  return _ready;
+}
+
+void LocalyticsSocketConnection::open()
+{
+  if (_socket->state() != QAbstractSocket::UnconnectedState)
+    return;
+
+#ifndef QT_NO_OPENSSL
+  QSslSocket *sslSocket = qobject_cast<QSslSocket *>(_socket);
+  if (sslSocket)
+    {
+      sslSocket->connectToHostEncrypted(_host, _port);
+      return;
+    }
+#endif
+  _socket->connectToHost(_host, _port);
+}
+
+void LocalyticsSocketConnection::send(int request, const QByteArray &head, QIODevice *body)
+{
+  _request = request;
+  _completing = false;
+  _response.clear();
+  _segments.clear();
+  _segmentOffset = 0;
+  _bytesSent = 0;
+
+  // A spooled body is written straight from its mapping.  Any other
+  // body is read in slices as the socket takes them, at most
+  // SOCKET_TRANSPORT_BODY_WINDOW bytes ahead, so it is never held
+  // whole.  Either way the body is kept until the request completes,
+  // and a shaped body which has no more data for now is read further
+  // when it signals readyRead().
+  _segments.append(head);
+  _buffered = head.size();
+  _body = body;
+  _body->setParent(this);
+  LocalyticsSpoolDevice *spool = qobject_cast<LocalyticsSpoolDevice *>(body);
+  _streaming = !spool || !spool->data();
+  if (_streaming)
+    {
+      connect(_body, SIGNAL(readyRead()), this, SLOT(bodyReadyRead()));
+    }
+  else
+    {
+      _segments.append(QByteArray::fromRawData(spool->data(), (int) spool->size()));
+      _buffered += spool->size();
+    }
+
+#ifdef QT_NO_OPENSSL
+  if (_scheme == QLatin1String("https"))
+    {
+      fail(QLatin1String("HTTPS is not supported"));
+      return;
+    }
+#endif
+
+  if (_ready)
+    {
+      // Nothing is reported before send() has returned.
+      QTimer::singleShot(0, this, SLOT(startWriting()));
+    }
+  else
+    {
+      open();
+    }
+}
+
+/*!
+ @method readBody
+ @abstract Reads slices of the body until SOCKET_TRANSPORT_BODY_WINDOW bytes are waiting to be written, here or in
+ the socket's own buffer, or the body has no more data for now.
+ */
+void LocalyticsSocketConnection::readBody()
+{
+  if (!_streaming || !_body)
+    return;
+
+  char chunk[UPLOAD_DEVICE_CHUNK_SIZE];
+  while (_buffered + _socket->bytesToWrite() < SOCKET_TRANSPORT_BODY_WINDOW)
+    {
+      qint64 read = _body->read(chunk, sizeof(chunk));
+      if (read <= 0)
+        break;
+      _segments.append(QByteArray(chunk, (int) read));
+      _buffered += read;
+    }
+}
+
+void LocalyticsSocketConnection::bodyReadyRead()
+{
+  if (!_body || _completing)
+    return;
+
+  if (_ready)
+    {
+      startWriting();
+    }
+}
+
+void LocalyticsSocketConnection::socketReady()
+{
+  _ready = true;
+#ifdef Q_OS_UNIX
+  if (_scheme != QLatin1String("https"))
+    {
+      delete _writeNotifier;
+      _writeNotifier = new QSocketNotifier(_socket->socketDescriptor(), QSocketNotifier::Write, this);
+      _writeNotifier->setEnabled(false);
+      connect(_writeNotifier, SIGNAL(activated(int)), this, SLOT(writeSegments()));
+    }
+#endif
+  emit opened(this, true);
+  if (isBusy())
+    {
+      startWriting();
+    }
+}
+
+void LocalyticsSocketConnection::startWriting()
+{
+  if (!isBusy() || _completing)
+    return;
+
+#ifdef Q_OS_UNIX
+  if (_writeNotifier)
+    {
+      writeSegments();
+      return;
+    }
+#endif
+  // The socket buffers what it is given, and is topped up as it
+  // reports the bytes written.
+  forever
+    {
+      readBody();
+      if (_segments.isEmpty())
+        break;
+      for (int i = 0; i < _segments.size(); i++)
+        {
+          _socket->write(_segments.at(i));
+        }
+      _segments.clear();
+      _buffered = 0;
+    }
+}
+
+/*!
+ @method writeSegments
+ @abstract Writes as many of the remaining segments as the socket takes, in one writev() call per
+ SOCKET_TRANSPORT_MAX_IOVECS of them, reading the body further as they are written, and waits for the socket to
+ become writable again for the rest.
+ */
+void LocalyticsSocketConnection::writeSegments()
+{
+#ifdef Q_OS_UNIX
+  // Qt ignores SIGPIPE for its sockets, so a write to a closed
+  // connection fails with EPIPE instead of ending the process.
+  forever
+    {
+      readBody();
+      if (_segments.isEmpty())
+        break;
+
+      struct iovec vectors[SOCKET_TRANSPORT_MAX_IOVECS];
+      int count = 0;
+      for (int i = 0; i < _segments.size() && count < SOCKET_TRANSPORT_MAX_IOVECS; i++)
+        {
+          const QByteArray &segment = _segments.at(i);
+          qint64 offset = (i == 0) ? _segmentOffset : 0;
+          vectors[count].iov_base = (void *) (segment.constData() + offset);
+          vectors[count].iov_len = (size_t) (segment.size() - offset);
+          count++;
+        }
+
+      ssize_t written = ::writev(_socket->socketDescriptor(), vectors, count);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+              _writeNotifier->setEnabled(true);
+              return;
+            }
+          fail(QString::fromLocal8Bit(strerror(errno)));
+          return;
+        }
+
+      _bytesSent += written;
+      _buffered -= written;
+      while (written > 0)
+        {
+          qint64 remaining = _segments.first().size() - _segmentOffset;
+          if (written >= remaining)
+            {
+              // Written slices are dropped, which frees them.
+              written -= remaining;
+              _segments.removeFirst();
+              _segmentOffset = 0;
+            }
+          else
+            {
+              _segmentOffset += written;
+              written = 0;
+            }
+        }
+      emit uploadProgress(_request, _bytesSent);
+    }
+
+  // A shaped body may add more segments later.
+  _writeNotifier->setEnabled(false);
+#endif
+}
+
+void LocalyticsSocketConnection::socketBytesWritten(qint64 bytes)
+{
+  if (!isBusy() || _completing)
+    return;
+
+  _bytesSent += bytes;
+  emit uploadProgress(_request, _bytesSent);
+  startWriting();
+}
+
+void LocalyticsSocketConnection::readResponse()
+{
+  QByteArray data = _socket->readAll();
+  if (!isBusy() || _completing)
+    return;
+
+  _response.append(data);
+  parseResponse(false);
+}
+
+/*!
+ @method parseResponse
+ @abstract Completes the request once its whole response has arrived.
+ @param closed Whether the connection has been closed, which ends a response without a length.
+ @return Whether the response was complete.
+ */
+bool LocalyticsSocketConnection::parseResponse(bool closed)
+{
+  int headerEnd = _response.indexOf("\r\n\r\n");
+  if (headerEnd < 0)
+    return false;
+
+  QList<QByteArray> lines = _response.left(headerEnd).split('\n');
+  LocalyticsTransportResponse response;
+  response.statusCode = lines.at(0).split(' ').value(1).toInt();
+  bool keepAlive = lines.at(0).startsWith("HTTP/1.1");
+  qint64 contentLength = -1;
+  bool chunked = false;
+  for (int i = 1; i < lines.size(); i++)
+    {
+      int colon = lines.at(i).indexOf(':');
+      if (colon < 0)
+        continue;
+      QByteArray name = lines.at(i).left(colon).trimmed().toLower();
+      QByteArray value = lines.at(i).mid(colon + 1).trimmed();
+      if (name == "content-length")
+        contentLength = value.toLongLong();
+      else if (name == "transfer-encoding")
+        chunked = value.toLower().contains("chunked");
+      else if (name == "connection")
+        keepAlive = value.toLower() != "close";
+      else if (name == "retry-after")
+        response.retryAfter = value;
+    }
+
+  QByteArray body = _response.mid(headerEnd + 4);
+  if (chunked)
+    {
+      QByteArray decoded;
+      int position = 0;
+      forever
+        {
+          int lineEnd = body.indexOf("\r\n", position);
+          if (lineEnd < 0)
+            return false;
+          bool ok = false;
+          int size = body.mid(position, lineEnd - position).split(';').at(0).trimmed().toInt(&ok, 16);
+          if (!ok)
+            {
+              fail(QLatin1String("Malformed chunked response"));
+              return true;
+            }
+          if (size == 0)
+            {
+              // The last chunk, then optional trailers and a blank line.
+              if (body.indexOf("\r\n\r\n", lineEnd) < 0)
+                return false;
+              break;
+            }
+          if (body.size() < lineEnd + 2 + size + 2)
+            return false;
+          decoded.append(body.mid(lineEnd + 2, size));
+          position = lineEnd + 2 + size + 2;
+        }
+      response.body = decoded;
+    }
+  else if (contentLength >= 0)
+    {
+      if (body.size() < contentLength)
+        return false;
+      response.body = body.left((int) contentLength);
+    }
+  else if (response.statusCode == 204 || response.statusCode == 304)
+    {
+      // No body.
+    }
+  else if (closed)
+    {
+      response.body = body;
+      keepAlive = false;
+    }
+  else
+    {
+      return false;
+    }
+
+  complete(response);
+  if (!keepAlive)
+    {
+      _socket->disconnectFromHost();
+    }
+  return true;
+}
+
+void LocalyticsSocketConnection::socketError()
+{
+  // A closed connection is handled once it is disconnected.
+  if (_socket->error() == QAbstractSocket::RemoteHostClosedError)
+    return;
+
+  if (!_ready)
+    {
+      emit opened(this, false);
+    }
+  if (isBusy() && !_completing)
+    {
+      fail(_socket->errorString());
+    }
+  _ready = false;
+  _socket->abort();
+}
+
+void LocalyticsSocketConnection::socketDisconnected()
+{
+  _ready = false;
+  delete _writeNotifier;
+  _writeNotifier = 0;
+
+  if (isBusy() && !_completing && !parseResponse(true))
+    {
+      fail(QLatin1String("Connection closed before the response was complete"));
+    }
+}
+
+void LocalyticsSocketConnection::fail(const QString &errorString)
+{
+  LocalyticsTransportResponse response;
+  response.errorString = errorString;
+  complete(response);
+  _ready = false;
+  _socket->abort();
+}
+
+void LocalyticsSocketConnection::complete(const LocalyticsTransportResponse &response)
+{
+  _result = response;
+  _completing = true;
+  _segments.clear();
+  _segmentOffset = 0;
+  _buffered = 0;
+  delete _body;
+  _body = 0;
+  _response.clear();
+  if (_writeNotifier)
+    {
+      _writeNotifier->setEnabled(false);
+    }
+  // Carries the request, so a call left queued by a request aborted in
+  // the meantime doesn't finish the next one.
+  QMetaObject::invokeMethod(this, "emitFinished", Qt::QueuedConnection, Q_ARG(int, _request));
+}
+
+void LocalyticsSocketConnection::emitFinished(int request)
+{
+  if (request == 0 || request != _request || !_completing)
+    return;
+
+  _request = 0;
+  _completing = false;
+  emit finished(request, _result);
+}
+
+/*!
+ @method abort
+ @abstract Drops the request and closes the connection, which can't be reused with a request half sent.
+ */
+void LocalyticsSocketConnection::abort()
+{
+  _request = 0;
+  _completing = false;
+  _segments.clear();
+  _segmentOffset = 0;
+  _buffered = 0;
+  _response.clear();
+  delete _body;
+  _body = 0;
+  if (_writeNotifier)
+    {
+      _writeNotifier->setEnabled(false);
+    }
+  _ready = false;
+  _socket->abort();
+}
+
+
+LocalyticsSocketTransport::LocalyticsSocketTransport(QObject *parent) :
+  LocalyticsTransport(parent),
+  _prewarmConnection(0),
+  _connectionsOpened(0)
+{
+}
+
+/*!
+ @method connection
+ @abstract An idle connection to the host of the given URL, opened or not, or a new one if all are busy.
+ */
+LocalyticsSocketConnection *LocalyticsSocketTransport::connection(const QUrl &url)
+{
+  LocalyticsSocketConnection *closed = 0;
+  for (int i = 0; i < _connections.size(); i++)
+    {
+      LocalyticsSocketConnection *candidate = _connections.at(i);
+      if (candidate->isBusy() || !candidate->matches(url))
+        continue;
+      if (candidate->isOpen())
+        return candidate;
+      if (!closed)
+        closed = candidate;
+    }
+  if (closed)
+    return closed;
+
+  LocalyticsSocketConnection *created = new LocalyticsSocketConnection(url, this);
+  connect(created, SIGNAL(opened(LocalyticsSocketConnection*, bool)),
+          this, SLOT(connectionOpened(LocalyticsSocketConnection*, bool)));
+  connect(created, SIGNAL(uploadProgress(int, qint64)),
+          this, SIGNAL(uploadProgress(int, qint64)));
+  connect(created, SIGNAL(finished(int, const LocalyticsTransportResponse &)),
+          this, SIGNAL(finished(int, const LocalyticsTransportResponse &)));
+  _connections.append(created);
+  return created;
+}
+
+int LocalyticsSocketTransport::send(const QUrl &url, const LocalyticsTransportHeaders &headers, QIODevice *body)
+{
+  QByteArray target = url.encodedPath();
+  if (target.isEmpty())
+    target = "/";
+  if (url.hasQuery())
+    target += '?' + url.encodedQuery();
+
+  QByteArray host = url.host().toAscii();
+  int defaultPort = url.scheme().toLower() == QLatin1String("https") ? 443 : 80;
+  if (url.port(defaultPort) != defaultPort)
+    host += ':' + QByteArray::number(url.port());
+
+  QByteArray head = "POST " + target + " HTTP/1.1\r\nHost: " + host + "\r\n";
+  for (int i = 0; i < headers.size(); i++)
+    {
+      head += headers.at(i).first + ": " + headers.at(i).second + "\r\n";
+    }
+  head += "\r\n";
+
+  int request = nextRequest();
+  connection(url)->send(request, head, body);
+  return request;
+}
+
+void LocalyticsSocketTransport::prewarm(const QUrl &url)
+{
+  LocalyticsSocketConnection *warm = connection(url);
+  if (warm->isOpen())
+    {
+      emit prewarmed();
+      return;
+    }
+  _prewarmConnection = warm;
+  warm->open();
+}
+
+void LocalyticsSocketTransport::connectionOpened(LocalyticsSocketConnection *connection, bool success)
+{
+  if (success)
+    {
+      _connectionsOpened++;
+    }
+  if (connection == _prewarmConnection)
+    {
+      _prewarmConnection = 0;
+      emit prewarmed();
+    }
+}
+
+void LocalyticsSocketTransport::abort(int request)
+{
+  for (int i = 0; i < _connections.size(); i++)
+    {
+      if (_connections.at(i)->request() == request)
+        {
+          _connections.at(i)->abort();
+          return;
+        }
+    }
+}
+
+int LocalyticsSocketTransport::connectionsOpened() const
+{
+  return _connectionsOpened;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSSOCKETTRANSPORT_H
+#define LOCALYTICSSOCKETTRANSPORT_H
+
+#include <QtCore/QList>
+#include "localyticstransport.h"
+
+#define SOCKET_TRANSPORT_MAX_IOVECS 64      // Segments handed to a single writev() call
+#define SOCKET_TRANSPORT_BODY_WINDOW 65536  // Most bytes of a body read ahead of the socket
+
+class QSocketNotifier;
+class QTcpSocket;
+
+/*
+  One keep-alive HTTP/1.1 connection of a LocalyticsSocketTransport,
+  carrying one request at a time.
+*/
+class LocalyticsSocketConnection : public QObject
+{
+  Q_OBJECT
+  friend class UploaderTest;
+  public:
+  LocalyticsSocketConnection(const QUrl &url, QObject *parent = 0);
+
+  bool matches(const QUrl &url) const;
+  bool isBusy() const;
+  int request() const;
+  bool isOpen() const;
+
+  void open();
+  void send(int request, const QByteArray &head, QIODevice *body);
+  void abort();
+
+  signals:
+  void opened(LocalyticsSocketConnection *connection, bool success);
+  void uploadProgress(int request, qint64 bytesSent);
+  void finished(int request, const LocalyticsTransportResponse &response);
+
+  private slots:
+  void socketReady();
+  void socketError();
+  void socketDisconnected();
+  void socketBytesWritten(qint64 bytes);
+  void bodyReadyRead();
+  void startWriting();
+  void writeSegments();
+  void readResponse();
+  void emitFinished(int request);
+
+  private:
+  void readBody();
+  bool parseResponse(bool closed);
+  void complete(const LocalyticsTransportResponse &response);
+  void fail(const QString &errorString);
+
+  QString _scheme;
+  QString _host;
+  quint16 _port;
+  QTcpSocket *_socket;
+  QSocketNotifier *_writeNotifier;
+  bool _ready;
+  int _request;
+  bool _completing;
+  QList<QByteArray> _segments;  // Waiting to be written; the first one from _segmentOffset
+  QIODevice *_body;
+  bool _streaming;              // Whether the body is read in slices
+  qint64 _segmentOffset;
+  qint64 _buffered;             // Bytes of _segments not yet written
+  qint64 _bytesSent;
+  QByteArray _response;
+  LocalyticsTransportResponse _result;
+};
+
+/*!
+  Sends requests as hand-written HTTP/1.1 over its own sockets, keeping
+  a connection alive per concurrent request.
+
+  On Unix, the request head and the body, read from the upload device
+  in slices no more than SOCKET_TRANSPORT_BODY_WINDOW bytes ahead of
+  the socket, are written to plain HTTP connections with writev(), so
+  they go out without being copied into one buffer or through the
+  socket's own write buffer, and a spooled body (see
+  LocalyticsSpoolDevice) is written straight from its mapping.  HTTPS
+  connections write the same slices through QSslSocket, which has to
+  encrypt them anyway.  Responses must be delimited by Content-Length,
+  chunked encoding or the end of the connection.  Proxies are not
+  supported.
+*/
+class LocalyticsSocketTransport : public LocalyticsTransport
+{
+  Q_OBJECT
+  public:
+  explicit LocalyticsSocketTransport(QObject *parent = 0);
+
+  int send(const QUrl &url, const LocalyticsTransportHeaders &headers, QIODevice *body);
+
+  /*!
+    Opens a connection, and for HTTPS completes the TLS handshake,
+    which the next request then uses.
+  */
+  void prewarm(const QUrl &url);
+  void abort(int request);
+
+  /*!
+    \return The number of connections opened so far.
+  */
+  int connectionsOpened() const;
+
+  private slots:
+  void connectionOpened(LocalyticsSocketConnection *connection, bool success);
+
+  private:
+  LocalyticsSocketConnection *connection(const QUrl &url);
+
+  QList<LocalyticsSocketConnection *> _connections;
+  LocalyticsSocketConnection *_prewarmConnection;
+  int _connectionsOpened;
+};
+
+#endif // LOCALYTICSSOCKETTRANSPORT_H
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsspooldevice.h"
+#include "localyticsuploaddevice.h"
+#include <string.h>
+
+LocalyticsSpoolDevice::LocalyticsSpoolDevice(const QString &fileName, QObject *parent) :
+  QIODevice(parent),
+  _file(fileName),
+  _map(0)
+{
+}
+
+LocalyticsSpoolDevice::~LocalyticsSpoolDevice()
+{
+  close();
+}
+
+bool LocalyticsSpoolDevice::spool(QIODevice *body, const QString &fileName)
+{
+  QString temporaryName = fileName + QLatin1String(".tmp");
+  QFile file(temporaryName);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+      return false;
+    }
+
+  char buffer[UPLOAD_DEVICE_CHUNK_SIZE];
+  qint64 length;
+  bool success = true;
+  while (success && (length = body->read(buffer, sizeof(buffer))) > 0)
+    {
+      success = file.write(buffer, length) == length;
+    }
+  success &= body->atEnd() && file.flush();
+  file.close();
+  body->seek(0);
+
+  // A spool file of the same name is always the same body.
+  QFile::remove(fileName);
+  if (!success || !file.rename(fileName))
+    {
+      QFile::remove(temporaryName);
+      return false;
+    }
+  return true;
+}
+
+bool LocalyticsSpoolDevice::open(OpenMode mode)
+{
+  if ((mode & QIODevice::WriteOnly) || !_file.open(QIODevice::ReadOnly))
+    {
+      return false;
+    }
+  // An empty file cannot be mapped, and needs no mapping.
+  if (_file.size() > 0)
+    {
+      _map = _file.map(0, _file.size());
+      if (!_map)
+        {
+          setErrorString(_file.errorString());
+          _file.close();
+          return false;
+        }
+    }
+  return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+void LocalyticsSpoolDevice::close()
+{
+  if (_map)
+    {
+      _file.unmap(_map);
+      _map = 0;
+    }
+  _file.close();
+  if (isOpen())
+    {
+      QIODevice::close();
+    }
+}
+
+bool LocalyticsSpoolDevice::isSequential() const
+{
+  return false;
+}
+
+qint64 LocalyticsSpoolDevice::size() const
+{
+  return _file.size();
+}
+
+const char *LocalyticsSpoolDevice::data() const
+{
+  return (const char *) _map;
+}
+
+qint64 LocalyticsSpoolDevice::readData(char *data, qint64 maxSize)
+{
+  qint64 length = qMin(maxSize, size() - pos());
+  if (length <= 0)
+    {
+      return 0;
+    }
+  memcpy(data, _map + pos(), length);
+  return length;
+}
+
+qint64 LocalyticsSpoolDevice::writeData(const char *, qint64)
+{
+  return -1;
+}
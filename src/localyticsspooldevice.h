@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSSPOOLDEVICE_H
+#define LOCALYTICSSPOOLDEVICE_H
+
+#include <QtCore/QFile>
+#include <QtCore/QIODevice>
+
+/*!
+  Request body of an upload, read from a spool file.
+
+  The spool file holds the finished, compressed body of one request,
+  written once by spool() when spooling is enabled, see
+  LocalyticsUploader::setSpooling().  The device maps the file into
+  memory and hands out slices of the mapping, so the body is neither
+  read back from the database nor copied onto the heap, however many
+  times the request is sent.
+*/
+class LocalyticsSpoolDevice : public QIODevice
+{
+  Q_OBJECT
+  public:
+  /*!
+    \param fileName Path of an existing spool file.
+    \param parent Parent object to retain ownership.
+  */
+  explicit LocalyticsSpoolDevice(const QString &fileName, QObject *parent = 0);
+  ~LocalyticsSpoolDevice();
+
+  /*!
+    Writes a request body to a spool file.  The body is copied in
+    slices to a temporary file which is then renamed, so that a spool
+    file is always complete.
+    \param body The request body, open for reading and at its start.
+    It is rewound afterwards.
+    \param fileName Path of the spool file.
+    \return `true` on success, `false` otherwise.
+  */
+  static bool spool(QIODevice *body, const QString &fileName);
+
+  /*!
+    Opens the device and maps the spool file.  Only reading is
+    supported.
+  */
+  bool open(OpenMode mode);
+  void close();
+  bool isSequential() const;
+  qint64 size() const;
+
+  /*!
+    \return The mapped body while the device is open and not empty,
+    `0` otherwise.
+  */
+  const char *data() const;
+
+  protected:
+  qint64 readData(char *data, qint64 maxSize);
+  qint64 writeData(const char *data, qint64 maxSize);
+
+  private:
+  QFile _file;
+  uchar *_map;
+};
+
+#endif // LOCALYTICSSPOOLDEVICE_H
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSTRANSPORT_H
+#define LOCALYTICSTRANSPORT_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QPair>
+#include <QtCore/QUrl>
+
+class QIODevice;
+
+typedef QList<QPair<QByteArray, QByteArray> > LocalyticsTransportHeaders;
+
+/*!
+  Outcome of a request sent through a LocalyticsTransport.
+*/
+struct LocalyticsTransportResponse
+{
+  LocalyticsTransportResponse() : statusCode(0) {}
+
+  int statusCode;        // HTTP status code, or 0 if no response was received
+  QString errorString;   // Why no response was received
+  QByteArray retryAfter; // Value of the Retry-After header, if any
+  QByteArray body;
+};
+
+/*!
+  Sends upload requests on behalf of LocalyticsUploader.
+
+  A transport POSTs a request body with the given headers and reports
+  completion asynchronously through finished(), identifying requests
+  by the number send() returned.  Several requests may be in flight at
+  once.
+
+  \sa LocalyticsNetworkTransport, LocalyticsSocketTransport,
+  LocalyticsLoopbackTransport
+*/
+class LocalyticsTransport : public QObject
+{
+  Q_OBJECT
+  public:
+  explicit LocalyticsTransport(QObject *parent = 0);
+  virtual ~LocalyticsTransport();
+
+  /*!
+    Starts sending a request.
+
+    \param url The upload URL.
+    \param headers Request headers, including Content-Length.
+    \param body The request body, open for reading and positioned at
+    its start.  The transport takes ownership.
+    \return A number identifying the request in the signals.
+  */
+  virtual int send(const QUrl &url, const LocalyticsTransportHeaders &headers, QIODevice *body) = 0;
+
+  /*!
+    Opens a connection to the host of `url` ahead of the first
+    request, if the transport keeps connections.  Emits prewarmed()
+    once done, successfully or not.  The default only emits
+    prewarmed().
+  */
+  virtual void prewarm(const QUrl &url);
+
+  /*!
+    Abandons a request in flight, closing its connection if the
+    transport keeps one per request.  No finished() signal is emitted
+    for it afterwards.  The default does nothing, and the uploader
+    ignores whatever is reported for an abandoned request.
+  */
+  virtual void abort(int request);
+
+signals:
+  /*!
+    Emitted as the body of a request is written.
+  */
+  void uploadProgress(int request, qint64 bytesSent);
+
+  /*!
+    Emitted once per request, when its response has arrived or it has
+    failed.
+  */
+  void finished(int request, const LocalyticsTransportResponse &response);
+
+  void prewarmed();
+
+  protected:
+  /*!
+    \return A new request number.
+  */
+  int nextRequest();
+
+  private:
+  int _lastRequest;
+};
+
+#endif // LOCALYTICSTRANSPORT_H
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsuploaddevice.h"
+#include <string.h>
+
+LocalyticsUploadDevice::LocalyticsUploadDevice(LocalyticsDatabase *database, const QList<LocalyticsUploadSegment> &segments, QObject *parent) :
+  QIODevice(parent),
+  _database(database),
+  _segments(segments),
+  _size(0),
+  _segment(0),
+  _segmentOffset(0),
+  _memberSegment(-1)
+{
+  for (int i = 0; i < _segments.size(); i++)
+    {
+      _size += _segments.at(i).size;
+    }
+}
+
+bool LocalyticsUploadDevice::open(OpenMode mode)
+{
+  if (mode & QIODevice::WriteOnly)
+    {
+      return false;
+    }
+  locate(0);
+  return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+bool LocalyticsUploadDevice::isSequential() const
+{
+  return false;
+}
+
+qint64 LocalyticsUploadDevice::size() const
+{
+  return _size;
+}
+
+bool LocalyticsUploadDevice::seek(qint64 pos)
+{
+  if (pos > _size || !QIODevice::seek(pos))
+    {
+      return false;
+    }
+  locate(pos);
+  return true;
+}
+
+QList<int> LocalyticsUploadDevice::sequenceNumbers() const
+{
+  QList<int> numbers;
+  for (int i = 0; i < _segments.size(); i++)
+    {
+      numbers.append(_segments.at(i).sequenceNumber);
+    }
+  return numbers;
+}
+
+qint64 LocalyticsUploadDevice::readData(char *data, qint64 maxSize)
+{
+  qint64 total = 0;
+  while (total < maxSize && _segment < _segments.size())
+    {
+      const LocalyticsUploadSegment &segment = _segments.at(_segment);
+      if (_memberSegment != _segment)
+        {
+          _member = _database->uploadSegmentData(segment.sequenceNumber);
+          _memberSegment = _segment;
+        }
+      if (_member.length() != segment.size)
+        {
+          // The header was deleted or changed underneath the upload.
+          _memberSegment = -1;
+          _member.clear();
+          setErrorString(QLatin1String("Upload header is no longer available"));
+          return total > 0 ? total : -1;
+        }
+
+      qint64 length = qMin(maxSize - total, segment.size - _segmentOffset);
+      memcpy(data + total, _member.constData() + _segmentOffset, length);
+      total += length;
+      _segmentOffset += length;
+      if (_segmentOffset >= segment.size)
+        {
+          _segment++;
+          _segmentOffset = 0;
+        }
+    }
+  if (_segment >= _segments.size())
+    {
+      _member.clear();
+      _memberSegment = -1;
+    }
+  return total;
+}
+
+qint64 LocalyticsUploadDevice::writeData(const char *, qint64)
+{
+  return -1;
+}
+
+void LocalyticsUploadDevice::locate(qint64 pos)
+{
+  _segment = 0;
+  _segmentOffset = pos;
+  while (_segment < _segments.size() && _segmentOffset >= _segments.at(_segment).size)
+    {
+      _segmentOffset -= _segments.at(_segment).size;
+      _segment++;
+    }
+}
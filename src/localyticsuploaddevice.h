@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSUPLOADDEVICE_H
+#define LOCALYTICSUPLOADDEVICE_H
+
+#include <QtCore/QIODevice>
+#include <QtCore/QList>
+#include "localyticsdatabase.h"
+
+#define UPLOAD_DEVICE_CHUNK_SIZE 16384   // Size of the buffers an upload body is copied through, in bytes
+
+/*!
+  Request body of an upload, read straight from the database.
+
+  The body is the concatenation of the stored gzip members of a fixed
+  set of upload headers.  Each member is read in one query when the
+  network layer first asks for its bytes, and only the member being
+  sent is held, so memory use does not depend on how much data is
+  waiting to be uploaded.  The device is random-access with a known size, which lets
+  QNetworkAccessManager send it with a Content-Length without
+  buffering it, and rewind it if the request has to be sent again.
+*/
+class LocalyticsUploadDevice : public QIODevice
+{
+  Q_OBJECT
+  public:
+  /*!
+    \param database The database holding the upload headers.
+    \param segments The headers to send, in order, as returned by
+    LocalyticsDatabase::uploadSegments().
+    \param parent Parent object to retain ownership.
+  */
+  LocalyticsUploadDevice(LocalyticsDatabase *database, const QList<LocalyticsUploadSegment> &segments, QObject *parent = 0);
+
+  /*!
+    Opens the device.  Only reading is supported, and the device is
+    always unbuffered so that seeking stays exact.
+  */
+  bool open(OpenMode mode);
+  bool isSequential() const;
+  qint64 size() const;
+  bool seek(qint64 pos);
+
+  /*!
+    \return The sequence numbers of the upload headers in this body.
+  */
+  QList<int> sequenceNumbers() const;
+
+  protected:
+  qint64 readData(char *data, qint64 maxSize);
+  qint64 writeData(const char *data, qint64 maxSize);
+
+  private:
+  void locate(qint64 pos);
+
+  LocalyticsDatabase *_database;
+  QList<LocalyticsUploadSegment> _segments;
+  qint64 _size;
+  int _segment;
+  qint64 _segmentOffset;
+  QByteArray _member;   // Stored gzip member of _memberSegment
+  int _memberSegment;
+};
+
+#endif // LOCALYTICSUPLOADDEVICE_H
@@ -27,16 +27,23 @@
  * DAMAGE.
  */
 
+#define LOCALYTICS_LOG_COMPONENT "localytics uploader"
+
 #include "localyticsuploader.h"
 #include "webserviceconstants.h"
 #include "localyticsdatabase.h"
-#include "localyticssession.h"
-#include <zlib.h>
+#include "localyticslog.h"
+#include "localyticsnetworktransport.h"
+#include "localyticsspooldevice.h"
+#include "localyticsuploaddevice.h"
 #include <QtCore/QByteArray>
+#include <QtCore/QCryptographicHash>
 #include <QtCore/QDateTime>
-#include <QtCore/QDebug>
-#include <QtNetwork/QNetworkAccessManager>
-#include <QtNetwork/QNetworkRequest>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
 
 #ifndef LOCALYTICS_URL
 #define LOCALYTICS_URL QLatin1String("http://analytics.localytics.com/api/v2/applications/%1/uploads")
@@ -47,14 +54,56 @@
 #endif
 
 LocalyticsUploader* LocalyticsUploader::_sharedLocalyticsUploader = 0;
+QMutex LocalyticsUploader::_sharedLock;
+
+LocalyticsUploader::LocalyticsUploader(LocalyticsDatabase *database, QObject *parent) :
+    QObject(parent)
+{
+  _transport = 0;
+  setUp(database);
+  setTransport(new LocalyticsNetworkTransport);
+}
 
-LocalyticsUploader::LocalyticsUploader(QObject *parent) :
+/*!
+ @method LocalyticsUploader
+ @abstract An uploader which shares the given transport, which it doesn't own, with the other uploaders of a pool.
+ No transport of its own is created.
+ */
+LocalyticsUploader::LocalyticsUploader(LocalyticsDatabase *database, LocalyticsTransport *transport, QObject *parent) :
     QObject(parent)
 {
+  _transport = 0;
+  setUp(database);
+  useTransport(transport, false);
+}
+
+/*!
+ @method setUp
+ @abstract Initializes the members of a new uploader, except its transport.
+ */
+void LocalyticsUploader::setUp(LocalyticsDatabase *database)
+{
+  _database = database ? database : LocalyticsDatabase::sharedLocalyticsDatabase();
+  _bucket = &_uploadBucket;
   _isUploading = false;
-  m_networkManager = new QNetworkAccessManager(this);
-  connect(m_networkManager, SIGNAL(finished(QNetworkReply*)),
-          this, SLOT(replyFinished(QNetworkReply*)));
+  _useHTTPS = true;
+  _maxUploadBytes = MAX_UPLOAD_BYTES;
+  _maxConcurrentUploads = MAX_CONCURRENT_UPLOADS;
+  _spooling = false;
+  _uploadFailed = false;
+  _retryAfter = -1;
+  _prewarming = false;
+  resetUploadStats();
+
+  _retryTimer = new QTimer(this);
+  _retryTimer->setSingleShot(true);
+  connect(_retryTimer, SIGNAL(timeout()), this, SLOT(retryUpload()));
+
+  _connectDeadline = UPLOAD_CONNECT_DEADLINE_MS;
+  _idleDeadline = UPLOAD_IDLE_DEADLINE_MS;
+  _totalDeadline = UPLOAD_TOTAL_DEADLINE_MS;
+  _watchdogTimer = new QTimer(this);
+  connect(_watchdogTimer, SIGNAL(timeout()), this, SLOT(checkDeadlines()));
 }
 
 
@@ -62,42 +111,330 @@ void LocalyticsUploader::upload(QString localyticsApplicationKey, bool useHTTPS,
 {
   if (isUploading())
     {
-      logMessage(QLatin1String("Upload already in progress. Aborting"));
+      LOCALYTICS_DEBUG(QLatin1String("Upload already in progress. Aborting"));
       return;
     }
 
 
-  logMessage(QLatin1String("Beginning upload process"));
+  _applicationKey = localyticsApplicationKey;
+  _useHTTPS = useHTTPS;
+  _installId = installId;
+
+  if (isCircuitOpen())
+    {
+      LOCALYTICS_DEBUG(QLatin1String("Uploads are suspended after repeated failures. Aborting"));
+      return;
+    }
+  if (isRetryScheduled())
+    {
+      // The staged data goes out with the scheduled retry.
+      LOCALYTICS_DEBUG(QLatin1String("A retry is already scheduled. Aborting"));
+      return;
+    }
+
+  LOCALYTICS_DEBUG(QLatin1String("Beginning upload process"));
   _isUploading = true;
-  
+  startUpload();
+}
+
+void LocalyticsUploader::startUpload()
+{
   // Prepare the data for upload.  The upload could take a long time, so some effort has to be made to be sure that events
   // which get written while the upload is taking place don't get lost or duplicated.  To achieve this, the logic is:
-  // 1) Append every header row blob string and and those of its associated events to the upload string.
-  // 2) Deflate and upload the data.
-  // 3) On success, delete all blob headers and staged events. Events added while an upload is in process are not
-  //    deleted because they are not associated a header (and cannot be until the upload completes).
+  // 1) Collect the gzip member of every header row.  Members are built when the header is staged, and cover the
+  //    header blob and those of its associated events.  Group the headers into batches of at most maxUploadBytes().
+  // 2) Upload the batches, up to maxConcurrentUploads() at a time, reading the members from the database as they
+  //    are sent.
+  // 3) When a batch succeeds, delete its blob headers and staged events. Events added while an upload is in process
+  //    are not deleted because they are not associated a header (and cannot be until the upload completes).
+  // Each request is recorded in the upload journal before it is posted and marked when it is acknowledged, so that
+  // if the process dies part way through, the next upload finishes the deletions the server already confirmed and
+  // re-sends only the requests whose outcome is unknown.
   
   // Step 1
-  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
-  QString blobString = db->uploadBlobString();
+  LocalyticsDatabase *db = _database;
+  QList<LocalyticsUploadSegment> segments = db->uploadSegments();
+  QList<QList<LocalyticsUploadSegment> > resumed = recoverJournal(segments);
 
-  if (blobString.isEmpty()) 
+  if (segments.isEmpty() && resumed.isEmpty()) 
     {
       // There is nothing outstanding to upload.
-      logMessage(QLatin1String("Abandoning upload. There are no new events."));
+      LOCALYTICS_DEBUG(QLatin1String("Abandoning upload. There are no new events."));
       finishUpload();
       return;
     }
 
-  QByteArray requestData = blobString.toUtf8();
-  logMessage(QString(QLatin1String("Uploading data (length: %1)")).arg(requestData.length()));
-  logMessage(blobString);
+  _pendingBatches = resumed + batchSegments(segments, _maxUploadBytes);
+  _uploadFailed = false;
+  _retryAfter = -1;
+  LOCALYTICS_DEBUG(QString(QLatin1String("Uploading %1 headers in %2 requests")).arg(segments.size()).arg(_pendingBatches.size()));
+  postPendingBatches();
+}
+
+/*!
+ @method batchSegments
+ @abstract Groups upload headers, in order, into batches whose bodies are no larger than the given size.
+ A header larger than the limit is sent in a batch of its own.
+ */
+QList<QList<LocalyticsUploadSegment> > LocalyticsUploader::batchSegments(const QList<LocalyticsUploadSegment> &segments, qint64 maxBytes)
+{
+  QList<QList<LocalyticsUploadSegment> > batches;
+  QList<LocalyticsUploadSegment> batch;
+  qint64 batchBytes = 0;
+  for (int i = 0; i < segments.size(); i++)
+    {
+      const LocalyticsUploadSegment &segment = segments.at(i);
+      if (!batch.isEmpty() && batchBytes + segment.size > maxBytes)
+        {
+          batches.append(batch);
+          batch.clear();
+          batchBytes = 0;
+        }
+      batch.append(segment);
+      batchBytes += segment.size;
+    }
+  if (!batch.isEmpty())
+    {
+      batches.append(batch);
+    }
+  return batches;
+}
+
+/*!
+ @method recoverJournal
+ @abstract Settles the journal left by a previous upload.  Acknowledged requests have their headers deleted without
+ being sent again.  Requests which were in flight, and failed requests whose spool file is still there, are returned
+ as batches, grouped as they were first sent.  Their headers are removed from segments, which is left holding the
+ headers free to batch anew.
+ */
+QList<QList<LocalyticsUploadSegment> > LocalyticsUploader::recoverJournal(QList<LocalyticsUploadSegment> &segments)
+{
+  LocalyticsDatabase *db = _database;
+  QList<QList<LocalyticsUploadSegment> > resumed;
+  QList<LocalyticsJournalEntry> entries = db->journalEntries();
+
+  for (int i = 0; i < entries.size(); i++)
+    {
+      const LocalyticsJournalEntry &entry = entries.at(i);
+      // A failed request which was spooled goes out again from its
+      // spool file, so it keeps its grouping.
+      QString spoolFile = spoolFileName(entry.sequenceNumbers);
+      bool resume = entry.state == JOURNAL_IN_FLIGHT
+        || (entry.state == JOURNAL_FAILED && _spooling && QFile::exists(spoolFile));
+      QList<LocalyticsUploadSegment> batch;
+      if (entry.state == JOURNAL_ACKED || resume)
+        {
+          for (int j = 0; j < segments.size(); )
+            {
+              if (entry.sequenceNumbers.contains(segments.at(j).sequenceNumber))
+                batch.append(segments.takeAt(j));
+              else
+                j++;
+            }
+        }
+
+      if (entry.state == JOURNAL_ACKED)
+        {
+          LOCALYTICS_INFO(QString(QLatin1String("Deleting %1 headers acknowledged before the last upload was interrupted")).arg(batch.size()));
+          if (!db->deleteUploadedData(entry.sequenceNumbers))
+            continue;
+        }
+      else if (resume && !batch.isEmpty())
+        {
+          // The hash covers the stored members, which never change,
+          // so no body is read to check it.  A spool file was renamed
+          // into place once written, so only its size is checked.
+          bool matches = batch.size() == entry.sequenceNumbers.size() && bodyHash(batch) == entry.bodyHash;
+          if (matches && QFile::exists(spoolFile))
+            {
+              qint64 bytes = 0;
+              for (int j = 0; j < batch.size(); j++)
+                {
+                  bytes += batch.at(j).size;
+                }
+              matches = QFileInfo(spoolFile).size() == bytes;
+            }
+          if (!matches)
+            {
+              // Any spool file is stale, and the batch is read from the database again.
+              LOCALYTICS_WARNING(QString(QLatin1String("Interrupted request %1 no longer matches its journal entry")).arg(entry.requestId));
+              QFile::remove(spoolFile);
+            }
+          LOCALYTICS_INFO(QString(QLatin1String("Re-sending %1 headers whose upload did not complete")).arg(batch.size()));
+          resumed.append(batch);
+        }
+      // Other failed requests left their headers staged, and they are batched like any others.
+      db->removeJournalEntry(entry.requestId);
+    }
+
+  // Spool files of batches which are not resumed would never be used.
+  QSet<QString> keep;
+  for (int i = 0; i < resumed.size(); i++)
+    {
+      QList<int> sequenceNumbers;
+      for (int j = 0; j < resumed.at(i).size(); j++)
+        {
+          sequenceNumbers.append(resumed.at(i).at(j).sequenceNumber);
+        }
+      keep.insert(spoolFileName(sequenceNumbers));
+    }
+  QDir spool(db->spoolDirectory());
+  QStringList files = spool.entryList(QDir::Files);
+  for (int i = 0; i < files.size(); i++)
+    {
+      if (!keep.contains(spool.filePath(files.at(i))))
+        spool.remove(files.at(i));
+    }
+  return resumed;
+}
+
+/*!
+ @method bodyHash
+ @abstract The SHA-1 hash of the identity of a request body: the sequence number and stored gzip member size of each
+ of its headers.  Members are written once when their header is staged, so this stands for the body without reading it.
+ */
+QByteArray LocalyticsUploader::bodyHash(const QList<LocalyticsUploadSegment> &batch)
+{
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  for (int i = 0; i < batch.size(); i++)
+    {
+      hash.addData(QByteArray::number(batch.at(i).sequenceNumber) + ':' + QByteArray::number(batch.at(i).size) + ',');
+    }
+  return hash.result();
+}
+
+/*!
+ @method postPendingBatches
+ @abstract Posts batches until maxConcurrentUploads() requests are in flight, and finishes the upload once none are
+ left either way.  A failed batch is only retried after every request of the upload has completed.
+ */
+void LocalyticsUploader::postPendingBatches()
+{
+  while (!_pendingBatches.isEmpty() && _inFlight.size() < _maxConcurrentUploads)
+    {
+      postBatch(_pendingBatches.takeFirst());
+    }
+
+  if (_inFlight.isEmpty())
+    {
+      if (_uploadFailed)
+        {
+          scheduleRetry(_retryAfter);
+        }
+      finishUpload();
+    }
+}
+
+/*!
+ @method spoolFileName
+ @abstract The spool file of the batch of the given headers.  A batch is always the same body, so its file is
+ named after its headers.
+ */
+QString LocalyticsUploader::spoolFileName(const QList<int> &sequenceNumbers)
+{
+  QByteArray list;
+  for (int i = 0; i < sequenceNumbers.size(); i++)
+    {
+      list += QByteArray::number(sequenceNumbers.at(i)) + ',';
+    }
+  QString name = QLatin1String(QCryptographicHash::hash(list, QCryptographicHash::Sha1).toHex()) + QLatin1String(".gz");
+  return QDir(_database->spoolDirectory()).filePath(name);
+}
+
+/*!
+ @method openBody
+ @abstract Opens the body of a batch.  Without spooling, it is read from the database as it is sent.  With
+ spooling, it is sent from its spool file, which is written first if this is the batch's first attempt.
+ */
+QIODevice *LocalyticsUploader::openBody(const QList<LocalyticsUploadSegment> &batch)
+{
+  LocalyticsUploadDevice *body = new LocalyticsUploadDevice(_database, batch);
+  body->open(QIODevice::ReadOnly);
+  if (!_spooling)
+    {
+      return body;
+    }
+
+  QString fileName = spoolFileName(body->sequenceNumbers());
+  if (QFile::exists(fileName) || LocalyticsSpoolDevice::spool(body, fileName))
+    {
+      LocalyticsSpoolDevice *spooled = new LocalyticsSpoolDevice(fileName);
+      if (spooled->open(QIODevice::ReadOnly))
+        {
+          delete body;
+          return spooled;
+        }
+      delete spooled;
+    }
+  LOCALYTICS_WARNING(QLatin1String("Unable to spool upload body: ") + fileName);
+  return body;
+}
+
+void LocalyticsUploader::postBatch(const QList<LocalyticsUploadSegment> &batch)
+{
+  QIODevice *body = openBody(batch);
+  LOCALYTICS_DEBUG(QString(QLatin1String("Uploading data (compressed length: %1)")).arg(body->size()));
   
   // Step 2
-  QByteArray deflatedRequestData = gzipDeflate(requestData);
-  
+  LocalyticsTransportHeaders headers;
+  headers << qMakePair(QString(HEADER_CLIENT_TIME).toAscii(), uploadTimestamp().toAscii());
+  headers << qMakePair(QString(HEADER_INSTALL_ID).toAscii(), _installId.toAscii());
+  headers << qMakePair(QByteArray("Content-Type"), QByteArray("application/x-gzip"));
+  headers << qMakePair(QByteArray("Content-Length"), QByteArray::number(body->size()));
+  // Keep the connection open for the next batch or upload.
+  headers << qMakePair(QByteArray("Connection"), QByteArray("keep-alive"));
+  LOCALYTICS_DEBUG(QLatin1String("Posting NOW"));
+
+  QList<int> sequenceNumbers;
+  for (int i = 0; i < batch.size(); i++)
+    {
+      sequenceNumbers.append(batch.at(i).sequenceNumber);
+    }
+  int journalId = -1;
+  if (!_database->addJournalEntry(sequenceNumbers, bodyHash(batch), &journalId))
+    {
+      LOCALYTICS_WARNING(QLatin1String("Unable to journal upload request"));
+      journalId = -1;
+    }
+
+  qint64 bytes = body->size();
+  if (_bucket->rate() > 0)
+    {
+      body = new LocalyticsShapedDevice(body, _bucket);
+      body->open(QIODevice::ReadOnly);
+    }
+  int request = _transport->send(uploadUrl(), headers, body);
+
+  LocalyticsUploadRequest &inFlight = _inFlight[request];
+  inFlight.sequenceNumbers = sequenceNumbers;
+  inFlight.bytes = bytes;
+  inFlight.journalId = journalId;
+  inFlight.posted.start();
+  inFlight.lastProgress.start();
+  inFlight.connectMilliseconds = -1;
+
+  if (!_watchdogTimer->isActive())
+    {
+      // Deadlines are checked a few times within the shortest one.
+      int shortest = UPLOAD_TOTAL_DEADLINE_MS;
+      if (_connectDeadline > 0)
+        shortest = qMin(shortest, _connectDeadline);
+      if (_idleDeadline > 0)
+        shortest = qMin(shortest, _idleDeadline);
+      if (_totalDeadline > 0)
+        shortest = qMin(shortest, _totalDeadline);
+      _watchdogTimer->start(qBound(10, shortest / 4, 1000));
+    }
+}
+
+QUrl LocalyticsUploader::uploadUrl()
+{
   QString urlStringFormat;
-  if (useHTTPS)
+  if (!_urlFormat.isEmpty())
+    {
+      urlStringFormat = _urlFormat;
+    }
+  else if (_useHTTPS)
     {
       urlStringFormat = LOCALYTICS_URL_SECURED;
     } 
@@ -105,120 +442,375 @@ void LocalyticsUploader::upload(QString localyticsApplicationKey, bool useHTTPS,
     {
       urlStringFormat = LOCALYTICS_URL;
     }
-  QString apiUrlString = urlStringFormat.arg(QString(QLatin1String(QUrl::toPercentEncoding(localyticsApplicationKey))));
+  return QUrl(urlStringFormat.arg(QString(QLatin1String(QUrl::toPercentEncoding(_applicationKey)))));
+}
 
-  QNetworkRequest request(apiUrlString);
-  request.setRawHeader(QString(HEADER_CLIENT_TIME).toAscii(), uploadTimestamp().toAscii());
-  request.setRawHeader(QString(HEADER_INSTALL_ID).toAscii(), installId.toAscii());
-  request.setHeader(QNetworkRequest::ContentTypeHeader, QLatin1String("application/x-gzip"));
-  request.setRawHeader(QString(QLatin1String("Content-Length")).toAscii(), QString(QLatin1String("%1")).arg(deflatedRequestData.length()).toAscii());
-  logMessage(QLatin1String("Posting NOW"));
-  m_networkManager->post(request, deflatedRequestData);
+void LocalyticsUploader::setSpooling(bool spooling)
+{
+  _spooling = spooling;
+}
+
+bool LocalyticsUploader::isSpooling() const
+{
+  return _spooling;
+}
+
+void LocalyticsUploader::setEndpoint(const QString &urlFormat)
+{
+  _urlFormat = urlFormat;
 }
 
-void LocalyticsUploader::replyFinished(QNetworkReply *reply)
+QString LocalyticsUploader::endpoint() const
 {
-  logMessage(QLatin1String("Reply finished"));
-  QVariant statusCodeV = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
-  int responseStatusCode = statusCodeV.toInt();
-  if (reply->error() != QNetworkReply::NoError)
+  return _urlFormat;
+}
+
+void LocalyticsUploader::setTransport(LocalyticsTransport *transport)
+{
+  useTransport(transport, true);
+}
+
+/*!
+ @method useTransport
+ @abstract Sends requests through the given transport, which the uploader owns or shares with the other uploaders
+ of a pool.  A shared transport reports the requests of every uploader, and each ignores those it did not post.
+ */
+void LocalyticsUploader::useTransport(LocalyticsTransport *transport, bool owned)
+{
+  Q_ASSERT(_inFlight.isEmpty());
+  if (_transport && _ownsTransport)
+    {
+      _transport->deleteLater();
+    }
+  else if (_transport)
+    {
+      disconnect(_transport, 0, this, 0);
+    }
+  _prewarming = false;
+
+  _transport = transport;
+  _ownsTransport = owned;
+  if (owned)
+    {
+      _transport->setParent(this);
+    }
+  connect(_transport, SIGNAL(finished(int, const LocalyticsTransportResponse &)),
+          this, SLOT(requestFinished(int, const LocalyticsTransportResponse &)));
+  connect(_transport, SIGNAL(uploadProgress(int, qint64)),
+          this, SLOT(requestUploadProgress(int, qint64)));
+  connect(_transport, SIGNAL(prewarmed()), this, SLOT(transportPrewarmed()));
+}
+
+LocalyticsTransport *LocalyticsUploader::transport() const
+{
+  return _transport;
+}
+
+void LocalyticsUploader::prewarm(bool httpsMode)
+{
+  if (isUploading() || _prewarming)
+    return;
+
+  _useHTTPS = httpsMode;
+  QUrl url = uploadUrl();
+  LOCALYTICS_DEBUG(QLatin1String("Prewarming connection to ") + url.host());
+  _prewarming = true;
+  _prewarmStarted.start();
+  _transport->prewarm(url);
+}
+
+void LocalyticsUploader::transportPrewarmed()
+{
+  if (!_prewarming)
+    return;
+
+  // Whatever the outcome, the connection is now open if it can be.
+  _stats.prewarms++;
+  _stats.prewarmMilliseconds += _prewarmStarted.elapsed();
+  LOCALYTICS_DEBUG(QString(QLatin1String("Connection prewarmed in %1 ms")).arg(_prewarmStarted.elapsed()));
+  _prewarming = false;
+}
+
+/*!
+ @method requestUploadProgress
+ @abstract The first body bytes of a request were written, so its connection is established.
+ */
+void LocalyticsUploader::requestUploadProgress(int request, qint64 bytesSent)
+{
+  if (bytesSent <= 0 || !_inFlight.contains(request))
+    return;
+
+  LocalyticsUploadRequest &inFlight = _inFlight[request];
+  inFlight.lastProgress.start();
+  if (inFlight.connectMilliseconds < 0)
+    {
+      inFlight.connectMilliseconds = inFlight.posted.elapsed();
+    }
+}
+
+void LocalyticsUploader::requestFinished(int request, const LocalyticsTransportResponse &response)
+{
+  if (!_inFlight.contains(request))
+    return;
+
+  LOCALYTICS_DEBUG(QLatin1String("Reply finished"));
+  int responseStatusCode = response.statusCode;
+  LocalyticsUploadRequest inFlight = _inFlight.take(request);
+  QList<int> sequenceNumbers = inFlight.sequenceNumbers;
+  LocalyticsDatabase *db = _database;
+
+  qint64 elapsed = inFlight.posted.elapsed();
+  qint64 connectTime = inFlight.connectMilliseconds < 0 ? elapsed : inFlight.connectMilliseconds;
+  _stats.requests++;
+  _stats.bytesSent += inFlight.bytes;
+  _stats.connectMilliseconds += connectTime;
+  _stats.transferMilliseconds += elapsed - connectTime;
+  if (responseStatusCode == 0)
     {
       // On error, simply print the error and close the uploader.  We
       // have to assume the data was not transmited so it is not
       // deleted.  In the event that we accidently store data which
       // was succesfully uploaded, the duplicate data will be ignored
-      // by the server when it is next uploaded.
-      logMessage(QString(QLatin1String("Error Uploading.  Code: %1,  Description: %2")).arg(reply->error()).arg(reply->errorString()));
+      // by the server when it is next uploaded.  Batches which were
+      // already acknowledged stay deleted, and requests already in
+      // flight are allowed to complete.
+      LOCALYTICS_WARNING(QString(QLatin1String("Error Uploading.  Description: %1")).arg(response.errorString));
+      db->setJournalState(inFlight.journalId, JOURNAL_FAILED);
+      _pendingBatches.clear();
+      batchFailed(-1);
     }
   else 
     {
       // Step 3 
-      // While response status codes in the 5xx range leave upload
-      // rows intact, the default case is to delete.
-      if (responseStatusCode >= 500 && responseStatusCode < 600) 
+      // While response status codes in the 5xx range, and 429 (Too
+      // Many Requests), leave upload rows intact and are retried, the
+      // default case is to delete.  Other client errors leave them
+      // intact too, but would only fail the same way again.
+      if ((responseStatusCode >= 500 && responseStatusCode < 600) || responseStatusCode == 429) 
         {
-          logMessage(QString(QLatin1String("Upload failed with response status code %1")).arg(responseStatusCode));
+          LOCALYTICS_DEBUG(QString(QLatin1String("Upload failed with response status code %1")).arg(responseStatusCode));
+          db->setJournalState(inFlight.journalId, JOURNAL_FAILED);
+          _pendingBatches.clear();
+          batchFailed(LocalyticsRetryPolicy::parseRetryAfter(response.retryAfter));
         } 
+      else if (responseStatusCode >= 400)
+        {
+          LOCALYTICS_WARNING(QString(QLatin1String("Upload rejected with response status code %1")).arg(responseStatusCode));
+          db->setJournalState(inFlight.journalId, JOURNAL_FAILED);
+          _pendingBatches.clear();
+        }
       else
         {
-          // Because only one instance of the uploader can be running at
-          // a time it should not be possible for new upload rows to
-          // appear so there is no fear of deleting data which has not
-          // yet been uploaded.
-          logMessage(QString(QLatin1String("Upload completed successfully. Response code %1")).arg(responseStatusCode));
-          LocalyticsDatabase::sharedLocalyticsDatabase()->deleteUploadedData();
+          // Only the headers carried by this request are deleted.
+          // Events staged while the upload is running belong to newer
+          // headers, so there is no fear of deleting data which has
+          // not yet been uploaded.
+          // The acknowledgement is journaled first, so that if the
+          // process dies before the deletion the batch is deleted,
+          // not sent again, by the next upload.
+          LOCALYTICS_INFO(QString(QLatin1String("Upload completed successfully. Response code %1")).arg(responseStatusCode));
+          db->setJournalState(inFlight.journalId, JOURNAL_ACKED);
+          if (db->deleteUploadedData(sequenceNumbers))
+            {
+              db->removeJournalEntry(inFlight.journalId);
+              QFile::remove(spoolFileName(sequenceNumbers));
+            }
+          if (!_uploadFailed)
+            {
+              _retryPolicy.recordSuccess();
+            }
       }
     }
-  QByteArray responseData = reply->readAll();
-  if (responseData.length() > 0) 
+  if (response.body.length() > 0) 
     {
-      if (DO_LOCALYTICS_LOGGING) 
+      LOCALYTICS_DEBUG(QLatin1String("Response Body: ") + QString::fromUtf8(response.body));
+    }
+  postPendingBatches();
+}
+
+/*!
+ @method batchFailed
+ @abstract Notes that a request of the current upload failed, so that the upload is retried, once, when it finishes.
+ */
+void LocalyticsUploader::batchFailed(int retryAfter)
+{
+  _uploadFailed = true;
+  _retryAfter = qMax(_retryAfter, retryAfter);
+}
+
+/*!
+ @method checkDeadlines
+ @abstract Aborts the requests which exceeded a deadline.  Transports don't time requests out on their own, and a
+ response which never comes would otherwise leave the uploader busy for good.
+ */
+void LocalyticsUploader::checkDeadlines()
+{
+  QList<int> expired;
+  QHash<int, LocalyticsUploadRequest>::const_iterator i;
+  for (i = _inFlight.constBegin(); i != _inFlight.constEnd(); ++i)
+    {
+      const LocalyticsUploadRequest &inFlight = i.value();
+      qint64 elapsed = inFlight.posted.elapsed();
+      if (_totalDeadline > 0 && elapsed > _totalDeadline)
+        {
+          LOCALYTICS_WARNING(QString(QLatin1String("Upload request exceeded its %1 ms deadline")).arg(_totalDeadline));
+          _stats.totalDeadlinesExceeded++;
+        }
+      else if (_connectDeadline > 0 && inFlight.connectMilliseconds < 0 && elapsed > _connectDeadline)
         {
-          QString string = QString::fromUtf8(responseData);
-          logMessage(QLatin1String("Response Body: "));
-          logMessage(string);
+          LOCALYTICS_WARNING(QString(QLatin1String("Upload request not connected after %1 ms")).arg(_connectDeadline));
+          _stats.connectDeadlinesExceeded++;
         }
+      else if (_idleDeadline > 0 && inFlight.connectMilliseconds >= 0 && inFlight.lastProgress.elapsed() > _idleDeadline)
+        {
+          LOCALYTICS_WARNING(QString(QLatin1String("Upload request stalled for %1 ms")).arg(_idleDeadline));
+          _stats.idleDeadlinesExceeded++;
+        }
+      else
+        {
+          continue;
+        }
+      expired.append(i.key());
+    }
+
+  if (expired.isEmpty())
+    return;
 
+  for (int j = 0; j < expired.size(); j++)
+    {
+      abortRequest(expired.at(j));
     }
-  finishUpload();
+  _pendingBatches.clear();
+  batchFailed(-1);
+  postPendingBatches();
 }
 
-void LocalyticsUploader::finishUpload()
+/*!
+ @method abortRequest
+ @abstract Abandons a request in flight.  Its data is kept, as after a network error.
+ */
+void LocalyticsUploader::abortRequest(int request)
 {
-  _isUploading = false;
-  LocalyticsDatabase::sharedLocalyticsDatabase()->vacuumIfRequired();
-  emit uploadComplete();
+  LocalyticsUploadRequest inFlight = _inFlight.take(request);
+  _transport->abort(request);
+  _database->setJournalState(inFlight.journalId, JOURNAL_FAILED);
 }
 
-QByteArray LocalyticsUploader::gzipDeflate(QByteArray data)
+void LocalyticsUploader::cancelUpload()
 {
-  if (data.length() == 0)
-    return data;
-	
-  z_stream strm;
-  
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.total_out = 0;
-  strm.next_in=(Bytef *)data.data();
-  strm.avail_in = data.length();
-  
-  // Compresssion Levels:
-  //   Z_NO_COMPRESSION
-  //   Z_BEST_SPEED
-  //   Z_BEST_COMPRESSION
-  //   Z_DEFAULT_COMPRESSION
-  
-  if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, (15+16), 8, Z_DEFAULT_STRATEGY) != Z_OK)
-    return QByteArray();
-  
-  QByteArray compressed(16384, '\0');  // 16K chunks for expansion
-  
-  do {
-    
-    if (abs(strm.total_out) >= compressed.length())
-      compressed.resize(compressed.length() + 16384);
-    
-    strm.next_out = (Bytef *)compressed.data() + strm.total_out;
-    strm.avail_out = compressed.length() - strm.total_out;
-    
-    deflate(&strm, Z_FINISH);  
-    
-  } while (strm.avail_out == 0);
-  
-  deflateEnd(&strm);
-  
-  compressed.resize(strm.total_out);
-  return compressed;
+  _retryTimer->stop();
+  if (!isUploading())
+    return;
+
+  LOCALYTICS_INFO(QLatin1String("Cancelling upload"));
+  _pendingBatches.clear();
+  QList<int> requests = _inFlight.keys();
+  for (int i = 0; i < requests.size(); i++)
+    {
+      abortRequest(requests.at(i));
+    }
+  // A cancelled upload isn't a failure, and isn't retried.
+  _uploadFailed = false;
+  finishUpload();
+}
+
+void LocalyticsUploader::setDeadlines(int connectMilliseconds, int idleMilliseconds, int totalMilliseconds)
+{
+  _connectDeadline = connectMilliseconds;
+  _idleDeadline = idleMilliseconds;
+  _totalDeadline = totalMilliseconds;
 }
 
-void LocalyticsUploader::logMessage(QString message)
+void LocalyticsUploader::scheduleRetry(int retryAfter)
 {
-  if (DO_LOCALYTICS_LOGGING)
+  int delay = _retryPolicy.recordFailure(retryAfter);
+  if (delay < 0)
     {
-      qDebug() << "(localytics uploader) " << message;
+      LOCALYTICS_WARNING(QString(QLatin1String("Upload failed %1 times in a row. Suspending uploads.")).arg(_retryPolicy.consecutiveFailures()));
+      return;
     }
+  LOCALYTICS_DEBUG(QString(QLatin1String("Retrying upload in %1 ms")).arg(delay));
+  _retryTimer->start(delay);
+}
+
+void LocalyticsUploader::retryUpload()
+{
+  if (isUploading())
+    return;
+
+  LOCALYTICS_DEBUG(QLatin1String("Retrying upload"));
+  _isUploading = true;
+  startUpload();
+}
+
+bool LocalyticsUploader::isRetryScheduled() const
+{
+  return _retryTimer->isActive();
+}
+
+bool LocalyticsUploader::isCircuitOpen() const
+{
+  return _retryPolicy.isCircuitOpen();
+}
+
+void LocalyticsUploader::setMaxUploadBytes(qint64 bytes)
+{
+  _maxUploadBytes = bytes;
+}
+
+qint64 LocalyticsUploader::maxUploadBytes() const
+{
+  return _maxUploadBytes;
+}
+
+void LocalyticsUploader::setMaxConcurrentUploads(int requests)
+{
+  _maxConcurrentUploads = qMax(1, requests);
+}
+
+int LocalyticsUploader::maxConcurrentUploads() const
+{
+  return _maxConcurrentUploads;
+}
+
+void LocalyticsUploader::setMaxUploadRate(qint64 bytesPerSecond)
+{
+  _bucket->setRate(bytesPerSecond);
+}
+
+qint64 LocalyticsUploader::maxUploadRate() const
+{
+  return _bucket->rate();
+}
+
+LocalyticsUploadStats LocalyticsUploader::uploadStats() const
+{
+  LocalyticsUploadStats stats = _stats;
+  qint64 milliseconds = stats.connectMilliseconds + stats.transferMilliseconds;
+  stats.bytesPerSecond = milliseconds > 0 ? stats.bytesSent * 1000 / milliseconds : 0;
+  return stats;
+}
+
+void LocalyticsUploader::resetUploadStats()
+{
+  _stats.requests = 0;
+  _stats.bytesSent = 0;
+  _stats.connectMilliseconds = 0;
+  _stats.transferMilliseconds = 0;
+  _stats.bytesPerSecond = 0;
+  _stats.prewarms = 0;
+  _stats.prewarmMilliseconds = 0;
+  _stats.connectDeadlinesExceeded = 0;
+  _stats.idleDeadlinesExceeded = 0;
+  _stats.totalDeadlinesExceeded = 0;
+}
+
+void LocalyticsUploader::finishUpload()
+{
+  _watchdogTimer->stop();
+  _isUploading = false;
+  _database->vacuumIfRequired();
+  emit uploadComplete();
 }
 
 /*!
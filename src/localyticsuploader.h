@@ -30,20 +30,73 @@
 #ifndef LOCALYTICSUPLOADER_H
 #define LOCALYTICSUPLOADER_H
 
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
 #include <QtCore/QObject>
-#include <QtNetwork/QNetworkReply>
+#include <QtCore/QUrl>
+#include "localyticsdatabase.h"
+#include "localyticsretrypolicy.h"
+#include "localyticsshapeddevice.h"
+#include "localyticstransport.h"
 
-class QNetworkAccessManager;
+#define MAX_UPLOAD_BYTES 131072   // Default largest request body, in bytes of compressed data
+#define MAX_CONCURRENT_UPLOADS 2  // Default number of requests in flight at once
+#define UPLOAD_CONNECT_DEADLINE_MS 30000   // Longest a request may wait for its connection
+#define UPLOAD_IDLE_DEADLINE_MS    60000   // Longest a request may go without progress once connected
+#define UPLOAD_TOTAL_DEADLINE_MS   300000  // Longest a request may take altogether
+
+class QTimer;
+
+/*!
+  Timings of the uploads made so far.  Connection time runs from
+  posting a request until the first byte of its body is written, and
+  so covers any DNS lookup, TCP connect and TLS handshake; it is close
+  to zero on a reused connection.  Transfer time runs from there until
+  the response has arrived.  Throughput is the body bytes of the
+  completed requests over the time they took, and so shows the effect
+  of setMaxUploadRate().  Requests aborted by a deadline, see
+  setDeadlines(), are only counted by the deadline they exceeded.
+*/
+struct LocalyticsUploadStats
+{
+  int requests;
+  qint64 bytesSent;
+  qint64 connectMilliseconds;
+  qint64 transferMilliseconds;
+  qint64 bytesPerSecond;
+  int prewarms;
+  qint64 prewarmMilliseconds;
+  int connectDeadlinesExceeded;
+  int idleDeadlinesExceeded;
+  int totalDeadlinesExceeded;
+};
+
+/*
+  Bookkeeping of one request in flight.
+*/
+struct LocalyticsUploadRequest
+{
+  QList<int> sequenceNumbers;
+  qint64 bytes;
+  int journalId;
+  QElapsedTimer posted;
+  QElapsedTimer lastProgress;
+  qint64 connectMilliseconds;
+};
 
 class LocalyticsUploader : public QObject
 {
   Q_OBJECT
+  friend class UploaderTest;
+  friend class LocalyticsUploaderPool;
   public:
   /*!
     Establishes this as a Singleton Class allowing for data persistence.
   */
   static LocalyticsUploader* sharedLocalyticsUploader()
   {
+    QMutexLocker locker(&_sharedLock);
     if (!_sharedLocalyticsUploader)
       _sharedLocalyticsUploader = new LocalyticsUploader;
     return _sharedLocalyticsUploader;
@@ -77,6 +130,153 @@ class LocalyticsUploader : public QObject
   */
   void upload(QString localyticsApplicationKey, bool httpsMode, QString installId);
 
+  /*!
+    Limits the size of each upload request.
+
+    Staged headers are split into consecutive requests no larger than
+    this, and each batch is deleted as soon as its own request
+    succeeds, so a failure part way through a large backlog only
+    leaves the remaining batches to be sent again.  Headers are never
+    split: a single header larger than the limit is sent on its own.
+
+    \param bytes Largest request body, in bytes of compressed data.
+    Defaults to MAX_UPLOAD_BYTES.  LocalyticsSession::upload() sets it
+    for the current network type before each upload, see
+    LocalyticsUploadScheduler::setMaxUploadBytes().
+  */
+  void setMaxUploadBytes(qint64 bytes);
+  qint64 maxUploadBytes() const;
+
+  /*!
+    Limits how many requests are in flight at once.
+
+    When more than one batch is staged, for example after a long time
+    offline, up to this many are posted without waiting for each
+    other, so that draining the backlog is not serialized on the round
+    trip time.  Each request carries its own headers and only those
+    are deleted when it succeeds.
+
+    \param requests Number of concurrent requests, at least 1.
+    Defaults to MAX_CONCURRENT_UPLOADS.
+  */
+  void setMaxConcurrentUploads(int requests);
+  int maxConcurrentUploads() const;
+
+  /*!
+    Limits how fast request bodies are sent, so that a large backlog
+    doesn't crowd out the application's own traffic on a slow link.
+    The limit applies to all the requests in flight together, those of
+    every uploader for uploaders of a LocalyticsUploaderPool, and takes
+    effect from the next request posted.
+
+    \param bytesPerSecond Upload rate, or 0, the default, for no
+    limit.  LocalyticsSession::upload() sets it for the current
+    network type before each upload, see
+    LocalyticsUploadScheduler::setMaxUploadRate().
+  */
+  void setMaxUploadRate(qint64 bytesPerSecond);
+  qint64 maxUploadRate() const;
+
+  /*!
+    Spools request bodies to files before they are sent.
+
+    When enabled, each batch is written once, compressed and complete,
+    to a file in LocalyticsDatabase::spoolDirectory(), and posted from
+    a memory mapping of that file.  A batch which has to be sent again
+    after a failure is posted from the same file, grouped as before,
+    instead of being read back from the database.  The file is deleted
+    when the server acknowledges the batch.  Spool files count towards
+    MAX_DATABASE_SIZE, see LocalyticsDatabase::storageSize().
+
+    \param spooling `true` to spool request bodies.  Off by default.
+  */
+  void setSpooling(bool spooling);
+  bool isSpooling() const;
+
+  /*!
+    Sets how long a request may take before it is aborted.  A request
+    which exceeds a deadline fails as if the network had, so it is
+    retried with backoff and its data is kept.
+
+    \param connectMilliseconds Longest wait for the connection, up to
+    the first body bytes written.  Defaults to
+    UPLOAD_CONNECT_DEADLINE_MS.
+    \param idleMilliseconds Longest time without progress once
+    connected, including the wait for the response.  Defaults to
+    UPLOAD_IDLE_DEADLINE_MS.
+    \param totalMilliseconds Longest time for the whole request.
+    Defaults to UPLOAD_TOTAL_DEADLINE_MS.
+
+    A deadline of 0 is never exceeded.
+  */
+  void setDeadlines(int connectMilliseconds, int idleMilliseconds, int totalMilliseconds);
+
+  /*!
+    Stops the upload in progress, if any, and any scheduled retry.
+    Requests in flight are aborted, and their data is kept for the next
+    upload.  uploadComplete() is emitted if an upload was running.
+  */
+  void cancelUpload();
+
+  /*!
+    Sets where uploads are sent.
+
+    \param urlFormat The upload URL, in which `%1` is replaced by the
+    application key, e.g.
+    `http://localhost:8080/api/v2/applications/%1/uploads` for a local
+    stand-in collector.  An empty string, the default, selects the
+    Localytics service over HTTP or HTTPS as requested by upload().
+  */
+  void setEndpoint(const QString &urlFormat);
+  QString endpoint() const;
+
+  /*!
+    Sets how requests are sent.  The uploader takes ownership of the
+    transport and deletes the previous one, which must not have
+    requests in flight.  Defaults to a LocalyticsNetworkTransport, or
+    the pool's transport for uploaders of a LocalyticsUploaderPool.
+  */
+  void setTransport(LocalyticsTransport *transport);
+  LocalyticsTransport *transport() const;
+
+  /*!
+    Opens a connection to the upload server ahead of the first upload,
+    so that the DNS lookup, TCP connect and TLS handshake are out of
+    the way when data is posted.  The connection is kept alive and
+    reused by the uploads which follow.
+
+    Does nothing while an upload or another prewarm is in progress.
+
+    \param httpsMode Flag determining whether HTTP or HTTPS is used.
+  */
+  void prewarm(bool httpsMode);
+
+  /*!
+    \return Timings of the uploads and prewarms since the uploader was
+    created or the stats were last reset.
+  */
+  LocalyticsUploadStats uploadStats() const;
+  void resetUploadStats();
+
+  /*!
+    Failed uploads (network errors, 5xx and 429 responses) are retried
+    automatically with exponential backoff and jitter, honoring any
+    `Retry-After` header.  While a retry is scheduled, upload() does
+    not start another attempt early.
+
+    \return `true` if a retry is waiting for its backoff delay.
+  */
+  bool isRetryScheduled() const;
+
+  /*!
+    After repeated consecutive failures the uploader stops trying
+    until a cooldown has passed, so that no payloads are built or
+    compressed for a server which cannot take them.
+
+    \return `true` while uploads are suspended.
+  */
+  bool isCircuitOpen() const;
+
 
 signals:
   /*!
@@ -87,17 +287,59 @@ signals:
   void uploadComplete();
 
 private slots:
-  void replyFinished(QNetworkReply*);
+  void requestFinished(int request, const LocalyticsTransportResponse &response);
+  void requestUploadProgress(int request, qint64 bytesSent);
+  void transportPrewarmed();
+  void retryUpload();
+  void checkDeadlines();
     
 private:
-  explicit LocalyticsUploader(QObject *parent = 0);
-  void logMessage(QString message);
-  QByteArray gzipDeflate(QByteArray data);
+  explicit LocalyticsUploader(LocalyticsDatabase *database = 0, QObject *parent = 0);
+  LocalyticsUploader(LocalyticsDatabase *database, LocalyticsTransport *transport, QObject *parent = 0);
+  void setUp(LocalyticsDatabase *database);
+  void useTransport(LocalyticsTransport *transport, bool owned);
+  static QList<QList<LocalyticsUploadSegment> > batchSegments(const QList<LocalyticsUploadSegment> &segments, qint64 maxBytes);
+  static QByteArray bodyHash(const QList<LocalyticsUploadSegment> &batch);
+  QString spoolFileName(const QList<int> &sequenceNumbers);
+  QIODevice *openBody(const QList<LocalyticsUploadSegment> &batch);
+  QList<QList<LocalyticsUploadSegment> > recoverJournal(QList<LocalyticsUploadSegment> &segments);
+  void startUpload();
+  QUrl uploadUrl();
+  void postPendingBatches();
+  void postBatch(const QList<LocalyticsUploadSegment> &batch);
+  void batchFailed(int retryAfter);
+  void abortRequest(int request);
+  void scheduleRetry(int retryAfter);
   QString uploadTimestamp();
   void finishUpload();
-  QNetworkAccessManager *m_networkManager;
+  LocalyticsDatabase *_database;
+  LocalyticsTransport *_transport;
+  bool _ownsTransport;
   bool _isUploading;
+  QString _applicationKey;
+  bool _useHTTPS;
+  QString _installId;
+  qint64 _maxUploadBytes;
+  QList<QList<LocalyticsUploadSegment> > _pendingBatches;
+  int _maxConcurrentUploads;
+  bool _spooling;
+  QHash<int, LocalyticsUploadRequest> _inFlight;
+  bool _prewarming;
+  QElapsedTimer _prewarmStarted;
+  LocalyticsUploadStats _stats;
+  bool _uploadFailed;
+  int _retryAfter;
+  QString _urlFormat;
+  LocalyticsRetryPolicy _retryPolicy;
+  LocalyticsTokenBucket _uploadBucket;
+  LocalyticsTokenBucket *_bucket;
+  QTimer *_retryTimer;
+  int _connectDeadline;
+  int _idleDeadline;
+  int _totalDeadline;
+  QTimer *_watchdogTimer;
   static LocalyticsUploader* _sharedLocalyticsUploader;
+  static QMutex _sharedLock;
 };
 
 #endif // LOCALYTICSUPLOADER_H
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsuploaderpool.h"
+#include "localyticsnetworktransport.h"
+#include "localyticsuploader.h"
+
+LocalyticsUploaderPool* LocalyticsUploaderPool::_sharedUploaderPool = 0;
+QMutex LocalyticsUploaderPool::_sharedLock;
+
+LocalyticsUploaderPool::LocalyticsUploaderPool(QObject *parent) :
+  QObject(parent)
+{
+  _transport = new LocalyticsNetworkTransport(this);
+}
+
+LocalyticsUploaderPool* LocalyticsUploaderPool::sharedUploaderPool()
+{
+  QMutexLocker locker(&_sharedLock);
+  if (!_sharedUploaderPool)
+    _sharedUploaderPool = new LocalyticsUploaderPool;
+  return _sharedUploaderPool;
+}
+
+LocalyticsUploader *LocalyticsUploaderPool::uploaderForDatabase(LocalyticsDatabase *database)
+{
+  LocalyticsUploader *uploader = _uploaders.value(database);
+  if (!uploader)
+    {
+      uploader = new LocalyticsUploader(database, _transport, this);
+      uploader->_bucket = &_uploadBucket;
+      _uploaders.insert(database, uploader);
+    }
+  return uploader;
+}
+
+void LocalyticsUploaderPool::setTransport(LocalyticsTransport *transport)
+{
+  Q_ASSERT(!isUploading());
+  QHash<LocalyticsDatabase *, LocalyticsUploader *>::const_iterator i;
+  for (i = _uploaders.constBegin(); i != _uploaders.constEnd(); ++i)
+    {
+      i.value()->useTransport(transport, false);
+    }
+  _transport->deleteLater();
+  _transport = transport;
+  _transport->setParent(this);
+}
+
+LocalyticsTransport *LocalyticsUploaderPool::transport() const
+{
+  return _transport;
+}
+
+bool LocalyticsUploaderPool::isUploading() const
+{
+  QHash<LocalyticsDatabase *, LocalyticsUploader *>::const_iterator i;
+  for (i = _uploaders.constBegin(); i != _uploaders.constEnd(); ++i)
+    {
+      if (i.value()->isUploading())
+        return true;
+    }
+  return false;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSUPLOADERPOOL_H
+#define LOCALYTICSUPLOADERPOOL_H
+
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QObject>
+#include "localyticsshapeddevice.h"
+
+class LocalyticsDatabase;
+class LocalyticsTransport;
+class LocalyticsUploader;
+
+/*!
+  The uploaders of the sessions created with
+  LocalyticsSession::sessionForAppKey(), one per database.
+
+  Each uploader keeps its own batches, journal, retries and stats, but
+  they all send through one transport, so that their requests share
+  its connections, and through one token bucket, so that
+  LocalyticsUploader::setMaxUploadRate() limits their requests
+  together.
+*/
+class LocalyticsUploaderPool : public QObject
+{
+  Q_OBJECT
+  public:
+  static LocalyticsUploaderPool* sharedUploaderPool();
+
+  /*!
+    \return The uploader of `database`, created on first use.
+  */
+  LocalyticsUploader *uploaderForDatabase(LocalyticsDatabase *database);
+
+  /*!
+    Sets how the requests of every uploader of the pool are sent.  The
+    pool takes ownership of the transport and deletes the previous
+    one.  No upload may be in progress.  Defaults to a
+    LocalyticsNetworkTransport.
+  */
+  void setTransport(LocalyticsTransport *transport);
+  LocalyticsTransport *transport() const;
+
+  /*!
+    \return `true` if any uploader of the pool is uploading.
+  */
+  bool isUploading() const;
+
+  private:
+  explicit LocalyticsUploaderPool(QObject *parent = 0);
+
+  LocalyticsTransport *_transport;
+  LocalyticsTokenBucket _uploadBucket;
+  QHash<LocalyticsDatabase *, LocalyticsUploader *> _uploaders;
+  static LocalyticsUploaderPool* _sharedUploaderPool;
+  static QMutex _sharedLock;
+};
+
+#endif // LOCALYTICSUPLOADERPOOL_H
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include "localyticsuploadscheduler.h"
+#include "localyticsuploader.h"
+#include <QtCore/QTimer>
+
+LocalyticsUploadScheduler::LocalyticsUploadScheduler(LocalyticsUploader *uploader, QObject *parent) :
+  QObject(parent),
+  _uploader(uploader ? uploader : LocalyticsUploader::sharedLocalyticsUploader()),
+  _enabled(false),
+  _followUpRequested(false),
+  _pendingBytesThreshold(SCHEDULER_PENDING_BYTES_THRESHOLD),
+  _pendingEventsThreshold(SCHEDULER_PENDING_EVENTS_THRESHOLD),
+  _maxEventAge(SCHEDULER_MAX_EVENT_AGE_MS),
+  _idleTime(SCHEDULER_IDLE_MS),
+  _wifiMaxUploadBytes(SCHEDULER_WIFI_MAX_UPLOAD_BYTES),
+  _cellularMaxUploadBytes(SCHEDULER_CELLULAR_MAX_UPLOAD_BYTES),
+  _wifiMaxUploadRate(SCHEDULER_WIFI_MAX_UPLOAD_RATE),
+  _cellularMaxUploadRate(SCHEDULER_CELLULAR_MAX_UPLOAD_RATE),
+  _pendingBytes(0),
+  _pendingEvents(0)
+{
+  _ageTimer = new QTimer(this);
+  _ageTimer->setSingleShot(true);
+  connect(_ageTimer, SIGNAL(timeout()), this, SLOT(timerExpired()));
+
+  _idleTimer = new QTimer(this);
+  _idleTimer->setSingleShot(true);
+  connect(_idleTimer, SIGNAL(timeout()), this, SLOT(timerExpired()));
+
+  connect(_uploader, SIGNAL(uploadComplete()),
+          this, SLOT(uploadFinished()));
+}
+
+void LocalyticsUploadScheduler::setEnabled(bool enabled)
+{
+  _enabled = enabled;
+  if (!_enabled)
+    {
+      _ageTimer->stop();
+      _idleTimer->stop();
+    }
+}
+
+bool LocalyticsUploadScheduler::isEnabled() const
+{
+  return _enabled;
+}
+
+void LocalyticsUploadScheduler::setPendingBytesThreshold(qint64 bytes)
+{
+  _pendingBytesThreshold = bytes;
+}
+
+void LocalyticsUploadScheduler::setPendingEventsThreshold(int events)
+{
+  _pendingEventsThreshold = events;
+}
+
+void LocalyticsUploadScheduler::setMaxEventAge(int milliseconds)
+{
+  _maxEventAge = milliseconds;
+}
+
+void LocalyticsUploadScheduler::setIdleTime(int milliseconds)
+{
+  _idleTime = milliseconds;
+}
+
+void LocalyticsUploadScheduler::setMaxUploadBytes(qint64 wifiBytes, qint64 cellularBytes)
+{
+  _wifiMaxUploadBytes = wifiBytes;
+  _cellularMaxUploadBytes = cellularBytes;
+}
+
+qint64 LocalyticsUploadScheduler::maxUploadBytes(const QString &networkType) const
+{
+  return isCellular(networkType) ? _cellularMaxUploadBytes : _wifiMaxUploadBytes;
+}
+
+void LocalyticsUploadScheduler::setMaxUploadRate(qint64 wifiBytesPerSecond, qint64 cellularBytesPerSecond)
+{
+  _wifiMaxUploadRate = wifiBytesPerSecond;
+  _cellularMaxUploadRate = cellularBytesPerSecond;
+}
+
+qint64 LocalyticsUploadScheduler::maxUploadRate(const QString &networkType) const
+{
+  return isCellular(networkType) ? _cellularMaxUploadRate : _wifiMaxUploadRate;
+}
+
+bool LocalyticsUploadScheduler::isCellular(const QString &networkType)
+{
+  return networkType == QLatin1String("lte")
+    || networkType == QLatin1String("evdo")
+    || networkType == QLatin1String("cdma")
+    || networkType == QLatin1String("umts")
+    || networkType == QLatin1String("gsm");
+}
+
+void LocalyticsUploadScheduler::eventAdded(qint64 bytes)
+{
+  if (!_enabled)
+    return;
+
+  _pendingBytes += bytes;
+  _pendingEvents++;
+  if (!_ageTimer->isActive())
+    {
+      _ageTimer->start(_maxEventAge);
+    }
+  _idleTimer->start(_idleTime);
+
+  if (_pendingBytes >= _pendingBytesThreshold || _pendingEvents >= _pendingEventsThreshold)
+    {
+      requestUpload();
+    }
+}
+
+void LocalyticsUploadScheduler::lifecycleTransition()
+{
+  if (_enabled)
+    {
+      requestUpload();
+    }
+}
+
+void LocalyticsUploadScheduler::requestUpload()
+{
+  if (_uploader->isUploading())
+    {
+      // Everything recorded until the running upload completes goes
+      // out in one follow-up run.
+      _followUpRequested = true;
+      return;
+    }
+
+  _followUpRequested = false;
+  _pendingBytes = 0;
+  _pendingEvents = 0;
+  _ageTimer->stop();
+  _idleTimer->stop();
+  emit uploadDue();
+}
+
+/*!
+ @method timerExpired
+ @abstract Either the oldest waiting event reached its maximum age, or no event was recorded for the idle time.
+ */
+void LocalyticsUploadScheduler::timerExpired()
+{
+  if (_enabled && _pendingEvents > 0)
+    {
+      requestUpload();
+    }
+}
+
+void LocalyticsUploadScheduler::uploadFinished()
+{
+  if (_followUpRequested)
+    {
+      requestUpload();
+    }
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2012 Orangatame LLC
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met: 
+ *  * Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer.
+ *
+ *  * Neither the name of Orangatame LLC nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY ORANGATAME LLC. ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL ORANGATAME LLC BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#ifndef LOCALYTICSUPLOADSCHEDULER_H
+#define LOCALYTICSUPLOADSCHEDULER_H
+
+#include <QtCore/QObject>
+
+#define SCHEDULER_PENDING_BYTES_THRESHOLD   65536    // Bytes of event data which trigger an upload
+#define SCHEDULER_PENDING_EVENTS_THRESHOLD  100      // Number of unstaged events which trigger an upload
+#define SCHEDULER_MAX_EVENT_AGE_MS          300000   // Longest an event waits before an upload is triggered
+#define SCHEDULER_IDLE_MS                   30000    // Quiet time after the last event which triggers an upload
+#define SCHEDULER_WIFI_MAX_UPLOAD_BYTES     262144   // Largest request body on Wi-Fi and wired networks
+#define SCHEDULER_CELLULAR_MAX_UPLOAD_BYTES 65536    // Largest request body on cellular networks
+#define SCHEDULER_WIFI_MAX_UPLOAD_RATE      0        // Upload bytes per second on Wi-Fi and wired networks, 0 for no limit
+#define SCHEDULER_CELLULAR_MAX_UPLOAD_RATE  0        // Upload bytes per second on cellular networks, 0 for no limit
+
+class LocalyticsUploader;
+class QTimer;
+
+/*!
+  Decides when queued data is uploaded, so that applications get a
+  steady upload cadence without calling LocalyticsSession::upload()
+  themselves.
+
+  Once enabled, an upload is triggered when any of these is reached:
+  <ul>
+  <li>the event data recorded since the last upload exceeds
+  SCHEDULER_PENDING_BYTES_THRESHOLD bytes,</li>
+  <li>SCHEDULER_PENDING_EVENTS_THRESHOLD events are waiting,</li>
+  <li>the oldest waiting event is SCHEDULER_MAX_EVENT_AGE_MS old,</li>
+  <li>no event was recorded for SCHEDULER_IDLE_MS while some are
+  waiting,</li>
+  <li>the session is opened or closed.</li>
+  </ul>
+
+  Uploads requested while one is running, automatically or not, are
+  coalesced into a single follow-up run once it completes.
+*/
+class LocalyticsUploadScheduler : public QObject
+{
+  Q_OBJECT
+  public:
+  /*!
+    \param uploader The uploader whose uploads are coalesced, by
+    default the shared one.
+  */
+  explicit LocalyticsUploadScheduler(LocalyticsUploader *uploader = 0, QObject *parent = 0);
+
+  /*!
+    Turns the automatic triggers on or off.  Disabled by default;
+    coalescing of upload requests works either way.
+  */
+  void setEnabled(bool enabled);
+  bool isEnabled() const;
+
+  void setPendingBytesThreshold(qint64 bytes);
+  void setPendingEventsThreshold(int events);
+  void setMaxEventAge(int milliseconds);
+  void setIdleTime(int milliseconds);
+  void setMaxUploadBytes(qint64 wifiBytes, qint64 cellularBytes);
+
+  /*!
+    \param networkType The network type reported in the upload header.
+    \return The request size limit to use on that network.
+  */
+  qint64 maxUploadBytes(const QString &networkType) const;
+
+  /*!
+    Sets the upload rates used on each kind of network, in bytes per
+    second, or 0 for no limit.  Neither is limited by default.
+  */
+  void setMaxUploadRate(qint64 wifiBytesPerSecond, qint64 cellularBytesPerSecond);
+
+  /*!
+    \param networkType The network type reported in the upload header.
+    \return The upload rate limit to use on that network.
+  */
+  qint64 maxUploadRate(const QString &networkType) const;
+
+  /*!
+    \return `true` for the cellular technologies named in the upload
+    header ("lte", "evdo", "cdma", "umts" and "gsm").
+  */
+  static bool isCellular(const QString &networkType);
+
+  /*!
+    Records that an event of `bytes` bytes was stored.
+  */
+  void eventAdded(qint64 bytes);
+
+  /*!
+    Records that the session was opened or closed.
+  */
+  void lifecycleTransition();
+
+  /*!
+    Asks for an upload now, or as soon as the running one completes.
+  */
+  void requestUpload();
+
+signals:
+  /*!
+    Emitted when an upload should be staged and started.
+  */
+  void uploadDue();
+
+private slots:
+  void timerExpired();
+  void uploadFinished();
+
+private:
+  LocalyticsUploader *_uploader;
+  bool _enabled;
+  bool _followUpRequested;
+  qint64 _pendingBytesThreshold;
+  int _pendingEventsThreshold;
+  int _maxEventAge;
+  int _idleTime;
+  qint64 _wifiMaxUploadBytes;
+  qint64 _cellularMaxUploadBytes;
+  qint64 _wifiMaxUploadRate;
+  qint64 _cellularMaxUploadRate;
+  qint64 _pendingBytes;
+  int _pendingEvents;
+  QTimer *_ageTimer;
+  QTimer *_idleTimer;
+};
+
+#endif // LOCALYTICSUPLOADSCHEDULER_H
@@ -9,6 +9,24 @@ TARGET = qlocalytics
 DESTDIR = $$QLOCALYTICS_BASE/lib
 #CONFIG += create_prl # ???
 LIBS += -lz
+
+# Build with "CONFIG+=qlocalytics_verbose" to compile in debug messages.
+qlocalytics_verbose {
+  DEFINES += QLOCALYTICS_VERBOSE_DEBUG_OUTPUT
+}
+
+# Build with "CONFIG+=qlocalytics_libdeflate" to compress with libdeflate.
+qlocalytics_libdeflate {
+  DEFINES += QLOCALYTICS_USE_LIBDEFLATE
+  LIBS += -ldeflate
+}
+
+# Build with "CONFIG+=qlocalytics_tsan" to check for data races with
+# ThreadSanitizer.
+qlocalytics_tsan {
+  QMAKE_CXXFLAGS += -fsanitize=thread -fno-omit-frame-pointer
+  QMAKE_LFLAGS += -fsanitize=thread
+}
 VERSION = 0.0.1
 
 QLOCALYTICS_CPP = $$QLOCALYTICS_SRCBASE
@@ -16,16 +34,52 @@ QLOCALYTICS_CPP = $$QLOCALYTICS_SRCBASE
 INCLUDEPATH += $$QLOCALYTICS_CPP
 
 
+PRIVATE_HEADERS += \
+  localyticsclock.h \
+  localyticseventbuffer.h \
+  localyticsflowring.h \
+  localyticsretrypolicy.h \
+  localyticssequence.h \
+  localyticsshapeddevice.h \
+  localyticsspooldevice.h \
+  localyticsuploaddevice.h
+
 PUBLIC_HEADERS += \
+  localyticscompressor.h \
   localyticsdatabase.h \
+  localyticslog.h \
+  localyticsloopbacktransport.h \
+  localyticsnetworktransport.h \
+  localyticsrelay.h \
   localyticssession.h \
+  localyticssockettransport.h \
+  localyticstransport.h \
   localyticsuploader.h \
+  localyticsuploaderpool.h \
+  localyticsuploadscheduler.h \
   webserviceconstants.h
 
 HEADERS += $$PRIVATE_HEADERS $$PUBLIC_HEADERS
 
 SOURCES += \
+  localyticsclock.cpp \
+  localyticscompressor.cpp \
   localyticsdatabase.cpp \
+  localyticseventbuffer.cpp \
+  localyticsflowring.cpp \
+  localyticslog.cpp \
+  localyticsloopbacktransport.cpp \
+  localyticsnetworktransport.cpp \
+  localyticsrelay.cpp \
+  localyticsretrypolicy.cpp \
+  localyticssequence.cpp \
   localyticssession.cpp \
-  localyticsuploader.cpp
+  localyticsshapeddevice.cpp \
+  localyticssockettransport.cpp \
+  localyticsspooldevice.cpp \
+  localyticstransport.cpp \
+  localyticsuploaddevice.cpp \
+  localyticsuploader.cpp \
+  localyticsuploaderpool.cpp \
+  localyticsuploadscheduler.cpp
 
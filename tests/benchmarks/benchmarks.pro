@@ -0,0 +1,18 @@
+include(../../buildInfo.pri)
+
+QT += qtestlib
+CONFIG += qtestlib
+
+include(../../libraryIncludes.pri)
+
+TARGET = testbenchmarks
+DESTDIR = $${TESTS_DIRECTORY}/benchmarks
+OBJECTS_DIR = $${TESTS_DIRECTORY}/benchmarks
+MOC_DIR = $${TESTS_DIRECTORY}/benchmarks
+
+SOURCES += testbenchmarks.cpp
+
+# "make benchmarks" runs them and writes their results as XML.
+benchmarks.commands = $${DESTDIR}/testbenchmarks -xml -o $${TESTS_DIRECTORY}/benchmarks.xml
+benchmarks.depends = $${DESTDIR}/testbenchmarks
+QMAKE_EXTRA_TARGETS += benchmarks
@@ -0,0 +1,376 @@
+#include <QtTest/QtTest>
+#include <QtCore/QDir>
+#include <QtCore/QThread>
+#include <QLocalytics/QLocalyticsCompressor>
+#include <QLocalytics/QLocalyticsDatabase>
+#include <QLocalytics/QLocalyticsEventBuffer>
+#include <QLocalytics/QLocalyticsSession>
+
+#define BENCHMARK_APP_KEY "b8ebdecee388a9cb1219c89-1bb6b05a-2af6-11e2-6265-00ef75f32667"
+
+// A stored event as tagEvent() writes it.
+#define BENCHMARK_EVENT_BLOB "{\"dt\":\"e\",\"u\":\"3c5c1a4e-90fb-4b1e-8f57-6a2b1d3c4e5f\",\"n\":\"Barcode Added\",\"ct\":1352000000," \
+  "\"au\":\"" BENCHMARK_APP_KEY "\",\"su\":\"0f4c2e9a-7d1b-4c3a-9e8f-1a2b3c4d5e6f\"," \
+  "\"attrs\":{\"Barcode Length\":\"13\",\"Format\":\"EAN-13\"}}\n"
+
+#define BENCHMARK_BUFFERED_EVENTS 10000   // Events tagged from another thread by one buffering pass
+
+/*
+  Tags events from a thread of its own, where they are only formatted
+  and buffered.
+*/
+class TagThread : public QThread
+{
+public:
+  TagThread(const QVariantMap &attributes) : elapsed(0), _attributes(attributes) {}
+
+  qint64 elapsed; // nanoseconds
+
+protected:
+  void run()
+  {
+    LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+    QString name(QLatin1String("Barcode Added"));
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < BENCHMARK_BUFFERED_EVENTS; i++)
+      session->tagEvent(name, _attributes);
+    elapsed = timer.nsecsElapsed();
+  }
+
+private:
+  QVariantMap _attributes;
+};
+
+/*
+  Benchmarks of the paths which run for every event, upload and
+  session.  They run against a database of their own, in a temporary
+  home directory, and their results can be written as XML with
+  "-xml -o <file>" to be compared from release to release.
+*/
+class BenchmarkTest : public QObject
+{
+    Q_OBJECT
+
+
+private slots:
+  void initTestCase();
+  void benchmarkTagEvent_data();
+  void benchmarkTagEvent();
+  void benchmarkEscapeString_data();
+  void benchmarkEscapeString();
+  void benchmarkUploadBlobString_data();
+  void benchmarkUploadBlobString();
+  void benchmarkGzipDeflate_data();
+  void benchmarkGzipDeflate();
+  void benchmarkStageEventsForUpload_data();
+  void benchmarkStageEventsForUpload();
+  void benchmarkDeleteUploadedData_data();
+  void benchmarkDeleteUploadedData();
+  void benchmarkVacuumIfRequired_data();
+  void benchmarkVacuumIfRequired();
+  void benchmarkSessionCycle_data();
+  void benchmarkSessionCycle();
+
+private:
+  void fillEvents(int count);
+  int stageEvents(int count);
+};
+
+void BenchmarkTest::initTestCase()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  LocalyticsDatabase::sharedLocalyticsDatabase()->resetAnalyticsData();
+  session->init(QLatin1String(BENCHMARK_APP_KEY));
+  QVERIFY(session->hasInitialized());
+}
+
+/*
+  Replaces the events of the database with a number of copies of the
+  sample event.
+*/
+void BenchmarkTest::fillEvents(int count)
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  QVERIFY(db->resetAnalyticsData());
+  QString blob(QLatin1String(BENCHMARK_EVENT_BLOB));
+  QString t(QLatin1String("fill_events"));
+  QVERIFY(db->beginTransaction(t));
+  for (int i = 0; i < count; i++)
+    QVERIFY(db->addEventWithBlobString(blob));
+  QVERIFY(db->releaseTransaction(t));
+}
+
+/*
+  Adds an upload header for the events not staged yet.
+  \return The header's row id.
+*/
+int BenchmarkTest::stageEvents(int count)
+{
+  static int sequenceNumber = 0;
+  int headerId = 0;
+  fillEvents(count);
+  LocalyticsDatabase::sharedLocalyticsDatabase()->addHeaderWithSequenceNumber(++sequenceNumber, QLatin1String("{\"dt\":\"h\"}\n"), &headerId);
+  return headerId;
+}
+
+void BenchmarkTest::benchmarkTagEvent_data()
+{
+  QTest::addColumn<int>("attributes");
+  QTest::addColumn<bool>("stored");
+
+  QTest::newRow("buffered, no attributes") << 0 << false;
+  QTest::newRow("buffered, 5 attributes") << 5 << false;
+  QTest::newRow("stored, no attributes") << 0 << true;
+  QTest::newRow("stored, 5 attributes") << 5 << true;
+}
+
+void BenchmarkTest::benchmarkTagEvent()
+{
+  QFETCH(int, attributes);
+  QFETCH(bool, stored);
+
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->resetAnalyticsData());
+  session->resume();
+  QVERIFY(session->_isSessionOpen);
+
+  QVariantMap map;
+  for (int i = 0; i < attributes; i++)
+    map.insert(QString(QLatin1String("Attribute %1")).arg(i), QString(QLatin1String("Value %1")).arg(i));
+
+  if (stored)
+    {
+      // Formatting, buffering and the database write, with the buffer
+      // drained on every iteration.
+      QString name(QLatin1String("Barcode Added"));
+      QBENCHMARK {
+        session->tagEvent(name, map);
+        session->flushEventBuffers();
+      }
+    }
+  else
+    {
+      // Formatting and buffering only: events tagged on another thread
+      // wait for the session's thread, which is blocked here until the
+      // pass is timed.  They are stored untimed afterwards.
+      TagThread thread(map);
+      thread.start();
+      QVERIFY(thread.wait(60000));
+      session->flushEventBuffers();
+      QTest::setBenchmarkResult(thread.elapsed / 1e6 / BENCHMARK_BUFFERED_EVENTS, QTest::WalltimeMilliseconds);
+    }
+  QVERIFY(session->_eventBuffers->takeAll().isEmpty());
+  session->close();
+}
+
+void BenchmarkTest::benchmarkEscapeString_data()
+{
+  QTest::addColumn<QString>("input");
+
+  QTest::newRow("plain") << QString(QLatin1String("Barcode Added"));
+  QTest::newRow("quotes and controls") << QString(QLatin1String("\"Quoted\"\tand\\escaped\r\n"));
+  QTest::newRow("1 KB") << QString(QLatin1String("Some \"text\" to escape\n")).repeated(43);
+}
+
+void BenchmarkTest::benchmarkEscapeString()
+{
+  QFETCH(QString, input);
+
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  QString escaped;
+  QBENCHMARK {
+    escaped = session->escapeString(input);
+  }
+  QVERIFY(escaped.length() >= input.length());
+}
+
+void BenchmarkTest::benchmarkUploadBlobString_data()
+{
+  QTest::addColumn<int>("rows");
+
+  QTest::newRow("1k rows") << 1000;
+  QTest::newRow("10k rows") << 10000;
+  QTest::newRow("100k rows") << 100000;
+}
+
+void BenchmarkTest::benchmarkUploadBlobString()
+{
+  QFETCH(int, rows);
+
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  fillEvents(rows);
+  QString blob;
+  QBENCHMARK {
+    blob = db->uploadBlobString();
+  }
+  QCOMPARE(blob.length(), rows * QString(QLatin1String(BENCHMARK_EVENT_BLOB)).length());
+}
+
+void BenchmarkTest::benchmarkGzipDeflate_data()
+{
+  QTest::addColumn<int>("rows");
+
+  QTest::newRow("1k rows") << 1000;
+  QTest::newRow("10k rows") << 10000;
+  QTest::newRow("100k rows") << 100000;
+}
+
+void BenchmarkTest::benchmarkGzipDeflate()
+{
+  QFETCH(int, rows);
+
+  QByteArray data = QByteArray(BENCHMARK_EVENT_BLOB).repeated(rows);
+  QByteArray compressed;
+  QBENCHMARK {
+    compressed = LocalyticsCompressor::gzipDeflate(data);
+  }
+  QVERIFY(!compressed.isEmpty());
+  QVERIFY(compressed.size() < data.size());
+}
+
+void BenchmarkTest::benchmarkStageEventsForUpload_data()
+{
+  QTest::addColumn<int>("rows");
+
+  QTest::newRow("1k rows") << 1000;
+  QTest::newRow("10k rows") << 10000;
+}
+
+void BenchmarkTest::benchmarkStageEventsForUpload()
+{
+  QFETCH(int, rows);
+
+  // Staging consumes the events, so only one pass can be timed.
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  int headerId = stageEvents(rows);
+  bool staged = false;
+  QBENCHMARK_ONCE {
+    staged = db->stageEventsForUpload(headerId);
+  }
+  QVERIFY(staged);
+  QCOMPARE(db->unstagedEventCount(), 0);
+}
+
+void BenchmarkTest::benchmarkDeleteUploadedData_data()
+{
+  QTest::addColumn<int>("rows");
+
+  QTest::newRow("1k rows") << 1000;
+  QTest::newRow("10k rows") << 10000;
+}
+
+void BenchmarkTest::benchmarkDeleteUploadedData()
+{
+  QFETCH(int, rows);
+
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  QVERIFY(db->stageEventsForUpload(stageEvents(rows)));
+  bool deleted = false;
+  QBENCHMARK_ONCE {
+    deleted = db->deleteUploadedData();
+  }
+  QVERIFY(deleted);
+  QCOMPARE(db->eventCount(), 0);
+}
+
+void BenchmarkTest::benchmarkVacuumIfRequired_data()
+{
+  QTest::addColumn<bool>("required");
+
+  QTest::newRow("under the threshold") << false;
+  QTest::newRow("after a bulk delete") << true;
+}
+
+void BenchmarkTest::benchmarkVacuumIfRequired()
+{
+  QFETCH(bool, required);
+
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  if (required)
+    {
+      // Deleted rows leave the file over the threshold until it is vacuumed.
+      fillEvents(10000);
+      QVERIFY(db->resetAnalyticsData());
+      QVERIFY(db->databaseSize() > MAX_DATABASE_SIZE * VACUUM_THRESHOLD);
+      QBENCHMARK_ONCE {
+        db->vacuumIfRequired();
+      }
+    }
+  else
+    {
+      QVERIFY(db->resetAnalyticsData());
+      db->vacuumIfRequired();
+      QBENCHMARK {
+        db->vacuumIfRequired();
+      }
+    }
+  QVERIFY(db->databaseSize() <= MAX_DATABASE_SIZE * VACUUM_THRESHOLD);
+}
+
+void BenchmarkTest::benchmarkSessionCycle_data()
+{
+  QTest::addColumn<bool>("resumed");
+
+  QTest::newRow("open and close") << false;
+  QTest::newRow("resume and close") << true;
+}
+
+void BenchmarkTest::benchmarkSessionCycle()
+{
+  QFETCH(bool, resumed);
+
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  LocalyticsDatabase::sharedLocalyticsDatabase()->resetAnalyticsData();
+  session->resume();
+  session->close();
+  QBENCHMARK {
+    // Promoting the close event of the last session makes resume()
+    // open a new one.
+    if (!resumed)
+      session->promoteProvisionalEvents();
+    QCOMPARE(session->resume(), resumed);
+    session->tagScreen(QLatin1String("Benchmark"));
+    session->close();
+  }
+}
+
+/*
+  Removes a directory and everything in it.
+*/
+static void removeTree(const QString &path)
+{
+  QDir directory(path);
+  QFileInfoList entries = directory.entryInfoList(QDir::NoDotAndDotDot | QDir::AllEntries | QDir::Hidden);
+  for (int i = 0; i < entries.size(); i++)
+    {
+      if (entries.at(i).isDir())
+        removeTree(entries.at(i).absoluteFilePath());
+      else
+        directory.remove(entries.at(i).fileName());
+    }
+  directory.rmdir(path);
+}
+
+int main(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+
+  // The benchmarks fill and empty the database many times, so they
+  // don't touch that of the user running them.
+  QString home = QDir::tempPath() + QLatin1String("/qlocalytics-benchmarks-") + QString::number(QCoreApplication::applicationPid());
+  QDir().mkpath(home);
+  qputenv("HOME", QFile::encodeName(home));
+
+  BenchmarkTest test;
+  int result = QTest::qExec(&test, argc, argv);
+
+  removeTree(home);
+  return result;
+}
+
+#ifdef QMAKE_BUILD
+#include "testbenchmarks.moc"
+#else
+#include "moc_testbenchmarks.cxx"
+#endif
@@ -0,0 +1,12 @@
+include(../../buildInfo.pri)
+
+QT += qtestlib
+CONFIG += qtestlib
+
+include(../../libraryIncludes.pri)
+
+DESTDIR = $${TESTS_DIRECTORY}/clock
+OBJECTS_DIR = $${TESTS_DIRECTORY}/clock
+MOC_DIR = $${TESTS_DIRECTORY}/clock
+
+SOURCES += testclock.cpp
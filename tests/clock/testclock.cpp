@@ -0,0 +1,120 @@
+#include <QtTest/QtTest>
+#include <QtCore/QDateTime>
+#include <QLocalytics/QLocalyticsClock>
+
+// Calls timed by the benchmark.
+#define BENCHMARK_CALLS 200000
+
+class ClockTest : public QObject
+{
+    Q_OBJECT
+
+
+private slots:
+  void testMonotonic();
+  void testElapsedRealtime();
+  void testEpoch();
+  void testFormat();
+  void benchmarkClientTime_data();
+  void benchmarkClientTime();
+};
+
+void ClockTest::testMonotonic()
+{
+  qint64 first = LocalyticsClock::monotonicMSecs();
+  QTest::qWait(50);
+  qint64 second = LocalyticsClock::monotonicMSecs();
+  QVERIFY(second - first >= 45);
+  for (int i = 0; i < 1000; i++)
+    {
+      qint64 next = LocalyticsClock::monotonicMSecs();
+      QVERIFY(next >= second);
+      second = next;
+    }
+}
+
+void ClockTest::testElapsedRealtime()
+{
+  // Awake, it advances with the monotonic clock.
+  qint64 realtime = LocalyticsClock::elapsedRealtimeMSecs();
+  qint64 monotonic = LocalyticsClock::monotonicMSecs();
+  QTest::qWait(50);
+  qint64 realtimeElapsed = LocalyticsClock::elapsedRealtimeMSecs() - realtime;
+  qint64 monotonicElapsed = LocalyticsClock::monotonicMSecs() - monotonic;
+  QVERIFY(realtimeElapsed >= 45);
+  QVERIFY(qAbs(realtimeElapsed - monotonicElapsed) < 20);
+  for (int i = 0; i < 1000; i++)
+    {
+      qint64 next = LocalyticsClock::elapsedRealtimeMSecs();
+      QVERIFY(next >= realtime);
+      realtime = next;
+    }
+}
+
+void ClockTest::testEpoch()
+{
+  // The cached base stays within a few milliseconds of the wall clock.
+  qint64 wall = QDateTime::currentMSecsSinceEpoch();
+  qint64 clock = LocalyticsClock::currentMSecsSinceEpoch();
+  QVERIFY(qAbs(clock - wall) < 50);
+  QVERIFY(qAbs((qint64) LocalyticsClock::clientTime().toUInt() - (qint64) QDateTime::currentDateTime().toTime_t()) <= 1);
+}
+
+void ClockTest::testFormat()
+{
+  QCOMPARE(LocalyticsClock::formatTime(Q_INT64_C(1352000000123)), QString(QLatin1String("1352000000")));
+  QCOMPARE(LocalyticsClock::formatTime(Q_INT64_C(1352000000123), true), QString(QLatin1String("1352000000.123")));
+  QCOMPARE(LocalyticsClock::formatTime(Q_INT64_C(1352000000005), true), QString(QLatin1String("1352000000.005")));
+}
+
+void ClockTest::benchmarkClientTime_data()
+{
+  QTest::addColumn<int>("source");
+
+  QTest::newRow("QDateTime::currentDateTime().toTime_t()") << 0;
+  QTest::newRow("LocalyticsClock::currentMSecsSinceEpoch()") << 1;
+  QTest::newRow("LocalyticsClock::clientTime()") << 2;
+  QTest::newRow("LocalyticsClock::clientTime(true)") << 3;
+}
+
+void ClockTest::benchmarkClientTime()
+{
+  QFETCH(int, source);
+
+  // The old per-event formatting is timed along with the read.
+  QElapsedTimer timer;
+  timer.start();
+  int length = 0;
+  for (int i = 0; i < BENCHMARK_CALLS; i++)
+    {
+      switch (source)
+        {
+        case 0:
+          length += QString(QLatin1String("%1")).arg((double) QDateTime::currentDateTime().toTime_t(), 0, 'f', 0).length();
+          break;
+        case 1:
+          length += (int) (LocalyticsClock::currentMSecsSinceEpoch() & 1);
+          break;
+        case 2:
+          length += LocalyticsClock::clientTime().length();
+          break;
+        default:
+          length += LocalyticsClock::clientTime(true).length();
+          break;
+        }
+    }
+  qint64 elapsed = timer.nsecsElapsed();
+  QVERIFY(length >= 0);
+
+  double nsPerCall = (double) elapsed / BENCHMARK_CALLS;
+  qDebug() << QTest::currentDataTag()
+           << "ns/call" << QString::number(nsPerCall, 'f', 1).toUtf8().constData();
+  QTest::setBenchmarkResult(1e9 / qMax(nsPerCall, 1.0), QTest::Events);
+}
+
+QTEST_MAIN(ClockTest)
+#ifdef QMAKE_BUILD
+#include "testclock.moc"
+#else
+#include "moc_testclock.cxx"
+#endif
@@ -0,0 +1,16 @@
+include(../../buildInfo.pri)
+
+QT += qtestlib
+CONFIG += qtestlib
+
+include(../../libraryIncludes.pri)
+
+DESTDIR = $${TESTS_DIRECTORY}/compression
+OBJECTS_DIR = $${TESTS_DIRECTORY}/compression
+MOC_DIR = $${TESTS_DIRECTORY}/compression
+
+# The benchmark reads recorded event payloads from the source directory
+DEFINES += SRCDIR=\\\"$$PWD/\\\"
+LIBS += -lz
+
+SOURCES += testcompression.cpp
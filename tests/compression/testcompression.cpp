@@ -0,0 +1,179 @@
+#include <QtTest/QtTest>
+#include <QLocalytics/QLocalyticsCompressor>
+#include <zlib.h>
+
+// Size of the payload each setting is measured on, in bytes.
+#define BENCHMARK_PAYLOAD_SIZE (1024 * 1024)
+
+class CompressionTest : public QObject
+{
+    Q_OBJECT
+    
+    
+private slots:
+  void initTestCase();
+  void testRoundTrip();
+  void testAdaptiveLevel();
+  void benchmarkSettings_data();
+  void benchmarkSettings();
+
+private:
+  QByteArray inflate(const QByteArray &member);
+  QByteArray _payload;
+};
+
+
+void CompressionTest::initTestCase()
+{
+  // Recorded event blobs, repeated with fresh UUIDs so that the
+  // payload doesn't compress better than real traffic would.
+  QFile file(QLatin1String(SRCDIR "events.txt"));
+  QVERIFY(file.open(QIODevice::ReadOnly));
+  QString recorded = QString::fromUtf8(file.readAll());
+  QVERIFY(!recorded.isEmpty());
+
+  QRegExp uuid(QLatin1String("\\{[0-9a-f-]{36}\\}"));
+  while (_payload.length() < BENCHMARK_PAYLOAD_SIZE)
+    {
+      QString copy = recorded;
+      int pos = 0;
+      while ((pos = uuid.indexIn(copy, pos)) != -1)
+        {
+          QString fresh = QUuid::createUuid().toString();
+          copy.replace(pos, uuid.matchedLength(), fresh);
+          pos += fresh.length();
+        }
+      _payload.append(copy.toUtf8());
+    }
+
+#ifdef QLOCALYTICS_USE_LIBDEFLATE
+  qDebug() << "Compression backend: libdeflate";
+#else
+  qDebug() << "Compression backend: zlib" << zlibVersion();
+#endif
+}
+
+QByteArray CompressionTest::inflate(const QByteArray &member)
+{
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.next_in = (Bytef *)member.data();
+  strm.avail_in = member.length();
+  if (inflateInit2(&strm, 15 + 32) != Z_OK)
+    return QByteArray();
+
+  QByteArray result;
+  char window[16384];
+  int code;
+  do {
+    strm.next_out = (Bytef *)window;
+    strm.avail_out = sizeof(window);
+    code = inflate(&strm, Z_NO_FLUSH);
+    result.append(window, sizeof(window) - strm.avail_out);
+  } while (code == Z_OK);
+  inflateEnd(&strm);
+  return code == Z_STREAM_END ? result : QByteArray();
+}
+
+void CompressionTest::testRoundTrip()
+{
+  // Input fed in odd-sized pieces comes back out unchanged.
+  LocalyticsCompressor compressor;
+  QByteArray member;
+  QVERIFY(compressor.begin());
+  for (int pos = 0; pos < _payload.length(); pos += 7001)
+    {
+      QVERIFY(compressor.append(_payload.mid(pos, 7001), &member));
+    }
+  QVERIFY(compressor.finish(&member));
+  QVERIFY(member.length() < _payload.length());
+  QCOMPARE(inflate(member), _payload);
+
+  QCOMPARE(inflate(LocalyticsCompressor::gzipDeflate(_payload)), _payload);
+  QVERIFY(LocalyticsCompressor::gzipDeflate(QByteArray()).isEmpty());
+}
+
+void CompressionTest::testAdaptiveLevel()
+{
+  LocalyticsCompressor compressor;
+  compressor.setLevel(COMPRESSION_LEVEL_ADAPTIVE);
+
+  // Small members can afford the best compression.
+  QByteArray member;
+  QByteArray small = _payload.left(4096);
+  QVERIFY(compressor.begin(small.length()));
+  QVERIFY(compressor.append(small, &member));
+  QVERIFY(compressor.finish(&member));
+  QCOMPARE(compressor.effectiveLevel(), 9);
+  QCOMPARE(inflate(member), small);
+
+  // Large ones fall back to faster levels to stay within the budget.
+  member.clear();
+  QVERIFY(compressor.begin(_payload.length()));
+  QVERIFY(compressor.append(_payload, &member));
+  QVERIFY(compressor.finish(&member));
+  QVERIFY(compressor.effectiveLevel() < 9);
+  QCOMPARE(inflate(member), _payload);
+}
+
+void CompressionTest::benchmarkSettings_data()
+{
+  QTest::addColumn<int>("level");
+  QTest::addColumn<int>("strategy");
+  QTest::addColumn<int>("memLevel");
+
+  QTest::newRow("level 1")       << 1 << (int) Z_DEFAULT_STRATEGY << 8;
+  QTest::newRow("level 6")       << 6 << (int) Z_DEFAULT_STRATEGY << 8;
+  QTest::newRow("level 9")       << 9 << (int) Z_DEFAULT_STRATEGY << 8;
+  QTest::newRow("default")       << (int) Z_DEFAULT_COMPRESSION << (int) Z_DEFAULT_STRATEGY << 8;
+  QTest::newRow("adaptive")      << (int) COMPRESSION_LEVEL_ADAPTIVE << (int) Z_DEFAULT_STRATEGY << 8;
+  QTest::newRow("filtered")      << 6 << (int) Z_FILTERED << 8;
+  QTest::newRow("huffman only")  << 6 << (int) Z_HUFFMAN_ONLY << 8;
+  QTest::newRow("rle")           << 6 << (int) Z_RLE << 8;
+  QTest::newRow("memLevel 1")    << 6 << (int) Z_DEFAULT_STRATEGY << 1;
+  QTest::newRow("memLevel 9")    << 6 << (int) Z_DEFAULT_STRATEGY << 9;
+}
+
+void CompressionTest::benchmarkSettings()
+{
+  QFETCH(int, level);
+  QFETCH(int, strategy);
+  QFETCH(int, memLevel);
+
+  LocalyticsCompressor compressor;
+  compressor.setLevel(level);
+  compressor.setStrategy(strategy);
+  compressor.setMemLevel(memLevel);
+
+  QByteArray member;
+  int iterations = 0;
+  QElapsedTimer timer;
+  timer.start();
+  do {
+    member.clear();
+    QVERIFY(compressor.begin(_payload.length()));
+    QVERIFY(compressor.append(_payload, &member));
+    QVERIFY(compressor.finish(&member));
+    iterations++;
+  } while (timer.elapsed() < 500);
+  qint64 elapsed = qMax(timer.elapsed(), (qint64) 1);
+
+  QCOMPARE(inflate(member), _payload);
+
+  double bytesPerSecond = (double) _payload.length() * iterations * 1000.0 / elapsed;
+  double ratio = (double) member.length() / _payload.length();
+  qDebug() << QTest::currentDataTag()
+           << "level" << compressor.effectiveLevel()
+           << "ratio" << QString::number(ratio, 'f', 4).toUtf8().constData()
+           << "MB/s" << QString::number(bytesPerSecond / (1024 * 1024), 'f', 1).toUtf8().constData();
+  QTest::setBenchmarkResult(bytesPerSecond, QTest::BytesPerSecond);
+}
+
+QTEST_MAIN(CompressionTest)
+#ifdef QMAKE_BUILD
+#include "testcompression.moc"
+#else
+#include "moc_testcompression.cxx"
+#endif
@@ -1,5 +1,7 @@
 #include <QtTest/QtTest>
+#include <QtSql/QSqlQuery>
 #include <QLocalytics/QLocalyticsDatabase>
+#include <QLocalytics/QLocalyticsUploadDevice>
 
 class DatabaseTest : public QObject
 {
@@ -11,7 +13,13 @@ private slots:
   void testGettersAndSetters();
   void testEvents();
   void testTransactions();
+  void testQueuedCloseEvent();
   void testCustomDimensions();
+  void testStagedGzipMembers();
+  void testSequenceBlocks();
+  void testUploadDevice();
+  void testDeleteUploadedBatch();
+  void testUploadJournal();
 };
 
 
@@ -24,7 +32,7 @@ void DatabaseTest::testCase1()
   QVERIFY(!createdTimestamp.isNull());
   QVERIFY(createdTimestamp.isValid());
   QVERIFY(createdTimestamp.secsTo(QDateTime::currentDateTime()) <= 2);
-  QVERIFY(db->schemaVersion() == 7);
+  QVERIFY(db->schemaVersion() == 11);
 
   QVERIFY(db->eventCount() == 0);
 }
@@ -68,17 +76,42 @@ void DatabaseTest::testEvents()
     db->addEventWithBlobString(QLatin1String("{blobEvent}"));
     QVERIFY(db->eventCount() == 1);
 
-    db->addFlowEventWithBlobString(QLatin1String("{flowEvent}"));
-    QVERIFY(db->eventCount() == 2);
-    success = db->removeLastCloseAndFlowEvents();
+    success = db->queueProvisionalEvents(QLatin1String("{closeEvent}"), QLatin1String("{flowEvent}"));
     QVERIFY(success);
     QVERIFY(db->eventCount() == 1);
-
-    db->addCloseEventWithBlobString(QLatin1String("{closeEvent}"));
-    QVERIFY(db->eventCount() == 2);
-    success = db->removeLastCloseAndFlowEvents();
+    success = db->promoteProvisionalEvents();
     QVERIFY(success);
-    QVERIFY(db->eventCount() == 1);
+    QVERIFY(db->eventCount() == 3);
+}
+
+void DatabaseTest::testQueuedCloseEvent()
+{
+    LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+    QSignalSpy dimensionsChanged(db, SIGNAL(customDimensionsChanged()));
+    // Every table it clears exists.
+    QVERIFY(db->resetAnalyticsData());
+    QCOMPARE(dimensionsChanged.count(), 1);
+
+    // The slot keeps the latest events, and a cleared flow event isn't
+    // stored.
+    QVERIFY(db->queueProvisionalEvents(QLatin1String("{closeEvent}"), QLatin1String("{flowEvent}")));
+    QVERIFY(db->queueProvisionalEvents(QLatin1String("{laterCloseEvent}"), QLatin1String("{laterFlowEvent}")));
+    QVERIFY(db->queueFlowEventWithBlobString(QString()));
+    QCOMPARE(db->eventCount(), 0);
+    QVERIFY(db->promoteProvisionalEvents());
+    QCOMPARE(db->eventCount(), 1);
+    QSqlQuery q(db->_databaseConnection);
+    QVERIFY(q.exec(QLatin1String("SELECT blob_string FROM events")));
+    QVERIFY(q.next());
+    QCOMPARE(q.value(0).toString(), QString(QLatin1String("{laterCloseEvent}")));
+
+    // Promoting empties the slot.
+    QVERIFY(db->promoteProvisionalEvents());
+    QCOMPARE(db->eventCount(), 1);
+
+    QVERIFY(db->setCustomDimension(0, QLatin1String("dimension")));
+    QCOMPARE(dimensionsChanged.count(), 2);
+    QVERIFY(db->setCustomDimension(0, QString()));
 }
 
 void DatabaseTest::testTransactions()
@@ -122,6 +155,179 @@ void DatabaseTest::testCustomDimensions()
   QCOMPARE(db->customDimension(-1), QString());
 }
 
+void DatabaseTest::testStagedGzipMembers()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  db->resetAnalyticsData();
+  QVERIFY(db->uploadGzipData().isEmpty());
+
+  int headerId = 0;
+  QVERIFY(db->addEventWithBlobString(QLatin1String("{event1}\n")));
+  QVERIFY(db->addHeaderWithSequenceNumber(1, QLatin1String("{header1}"), &headerId));
+  QVERIFY(db->stageEventsForUpload(headerId));
+  QByteArray first = db->uploadGzipData();
+  QVERIFY(first.length() > 2);
+  QCOMPARE((unsigned char) first.at(0), (unsigned char) 0x1f);
+  QCOMPARE((unsigned char) first.at(1), (unsigned char) 0x8b);
+
+  // A second header adds a second member behind the first one.
+  QVERIFY(db->addEventWithBlobString(QLatin1String("{event2}\n")));
+  QVERIFY(db->addHeaderWithSequenceNumber(2, QLatin1String("{header2}"), &headerId));
+  QVERIFY(db->stageEventsForUpload(headerId));
+  QByteArray both = db->uploadGzipData();
+  QVERIFY(both.startsWith(first));
+  QCOMPARE((unsigned char) both.at(first.length()), (unsigned char) 0x1f);
+
+  QVERIFY(db->deleteUploadedData());
+  QVERIFY(db->uploadGzipData().isEmpty());
+  QCOMPARE(db->eventCount(), 0);
+}
+
+void DatabaseTest::testSequenceBlocks()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  db->resetAnalyticsData();
+
+  // The stored value is the end of the reserved block, not the last number.
+  int number = 0;
+  QVERIFY(db->incrementLastUploadNumber(&number));
+  QCOMPARE(number, 1);
+  QSqlQuery q(db->_databaseConnection);
+  QVERIFY(q.exec(QLatin1String("SELECT last_upload_number FROM localytics_info")) && q.next());
+  QCOMPARE(q.value(0).toInt(), SEQUENCE_BLOCK_SIZE);
+
+  for (int i = 1; i <= SEQUENCE_BLOCK_SIZE; i++)
+    {
+      QVERIFY(db->incrementLastUploadNumber(&number));
+      QCOMPARE(number, i + 1);
+    }
+  QVERIFY(q.exec(QLatin1String("SELECT last_upload_number FROM localytics_info")) && q.next());
+  QCOMPARE(q.value(0).toInt(), 2 * SEQUENCE_BLOCK_SIZE);
+
+  // A fresh allocator, as after a crash, continues past the high-water mark.
+  db->_uploadSequence.invalidate();
+  QVERIFY(db->incrementLastUploadNumber(&number));
+  QCOMPARE(number, 2 * SEQUENCE_BLOCK_SIZE + 1);
+
+  // Numbers drawn inside a rolled back savepoint are not persisted.
+  QString t(QLatin1String("sequence_rollback"));
+  QVERIFY(db->beginTransaction(t));
+  QVERIFY(db->incrementLastSessionNumber(&number));
+  QCOMPARE(number, 1);
+  QVERIFY(db->rollbackTransaction(t));
+  QVERIFY(db->incrementLastSessionNumber(&number));
+  QCOMPARE(number, 1);
+
+  // Session numbers are not reserved in blocks, so a fresh allocator
+  // skips none.
+  QVERIFY(q.exec(QLatin1String("SELECT last_session_number FROM localytics_info")) && q.next());
+  QCOMPARE(q.value(0).toInt(), 1);
+  db->_sessionSequence.invalidate();
+  QVERIFY(db->incrementLastSessionNumber(&number));
+  QCOMPARE(number, 2);
+}
+
+void DatabaseTest::testUploadDevice()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  db->resetAnalyticsData();
+
+  // Two headers, the second large enough to span several device chunks.
+  int headerId = 0;
+  QVERIFY(db->addEventWithBlobString(QLatin1String("{event1}\n")));
+  QVERIFY(db->addHeaderWithSequenceNumber(1, QLatin1String("{header1}"), &headerId));
+  QVERIFY(db->stageEventsForUpload(headerId));
+  for (int i = 0; i < 2000; i++)
+    {
+      QVERIFY(db->addEventWithBlobString(QString(QLatin1String("{\"u\":\"%1\"}\n")).arg(QUuid::createUuid().toString())));
+    }
+  QVERIFY(db->addHeaderWithSequenceNumber(2, QLatin1String("{header2}"), &headerId));
+  QVERIFY(db->stageEventsForUpload(headerId));
+
+  QByteArray expected = db->uploadGzipData();
+  QVERIFY(expected.length() > UPLOAD_DEVICE_CHUNK_SIZE);
+
+  LocalyticsUploadDevice device(db, db->uploadSegments());
+  QVERIFY(device.open(QIODevice::ReadOnly));
+  QCOMPARE(device.size(), (qint64) expected.length());
+  QCOMPARE(device.sequenceNumbers(), QList<int>() << 1 << 2);
+
+  QByteArray body;
+  while (!device.atEnd())
+    {
+      QByteArray piece = device.read(1000);
+      QVERIFY(!piece.isEmpty());
+      body.append(piece);
+    }
+  QCOMPARE(body, expected);
+
+  // Seeking lands in the middle of the second member.
+  qint64 pos = expected.length() - 100;
+  QVERIFY(device.seek(pos));
+  QCOMPARE(device.readAll(), expected.mid(pos));
+  QVERIFY(device.reset());
+  QCOMPARE(device.readAll(), expected);
+
+  QVERIFY(db->deleteUploadedData());
+}
+
+void DatabaseTest::testDeleteUploadedBatch()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  db->resetAnalyticsData();
+
+  int headerId = 0;
+  for (int seq = 1; seq <= 3; seq++)
+    {
+      QVERIFY(db->addEventWithBlobString(QLatin1String("{event}\n")));
+      QVERIFY(db->addHeaderWithSequenceNumber(seq, QLatin1String("{header}"), &headerId));
+      QVERIFY(db->stageEventsForUpload(headerId));
+    }
+  QVERIFY(db->addEventWithBlobString(QLatin1String("{unstaged}\n")));
+
+  // Only the acknowledged headers and their events go away.
+  QVERIFY(db->deleteUploadedData(QList<int>() << 1 << 3));
+  QList<LocalyticsUploadSegment> segments = db->uploadSegments();
+  QCOMPARE(segments.size(), 1);
+  QCOMPARE(segments.at(0).sequenceNumber, 2);
+  QCOMPARE(db->eventCount(), 2);
+  QCOMPARE(db->unstagedEventCount(), 1);
+
+  QVERIFY(db->deleteUploadedData(QList<int>()));
+  QCOMPARE(db->eventCount(), 2);
+}
+
+void DatabaseTest::testUploadJournal()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  db->resetAnalyticsData();
+  foreach (const LocalyticsJournalEntry &entry, db->journalEntries())
+    {
+      QVERIFY(db->removeJournalEntry(entry.requestId));
+    }
+
+  int first = 0;
+  int second = 0;
+  QVERIFY(db->addJournalEntry(QList<int>() << 4 << 5, QByteArray("hash"), &first));
+  QVERIFY(db->addJournalEntry(QList<int>() << 6, QByteArray("other"), &second));
+  QVERIFY(!db->addJournalEntry(QList<int>(), QByteArray(), &second));
+  QVERIFY(db->setJournalState(second, JOURNAL_ACKED));
+
+  // Entries come back oldest first, as they were recorded.
+  QList<LocalyticsJournalEntry> entries = db->journalEntries();
+  QCOMPARE(entries.size(), 2);
+  QCOMPARE(entries.at(0).requestId, first);
+  QCOMPARE(entries.at(0).sequenceNumbers, QList<int>() << 4 << 5);
+  QCOMPARE(entries.at(0).bodyHash, QByteArray("hash"));
+  QCOMPARE(entries.at(0).state, JOURNAL_IN_FLIGHT);
+  QCOMPARE(entries.at(1).state, JOURNAL_ACKED);
+
+  QVERIFY(db->removeJournalEntry(first));
+  QCOMPARE(db->journalEntries().size(), 1);
+  QVERIFY(db->removeJournalEntry(second));
+  QVERIFY(db->journalEntries().isEmpty());
+}
+
 QTEST_MAIN(DatabaseTest)
 #ifdef QMAKE_BUILD
 #include "testdatabase.moc"
@@ -0,0 +1,21 @@
+include(../../buildInfo.pri)
+
+QT += qtestlib network
+CONFIG += qtestlib
+
+include(../../libraryIncludes.pri)
+
+# Build with "CONFIG+=qlocalytics_tsan" to check for data races with
+# ThreadSanitizer.
+qlocalytics_tsan {
+  QMAKE_CXXFLAGS += -fsanitize=thread -fno-omit-frame-pointer
+  QMAKE_LFLAGS += -fsanitize=thread
+}
+
+DESTDIR = $${TESTS_DIRECTORY}/relay
+OBJECTS_DIR = $${TESTS_DIRECTORY}/relay
+MOC_DIR = $${TESTS_DIRECTORY}/relay
+
+LIBS += -lz
+
+SOURCES += testrelay.cpp
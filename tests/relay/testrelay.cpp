@@ -0,0 +1,369 @@
+#include <QtTest/QtTest>
+#include <QtCore/QtEndian>
+#include <QtNetwork/QTcpSocket>
+#include <QLocalytics/QLocalyticsLoopbackTransport>
+#include <QLocalytics/QLocalyticsRelay>
+#include <zlib.h>
+
+// Devices, and events of each, sent by the throughput benchmark.
+#define BENCHMARK_DEVICES 4096
+#define BENCHMARK_EVENTS_PER_DEVICE 50
+
+class RelayTest : public QObject
+{
+    Q_OBJECT
+
+
+private slots:
+  void testBatching();
+  void testSocketIngest();
+  void testDeviceEviction();
+  void benchmarkThroughput_data();
+  void benchmarkThroughput();
+
+private:
+  QByteArray inflate(const QByteArray &member);
+  bool waitForIdle(LocalyticsRelay *relay);
+};
+
+static QByteArray lengthPrefixed(const QByteArray &record)
+{
+  QByteArray prefixed(4, '\0');
+  qToBigEndian<quint32>(record.size(), reinterpret_cast<uchar *>(prefixed.data()));
+  return prefixed + record;
+}
+
+static QByteArray deviceRecord(const QByteArray &installId, const QByteArray &counters = "0 0")
+{
+  return "d" + installId + "\napp-key\n" + counters + "\n\"dp\":\"test\",\"dmo\":\"relay\"";
+}
+
+static QByteArray eventRecord(const QByteArray &installId, int index)
+{
+  return "e" + installId + "\n{\"dt\":\"e\",\"u\":\"3c5c1a4e-90fb-4b1e-8f57-6a2b1d3c4e5f\",\"n\":\"Relayed\",\"ct\":1352000000,\"attrs\":{\"index\":\""
+    + QByteArray::number(index) + "\"}}";
+}
+
+/*
+  Sends events for a range of devices, through the socket or straight
+  to LocalyticsRelay::ingest().
+*/
+class RelayProducer : public QThread
+{
+public:
+  RelayProducer(LocalyticsRelay *relay, int firstDevice, int devices, quint16 port) :
+    _relay(relay), _firstDevice(firstDevice), _devices(devices), _port(port) {}
+
+protected:
+  void run()
+  {
+    QList<QByteArray> installIds;
+    for (int i = 0; i < _devices; i++)
+      installIds << "device-" + QByteArray::number(_firstDevice + i);
+
+    QTcpSocket *socket = 0;
+    if (_port)
+      {
+        socket = new QTcpSocket;
+        socket->connectToHost(QHostAddress::LocalHost, _port);
+        if (!socket->waitForConnected(5000))
+          {
+            delete socket;
+            return;
+          }
+      }
+
+    QByteArray pending;
+    for (int event = -1; event < BENCHMARK_EVENTS_PER_DEVICE; event++)
+      {
+        for (int i = 0; i < installIds.size(); i++)
+          {
+            QByteArray record = event < 0 ? deviceRecord(installIds.at(i)) : eventRecord(installIds.at(i), event);
+            if (!socket)
+              {
+                _relay->ingest(record);
+                continue;
+              }
+            pending += lengthPrefixed(record);
+            if (pending.size() >= 65536)
+              {
+                socket->write(pending);
+                socket->waitForBytesWritten(5000);
+                pending.clear();
+              }
+          }
+      }
+    if (socket)
+      {
+        socket->write(pending);
+        socket->waitForBytesWritten(5000);
+        socket->disconnectFromHost();
+        if (socket->state() != QAbstractSocket::UnconnectedState)
+          socket->waitForDisconnected(5000);
+        delete socket;
+      }
+  }
+
+private:
+  LocalyticsRelay *_relay;
+  int _firstDevice;
+  int _devices;
+  quint16 _port;
+};
+
+QByteArray RelayTest::inflate(const QByteArray &member)
+{
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.next_in = (Bytef *)member.data();
+  strm.avail_in = member.length();
+  if (inflateInit2(&strm, 15 + 32) != Z_OK)
+    return QByteArray();
+
+  QByteArray result;
+  char window[16384];
+  int code;
+  do {
+    strm.next_out = (Bytef *)window;
+    strm.avail_out = sizeof(window);
+    code = inflate(&strm, Z_NO_FLUSH);
+    result.append(window, sizeof(window) - strm.avail_out);
+  } while (code == Z_OK);
+  inflateEnd(&strm);
+  return code == Z_STREAM_END ? result : QByteArray();
+}
+
+bool RelayTest::waitForIdle(LocalyticsRelay *relay)
+{
+  QElapsedTimer timer;
+  timer.start();
+  while (relay->pendingBatches() > 0 && timer.elapsed() < 30000)
+    {
+      QTest::qWait(10);
+    }
+  return relay->pendingBatches() == 0;
+}
+
+void RelayTest::testBatching()
+{
+  LocalyticsRelay relay;
+  LocalyticsLoopbackTransport *transport = new LocalyticsLoopbackTransport;
+  transport->setKeepBodies(true);
+  relay.setTransport(transport);
+  relay.setEndpoint(QLatin1String("http://localhost:8080/api/v2/applications/%1/uploads"));
+  relay.setBatchLimits(3, 1 << 20, 60000);
+
+  // Events arriving before the device's header wait for it.
+  QVERIFY(relay.ingest(eventRecord("device-1", 0)));
+  QVERIFY(relay.ingest(deviceRecord("device-1")));
+  QVERIFY(relay.ingest(eventRecord("device-1", 1)));
+  QCOMPARE(relay.pendingBatches(), 0);
+  QVERIFY(relay.ingest(eventRecord("device-1", 2)));
+  QVERIFY(waitForIdle(&relay));
+  QCOMPARE(transport->bodies().size(), 1);
+
+  // One header, then the events in the order they were received.
+  QList<QByteArray> lines = inflate(transport->bodies().at(0)).split('\n');
+  QCOMPARE(lines.size(), 5);
+  QVERIFY(lines.at(0).startsWith("{\"seq\":1,"));
+  QVERIFY(lines.at(0).contains("\"dt\":\"h\""));
+  QVERIFY(lines.at(0).contains("\"iu\":\"device-1\""));
+  QVERIFY(lines.at(0).contains("\"au\":\"app-key\""));
+  QVERIFY(lines.at(0).contains("\"dp\":\"test\""));
+  QCOMPARE(lines.at(1), eventRecord("device-1", 0).mid(10));
+  QCOMPARE(lines.at(3), eventRecord("device-1", 2).mid(10));
+  QVERIFY(lines.at(4).isEmpty());
+
+  // Devices are batched apart, and each batch of a device takes its
+  // next sequence number.
+  QVERIFY(relay.ingest(deviceRecord("device-2")));
+  QVERIFY(relay.ingest(eventRecord("device-2", 0)));
+  QVERIFY(relay.ingest(eventRecord("device-1", 3)));
+  relay.flush();
+  QVERIFY(waitForIdle(&relay));
+  QCOMPARE(transport->bodies().size(), 3);
+  QByteArray second = inflate(transport->bodies().at(1)) + inflate(transport->bodies().at(2));
+  QVERIFY(second.contains("{\"seq\":2,"));
+  QVERIFY(second.contains("\"iu\":\"device-2\""));
+  QCOMPARE(relay.deviceCount(), 2);
+
+  QVERIFY(!relay.ingest("x"));
+  QVERIFY(!relay.ingest("qdevice-1\n{}"));
+  QVERIFY(!relay.ingest("ddevice-1\n"));
+
+  LocalyticsRelayStats stats = relay.stats();
+  QCOMPARE(stats.events, (qint64) 5);
+  QCOMPARE(stats.malformedRecords, (qint64) 3);
+  QCOMPARE(stats.batches, (qint64) 3);
+  QCOMPARE(stats.uploadedBatches, (qint64) 3);
+  QCOMPARE(stats.droppedEvents, (qint64) 0);
+}
+
+void RelayTest::testDeviceEviction()
+{
+  LocalyticsRelay relay;
+  LocalyticsLoopbackTransport *transport = new LocalyticsLoopbackTransport;
+  relay.setTransport(transport);
+  relay.setEndpoint(QLatin1String("http://localhost:8080/api/v2/applications/%1/uploads"));
+  relay.setBatchLimits(100, 1 << 20, 60000);
+  transport->setKeepBodies(true);
+  relay.setDeviceLimits(RELAY_MAX_DEVICES_PER_SHARD, 50);
+
+  // Idle devices are evicted once their events are sent, and the
+  // events of a device whose header never arrived are dropped.
+  QVERIFY(relay.ingest(deviceRecord("device-1")));
+  QVERIFY(relay.ingest(eventRecord("device-1", 0)));
+  QVERIFY(relay.ingest(eventRecord("unknown", 0)));
+  QVERIFY(relay.ingest(eventRecord("unknown", 1)));
+  relay.flush();
+  QCOMPARE(relay.deviceCount(), 2);
+  QTest::qWait(100);
+  relay.flush();
+  QVERIFY(waitForIdle(&relay));
+  QCOMPARE(relay.deviceCount(), 0);
+  LocalyticsRelayStats stats = relay.stats();
+  QCOMPARE(stats.evictedDevices, (qint64) 2);
+  QCOMPARE(stats.droppedEvents, (qint64) 2);
+  QCOMPARE(stats.uploadedBatches, (qint64) 1);
+
+  // A device coming back continues from the counters of its record, and
+  // doesn't repeat the sequence numbers it used before.
+  QVERIFY(relay.ingest(deviceRecord("device-1", "1352000000 2")));
+  QVERIFY(relay.ingest(eventRecord("device-1", 1)));
+  relay.flush();
+  QVERIFY(waitForIdle(&relay));
+  QCOMPARE(transport->bodies().size(), 2);
+  QByteArray header = inflate(transport->bodies().at(1)).split('\n').at(0);
+  QVERIFY(header.startsWith("{\"seq\":2,\"pa\":1352000000,"));
+  QVERIFY(!relay.ingest(deviceRecord("device-1", "1352000000")));
+  QVERIFY(!relay.ingest(deviceRecord("device-1", "x 2")));
+  relay.setDeviceLimits(RELAY_MAX_DEVICES_PER_SHARD, 0);
+  relay.flush();
+  QCOMPARE(relay.deviceCount(), 0);
+
+  // A full shard evicts its least recently seen device.
+  relay.setDeviceLimits(1, 60000);
+  for (int i = 0; i < 4 * RELAY_SHARDS; i++)
+    {
+      QVERIFY(relay.ingest(eventRecord("device-" + QByteArray::number(i), 0)));
+    }
+  QVERIFY(relay.deviceCount() <= RELAY_SHARDS);
+  stats = relay.stats();
+  QCOMPARE(stats.evictedDevices, (qint64) (3 + 4 * RELAY_SHARDS - relay.deviceCount()));
+  QCOMPARE(stats.droppedEvents, stats.evictedDevices - 1);
+}
+
+void RelayTest::testSocketIngest()
+{
+  LocalyticsRelay relay;
+  relay.setTransport(new LocalyticsLoopbackTransport);
+  relay.setWorkerThreads(2);
+  QVERIFY(relay.listen());
+
+  QTcpSocket client;
+  client.connectToHost(QHostAddress::LocalHost, relay.serverPort());
+  QVERIFY(client.waitForConnected(5000));
+
+  // Records may be split anywhere between writes.
+  QByteArray records = lengthPrefixed(deviceRecord("device-1")) + lengthPrefixed(eventRecord("device-1", 0))
+    + lengthPrefixed(eventRecord("device-1", 1));
+  client.write(records.left(7));
+  QVERIFY(client.waitForBytesWritten(5000));
+  QTest::qWait(50);
+  client.write(records.mid(7));
+  QVERIFY(client.waitForBytesWritten(5000));
+
+  QElapsedTimer timer;
+  timer.start();
+  while (relay.stats().events < 2 && timer.elapsed() < 5000)
+    {
+      QTest::qWait(10);
+    }
+  QCOMPARE(relay.stats().records, (qint64) 3);
+  QCOMPARE(relay.stats().events, (qint64) 2);
+
+  // A length which can't be right closes the connection.
+  client.write(QByteArray(4, '\xff'));
+  QVERIFY(client.waitForBytesWritten(5000));
+  QVERIFY(client.state() == QAbstractSocket::UnconnectedState || client.waitForDisconnected(5000));
+  QCOMPARE(relay.stats().malformedRecords, (qint64) 1);
+
+  relay.flush();
+  QVERIFY(waitForIdle(&relay));
+  QCOMPARE(relay.stats().uploadedBatches, (qint64) 1);
+}
+
+void RelayTest::benchmarkThroughput_data()
+{
+  QTest::addColumn<int>("threads");
+  QTest::addColumn<bool>("socket");
+
+  int cores = qMax(1, QThread::idealThreadCount());
+  QTest::newRow("ingest, 1 thread") << 1 << false;
+  QTest::newRow("ingest, 1 thread per core") << cores << false;
+  QTest::newRow("socket, 1 connection") << 1 << true;
+  QTest::newRow("socket, 1 connection per core") << cores << true;
+}
+
+void RelayTest::benchmarkThroughput()
+{
+  QFETCH(int, threads);
+  QFETCH(bool, socket);
+
+  LocalyticsRelay relay;
+  LocalyticsLoopbackTransport *transport = new LocalyticsLoopbackTransport;
+  relay.setTransport(transport);
+  relay.setMaxConcurrentUploads(64);
+  relay.setBatchLimits(25, 1 << 20, 60000);
+  if (socket)
+    {
+      relay.setWorkerThreads(threads);
+      QVERIFY(relay.listen());
+    }
+
+  QElapsedTimer timer;
+  timer.start();
+  QList<RelayProducer *> producers;
+  int devices = BENCHMARK_DEVICES / threads;
+  for (int i = 0; i < threads; i++)
+    {
+      producers << new RelayProducer(&relay, i * devices, devices, socket ? relay.serverPort() : 0);
+      producers.last()->start();
+    }
+  for (int i = 0; i < producers.size(); i++)
+    {
+      // Batches are sent while the producers run.
+      while (!producers.at(i)->isFinished())
+        QTest::qWait(1);
+      delete producers.at(i);
+    }
+
+  qint64 events = (qint64) devices * threads * BENCHMARK_EVENTS_PER_DEVICE;
+  while (relay.stats().events < events && timer.elapsed() < 60000)
+    {
+      QTest::qWait(1);
+    }
+  relay.flush();
+  QVERIFY(waitForIdle(&relay));
+  qint64 elapsed = qMax(timer.elapsed(), (qint64) 1);
+
+  LocalyticsRelayStats stats = relay.stats();
+  QCOMPARE(stats.events, events);
+  QCOMPARE(stats.droppedEvents, (qint64) 0);
+  QCOMPARE(transport->requestsReceived(), (int) stats.batches);
+
+  double eventsPerSecond = (double) events * 1000.0 / elapsed;
+  qDebug() << QTest::currentDataTag()
+           << "batches" << stats.batches
+           << "events/s" << QString::number(eventsPerSecond, 'f', 0).toUtf8().constData();
+  QTest::setBenchmarkResult(eventsPerSecond, QTest::Events);
+}
+
+QTEST_MAIN(RelayTest)
+#ifdef QMAKE_BUILD
+#include "testrelay.moc"
+#else
+#include "moc_testrelay.cxx"
+#endif
@@ -5,6 +5,13 @@ CONFIG += qtestlib
 
 include(../../libraryIncludes.pri)
 
+# Build with "CONFIG+=qlocalytics_tsan" to check for data races with
+# ThreadSanitizer.
+qlocalytics_tsan {
+  QMAKE_CXXFLAGS += -fsanitize=thread -fno-omit-frame-pointer
+  QMAKE_LFLAGS += -fsanitize=thread
+}
+
 DESTDIR = $${TESTS_DIRECTORY}/session
 OBJECTS_DIR = $${TESTS_DIRECTORY}/session
 MOC_DIR = $${TESTS_DIRECTORY}/session
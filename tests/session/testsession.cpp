@@ -1,7 +1,14 @@
+#define LOCALYTICS_LOG_COMPONENT "session test"
+
 #include <QtTest/QtTest>
+#include <QtCore/QThread>
+#include <QtSql/QSqlQuery>
 #include <QLocalytics/QLocalyticsDatabase>
+#include <QLocalytics/QLocalyticsFlowRing>
+#include <QLocalytics/QLocalyticsLog>
 #include <QLocalytics/QLocalyticsSession>
 #include <QLocalytics/QLocalyticsUploader>
+#include <QLocalytics/QLocalyticsUploaderPool>
 
 class SessionTest : public QObject
 {
@@ -12,8 +19,119 @@ private slots:
   void testCase1();
   void testEscapeStrings();
   void testEscapeStrings_data();
+  void testLogging();
+  void testConcurrentTagging();
+  void testOrderAcrossProducers();
+  void testSessionsPerAppKey();
+  void testScreenFlow();
+  void testUploadHeader();
+  void testProvisionalClose();
+  void testProvisionalFlowUploaded();
+  void testEventLimits();
+  void benchmarkCloseLatency();
+};
+
+#define PRODUCER_THREADS 8
+#define PRODUCER_EVENTS 200
+
+/*
+  Tags events numbered in order from a thread of its own.
+*/
+class ProducerThread : public QThread
+{
+public:
+  explicit ProducerThread(int producer) : _producer(producer) {}
+
+protected:
+  void run()
+  {
+    LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+    for (int i = 0; i < PRODUCER_EVENTS; i++)
+      {
+        QVariantMap attributes;
+        attributes.insert(QLatin1String("producer"), _producer);
+        attributes.insert(QLatin1String("index"), i);
+        session->tagEvent(QLatin1String("concurrent event"), attributes);
+      }
+  }
+
+private:
+  int _producer;
+};
+
+static QMutex ticketLock;
+static int nextTicket = 0;
+
+/*
+  Tags events numbered from one counter shared by every producer.  The
+  counter is taken and the event tagged under one lock, so the tickets
+  follow the order in which the events were tagged.
+*/
+class OrderedProducerThread : public QThread
+{
+public:
+  explicit OrderedProducerThread(int producer) : _producer(producer) {}
+
+protected:
+  void run()
+  {
+    LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+    for (int i = 0; i < PRODUCER_EVENTS; i++)
+      {
+        QMutexLocker locker(&ticketLock);
+        QVariantMap attributes;
+        attributes.insert(QLatin1String("producer"), _producer);
+        attributes.insert(QLatin1String("ticket"), nextTicket++);
+        session->tagEvent(QLatin1String("ordered event"), attributes);
+      }
+  }
+
+private:
+  int _producer;
+};
+
+#define CLOSE_CYCLES 200
+
+/*
+  Keeps tagging events from a thread of its own until stopped.
+*/
+class LoadThread : public QThread
+{
+public:
+  void stop() { _stopped.fetchAndStoreOrdered(1); }
+
+protected:
+  void run()
+  {
+    LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+    QVariantMap attributes;
+    attributes.insert(QLatin1String("load"), QLatin1String("background"));
+    while (!_stopped)
+      {
+        session->tagEvent(QLatin1String("load event"), attributes);
+        msleep(1);
+      }
+  }
+
+private:
+  QAtomicInt _stopped;
 };
 
+static QStringList loggedMessages;
+
+static void recordMessage(LocalyticsLog::Level level, const char *component, const QString &message)
+{
+  loggedMessages << QString(QLatin1String("%1 %2: %3")).arg((int) level).arg(QLatin1String(component)).arg(message);
+}
+
+static int formatted = 0;
+
+static QString countedMessage(const char *text)
+{
+  formatted++;
+  return QLatin1String(text);
+}
+
 
 void SessionTest::testCase1()
 {
@@ -85,6 +203,396 @@ void SessionTest::testEscapeStrings()
   QCOMPARE(session->escapeString(string), result);
 }
 
+void SessionTest::testLogging()
+{
+  LocalyticsLog::Level level = LocalyticsLog::level();
+  LocalyticsLog::setSink(recordMessage);
+  loggedMessages.clear();
+  formatted = 0;
+
+  // Disabled messages are not even formatted.
+  LocalyticsLog::setLevel(LocalyticsLog::Warning);
+  LOCALYTICS_INFO(countedMessage("hidden"));
+  QCOMPARE(formatted, 0);
+  LOCALYTICS_WARNING(countedMessage("shown"));
+  QCOMPARE(formatted, 1);
+  QCOMPARE(loggedMessages, QStringList() << QLatin1String("2 session test: shown"));
+
+  LocalyticsLog::setLevel(LocalyticsLog::Info);
+  LOCALYTICS_INFO(countedMessage("info"));
+  QCOMPARE(formatted, 2);
+  LocalyticsLog::setLevel(LocalyticsLog::Off);
+  LOCALYTICS_ERROR(countedMessage("off"));
+  QCOMPARE(formatted, 2);
+
+  // At the default level tagging an event logs nothing.
+  LocalyticsLog::setLevel(LocalyticsLog::Warning);
+  loggedMessages.clear();
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  session->resume();
+  session->tagEvent(QLatin1String("logged event"));
+  QVERIFY(loggedMessages.isEmpty());
+
+  LocalyticsLog::setSink(0);
+  LocalyticsLog::setLevel(level);
+}
+
+void SessionTest::testConcurrentTagging()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  session->resume();
+  QVERIFY(session->_isSessionOpen);
+  int eventCount = db->eventCount();
+
+  QList<ProducerThread *> producers;
+  for (int i = 0; i < PRODUCER_THREADS; i++)
+    {
+      producers << new ProducerThread(i);
+      producers.last()->start();
+    }
+  // Tagging from the session's thread at the same time.
+  for (int i = 0; i < PRODUCER_EVENTS; i++)
+    session->tagEvent(QLatin1String("main thread event"));
+  for (int i = 0; i < producers.size(); i++)
+    {
+      QVERIFY(producers.at(i)->wait(30000));
+      delete producers.at(i);
+    }
+
+  // Events of finished threads are still stored.
+  qApp->processEvents();
+  QCOMPARE(db->eventCount(), eventCount + (PRODUCER_THREADS + 1) * PRODUCER_EVENTS);
+
+  // Each thread's events are stored in the order it tagged them, and
+  // carry the session's keys.
+  QVector<int> next(PRODUCER_THREADS, 0);
+  // Attributes are written in the order of their keys.
+  QRegExp index(QLatin1String("\"index\":\"(\\d+)\",\"producer\":\"(\\d+)\""));
+  QSqlQuery q;
+  QVERIFY(q.exec(QLatin1String("SELECT blob_string FROM events ORDER BY event_id")));
+  int stored = 0;
+  while (q.next())
+    {
+      QString blob = q.value(0).toString();
+      if (!blob.contains(QLatin1String("concurrent event")))
+        continue;
+      QVERIFY(blob.contains(session->_sessionUUID));
+      QVERIFY(index.indexIn(blob) >= 0);
+      int producer = index.cap(2).toInt();
+      int i = index.cap(1).toInt();
+      QCOMPARE(i, next[producer]);
+      next[producer]++;
+      stored++;
+    }
+  QCOMPARE(stored, PRODUCER_THREADS * PRODUCER_EVENTS);
+}
+
+void SessionTest::testOrderAcrossProducers()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  session->resume();
+  QVERIFY(session->_isSessionOpen);
+  int eventCount = db->eventCount();
+  nextTicket = 0;
+
+  QList<OrderedProducerThread *> producers;
+  for (int i = 0; i < PRODUCER_THREADS; i++)
+    {
+      producers << new OrderedProducerThread(i);
+      producers.last()->start();
+    }
+  // Drain the buffers while the producers are tagging, so flushes fall
+  // between the appends of different threads.
+  bool running = true;
+  while (running)
+    {
+      session->flushEventBuffers();
+      running = false;
+      for (int i = 0; i < producers.size(); i++)
+        running = running || producers.at(i)->isRunning();
+    }
+  for (int i = 0; i < producers.size(); i++)
+    {
+      QVERIFY(producers.at(i)->wait(30000));
+      delete producers.at(i);
+    }
+  qApp->processEvents();
+  session->flushEventBuffers();
+  QCOMPARE(db->eventCount(), eventCount + PRODUCER_THREADS * PRODUCER_EVENTS);
+
+  // Events of every producer are stored in the order they were tagged.
+  QRegExp ticket(QLatin1String("\"producer\":\"\\d+\",\"ticket\":\"(\\d+)\""));
+  QSqlQuery q;
+  QVERIFY(q.exec(QLatin1String("SELECT blob_string FROM events ORDER BY event_id")));
+  int next = 0;
+  while (q.next())
+    {
+      QString blob = q.value(0).toString();
+      if (!blob.contains(QLatin1String("ordered event")))
+        continue;
+      QVERIFY(ticket.indexIn(blob) >= 0);
+      QCOMPARE(ticket.cap(1).toInt(), next);
+      next++;
+    }
+  QCOMPARE(next, PRODUCER_THREADS * PRODUCER_EVENTS);
+}
+
+void SessionTest::testSessionsPerAppKey()
+{
+  QString firstKey(QLatin1String("0a1b2c3d4e5f60718293a4b-00000000-1111-2222-3333-444444444444"));
+  QString secondKey(QLatin1String("0a1b2c3d4e5f60718293a4b-55555555-6666-7777-8888-999999999999"));
+  LocalyticsSession *first = LocalyticsSession::sessionForAppKey(firstKey);
+  QVERIFY(first != LocalyticsSession::sharedLocalyticsSession());
+  QCOMPARE(LocalyticsSession::sessionForAppKey(firstKey), first);
+  QVERIFY(first->_hasInitialized);
+  QCOMPARE(first->_applicationKey, firstKey);
+
+  // Each key has a database file of its own.
+  QVERIFY(first->_database != LocalyticsDatabase::sharedLocalyticsDatabase());
+  QVERIFY(!first->_database->shard().isEmpty());
+  first->open();
+  first->tagEvent(QLatin1String("first key event"));
+  int firstEvents = first->_database->eventCount();
+  QVERIFY(firstEvents > 0);
+
+  // Another key neither shares nor wipes it.
+  LocalyticsSession *second = LocalyticsSession::sessionForAppKey(secondKey);
+  QVERIFY(second != first);
+  QVERIFY(second->_database != first->_database);
+  QVERIFY(second->_database->shard() != first->_database->shard());
+  int secondEvents = second->_database->eventCount();
+  second->open();
+  second->tagEvent(QLatin1String("second key event"));
+  QCOMPARE(first->_database->eventCount(), firstEvents);
+  QVERIFY(second->_database->eventCount() > secondEvents);
+
+  // Their uploaders are separate, but send through one transport.
+  LocalyticsUploaderPool *pool = LocalyticsUploaderPool::sharedUploaderPool();
+  QVERIFY(first->_uploader != second->_uploader);
+  QVERIFY(first->_uploader != LocalyticsUploader::sharedLocalyticsUploader());
+  QCOMPARE(first->_uploader->transport(), pool->transport());
+  QCOMPARE(second->_uploader->transport(), pool->transport());
+
+  first->close();
+  second->close();
+}
+
+void SessionTest::testScreenFlow()
+{
+  LocalyticsSession *session = LocalyticsSession::sessionForAppKey(QLatin1String("0a1b2c3d4e5f60718293a4b-aaaaaaaa-bbbb-cccc-dddd-eeeeeeeeeeee"));
+  session->open();
+  QCOMPARE(session->_flow->size(), 0);
+
+  // Screens and events, in the order they happened.
+  session->tagScreen(QLatin1String("Home"));
+  session->tagEvent(QLatin1String("Click \"here\""));
+  session->tagScreen(QLatin1String("Settings"));
+  QCOMPARE(session->_flow->unstagedEntries(), QString(QLatin1String("{\"s\":\"Home\"},{\"e\":\"Click \\\"here\\\"\"},{\"s\":\"Settings\"}")));
+  QCOMPARE(session->_flow->screens(), QString(QLatin1String("\"Home\",\"Settings\"")));
+
+  // Uploaded entries become old ones.
+  session->_flow->markStaged();
+  QVERIFY(!session->_flow->hasUnstaged());
+  session->tagScreen(QLatin1String("Home"));
+  QCOMPARE(session->_flow->unstagedEntries(), QString(QLatin1String("{\"s\":\"Home\"}")));
+  QVERIFY(session->_flow->stagedEntries().endsWith(QLatin1String("{\"s\":\"Settings\"}")));
+
+  // The oldest entries are overwritten, but not the screens.
+  for (int i = 0; i < FLOW_CAPACITY; i++)
+    session->addFlowEvent(QLatin1String("Loop"), LocalyticsFlowEvent);
+  QCOMPARE(session->_flow->size(), FLOW_CAPACITY);
+  QCOMPARE(session->_flow->droppedEntries(), (qint64) 4);
+  QVERIFY(session->_flow->stagedEntries().isEmpty());
+  QCOMPARE(session->_flow->screens(), QString(QLatin1String("\"Home\",\"Settings\",\"Home\"")));
+
+  // Long names are cut, and names past the table are not recorded.
+  session->addFlowEvent(QString(2 * FLOW_MAX_NAME_LENGTH, QLatin1Char('x')), LocalyticsFlowEvent);
+  QVERIFY(session->_flow->unstagedEntries().endsWith(QLatin1String("{\"e\":\"") + QString(FLOW_MAX_NAME_LENGTH, QLatin1Char('x')) + QLatin1String("\"}")));
+  for (int i = 0; i < FLOW_MAX_NAMES; i++)
+    session->addFlowEvent(QString(QLatin1String("Event %1")).arg(i), LocalyticsFlowEvent);
+  QVERIFY(session->_flow->droppedNames() > 0);
+
+  // The flow blob carries both arrays.
+  QVERIFY(session->saveApplicationFlowAndRemoveOnResume(true));
+  session->close();
+  session->open();
+  QCOMPARE(session->_flow->size(), 0);
+  session->close();
+}
+
+void SessionTest::testUploadHeader()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  QString first = session->blobHeaderStringWithSequenceNumber(1);
+  QString second = session->blobHeaderStringWithSequenceNumber(2);
+  QVERIFY(first.startsWith(QLatin1String("{\"seq\":1,\"pa\":")));
+  QVERIFY(second.startsWith(QLatin1String("{\"seq\":2,\"pa\":")));
+  QVERIFY(first.contains(QLatin1String(",\"iu\":\"") + session->installationId() + QLatin1Char('"')));
+  // Uploads take the install id from the cache, not from the settings.
+  QCOMPARE(session->_headerInstallId, session->installationId());
+  QVERIFY(first.contains(QLatin1String(",\"au\":\"") + session->_applicationKey + QLatin1Char('"')));
+  QVERIFY(first.indexOf(QLatin1String("\"dac\":")) < first.indexOf(QLatin1String("\"dll\":")));
+  QVERIFY(first.endsWith(QLatin1String("}}")));
+
+  // Apart from the sequence number and the UUID, the headers only
+  // differ in the memory available.
+  QRegExp volatileFields(QLatin1String("\"(seq|u|dmem)\":(\"[^\"]*\"|\\d+)"));
+  QCOMPARE(QString(first).remove(volatileFields), QString(second).remove(volatileFields));
+}
+
+void SessionTest::testProvisionalClose()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  session->resume();
+  session->tagScreen(QLatin1String("Provisional"));
+  session->close();
+  int eventCount = db->eventCount();
+
+  // Going to the background and back neither inserts nor deletes events.
+  for (int i = 0; i < 10; i++)
+    {
+      QVERIFY(session->resume());
+      session->close();
+    }
+  QCOMPARE(db->eventCount(), eventCount);
+  QVERIFY(session->_backgroundTimer->isActive());
+
+  // Once the session can't be resumed, its flow and close events are stored.
+  session->promoteProvisionalEvents();
+  QCOMPARE(db->eventCount(), eventCount + 2);
+  QSqlQuery q;
+  QVERIFY(q.exec(QLatin1String("SELECT blob_string FROM events ORDER BY event_id DESC LIMIT 2")));
+  QVERIFY(q.next());
+  QVERIFY(q.value(0).toString().startsWith(QLatin1String("{\"dt\":\"c\"")));
+  QVERIFY(q.next());
+  QVERIFY(q.value(0).toString().contains(QLatin1String("{\"s\":\"Provisional\"}")));
+
+  // A new session starts instead.
+  QVERIFY(!session->resume());
+  QVERIFY(session->_isSessionOpen);
+  session->close();
+}
+
+void SessionTest::testProvisionalFlowUploaded()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  session->_uploader->cancelUpload();
+  QVERIFY(!session->_uploader->isCircuitOpen());
+  session->resume();
+  session->tagEvent(QLatin1String("Flow once"));
+  session->close();
+
+  // An upload while in the background stores the flow event, and the
+  // provisional one is not stored again.
+  session->upload();
+  session->_uploader->cancelUpload();
+  session->promoteProvisionalEvents();
+
+  QRegExp newEntry(QLatin1String("\"nw\":\\[[^\\]]*\\{\"e\":\"Flow once\"\\}"));
+  QSqlQuery q;
+  QVERIFY(q.exec(QLatin1String("SELECT blob_string FROM events")));
+  int reported = 0;
+  while (q.next())
+    {
+      if (newEntry.indexIn(q.value(0).toString()) >= 0)
+        reported++;
+    }
+  QCOMPARE(reported, 1);
+  QVERIFY(!session->_flow->hasUnstaged());
+}
+
+void SessionTest::testEventLimits()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  session->resume();
+  QVERIFY(session->_isSessionOpen);
+  session->resetEventStats();
+
+  LocalyticsEventLimits limits;
+  limits.maxAttributes = 3;
+  limits.maxNameBytes = 8;
+  limits.maxKeyBytes = 4;
+  limits.maxValueBytes = 6;
+  limits.maxEventBytes = 30;
+  session->setEventLimits(limits);
+
+  // Four attributes, one with a long key and one with a value of
+  // multi-byte characters; the report attribute doesn't fit any more.
+  QVariantMap attributes;
+  attributes.insert(QLatin1String("a"), QString(10000, QLatin1Char('x')));
+  attributes.insert(QLatin1String("bbbbbb"), QLatin1String("b"));
+  attributes.insert(QLatin1String("c"), QString::fromUtf8("\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9"));
+  attributes.insert(QLatin1String("d"), QLatin1String("d"));
+  QVariantMap reportAttributes;
+  reportAttributes.insert(QLatin1String("r"), QLatin1String("r"));
+  session->tagEvent(QLatin1String("Limited event"), attributes, reportAttributes);
+
+  QSqlQuery q;
+  QVERIFY(q.exec(QLatin1String("SELECT blob_string FROM events ORDER BY event_id DESC LIMIT 1")));
+  QVERIFY(q.next());
+  QString blob = q.value(0).toString();
+  QVERIFY(blob.contains(QLatin1String("\"n\":\"Limited \"")));
+  QVERIFY(blob.contains(QLatin1String("\"attrs\":{\"a\":\"xxxxxx\",\"bbbb\":\"b\",\"c\":\"") + QString::fromUtf8("\xc3\xa9\xc3\xa9\xc3\xa9") + QLatin1String("\"}")));
+  QVERIFY(!blob.contains(QLatin1String("\"d\":")));
+  QVERIFY(!blob.contains(QLatin1String("\"r\":")));
+
+  LocalyticsEventStats stats = session->eventStats();
+  QCOMPARE(stats.events, (qint64) 1);
+  QCOMPARE(stats.truncatedEvents, (qint64) 1);
+  QCOMPARE(stats.truncatedNames, (qint64) 1);
+  QCOMPARE(stats.truncatedKeys, (qint64) 1);
+  QCOMPARE(stats.truncatedValues, (qint64) 2);
+  QCOMPARE(stats.droppedAttributes, (qint64) 2);
+
+  session->setEventLimits(LocalyticsEventLimits());
+  session->tagEvent(QLatin1String("Unlimited event"), reportAttributes);
+  QCOMPARE(session->eventStats().truncatedEvents, (qint64) 1);
+  session->close();
+}
+
+void SessionTest::benchmarkCloseLatency()
+{
+  LocalyticsSession *session = LocalyticsSession::sharedLocalyticsSession();
+  LocalyticsDatabase::sharedLocalyticsDatabase()->setCustomDimension(0, QLatin1String("benchmark"));
+  LoadThread load;
+  load.start();
+
+  // Background/foreground cycles while another thread tags events.
+  QList<qint64> latencies;
+  for (int i = 0; i < CLOSE_CYCLES; i++)
+    {
+      session->resume();
+      session->tagScreen(QString(QLatin1String("Screen %1")).arg(i % 10));
+      qApp->processEvents();
+      QElapsedTimer timer;
+      timer.start();
+      session->close();
+      latencies.append(timer.nsecsElapsed());
+    }
+  load.stop();
+  QVERIFY(load.wait(5000));
+  qApp->processEvents();
+  LocalyticsDatabase::sharedLocalyticsDatabase()->setCustomDimension(0, QString());
+
+  qSort(latencies);
+  double p50 = latencies.at(latencies.size() / 2) / 1e6;
+  double p99 = latencies.at(latencies.size() * 99 / 100) / 1e6;
+  qDebug() << "close latency ms p50" << QString::number(p50, 'f', 3).toUtf8().constData()
+           << "p99" << QString::number(p99, 'f', 3).toUtf8().constData();
+  // Reported, not asserted: wall time depends on the machine and its load.
+  QTest::setBenchmarkResult(p99, QTest::WalltimeMilliseconds);
+
+  // The close blob carries the dimension without querying it.
+  QSqlQuery q;
+  QVERIFY(q.exec(QLatin1String("SELECT queued_close_event_blob FROM localytics_info")));
+  QVERIFY(q.next());
+  QVERIFY(q.value(0).toString().contains(QLatin1String("\"c0\":\"benchmark\"")));
+}
+
 QTEST_MAIN(SessionTest)
 #ifdef QMAKE_BUILD
 #include "testsession.moc"
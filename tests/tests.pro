@@ -4,4 +4,9 @@ TEMPLATE = subdirs
 
 SUBDIRS += \
     database \
-    session
\ No newline at end of file
+    session \
+    compression \
+    uploader \
+    relay \
+    clock \
+    benchmarks
\ No newline at end of file
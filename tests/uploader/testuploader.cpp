@@ -0,0 +1,976 @@
+#include <QtTest/QtTest>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#ifndef QT_NO_OPENSSL
+#include <QtNetwork/QSslCertificate>
+#include <QtNetwork/QSslSocket>
+#endif
+#include <QLocalytics/QLocalyticsDatabase>
+#include <QLocalytics/QLocalyticsUploader>
+#include <QLocalytics/QLocalyticsUploadDevice>
+#include <QLocalytics/QLocalyticsUploadScheduler>
+#include <QLocalytics/QLocalyticsLoopbackTransport>
+#include <QLocalytics/QLocalyticsNetworkTransport>
+#include <QLocalytics/QLocalyticsSocketTransport>
+
+#define APP_KEY QLatin1String("b8ebdecee388a9cb1219c89-1bb6b05a-2af6-11e2-6265-00ef75f32667")
+#define INSTALL_ID QLatin1String("{6a0c9a1e-4c1f-4a53-9d0b-0f2d5a8c7e11}")
+
+/*
+  Stand-in for the Localytics upload service.  Answers each request
+  with the next scripted status code, or 202 once the script is used
+  up, after an optional injected latency, and records when each
+  request arrived.  HEAD requests are answered straight away.  When
+  secure, connections use TLS with the certificate in standin.crt.
+*/
+class StandInServer : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+  explicit StandInServer(bool secure = false) :
+    _secure(secure)
+  {
+    connect(this, SIGNAL(newConnection()), this, SLOT(acceptConnection()));
+    listen(QHostAddress::LocalHost);
+    clock.start();
+    latency = 0;
+    maxOutstanding = 0;
+    connections = 0;
+    heads = 0;
+  }
+
+  QString urlFormat() const
+  {
+    return QString(QLatin1String("%1://127.0.0.1:%2")).arg(QLatin1String(_secure ? "https" : "http")).arg(serverPort())
+      + QLatin1String("/api/v2/applications/%1/uploads");
+  }
+
+  QList<int> statuses;
+  QByteArray retryAfter;
+  int latency;
+  QList<qint64> arrivals;
+  QList<QByteArray> bodies;
+  QList<int> responses;
+  int maxOutstanding;
+  int connections;
+  int heads;
+  QElapsedTimer clock;
+
+protected:
+  void incomingConnection(int socketDescriptor)
+  {
+    connections++;
+#ifndef QT_NO_OPENSSL
+    if (_secure)
+      {
+        QSslSocket *socket = new QSslSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        socket->setLocalCertificate(QLatin1String(SRCDIR "standin.crt"));
+        socket->setPrivateKey(QLatin1String(SRCDIR "standin.key"));
+        socket->startServerEncryption();
+        addPendingConnection(socket);
+        return;
+      }
+#endif
+    QTcpServer::incomingConnection(socketDescriptor);
+  }
+
+private slots:
+  void acceptConnection()
+  {
+    while (hasPendingConnections())
+      {
+        QTcpSocket *socket = nextPendingConnection();
+        connect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+      }
+  }
+
+  void readRequest()
+  {
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    QByteArray &buffer = _buffers[socket];
+    buffer.append(socket->readAll());
+
+    int headerEnd = buffer.indexOf("\r\n\r\n");
+    if (headerEnd < 0)
+      return;
+    if (buffer.startsWith("HEAD "))
+      {
+        heads++;
+        buffer.remove(0, headerEnd + 4);
+        socket->write("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+        return;
+      }
+    QByteArray headers = buffer.left(headerEnd).toLower();
+    int length = 0;
+    int field = headers.indexOf("content-length:");
+    if (field >= 0)
+      length = headers.mid(field + 15, headers.indexOf("\r\n", field) - field - 15).trimmed().toInt();
+    if (buffer.length() < headerEnd + 4 + length)
+      return;
+
+    arrivals.append(clock.elapsed());
+    bodies.append(buffer.mid(headerEnd + 4, length));
+    buffer.remove(0, headerEnd + 4 + length);
+
+    _outstanding.append(QPointer<QTcpSocket>(socket));
+    maxOutstanding = qMax(maxOutstanding, _outstanding.size());
+    QTimer::singleShot(latency, this, SLOT(respond()));
+  }
+
+  void respond()
+  {
+    // Every request waits the same latency, so they are answered in order.
+    QPointer<QTcpSocket> socket = _outstanding.takeFirst();
+    int status = statuses.isEmpty() ? 202 : statuses.takeFirst();
+    responses.append(status);
+    QByteArray response = "HTTP/1.1 " + QByteArray::number(status) + " Scripted\r\nContent-Length: 0\r\n";
+    if (status >= 300 && !retryAfter.isEmpty())
+      response += "Retry-After: " + retryAfter + "\r\n";
+    response += "\r\n";
+    if (socket)
+      socket->write(response);
+  }
+
+private:
+  bool _secure;
+  QHash<QTcpSocket *, QByteArray> _buffers;
+  QList<QPointer<QTcpSocket> > _outstanding;
+};
+
+/*
+  Records the requests a transport or connection reports finished.
+*/
+class FinishedRecorder : public QObject
+{
+    Q_OBJECT
+
+public:
+  QList<int> requests;
+  QList<int> statusCodes;
+
+public slots:
+  void finished(int request, const LocalyticsTransportResponse &response)
+  {
+    requests.append(request);
+    statusCodes.append(response.statusCode);
+  }
+};
+
+class UploaderTest : public QObject
+{
+    Q_OBJECT
+    
+    
+private slots:
+  void init();
+  void testBatchSegments();
+  void testRetryPolicy();
+  void testRetriesScriptedFailures();
+  void testRetryAfter();
+  void testCircuitBreaker();
+  void testSchedulerTriggers();
+  void testSchedulerTimers();
+  void testSchedulerCoalesces();
+  void testConcurrentDrain_data();
+  void testConcurrentDrain();
+  void testConcurrentPartialFailure();
+  void testColdConnectionStats();
+  void testPrewarmReusesConnection();
+  void testLoopbackTransport();
+  void testJournalRecovery();
+  void testSpooledUpload();
+  void testUploadShaping();
+  void testWatchdog();
+  void testSocketTransport_data();
+  void testSocketTransport();
+  void testSocketStaleFinish();
+  void testSocketStreamedBody();
+
+private:
+  QList<LocalyticsUploadSegment> segments(const QList<qint64> &sizes);
+  void stageHeader(int sequenceNumber);
+  bool waitFor(int requests, StandInServer *server, int timeout);
+};
+
+
+void UploaderTest::init()
+{
+  // Start from an empty upload queue.
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  QList<int> staged;
+  foreach (const LocalyticsUploadSegment &segment, db->uploadSegments())
+    {
+      staged.append(segment.sequenceNumber);
+    }
+  QVERIFY(staged.isEmpty() || db->deleteUploadedData(staged));
+  foreach (const LocalyticsJournalEntry &entry, db->journalEntries())
+    {
+      QVERIFY(db->removeJournalEntry(entry.requestId));
+    }
+
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  QVERIFY(!uploader->isUploading());
+  uploader->_retryTimer->stop();
+  uploader->_retryPolicy = LocalyticsRetryPolicy();
+  uploader->_retryPolicy.setBaseDelay(100);
+  uploader->setMaxUploadBytes(MAX_UPLOAD_BYTES);
+  uploader->setMaxConcurrentUploads(MAX_CONCURRENT_UPLOADS);
+  uploader->setSpooling(false);
+  uploader->setMaxUploadRate(0);
+  uploader->setDeadlines(UPLOAD_CONNECT_DEADLINE_MS, UPLOAD_IDLE_DEADLINE_MS, UPLOAD_TOTAL_DEADLINE_MS);
+  if (!qobject_cast<LocalyticsNetworkTransport *>(uploader->transport()))
+    uploader->setTransport(new LocalyticsNetworkTransport);
+}
+
+void UploaderTest::stageHeader(int sequenceNumber)
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  int headerId = 0;
+  QVERIFY(db->addEventWithBlobString(QString(QLatin1String("{\"dt\":\"e\",\"n\":\"event %1\"}\n")).arg(sequenceNumber)));
+  QVERIFY(db->addHeaderWithSequenceNumber(sequenceNumber, QLatin1String("{\"dt\":\"h\"}"), &headerId));
+  QVERIFY(db->stageEventsForUpload(headerId));
+}
+
+bool UploaderTest::waitFor(int requests, StandInServer *server, int timeout)
+{
+  QElapsedTimer timer;
+  timer.start();
+  while (server->responses.size() < requests && timer.elapsed() < timeout)
+    {
+      QTest::qWait(20);
+    }
+  // Let the uploader process the last response.
+  QTest::qWait(50);
+  return server->responses.size() >= requests;
+}
+
+
+QList<LocalyticsUploadSegment> UploaderTest::segments(const QList<qint64> &sizes)
+{
+  QList<LocalyticsUploadSegment> result;
+  for (int i = 0; i < sizes.size(); i++)
+    {
+      LocalyticsUploadSegment segment;
+      segment.sequenceNumber = i + 1;
+      segment.size = sizes.at(i);
+      result.append(segment);
+    }
+  return result;
+}
+
+void UploaderTest::testBatchSegments()
+{
+  QList<QList<LocalyticsUploadSegment> > batches;
+
+  batches = LocalyticsUploader::batchSegments(segments(QList<qint64>()), 100);
+  QVERIFY(batches.isEmpty());
+
+  // Headers are packed in order up to the limit.
+  batches = LocalyticsUploader::batchSegments(segments(QList<qint64>() << 40 << 60 << 30 << 50 << 10), 100);
+  QCOMPARE(batches.size(), 3);
+  QCOMPARE(batches.at(0).size(), 2);
+  QCOMPARE(batches.at(1).size(), 2);
+  QCOMPARE(batches.at(1).at(0).sequenceNumber, 3);
+  QCOMPARE(batches.at(2).size(), 1);
+  QCOMPARE(batches.at(2).at(0).sequenceNumber, 5);
+
+  // An oversized header is never split, and travels alone.
+  batches = LocalyticsUploader::batchSegments(segments(QList<qint64>() << 10 << 250 << 10), 100);
+  QCOMPARE(batches.size(), 3);
+  QCOMPARE(batches.at(1).size(), 1);
+  QCOMPARE(batches.at(1).at(0).size, (qint64) 250);
+}
+
+void UploaderTest::testRetryPolicy()
+{
+  LocalyticsRetryPolicy policy;
+  policy.setBaseDelay(1000);
+  policy.setMaxDelay(8000);
+  policy.setFailureThreshold(6);
+
+  // Each delay is between half and all of the doubled backoff.
+  int expected[] = { 1000, 2000, 4000, 8000, 8000 };
+  for (int i = 0; i < 5; i++)
+    {
+      int delay = policy.recordFailure();
+      QVERIFY(delay >= expected[i] / 2);
+      QVERIFY(delay <= expected[i]);
+    }
+  QVERIFY(!policy.isCircuitOpen());
+
+  // The server's Retry-After is never undercut.
+  policy.recordSuccess();
+  QCOMPARE(policy.recordFailure(30000), 30000);
+
+  // Failures in a row open the circuit.
+  policy.setFailureThreshold(2);
+  QCOMPARE(policy.recordFailure(), -1);
+  QVERIFY(policy.isCircuitOpen());
+  policy.recordSuccess();
+  QVERIFY(!policy.isCircuitOpen());
+  QCOMPARE(policy.consecutiveFailures(), 0);
+
+  QCOMPARE(LocalyticsRetryPolicy::parseRetryAfter("120"), 120000);
+  QCOMPARE(LocalyticsRetryPolicy::parseRetryAfter("soon"), -1);
+  QCOMPARE(LocalyticsRetryPolicy::parseRetryAfter(""), -1);
+  QCOMPARE(LocalyticsRetryPolicy::parseRetryAfter("Wed, 21 Oct 2015 07:28:00 GMT"), 0);
+  QDateTime later = QDateTime::currentDateTime().toUTC().addSecs(60);
+  QByteArray date = "Thu, " + QByteArray::number(later.date().day()) + " "
+    + QByteArray("JanFebMarAprMayJunJulAugSepOctNovDec").mid((later.date().month() - 1) * 3, 3) + " "
+    + QByteArray::number(later.date().year()) + " " + later.time().toString(QLatin1String("hh:mm:ss")).toLatin1() + " GMT";
+  int delay = LocalyticsRetryPolicy::parseRetryAfter(date);
+  QVERIFY(delay > 55000 && delay <= 60000);
+}
+
+void UploaderTest::testRetriesScriptedFailures()
+{
+  StandInServer server;
+  server.statuses << 503 << 500;
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(server.urlFormat());
+  stageHeader(1);
+
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  QVERIFY(waitFor(3, &server, 5000));
+
+  // The backoff doubles: at least half of 100 ms, then of 200 ms.
+  QVERIFY(server.arrivals.at(1) - server.arrivals.at(0) >= 50);
+  QVERIFY(server.arrivals.at(2) - server.arrivals.at(1) >= 100);
+  QCOMPARE(server.bodies.at(0), server.bodies.at(2));
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+  QVERIFY(!uploader->isRetryScheduled());
+}
+
+void UploaderTest::testRetryAfter()
+{
+  StandInServer server;
+  server.statuses << 503;
+  server.retryAfter = "1";
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(server.urlFormat());
+  stageHeader(1);
+
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  QVERIFY(waitFor(1, &server, 5000));
+
+  // Asking again doesn't jump the queue.
+  QVERIFY(uploader->isRetryScheduled());
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  QTest::qWait(300);
+  QCOMPARE(server.arrivals.size(), 1);
+
+  QVERIFY(waitFor(2, &server, 5000));
+  QVERIFY(server.arrivals.at(1) - server.arrivals.at(0) >= 950);
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+}
+
+void UploaderTest::testCircuitBreaker()
+{
+  StandInServer server;
+  server.statuses << 503 << 503 << 503;
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(server.urlFormat());
+  uploader->_retryPolicy.setFailureThreshold(3);
+  uploader->_retryPolicy.setCooldown(1000);
+  stageHeader(1);
+
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  QVERIFY(waitFor(3, &server, 5000));
+  QVERIFY(uploader->isCircuitOpen());
+  QVERIFY(!uploader->isRetryScheduled());
+
+  // Nothing is sent while the circuit is open.
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  QTest::qWait(300);
+  QCOMPARE(server.arrivals.size(), 3);
+  QCOMPARE(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().size(), 1);
+
+  // After the cooldown a probe goes through and closes it again.
+  QTest::qWait(1000);
+  QVERIFY(!uploader->isCircuitOpen());
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  QVERIFY(waitFor(4, &server, 5000));
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+  QCOMPARE(uploader->_retryPolicy.consecutiveFailures(), 0);
+}
+
+void UploaderTest::testSchedulerTriggers()
+{
+  LocalyticsUploadScheduler scheduler;
+  QSignalSpy due(&scheduler, SIGNAL(uploadDue()));
+  scheduler.setPendingEventsThreshold(3);
+  scheduler.setPendingBytesThreshold(1000);
+
+  // Nothing is triggered until enabled.
+  scheduler.eventAdded(2000);
+  scheduler.lifecycleTransition();
+  QCOMPARE(due.count(), 0);
+
+  scheduler.setEnabled(true);
+  scheduler.eventAdded(10);
+  scheduler.eventAdded(10);
+  QCOMPARE(due.count(), 0);
+  scheduler.eventAdded(10);
+  QCOMPARE(due.count(), 1);
+
+  // Counting starts again after each upload.
+  scheduler.eventAdded(600);
+  QCOMPARE(due.count(), 1);
+  scheduler.eventAdded(600);
+  QCOMPARE(due.count(), 2);
+
+  scheduler.lifecycleTransition();
+  QCOMPARE(due.count(), 3);
+
+  QVERIFY(LocalyticsUploadScheduler::isCellular(QLatin1String("lte")));
+  QVERIFY(LocalyticsUploadScheduler::isCellular(QLatin1String("gsm")));
+  QVERIFY(!LocalyticsUploadScheduler::isCellular(QLatin1String("")));
+  QVERIFY(!LocalyticsUploadScheduler::isCellular(QLatin1String("802_11")));
+  QCOMPARE(scheduler.maxUploadBytes(QLatin1String("umts")), (qint64) SCHEDULER_CELLULAR_MAX_UPLOAD_BYTES);
+  QCOMPARE(scheduler.maxUploadBytes(QLatin1String("")), (qint64) SCHEDULER_WIFI_MAX_UPLOAD_BYTES);
+  QVERIFY(SCHEDULER_WIFI_MAX_UPLOAD_BYTES > SCHEDULER_CELLULAR_MAX_UPLOAD_BYTES);
+}
+
+void UploaderTest::testSchedulerTimers()
+{
+  LocalyticsUploadScheduler scheduler;
+  QSignalSpy due(&scheduler, SIGNAL(uploadDue()));
+  scheduler.setEnabled(true);
+
+  // A quiet period after the last event.
+  scheduler.setIdleTime(100);
+  scheduler.eventAdded(10);
+  QTest::qWait(50);
+  QCOMPARE(due.count(), 0);
+  QTest::qWait(150);
+  QCOMPARE(due.count(), 1);
+
+  // A steady trickle of events is uploaded once the oldest is old enough.
+  scheduler.setIdleTime(10000);
+  scheduler.setMaxEventAge(300);
+  for (int i = 0; i < 4; i++)
+    {
+      scheduler.eventAdded(10);
+      QTest::qWait(50);
+    }
+  QCOMPARE(due.count(), 1);
+  QTest::qWait(250);
+  QCOMPARE(due.count(), 2);
+
+  // Nothing waiting, nothing to upload.
+  QTest::qWait(400);
+  QCOMPARE(due.count(), 2);
+}
+
+void UploaderTest::testSchedulerCoalesces()
+{
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  LocalyticsUploadScheduler scheduler;
+  QSignalSpy due(&scheduler, SIGNAL(uploadDue()));
+
+  uploader->_isUploading = true;
+  scheduler.requestUpload();
+  scheduler.requestUpload();
+  scheduler.requestUpload();
+  QCOMPARE(due.count(), 0);
+
+  uploader->_isUploading = false;
+  emit uploader->uploadComplete();
+  QCOMPARE(due.count(), 1);
+
+  // A completion with nothing requested meanwhile starts nothing.
+  emit uploader->uploadComplete();
+  QCOMPARE(due.count(), 1);
+}
+
+void UploaderTest::testConcurrentDrain_data()
+{
+  QTest::addColumn<int>("concurrency");
+  QTest::newRow("1 request") << 1;
+  QTest::newRow("2 requests") << 2;
+  QTest::newRow("4 requests") << 4;
+}
+
+void UploaderTest::testConcurrentDrain()
+{
+  QFETCH(int, concurrency);
+  const int headers = 8;
+  const int latency = 150;
+
+  StandInServer server;
+  server.latency = latency;
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(server.urlFormat());
+  uploader->setMaxConcurrentUploads(concurrency);
+  // One header per request.
+  uploader->setMaxUploadBytes(1);
+  for (int i = 1; i <= headers; i++)
+    {
+      stageHeader(i);
+    }
+
+  QSignalSpy complete(uploader, SIGNAL(uploadComplete()));
+  QElapsedTimer timer;
+  timer.start();
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  while (complete.isEmpty() && timer.elapsed() < 10000)
+    {
+      QTest::qWait(5);
+    }
+  qint64 elapsed = timer.elapsed();
+
+  QCOMPARE(complete.count(), 1);
+  QCOMPARE(server.arrivals.size(), headers);
+  QCOMPARE(server.maxOutstanding, concurrency);
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+
+  // Draining is bounded by round trips, of which there are headers / concurrency.
+  int roundTrips = (headers + concurrency - 1) / concurrency;
+  QVERIFY(elapsed >= roundTrips * latency);
+  QVERIFY(elapsed < (roundTrips + 1) * latency + 500);
+  qDebug() << concurrency << "concurrent requests drained" << headers << "headers in" << elapsed << "ms,"
+           << headers * 1000.0 / elapsed << "headers/s";
+}
+
+void UploaderTest::testConcurrentPartialFailure()
+{
+  StandInServer server;
+  server.latency = 50;
+  server.statuses << 202 << 503 << 202;
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(server.urlFormat());
+  uploader->setMaxConcurrentUploads(2);
+  uploader->setMaxUploadBytes(1);
+  for (int i = 1; i <= 6; i++)
+    {
+      stageHeader(i);
+    }
+
+  // No new batch is posted after the failure, but the request already
+  // in flight completes and only acknowledged headers are deleted.
+  QSignalSpy complete(uploader, SIGNAL(uploadComplete()));
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  while (complete.isEmpty() && server.clock.elapsed() < 5000)
+    {
+      QTest::qWait(5);
+    }
+  QCOMPARE(server.responses, QList<int>() << 202 << 503 << 202);
+  QCOMPARE(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().size(), 4);
+  QVERIFY(uploader->isRetryScheduled());
+  QCOMPARE(uploader->_retryPolicy.consecutiveFailures(), 1);
+
+  QVERIFY(waitFor(7, &server, 5000));
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+}
+
+void UploaderTest::testColdConnectionStats()
+{
+#ifdef QT_NO_OPENSSL
+  QSKIP("TLS support is not available", SkipAll);
+#else
+  QSslSocket::addDefaultCaCertificates(QLatin1String(SRCDIR "standin.crt"));
+  StandInServer server(true);
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(server.urlFormat());
+  uploader->resetUploadStats();
+  stageHeader(1);
+
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QVERIFY(waitFor(1, &server, 5000));
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+
+  LocalyticsUploadStats stats = uploader->uploadStats();
+  QCOMPARE(stats.requests, 1);
+  QCOMPARE(stats.bytesSent, (qint64) server.bodies.at(0).size());
+  QCOMPARE(stats.prewarms, 0);
+  QCOMPARE(server.connections, 1);
+  qDebug() << "cold TLS upload: connect" << stats.connectMilliseconds << "ms, transfer" << stats.transferMilliseconds << "ms";
+#endif
+}
+
+void UploaderTest::testPrewarmReusesConnection()
+{
+#ifdef QT_NO_OPENSSL
+  QSKIP("TLS support is not available", SkipAll);
+#else
+  QSslSocket::addDefaultCaCertificates(QLatin1String(SRCDIR "standin.crt"));
+  StandInServer server(true);
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(server.urlFormat());
+  uploader->resetUploadStats();
+
+  uploader->prewarm(true);
+  while (uploader->uploadStats().prewarms == 0 && server.clock.elapsed() < 5000)
+    {
+      QTest::qWait(5);
+    }
+  QCOMPARE(uploader->uploadStats().prewarms, 1);
+  QCOMPARE(server.heads, 1);
+  QCOMPARE(server.connections, 1);
+
+  // Consecutive uploads go over the prewarmed connection.
+  stageHeader(1);
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QVERIFY(waitFor(1, &server, 5000));
+  stageHeader(2);
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QVERIFY(waitFor(2, &server, 5000));
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+  QCOMPARE(server.connections, 1);
+
+  LocalyticsUploadStats stats = uploader->uploadStats();
+  QCOMPARE(stats.requests, 2);
+  QCOMPARE(stats.bytesSent, (qint64) (server.bodies.at(0).size() + server.bodies.at(1).size()));
+  qDebug() << "prewarm (TLS handshake and one round trip):" << stats.prewarmMilliseconds << "ms";
+  qDebug() << "warm TLS uploads: connect" << stats.connectMilliseconds << "ms, transfer" << stats.transferMilliseconds << "ms";
+#endif
+}
+
+void UploaderTest::testLoopbackTransport()
+{
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  LocalyticsLoopbackTransport *loopback = new LocalyticsLoopbackTransport;
+  loopback->setKeepBodies(true);
+  uploader->setTransport(loopback);
+  uploader->setMaxUploadBytes(1);
+  for (int i = 1; i <= 3; i++)
+    {
+      stageHeader(i);
+    }
+  QByteArray expected = LocalyticsDatabase::sharedLocalyticsDatabase()->uploadGzipData();
+
+  QSignalSpy complete(uploader, SIGNAL(uploadComplete()));
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QTest::qWait(50);
+  QCOMPARE(complete.count(), 1);
+  QCOMPARE(loopback->requestsReceived(), 3);
+  QCOMPARE(loopback->bytesReceived(), (qint64) expected.size());
+  QByteArray received;
+  foreach (const QByteArray &body, loopback->bodies())
+    {
+      received.append(body);
+    }
+  QCOMPARE(received, expected);
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+
+  // Failures are handled as with any other transport.
+  loopback->setStatusCode(503);
+  stageHeader(4);
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QTest::qWait(50);
+  QCOMPARE(complete.count(), 2);
+  QVERIFY(uploader->isRetryScheduled());
+  QCOMPARE(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().size(), 1);
+  uploader->_retryTimer->stop();
+}
+
+void UploaderTest::testJournalRecovery()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  LocalyticsLoopbackTransport *loopback = new LocalyticsLoopbackTransport;
+  loopback->setKeepBodies(true);
+  uploader->setTransport(loopback);
+  for (int i = 1; i <= 4; i++)
+    {
+      stageHeader(i);
+    }
+
+  // Pretend a previous process died with header 1 acknowledged but
+  // not yet deleted, and headers 2 and 3 posted in one request.
+  QList<LocalyticsUploadSegment> interrupted;
+  foreach (const LocalyticsUploadSegment &segment, db->uploadSegments())
+    {
+      if (segment.sequenceNumber == 2 || segment.sequenceNumber == 3)
+        interrupted.append(segment);
+    }
+  LocalyticsUploadDevice body(db, interrupted);
+  body.open(QIODevice::ReadOnly);
+  QByteArray interruptedBody = body.readAll();
+  int acked = 0;
+  int inFlight = 0;
+  QVERIFY(db->addJournalEntry(QList<int>() << 1, QByteArray(), &acked));
+  QVERIFY(db->setJournalState(acked, JOURNAL_ACKED));
+  QVERIFY(db->addJournalEntry(QList<int>() << 2 << 3, LocalyticsUploader::bodyHash(interrupted), &inFlight));
+
+  // Header 1 is deleted unsent, the interrupted request goes out
+  // again as it was, and header 4 follows on its own.
+  uploader->setMaxUploadBytes(1);
+  QSignalSpy complete(uploader, SIGNAL(uploadComplete()));
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QTest::qWait(50);
+  QCOMPARE(complete.count(), 1);
+  QCOMPARE(loopback->requestsReceived(), 2);
+  QCOMPARE(loopback->bodies().at(0), interruptedBody);
+  QVERIFY(db->uploadSegments().isEmpty());
+  QVERIFY(db->journalEntries().isEmpty());
+
+  // A failed request is left in the journal until the next upload,
+  // which batches its headers anew.
+  loopback->setStatusCode(503);
+  stageHeader(5);
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QTest::qWait(50);
+  QCOMPARE(db->journalEntries().size(), 1);
+  QCOMPARE(db->journalEntries().at(0).state, JOURNAL_FAILED);
+  uploader->_retryTimer->stop();
+  loopback->setStatusCode(200);
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QTest::qWait(50);
+  QCOMPARE(loopback->requestsReceived(), 4);
+  QVERIFY(db->uploadSegments().isEmpty());
+  QVERIFY(db->journalEntries().isEmpty());
+}
+
+void UploaderTest::testSpooledUpload()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  LocalyticsLoopbackTransport *loopback = new LocalyticsLoopbackTransport;
+  loopback->setKeepBodies(true);
+  loopback->setStatusCode(503);
+  uploader->setTransport(loopback);
+  uploader->setSpooling(true);
+  stageHeader(1);
+  stageHeader(2);
+  QByteArray expected = db->uploadGzipData();
+
+  // The failed body stays spooled, and counts as stored data.
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QTest::qWait(50);
+  uploader->_retryTimer->stop();
+  QDir spool(db->spoolDirectory());
+  QStringList files = spool.entryList(QDir::Files);
+  QCOMPARE(files.size(), 1);
+  QCOMPARE(spool.entryInfoList(QDir::Files).at(0).size(), (qint64) expected.size());
+  QCOMPARE(db->storageSize(), db->databaseSize() + expected.size());
+
+  // Headers staged since don't change the spooled batch, which is sent
+  // again from its file and deleted once acknowledged.
+  stageHeader(3);
+  loopback->setStatusCode(200);
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  QTest::qWait(50);
+  QCOMPARE(loopback->requestsReceived(), 3);
+  QCOMPARE(loopback->bodies().at(0), expected);
+  QCOMPARE(loopback->bodies().at(1), expected);
+  QVERIFY(db->uploadSegments().isEmpty());
+  QVERIFY(spool.entryList(QDir::Files).isEmpty());
+  QCOMPARE(db->spoolSize(), (qint64) 0);
+}
+
+void UploaderTest::testUploadShaping()
+{
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setTransport(new LocalyticsLoopbackTransport);
+
+  // Random hex digits only compress by half, for a body of about 24 kB.
+  QByteArray noise;
+  qsrand(7);
+  for (int i = 0; i < 48000; i++)
+    {
+      noise.append("0123456789abcdef"[qrand() % 16]);
+    }
+  int headerId = 0;
+  QVERIFY(db->addEventWithBlobString(QLatin1String(noise.constData())));
+  QVERIFY(db->addHeaderWithSequenceNumber(1, QLatin1String("{\"dt\":\"h\"}"), &headerId));
+  QVERIFY(db->stageEventsForUpload(headerId));
+  qint64 size = db->uploadSegments().at(0).size;
+  QVERIFY(size > 2 * 8192);
+
+  uploader->setMaxUploadRate(8192);
+  uploader->resetUploadStats();
+  QSignalSpy complete(uploader, SIGNAL(uploadComplete()));
+  QElapsedTimer timer;
+  timer.start();
+  uploader->upload(APP_KEY, true, INSTALL_ID);
+  while (complete.count() == 0 && timer.elapsed() < 10000)
+    {
+      QTest::qWait(20);
+    }
+  QCOMPARE(complete.count(), 1);
+
+  // A full bucket goes at once, and the rest at the shaped rate.
+  QVERIFY(timer.elapsed() >= (size - 8192) * 1000 / 8192 - 50);
+  LocalyticsUploadStats stats = uploader->uploadStats();
+  QCOMPARE(stats.bytesSent, size);
+  QVERIFY(stats.bytesPerSecond > 0);
+  QVERIFY(stats.bytesPerSecond < 2 * 8192);
+  QVERIFY(db->uploadSegments().isEmpty());
+}
+
+void UploaderTest::testWatchdog()
+{
+  // A server which accepts connections and never answers.
+  QTcpServer silent;
+  QVERIFY(silent.listen(QHostAddress::LocalHost));
+  LocalyticsDatabase *db = LocalyticsDatabase::sharedLocalyticsDatabase();
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  uploader->setEndpoint(QString(QLatin1String("http://127.0.0.1:%1")).arg(silent.serverPort())
+                        + QLatin1String("/api/v2/applications/%1/uploads"));
+  uploader->_retryPolicy.setBaseDelay(10000);
+  uploader->setDeadlines(2000, 300, 5000);
+  uploader->resetUploadStats();
+  stageHeader(1);
+
+  // The stalled request is aborted, and retried later with its data.
+  QSignalSpy complete(uploader, SIGNAL(uploadComplete()));
+  QElapsedTimer timer;
+  timer.start();
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  while (complete.count() == 0 && timer.elapsed() < 5000)
+    {
+      QTest::qWait(20);
+    }
+  QCOMPARE(complete.count(), 1);
+  QVERIFY(!uploader->isUploading());
+  QVERIFY(uploader->isRetryScheduled());
+  QCOMPARE(uploader->uploadStats().idleDeadlinesExceeded, 1);
+  QCOMPARE(db->uploadSegments().size(), 1);
+
+  // Cancelling stops the retry, and an upload in flight, for good.
+  uploader->cancelUpload();
+  QVERIFY(!uploader->isRetryScheduled());
+  uploader->setDeadlines(0, 0, 0);
+  uploader->upload(APP_KEY, false, INSTALL_ID);
+  QTest::qWait(500);
+  QVERIFY(uploader->isUploading());
+  uploader->cancelUpload();
+  QVERIFY(!uploader->isUploading());
+  QCOMPARE(complete.count(), 2);
+  QVERIFY(!uploader->isRetryScheduled());
+  QCOMPARE(db->uploadSegments().size(), 1);
+  QCOMPARE(db->journalEntries().size(), 1);
+  QCOMPARE(db->journalEntries().at(0).state, JOURNAL_FAILED);
+}
+
+void UploaderTest::testSocketTransport_data()
+{
+  QTest::addColumn<bool>("secure");
+  QTest::newRow("http") << false;
+#ifndef QT_NO_OPENSSL
+  QTest::newRow("https") << true;
+#endif
+}
+
+void UploaderTest::testSocketTransport()
+{
+  QFETCH(bool, secure);
+#ifndef QT_NO_OPENSSL
+  QSslSocket::addDefaultCaCertificates(QLatin1String(SRCDIR "standin.crt"));
+#endif
+  StandInServer server(secure);
+  server.statuses << 503;
+  LocalyticsUploader *uploader = LocalyticsUploader::sharedLocalyticsUploader();
+  LocalyticsSocketTransport *transport = new LocalyticsSocketTransport;
+  uploader->setTransport(transport);
+  uploader->setEndpoint(server.urlFormat());
+  uploader->setMaxUploadBytes(1);
+  uploader->setMaxConcurrentUploads(1);
+  uploader->resetUploadStats();
+
+  uploader->prewarm(secure);
+  while (uploader->uploadStats().prewarms == 0 && server.clock.elapsed() < 5000)
+    {
+      QTest::qWait(5);
+    }
+  QCOMPARE(transport->connectionsOpened(), 1);
+
+  stageHeader(1);
+  stageHeader(2);
+  QByteArray expected = LocalyticsDatabase::sharedLocalyticsDatabase()->uploadGzipData();
+  uploader->upload(APP_KEY, secure, INSTALL_ID);
+
+  // The first request fails and the retry sends both headers, all over
+  // the prewarmed connection.
+  QVERIFY(waitFor(3, &server, 5000));
+  QCOMPARE(server.responses, QList<int>() << 503 << 202 << 202);
+  QCOMPARE(server.bodies.at(1) + server.bodies.at(2), expected);
+  QCOMPARE(server.bodies.at(0), server.bodies.at(1));
+  QVERIFY(LocalyticsDatabase::sharedLocalyticsDatabase()->uploadSegments().isEmpty());
+  QCOMPARE(server.connections, 1);
+  QCOMPARE(transport->connectionsOpened(), 1);
+  QCOMPARE(uploader->uploadStats().bytesSent, (qint64) (server.bodies.at(0).size() + expected.size()));
+}
+
+void UploaderTest::testSocketStaleFinish()
+{
+  StandInServer server;
+  QUrl url(server.urlFormat().arg(APP_KEY));
+  LocalyticsSocketConnection connection(url);
+  FinishedRecorder recorder;
+  connect(&connection, SIGNAL(finished(int, const LocalyticsTransportResponse &)),
+          &recorder, SLOT(finished(int, const LocalyticsTransportResponse &)));
+
+  // A request completes, and is aborted before its completion is
+  // reported, which leaves the connection idle.
+  LocalyticsTransportResponse failed;
+  failed.statusCode = 500;
+  connection._request = 1;
+  connection.complete(failed);
+  connection.abort();
+  QVERIFY(!connection.isBusy());
+
+  // The next request is only reported with its own response.
+  QBuffer *body = new QBuffer;
+  body->setData("body");
+  body->open(QIODevice::ReadOnly);
+  QByteArray head = "POST " + url.encodedPath() + " HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 4\r\n\r\n";
+  connection.send(2, head, body);
+  QElapsedTimer clock;
+  clock.start();
+  while (recorder.requests.isEmpty() && clock.elapsed() < 5000)
+    {
+      QTest::qWait(5);
+    }
+  QTest::qWait(20);
+  QCOMPARE(recorder.requests, QList<int>() << 2);
+  QCOMPARE(recorder.statusCodes, QList<int>() << 202);
+}
+
+void UploaderTest::testSocketStreamedBody()
+{
+  StandInServer server;
+  QUrl url(server.urlFormat().arg(APP_KEY));
+  LocalyticsSocketConnection connection(url);
+  FinishedRecorder recorder;
+  connect(&connection, SIGNAL(finished(int, const LocalyticsTransportResponse &)),
+          &recorder, SLOT(finished(int, const LocalyticsTransportResponse &)));
+
+  // A body several windows long is read as it is written, and never
+  // held whole.
+  QByteArray data;
+  for (int i = 0; i < 4 * SOCKET_TRANSPORT_BODY_WINDOW + 123; i++)
+    {
+      data.append((char) (i * 7));
+    }
+  QBuffer *body = new QBuffer;
+  body->setData(data);
+  body->open(QIODevice::ReadOnly);
+  QByteArray head = "POST " + url.encodedPath() + " HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: "
+    + QByteArray::number(data.size()) + "\r\n\r\n";
+  connection.send(1, head, body);
+  qint64 maxBuffered = 0;
+  QElapsedTimer clock;
+  clock.start();
+  while (recorder.requests.isEmpty() && clock.elapsed() < 5000)
+    {
+      maxBuffered = qMax(maxBuffered, connection._buffered);
+      QTest::qWait(1);
+    }
+  QCOMPARE(recorder.requests, QList<int>() << 1);
+  QCOMPARE(recorder.statusCodes, QList<int>() << 202);
+  QCOMPARE(server.bodies, QList<QByteArray>() << data);
+  QVERIFY(maxBuffered < SOCKET_TRANSPORT_BODY_WINDOW + UPLOAD_DEVICE_CHUNK_SIZE);
+}
+
+QTEST_MAIN(UploaderTest)
+#ifdef QMAKE_BUILD
+#include "testuploader.moc"
+#else
+#include "moc_testuploader.cxx"
+#endif
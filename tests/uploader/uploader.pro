@@ -0,0 +1,15 @@
+include(../../buildInfo.pri)
+
+QT += qtestlib network
+CONFIG += qtestlib
+
+include(../../libraryIncludes.pri)
+
+DESTDIR = $${TESTS_DIRECTORY}/uploader
+OBJECTS_DIR = $${TESTS_DIRECTORY}/uploader
+MOC_DIR = $${TESTS_DIRECTORY}/uploader
+
+# The TLS stand-in server reads its certificate from the source directory
+DEFINES += SRCDIR=\\\"$$PWD/\\\"
+
+SOURCES += testuploader.cpp